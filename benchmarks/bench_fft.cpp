@@ -0,0 +1,62 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* file bench_fft.cpp: times the FFTs of the multislice loop (a forward
+ * and inverse PrunedFFT with the 2/3 bandwidth limit) with every
+ * FFT library of this build (see fft_backend.h), for the wave size of
+ * a run, and names the fastest one for its 'fft library:' parameter.
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "fft_backend.h"
+#include "fft_plans.h"
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> names = fftBackendNames();
+	int nx = 512, ny = 0, i, best = 0;
+	double t, fftw = 0, bestTime = 0;
+
+	if (((argc > 1) && ((sscanf(argv[1], "%d", &nx) != 1) || (nx < 1))) ||
+		((argc > 2) && ((sscanf(argv[2], "%d", &ny) != 1) || (ny < 1))) ||
+		((argc > 3) && (fftRigorFromName(argv[3]) == 0))) {
+		printf("usage: bench-fft [nx, default 512] [ny, default nx] [fftw plans: estimate|measure|patient]\n");
+		exit(0);
+	}
+	if (ny == 0) ny = nx;
+	if (argc > 3) setFFTRigor(fftRigorFromName(argv[3]));
+
+	printf("%-8s %12s %8s   (%d x %d, fftw plans: %s)\n", "library", "fft+ifft [ms]", "speedup", 
+		nx, ny, fftRigorName(fftRigor()));
+	for (i=0; i<(int)names.size(); i++) {
+		t = timeFFTBackend(names[i].c_str(), nx, ny);
+		if (i == 0) fftw = t;
+		if ((i == 0) || (t < bestTime)) {
+			best = i;
+			bestTime = t;
+		}
+		printf("%-8s %12.3f %7.2fx\n", names[i].c_str(), 1e3*t, fftw/t);
+	}
+	printf("\nfft library: %s\n", names[best].c_str());
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* file bench_kernels.cpp: times the transmission and propagation
+ * kernels of simd_kernels.h on 512x512 and 1024x1024 waves for every
+ * instruction set this CPU supports, and compares them to the scalar code.
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+
+#include "simd_kernels.h"
+
+// seconds per pass over an nx x ny wave
+static double timeTransmit(std::vector<float_tt> &w, std::vector<float_tt> &t, int nx, int ny, int passes) {
+	clock_t start = clock();
+	for (int p=0; p<passes; p++) for (int ix=0; ix<nx; ix++)
+		complexMultiply(&w[2*(size_t)ix*ny], &t[2*(size_t)ix*ny], ny);
+	return (double)(clock()-start)/CLOCKS_PER_SEC/passes;
+}
+
+static double timePropagate(std::vector<float_tt> &w, std::vector<float_tt> &py, std::vector<float_tt> &px, 
+							int nx, int ny, int passes) {
+	clock_t start = clock();
+	for (int p=0; p<passes; p++) for (int ix=0; ix<nx; ix++)
+		complexMultiply2(&w[2*(size_t)ix*ny], &py[0], px[2*ix], px[2*ix+1], ny);
+	return (double)(clock()-start)/CLOCKS_PER_SEC/passes;
+}
+
+int main(int argc, char *argv[]) {
+	int sizes[2] = {512, 1024};
+	int passes = 200, s, level, nx, ny, i;
+	double transmitScalar=0, propagateScalar=0, tt, tp;
+
+	if ((argc > 1) && ((sscanf(argv[1], "%d", &passes) != 1) || (passes < 1))) {
+		printf("usage: bench-kernels [passes per size, default 200]\n");
+		exit(0);
+	}
+	printf("Best instruction set of this CPU: %s\n\n", simdLevelName(simdDetectLevel()));
+	printf("%6s %-8s %14s %8s %14s %8s\n", "size", "kernel", "transmit [ms]", "speedup", "propagate [ms]", "speedup");
+	for (s=0; s<2; s++) {
+		nx = ny = sizes[s];
+		// values of modulus 1, like those of the transmission function and the propagator
+		std::vector<float_tt> w(2*(size_t)nx*ny), t(2*(size_t)nx*ny), py(2*ny), px(2*nx);
+		for (i=0; i<nx*ny; i++) {
+			w[2*i] = 1; w[2*i+1] = 0;
+			t[2*i] = (float_tt)cos(0.001*i); t[2*i+1] = (float_tt)sin(0.001*i);
+		}
+		for (i=0; i<ny; i++) { py[2*i] = (float_tt)cos(0.01*i); py[2*i+1] = (float_tt)-sin(0.01*i); }
+		for (i=0; i<nx; i++) { px[2*i] = (float_tt)cos(0.02*i); px[2*i+1] = (float_tt)-sin(0.02*i); }
+
+		for (level=SIMD_SCALAR; level<=simdDetectLevel(); level++) {
+			setSimdLevel(level);
+			timeTransmit(w, t, nx, ny, 1);   // warm up the caches
+			tt = timeTransmit(w, t, nx, ny, passes);
+			tp = timePropagate(w, py, px, nx, ny, passes);
+			if (level == SIMD_SCALAR) {
+				transmitScalar = tt;
+				propagateScalar = tp;
+			}
+			printf("%6d %-8s %14.3f %7.2fx %14.3f %7.2fx\n", nx, simdLevelName(level), 
+				1e3*tt, transmitScalar/tt, 1e3*tp, propagateScalar/tp);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,20 @@
+# Looks for the DFTI interface of Intel MKL (single dynamic library mkl_rt),
+# in $MKLROOT or the usual places.  Sets MKL_FOUND, MKL_INCLUDE_DIRS and MKL_LIBS.
+
+find_path(MKL_INCLUDE_DIRS mkl_dfti.h HINTS $ENV{MKLROOT}/include /opt/intel/mkl/include)
+
+IF(WIN32)
+	find_library(MKL_LIBS mkl_rt HINTS $ENV{MKLROOT}/lib/intel64 $ENV{MKLROOT}/lib)
+ELSEIF(UNIX)
+	find_library(MKL_LIBS mkl_rt HINTS $ENV{MKLROOT}/lib/intel64 $ENV{MKLROOT}/lib /opt/intel/mkl/lib/intel64)
+ENDIF(WIN32)
+
+set(MKL_FOUND TRUE)
+
+if (NOT MKL_INCLUDE_DIRS)
+  set(MKL_FOUND FALSE)
+endif (NOT MKL_INCLUDE_DIRS)
+
+if (NOT MKL_LIBS)
+  set(MKL_FOUND FALSE)
+endif (NOT MKL_LIBS)
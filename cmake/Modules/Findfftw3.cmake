@@ -32,3 +32,19 @@ endif (NOT FFTW3_LIBS)
 if (NOT FFTW3F_LIBS)
   set(FFTW3F_FOUND FALSE)
 endif (NOT FFTW3F_LIBS)
+
+# The threaded fftw libraries are optional, with them the single wave modes 
+# (TEM, CBED, NBED) use all threads for their FFTs.  Sets FFTW3_THREADS_FOUND
+# and adds them to FFTW3_LIBS and FFTW3F_LIBS.
+IF(UNIX)
+	find_library(FFTW3_THREADS_LIBS fftw3_threads HINTS $ENV{HOME}/lib /usr/lib)
+	find_library(FFTW3F_THREADS_LIBS fftw3f_threads HINTS $ENV{HOME}/lib /usr/lib)
+ENDIF(UNIX)
+
+set(FFTW3_THREADS_FOUND FALSE)
+
+if (FFTW3_THREADS_LIBS AND FFTW3F_THREADS_LIBS AND FFTW3_FOUND AND FFTW3F_FOUND)
+  set(FFTW3_THREADS_FOUND TRUE)
+  set(FFTW3_LIBS ${FFTW3_THREADS_LIBS} ${FFTW3_LIBS})
+  set(FFTW3F_LIBS ${FFTW3F_THREADS_LIBS} ${FFTW3F_LIBS})
+endif (FFTW3_THREADS_LIBS AND FFTW3F_THREADS_LIBS AND FFTW3_FOUND AND FFTW3F_FOUND)
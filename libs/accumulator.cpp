@@ -0,0 +1,81 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "accumulator.h"
+
+Accumulator::Accumulator(int nArrays, int n, int budgetMB, const char *spillName) :
+m_nArrays(nArrays),
+m_n(n)
+{
+	size_t slotBytes = 2*(size_t)n*sizeof(accum_tt);
+	size_t budget = (size_t)(budgetMB > 0 ? budgetMB : 0)*1024*1024;
+
+	m_nRam = (int)(budget/slotBytes);
+	if (m_nRam > nArrays) m_nRam = nArrays;
+	m_count = std::vector<int>(nArrays, 0);
+	m_ram = std::vector<accum_tt>(2*(size_t)n*m_nRam, 0.0);
+	if (m_nRam < nArrays)
+		m_spillFile = boost::shared_ptr<CMappedBuffer>(new CMappedBuffer(spillName, (size_t)(nArrays-m_nRam)*slotBytes));
+}
+
+accum_tt *Accumulator::Slot(int index)
+{
+	if ((index < 0) || (index >= m_nArrays)) {
+		printf("Accumulator: index %d out of range (0..%d)\n", index, m_nArrays-1);
+		exit(0);
+	}
+	if (index < m_nRam) return &m_ram[2*(size_t)m_n*index];
+	return (accum_tt *)m_spillFile->Data()+2*(size_t)m_n*(index-m_nRam);
+}
+
+double Accumulator::Add(int index, const float_tt *data)
+{
+	accum_tt *mean = Slot(index);
+	accum_tt *m2 = mean+m_n;
+	double delta, change, chisq = 0;
+	int count = ++m_count[index];
+
+	for (int i=0; i<m_n; i++) {
+		delta = data[i]-mean[i];
+		change = delta/count;
+		mean[i] += change;
+		m2[i] += delta*(data[i]-mean[i]);
+		chisq += change*change;
+	}
+	return chisq;
+}
+
+void Accumulator::GetMean(int index, float_tt *mean)
+{
+	accum_tt *m = Slot(index);
+
+	for (int i=0; i<m_n; i++) mean[i] = (float_tt)m[i];
+}
+
+void Accumulator::GetVariance(int index, float_tt *var)
+{
+	accum_tt *m2 = Slot(index)+m_n;
+	int count = m_count[index];
+
+	for (int i=0; i<m_n; i++)
+		var[i] = (count > 0) ? (float_tt)(m2[i]/count) : 0.0f;
+}
@@ -0,0 +1,65 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ACCUMULATOR_H
+#define ACCUMULATOR_H
+
+#include <vector>
+#include "stemtypes_fftw3.h"
+#include "mapped_buffer.h"
+
+/**************************************************************
+ * Accumulator keeps the frozen phonon average of a set of
+ * equally sized real arrays (e.g. one diffraction pattern per
+ * scan position or per thickness) in memory, instead of
+ * reading, updating and writing an average file for every run.
+ *
+ * AccumulatorPtr acc = AccumulatorPtr(new Accumulator(nArrays,nx*ny,budgetMB,spillName));
+ * chisq += acc->Add(index, wave->diffpat[0]);   // once per TDS run
+ * acc->GetMean(index, wave->avgArray[0]);       // when writing the result
+ *
+ * Mean and sum of squared deviations are updated with Welford's
+ * method, in double precision (accum_tt), so that long runs do
+ * not drift.  Add() returns sum((oldMean-newMean)^2), which is what
+ * the chisq convergence numbers have always been computed from.
+ * Arrays that do not fit into budgetMB are kept in a single
+ * memory mapped file.  Different indices may be updated by
+ * different threads concurrently, the same index may not.
+ **************************************************************/
+class Accumulator {
+	int m_nArrays;
+	int m_n;                      // number of pixels per array
+	int m_nRam;                   // arrays [0..m_nRam-1] are kept in RAM
+	std::vector<int> m_count;
+	std::vector<accum_tt> m_ram;  // mean and M2 of each array, one after the other
+	boost::shared_ptr<CMappedBuffer> m_spillFile;
+
+	accum_tt *Slot(int index);
+public:
+	Accumulator(int nArrays, int n, int budgetMB, const char *spillName);
+
+	double Add(int index, const float_tt *data);
+	int Count(int index) { return m_count[index]; }
+	void GetMean(int index, float_tt *mean);
+	void GetVariance(int index, float_tt *var);
+};
+
+typedef boost::shared_ptr<Accumulator> AccumulatorPtr;
+
+#endif
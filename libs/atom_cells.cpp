@@ -0,0 +1,102 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <math.h>
+#include "atom_cells.h"
+
+AtomCells::AtomCells(atom *atoms, int natom, float_tt binSize) :
+m_nx(1), m_ny(1), m_nz(1),
+m_x0(0), m_y0(0), m_z0(0),
+m_size(binSize > 0 ? binSize : 1.0)
+{
+	int i, bin, nAtoms = 0;
+	double xmax=0, ymax=0, zmax=0;
+	std::vector<int> bins;
+
+	// bounding box of the atoms
+	for (i=0; i<natom; i++) {
+		if (atoms[i].Znum == 0) continue;
+		if ((nAtoms == 0) || (atoms[i].x < m_x0)) m_x0 = atoms[i].x;
+		if ((nAtoms == 0) || (atoms[i].y < m_y0)) m_y0 = atoms[i].y;
+		if ((nAtoms == 0) || (atoms[i].z < m_z0)) m_z0 = atoms[i].z;
+		if ((nAtoms == 0) || (atoms[i].x > xmax)) xmax = atoms[i].x;
+		if ((nAtoms == 0) || (atoms[i].y > ymax)) ymax = atoms[i].y;
+		if ((nAtoms == 0) || (atoms[i].z > zmax)) zmax = atoms[i].z;
+		nAtoms++;
+	}
+
+	// not many more cells than atoms, for dilute or thin samples
+	for (;;) {
+		m_nx = (int)floor((xmax-m_x0)/m_size)+1;
+		m_ny = (int)floor((ymax-m_y0)/m_size)+1;
+		m_nz = (int)floor((zmax-m_z0)/m_size)+1;
+		if ((double)m_nx*m_ny*m_nz <= 4.0*nAtoms+64) break;
+		m_size *= 1.25;
+	}
+
+	// counting sort, which keeps the atoms of each cell in order
+	bins = std::vector<int>(natom, -1);
+	m_start = std::vector<int>(m_nx*m_ny*m_nz+1, 0);
+	for (i=0; i<natom; i++) {
+		if (atoms[i].Znum == 0) continue;
+		bins[i] = (CellZ(atoms[i].z)*m_nx+CellX(atoms[i].x))*m_ny+CellY(atoms[i].y);
+		m_start[bins[i]+1]++;
+	}
+	for (bin=0; bin<m_nx*m_ny*m_nz; bin++) m_start[bin+1] += m_start[bin];
+	m_index = std::vector<int>(nAtoms);
+	std::vector<int> next(m_start.begin(), m_start.end()-1);
+	for (i=0; i<natom; i++) {
+		if (bins[i] >= 0) m_index[next[bins[i]]++] = i;
+	}
+}
+
+int AtomCells::Bin(double x, double x0, int n)
+{
+	int i = (int)floor((x-x0)/m_size);
+	if (i < 0) return 0;
+	if (i >= n) return n-1;
+	return i;
+}
+
+void AtomCells::Collect(int ix0, int ix1, int iy0, int iy1, int iz0, int iz1, std::vector<int> &list)
+{
+	int ix, iz, bin;
+
+	if (ix0 < 0) ix0 = 0;
+	if (iy0 < 0) iy0 = 0;
+	if (iz0 < 0) iz0 = 0;
+	if (ix1 >= m_nx) ix1 = m_nx-1;
+	if (iy1 >= m_ny) iy1 = m_ny-1;
+	if (iz1 >= m_nz) iz1 = m_nz-1;
+	if ((ix0 > ix1) || (iy0 > iy1)) return;
+	for (iz=iz0; iz<=iz1; iz++) for (ix=ix0; ix<=ix1; ix++) {
+		// the y-tiles of one x-tile are adjacent
+		bin = (iz*m_nx+ix)*m_ny;
+		list.insert(list.end(), m_index.begin()+m_start[bin+iy0], m_index.begin()+m_start[bin+iy1+1]);
+	}
+}
+
+void AtomCells::Collect(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, std::vector<int> &list)
+{
+	// boxes that miss the atoms completely would be clamped onto the border cells
+	if ((xmax < m_x0) || (ymax < m_y0) || (zmax < m_z0)) return;
+	if ((xmin >= m_x0+m_nx*m_size) || (ymin >= m_y0+m_ny*m_size) || (zmin >= m_z0+m_nz*m_size)) return;
+	Collect(CellX(xmin), CellX(xmax), CellY(ymin), CellY(ymax), CellZ(zmin), CellZ(zmax), list);
+}
@@ -0,0 +1,73 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef ATOM_CELLS_H
+#define ATOM_CELLS_H
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * AtomCells is a cell list of the atoms of one configuration:
+ * the atoms are binned into (z-slab, x-tile, y-tile) cells of
+ * (about) binSize A by a counting sort, so that the atoms near
+ * some region can be found without looking at all of them.
+ *
+ * AtomCellsPtr cells = AtomCellsPtr(new AtomCells(atoms,natom,muls->atomRadius));
+ * cells->Collect(xmin,xmax,ymin,ymax,zmin,zmax,list);  // appends atom indices
+ *
+ * Collect() returns all atoms inside the box, and possibly some
+ * outside of it (those of the cells that the box touches).  
+ * Within a cell the indices are ascending.  Vacancies (Znum=0)
+ * are left out.  The atoms array must not change while the cell
+ * list is in use.
+ **************************************************************/
+
+class AtomCells {
+	int m_nx, m_ny, m_nz;             // number of cells
+	double m_x0, m_y0, m_z0;          // lower corner of the first cell
+	double m_size;                    // edge length of a cell
+	std::vector<int> m_start;         // m_index[m_start[bin]..m_start[bin+1]-1] are in bin
+	std::vector<int> m_index;
+	int Bin(double x, double x0, int n);
+public:
+	AtomCells(atom *atoms, int natom, float_tt binSize);
+
+	int CellsX() { return m_nx; }
+	int CellsY() { return m_ny; }
+	int CellsZ() { return m_nz; }
+	double CellSize() { return m_size; }
+	double CellX0(int ix) { return m_x0+ix*m_size; }
+	double CellY0(int iy) { return m_y0+iy*m_size; }
+	double CellZ0(int iz) { return m_z0+iz*m_size; }
+	int CellX(double x) { return Bin(x, m_x0, m_nx); }
+	int CellY(double y) { return Bin(y, m_y0, m_ny); }
+	int CellZ(double z) { return Bin(z, m_z0, m_nz); }
+
+	// the atoms of the cells ix0..ix1, iy0..iy1, iz0..iz1 (inclusive)
+	void Collect(int ix0, int ix1, int iy0, int iy1, int iz0, int iz1, std::vector<int> &list);
+	void Collect(double xmin, double xmax, double ymin, double ymax, double zmin, double zmax, std::vector<int> &list);
+	int Atoms() { return (int)m_index.size(); }
+};
+
+typedef boost::shared_ptr<AtomCells> AtomCellsPtr;
+
+#endif
@@ -47,15 +47,12 @@ resolutionY(resY)
 
 #if FLOAT_PRECISION == 1
 	wave = complex2Df(nx, ny, "wave");
-	fftPlanWaveForw = fftwf_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_FORWARD, FFTW_ESTIMATE);
-	fftPlanWaveInv = fftwf_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_BACKWARD, FFTW_ESTIMATE);
 #else
 	wave = complex2D(nx, ny, "wave");
-	fftPlanWaveForw = fftw_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_FORWARD,
-		fftMeasureFlag);
-	fftPlanWaveInv = fftw_plan_dft_2d(nx,ny,wave[0],wave[0],FFTW_BACKWARD,
-		fftMeasureFlag);
 #endif
+	// all waves of this size share the same plans
+	fftPlanWaveForw = fftBackend()->WavePlan(nx, ny, FFTW_FORWARD);
+	fftPlanWaveInv = fftBackend()->WavePlan(nx, ny, FFTW_BACKWARD);
 
 	sprintf(waveFile,"%s.img",waveFileBase);
 	strcpy(fileout,waveFile);
@@ -115,22 +112,29 @@ Detector::Detector(int nx, int ny, float_tt resX, float_tt resY) :
   shiftX(0),
   shiftY(0),
   Navg(0),
-  thickness(0)
+  thickness(0),
+  m_resX(resX),
+  m_resY(resY)
 {
-#if FLOAT_PRECISION == 1
-	image = float2D(nx,ny,"ADFimag");
-	image2 = float2D(nx,ny,"ADFimag");
-#else
 	image = double2D(nx,ny,"ADFimag");	
 	image2 = double2D(nx,ny,"ADFimag");	
-#endif
+	m_nx = nx;
+	m_ny = ny;
 	m_imageIO=ImageIOPtr(new CImageIO(nx, ny, thickness, resX, resY, std::vector<double>(2+nx*ny), "STEM image"));
 }
 
+// the image files are in the precision of the build
 void Detector::WriteImage(const char *fileName)
 {
+	std::vector<float_tt> data((size_t)m_nx*m_ny);
+	std::vector<float_tt *> rows(m_nx);
+
+	for (int ix=0; ix<m_nx; ix++) {
+		rows[ix] = &data[(size_t)ix*m_ny];
+		for (int iy=0; iy<m_ny; iy++) rows[ix][iy] = (float_tt)image[ix][iy];
+	}
 	m_imageIO->SetThickness(thickness);
-	m_imageIO->WriteRealImage((void **)image, fileName);
+	m_imageIO->WriteRealImage((void **)&rows[0], fileName);
 }
 
 void Detector::SetThickness(float_tt t)
@@ -23,6 +23,10 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <vector>
 #include "stemtypes_fftw3.h"
 #include "imagelib_fftw3.h"
+#include "accumulator.h"
+#include "fft_backend.h"
+#include "trans_store.h"
+#include "atom_cells.h"
 
 // a structure for a probe/parallel beam wavefunction.
 // Separate from mulsliceStruct for parallelization.
@@ -44,11 +48,10 @@ public:
 	// These are not used for anything aside from when saving files.
 	float_tt resolutionX, resolutionY;
 
+	FFTPlanPtr fftPlanWaveForw,fftPlanWaveInv;  // shared by all waves of this size (see WavePlan())
 #if FLOAT_PRECISION == 1
-	fftwf_plan fftPlanWaveForw,fftPlanWaveInv;
 	fftwf_complex  **wave; /* complex wave function */
 #else
-	fftw_plan fftPlanWaveForw,fftPlanWaveInv;
 	fftw_complex  **wave; /* complex wave function */
 #endif
 
@@ -77,10 +80,13 @@ typedef boost::shared_ptr<WAVEFUNC> WavePtr;
 class Detector {
 	ImageIOPtr m_imageIO;
 	float_tt thickness;
+	float_tt m_resX, m_resY;
+	int m_nx, m_ny;
 public:
 	int Navg;
-	float_tt **image;        // place for storing avg image = sum(data)/Navg
-	float_tt **image2;        // we will store sum(data.^2)/Navg 
+	accum_tt **image;        // place for storing avg image = sum(data)/Navg
+	accum_tt **image2;        // we will store sum(data.^2)/Navg 
+	                          // (both in double precision, they are averaged over many runs)
 	float_tt rInside,rOutside;
 	float_tt k2Inside,k2Outside;
 	char name[32];
@@ -92,6 +98,8 @@ public:
 	void SetParameter(int index, double value);
 	void SetThickness(float_tt t);
 	void SetComment(const char *comment);
+	float_tt GetResolutionX() { return m_resX; }
+	float_tt GetResolutionY() { return m_resY; }
 	float_tt error;
 	float_tt shiftX,shiftY;
 };
@@ -107,19 +115,20 @@ public:
   int printLevel;                       /* Flag indicating how much output should appear
 					 * in the window. */
   int saveLevel;
-  int complete_pixels;  //the number of pixels completed so far
 
+  FFTPlanPtr fftPlanPotInv,fftPlanPotForw;
 #if FLOAT_PRECISION == 1
-  fftwf_plan fftPlanPotInv,fftPlanPotForw;
   // wave moved to probeStruct
   //fftwf_complex  **wave; /* complex wave function */
   fftwf_complex ***trans;
 #else
-  fftw_plan fftPlanPotInv,fftPlanPotForw;
   // wave moved to probeStruct
   //fftw_complex  **wave; /* complex wave function */
   fftw_complex ***trans;
 #endif
+  int transStorage;       // TRANS_COMPLEX: trans, otherwise transStore (see trans_store.h)
+  TransStorePtr transStore;
+  char transFile[512];    // memory mapped file of transStore ('transmission file:'.pid), empty: in RAM
 
   real **diffpat;
   real czOffset;
@@ -164,6 +173,7 @@ public:
   int nCellX,nCellY,nCellZ;             /* number of unit cells in x-y-z dir*/
   int natom;				/* number of atoms in "atoms" */
   atom *atoms;				/* 3D atoms array */	
+  AtomCellsPtr atomCells;               /* cell list of atoms, for make3DSlices() */
   float_tt atomRadius;                   /* for atom potential boxes */
   float_tt potOffsetX,potOffsetY;        /* offset of potential array from zero */
   float_tt potSizeX,potSizeY;            /* real space dimensions of potential array in A */
@@ -237,7 +247,7 @@ public:
   int saveFlag;			/* flag indicating, whether to save the result */
   float_tt rmin,rmax;		/* min and max of real part */
   float_tt aimin,aimax;		/* min and max of imag part */
-  float_tt *kx2,*ky2,k2max,*kx,*ky;
+  float_tt k2max;
 
   int nlayer;
   float_tt *cz;
@@ -256,6 +266,12 @@ public:
   int nonPeriodZ;      /* for slicecell (make non periodic in Z */
   int nonPeriod;       /* for slicecell (make non periodic in x,y */
   int bandlimittrans;  /* flag for bandwidth limiting transmission function */
+  int propagator2D;    /* store the propagator as one nx x ny array (faster), instead of separable in kx and ky */
+  int propagateOther;  /* run the multislice in other_real instead of float_tt ('propagation precision:') */
+  char wisdomFolder[512];  /* folder of the fftw wisdom files, empty: don't keep wisdom */
+  char potentialCacheFolder[512];  /* folder of the atom potential tables, empty: don't keep them */
+  char fftLibrary[32];     /* FFT backend (see fft_backend.h), or "fastest" to time them at start up */
+  int waveThreads;         /* threads working on one wave: all of them in TEM, CBED and NBED, 1 in STEM */
   int fftpotential;    /* flag indicating that we should use FFT for V_proj calculation */
   int plotPotential;
   int storeSeries;
@@ -285,6 +301,19 @@ public:
   std::vector<double> chisq;
   int webUpdate;
   int cellDiv;
+  int scanOrder;           // SCAN_ROWS, SCAN_ZORDER or SCAN_HILBERT (see scan_scheduler.h)
+  int scanTileSize;        // number of scan positions handed to a thread at a time
+  int tile, nTiles;        // this process computes tile number tile of nTiles (--tile i/N)
+  int tileXStart,tileXStop,tileYStart,tileYStop;  // scan window of this tile, stop is exclusive
+  int checkpointInterval;  // seconds between checkpoints of a STEM scan, 0: no checkpoints
+  long randomSeed;         // seed for the phonon displacements, 0: seed from the clock
+  int probeBatch;          // number of probe positions which are propagated together
+  int prism;               // STEM with the S-matrix of PRISM ("mode: PRISM"), see s_matrix.h
+  int prismFx, prismFy;    // PRISM interpolation factors, 0: as large as the probe window allows
+  int waveStoreMB;         // RAM (in MB) for keeping exit waves between slabs, the rest is spilled to disk
+  int avgStoreMB;          // RAM (in MB) for the frozen phonon averages, the rest is spilled to disk
+  AccumulatorPtr diffAverage;  // TDS average of the diffraction pattern(s)
+  float_tt ***diffpatSeries;   // CBED: diffraction pattern of every output thickness of the current run
   int equalDivs;           // this flag indicates whether we can reuse already pre-calculated potential data
 
   /* Parameters for STEM-detectors */
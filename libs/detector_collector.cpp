@@ -0,0 +1,111 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include "detector_collector.h"
+
+// orders k-points by their |k|^2
+class k2Less {
+	const std::vector<float_tt> &m_k2;
+public:
+	k2Less(const std::vector<float_tt> &k2) : m_k2(k2) {}
+	bool operator()(int a, int b) const { return m_k2[a] < m_k2[b]; }
+};
+
+DetectorCollector::DetectorCollector(int nx, int ny, float_tt ax, float_tt by, int nThreads) :
+m_nx(nx),
+m_ny(ny),
+m_nThreads(nThreads)
+{
+	int ix, iy, j;
+	float_tt kx, ky;
+	std::vector<float_tt> kx2(nx), ky2(ny), k2(nx*ny);
+
+	// same k-vectors as in the propagator
+	for (ix=0; ix<nx; ix++) {
+		kx = (ix>nx/2) ? (float_tt)(ix-nx)/ax : (float_tt)ix/ax;
+		kx2[ix] = kx*kx;
+	}
+	for (iy=0; iy<ny; iy++) {
+		ky = (iy>ny/2) ? (float_tt)(iy-ny)/by : (float_tt)iy/by;
+		ky2[iy] = ky*ky;
+	}
+	for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++)
+		k2[ix*ny+iy] = kx2[ix]+ky2[iy];
+
+	m_order = std::vector<int>(nx*ny);
+	for (j=0; j<nx*ny; j++) m_order[j] = j;
+	std::stable_sort(m_order.begin(), m_order.end(), k2Less(k2));
+	m_k2 = std::vector<float_tt>(nx*ny);
+	for (j=0; j<nx*ny; j++) m_k2[j] = k2[m_order[j]];
+	m_intensity = std::vector<double>(nx*ny);
+}
+
+/********************************************************************
+* Collect() adds scale*(intensity inside each detector) to the images,
+* which contain the average over Navg configurations so far, and 
+* scaleDiff*intensity to the (centered) diffraction pattern diffpat
+*******************************************************************/
+template <class T> void DetectorCollector::Collect(T (**wave)[2], float_tt **diffpat, std::vector<DetectorPtr> &detectors,
+								int posX, int posY, double scale, double scaleDiff)
+{
+	int ix, iy, ixs, iys, i, j, lo, hi, p, sx, sy;
+	double intensity, sum;
+	Detector *det;
+
+#pragma omp parallel for private(iy, intensity) num_threads(m_nThreads) if(m_nThreads > 1)
+	for (ix=0; ix<m_nx; ix++) for (iy=0; iy<m_ny; iy++) {
+		intensity = (double)wave[ix][iy][0]*wave[ix][iy][0]+(double)wave[ix][iy][1]*wave[ix][iy][1];
+		m_intensity[ix*m_ny+iy] = intensity;
+		diffpat[(ix+m_nx/2)%m_nx][(iy+m_ny/2)%m_ny] = (float_tt)(intensity*scaleDiff);
+	}
+
+	for (i=0; i<(int)detectors.size(); i++) {
+		det = detectors[i].get();
+		lo = (int)(std::lower_bound(m_k2.begin(), m_k2.end(), det->k2Inside)-m_k2.begin());
+		hi = (int)(std::upper_bound(m_k2.begin(), m_k2.end(), det->k2Outside)-m_k2.begin());
+		sum = 0;
+		// detector in center of diffraction pattern:
+		if ((det->shiftX == 0) && (det->shiftY == 0)) {
+#pragma omp parallel for reduction(+:sum) num_threads(m_nThreads) if(m_nThreads > 1)
+			for (j=lo; j<hi; j++) sum += m_intensity[m_order[j]];
+		}
+		/* special case for shifted detectors: */
+		else {
+			sx = (int)det->shiftX+m_nx;
+			sy = (int)det->shiftY+m_ny;
+#pragma omp parallel for private(p, ixs, iys) reduction(+:sum) num_threads(m_nThreads) if(m_nThreads > 1)
+			for (j=lo; j<hi; j++) {
+				p = m_order[j];
+				ixs = (p/m_ny+sx) % m_nx;
+				iys = (p%m_ny+sy) % m_ny;
+				sum += m_intensity[ixs*m_ny+iys];
+			}
+		}
+		sum *= scale;
+		// add this pixel's intensity (and its square) to the averages:
+		det->image[posX][posY]  = ((det->image[posX][posY]*det->Navg+sum)/(det->Navg+1));
+		det->image2[posX][posY] = ((det->image2[posX][posY]*det->Navg+sum*sum)/(det->Navg+1));
+	}
+}
+
+template void DetectorCollector::Collect<float>(float (**wave)[2], float_tt **diffpat, std::vector<DetectorPtr> &detectors,
+								int posX, int posY, double scale, double scaleDiff);
+template void DetectorCollector::Collect<double>(double (**wave)[2], float_tt **diffpat, std::vector<DetectorPtr> &detectors,
+								int posX, int posY, double scale, double scaleDiff);
@@ -0,0 +1,59 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DETECTOR_COLLECTOR_H
+#define DETECTOR_COLLECTOR_H
+
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+
+/**************************************************************
+ * DetectorCollector adds the intensity of a wave function (in 
+ * reciprocal space) on the annular detectors to the pixel of its 
+ * probe position.  The k-points are sorted by |k|^2 once, so that 
+ * the ring of every detector is a contiguous range which is found
+ * by bisection, instead of testing every k-point against every 
+ * detector.
+ *
+ * Each thread of the scan loop needs its own collector (see 
+ * PropagationContext), because the intensities are kept in a 
+ * scratch array.  Collect() does not allocate memory and only 
+ * writes to the pixel (posX, posY) of each detector image.
+ * With nThreads > 1, Collect() splits its loops between that many
+ * OpenMP threads, for the modes which have only one wave.
+ * The wave may be in float or double (T), independent of float_tt.
+ **************************************************************/
+class DetectorCollector {
+	int m_nx, m_ny, m_nThreads;
+	std::vector<int> m_order;           // k-points (ix*ny+iy) sorted by |k|^2
+	std::vector<float_tt> m_k2;         // |k|^2 of m_order[j]
+	std::vector<double> m_intensity;    // |wave|^2 of the current wave, ix*ny+iy
+public:
+	// ax, by: size of the wave function in A
+	DetectorCollector(int nx, int ny, float_tt ax, float_tt by, int nThreads=1);
+
+	template <class T> void Collect(T (**wave)[2], float_tt **diffpat, std::vector<DetectorPtr> &detectors,
+		int posX, int posY, double scale, double scaleDiff);
+};
+
+typedef boost::shared_ptr<DetectorCollector> DetectorCollectorPtr;
+
+#endif
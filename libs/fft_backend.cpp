@@ -0,0 +1,302 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "fft_backend.h"
+#include "fft_builtin.h"
+#include "fft_plans.h"
+#include "pruned_fft.h"
+
+static std::string s_backendName = "fftw";
+
+/*------------------------ fftw ------------------------*/
+// the fftwf_* and fftw_* functions of one precision
+template <class T> struct FFTW;
+
+template <> struct FFTW<float> {
+	typedef fftwf_plan plan;
+	typedef fftwf_complex complex_type;
+	static void *Malloc(size_t n) { return fftwf_malloc(n); }
+	static void Free(void *p) { fftwf_free(p); }
+	static void Destroy(plan p) { fftwf_destroy_plan(p); }
+	static void Execute(plan p, complex_type *data) { fftwf_execute_dft(p, data, data); }
+	static plan PlanMany(int rank, const int *n, int howmany, complex_type *data, int stride, int dist, int sign) {
+		return fftwf_plan_many_dft(rank, n, howmany, data, NULL, stride, dist, 
+			data, NULL, stride, dist, sign, fftRigor());
+	}
+};
+
+template <> struct FFTW<double> {
+	typedef fftw_plan plan;
+	typedef fftw_complex complex_type;
+	static void *Malloc(size_t n) { return fftw_malloc(n); }
+	static void Free(void *p) { fftw_free(p); }
+	static void Destroy(plan p) { fftw_destroy_plan(p); }
+	static void Execute(plan p, complex_type *data) { fftw_execute_dft(p, data, data); }
+	static plan PlanMany(int rank, const int *n, int howmany, complex_type *data, int stride, int dist, int sign) {
+		return fftw_plan_many_dft(rank, n, howmany, data, NULL, stride, dist, 
+			data, NULL, stride, dist, sign, fftRigor());
+	}
+};
+
+template <class T> class FFTWPlan : public FFTPlanT<T> {
+	typename FFTW<T>::plan m_plan;
+public:
+	FFTWPlan(typename FFTW<T>::plan plan) : m_plan(plan) {}
+	~FFTWPlan() { FFTW<T>::Destroy(m_plan); }
+	void Execute(typename FFTComplex<T>::type *data) { FFTW<T>::Execute(m_plan, data); }
+};
+
+template <class T> class FFTWBackend : public FFTBackendT<T> {
+public:
+	typedef typename FFTBackendT<T>::complex_type complex_type;
+	typedef typename FFTBackendT<T>::plan_ptr plan_ptr;
+
+	const char *Name() { return "fftw"; }
+
+	plan_ptr PlanMany(int rank, const int *n, int howmany, int stride, int dist, int sign, complex_type *data) {
+		typename FFTW<T>::plan plan;
+		size_t size = 1;
+		bool scratch = (data == NULL);
+		int i;
+
+		for (i=0; i<rank; i++) size *= n[i];
+		size = (size-1)*stride+(size_t)(howmany-1)*dist+1;
+		// MEASURE and PATIENT overwrite the array
+		if (scratch) data = (complex_type *)FFTW<T>::Malloc(size*sizeof(complex_type));
+		plan = FFTW<T>::PlanMany(rank, n, howmany, data, stride, dist, sign);
+		if (scratch) FFTW<T>::Free(data);
+		if (plan == NULL) {
+			printf("fftw cannot make a plan for %d transforms of rank %d\n", howmany, rank);
+			exit(0);
+		}
+		return plan_ptr(new FFTWPlan<T>(plan));
+	}
+};
+
+/*------------------------ builtin ------------------------*/
+template <class T> class BuiltinPlan : public FFTPlanT<T> {
+	typedef BuiltinFFT<T> fft_type;
+	std::vector<int> m_n;
+	typedef boost::shared_ptr<std::vector<T> > scratch_ptr;
+	int m_size, m_howmany, m_stride, m_dist, m_maxLength, m_workSize;
+	std::vector<boost::shared_ptr<fft_type> > m_ffts;
+	std::vector<scratch_ptr> m_scratch;       // line buffers which no thread is using at the moment
+public:
+	BuiltinPlan(int rank, const int *n, int howmany, int stride, int dist, int sign) :
+	m_n(n, n+rank), m_size(1), m_howmany(howmany), m_stride(stride), m_dist(dist), 
+	m_maxLength(1), m_workSize(1)
+	{
+		for (int d=0; d<rank; d++) {
+			m_ffts.push_back(boost::shared_ptr<fft_type>(new fft_type(n[d], sign)));
+			m_size *= n[d];
+			if (n[d] > m_maxLength) m_maxLength = n[d];
+			if (m_ffts[d]->WorkSize() > m_workSize) m_workSize = m_ffts[d]->WorkSize();
+		}
+	}
+
+	// every line along every dimension is copied out, transformed and copied back.
+	// Several threads may execute the plan at once, each of them takes a buffer 
+	// of its own, which is only allocated the first time.
+	void Execute(typename FFTComplex<T>::type *data) {
+		scratch_ptr line;
+		T *in, *out, *work;
+		int k, d, l, i, length, inner, lineStride;
+		typename FFTComplex<T>::type *t, *p;
+
+#pragma omp critical(builtin_fft_scratch)
+		{
+			if (m_scratch.empty()) line = scratch_ptr(new std::vector<T>(4*m_maxLength+2*m_workSize));
+			else {
+				line = m_scratch.back();
+				m_scratch.pop_back();
+			}
+		}
+		in = &(*line)[0];
+		out = in+2*m_maxLength;
+		work = out+2*m_maxLength;
+
+		for (k=0; k<m_howmany; k++) {
+			t = data+(size_t)k*m_dist;
+			inner = m_size;
+			for (d=0; d<(int)m_n.size(); d++) {
+				length = m_n[d];
+				inner /= length;
+				lineStride = inner*m_stride;
+				for (l=0; l<m_size/length; l++) {
+					p = t+((size_t)(l/inner)*length*inner+l%inner)*m_stride;
+					for (i=0; i<length; i++) {
+						in[2*i]   = p[i*lineStride][0];
+						in[2*i+1] = p[i*lineStride][1];
+					}
+					m_ffts[d]->Transform(in, out, work);
+					for (i=0; i<length; i++) {
+						p[i*lineStride][0] = out[2*i];
+						p[i*lineStride][1] = out[2*i+1];
+					}
+				}
+			}
+		}
+#pragma omp critical(builtin_fft_scratch)
+		m_scratch.push_back(line);
+	}
+};
+
+template <class T> class BuiltinBackend : public FFTBackendT<T> {
+public:
+	typedef typename FFTBackendT<T>::complex_type complex_type;
+	typedef typename FFTBackendT<T>::plan_ptr plan_ptr;
+
+	const char *Name() { return "builtin"; }
+
+	// there is nothing to measure, so no array is needed for planning
+	plan_ptr PlanMany(int rank, const int *n, int howmany, int stride, int dist, int sign, complex_type *) {
+		return plan_ptr(new BuiltinPlan<T>(rank, n, howmany, stride, dist, sign));
+	}
+};
+
+/*------------------------ common ------------------------*/
+template <class T> typename FFTBackendT<T>::plan_ptr FFTBackendT<T>::Plan2D(int nx, int ny, int sign) {
+	int n[2] = {nx, ny};
+	return PlanMany(2, n, 1, 1, nx*ny, sign);
+}
+
+template <class T> typename FFTBackendT<T>::plan_ptr FFTBackendT<T>::Plan3D(int nx, int ny, int nz, int sign) {
+	int n[3] = {nx, ny, nz};
+	return PlanMany(3, n, 1, 1, nx*ny*nz, sign);
+}
+
+template <class T> typename FFTBackendT<T>::plan_ptr FFTBackendT<T>::WavePlan(int nx, int ny, int sign) {
+	std::pair<std::pair<int, int>, int> key(std::make_pair(nx, ny), sign);
+
+	if (m_wavePlans.count(key) == 0) {
+		FFTPlanThreads threads(fftThreads());
+		m_wavePlans[key] = Plan2D(nx, ny, sign);
+	}
+	return m_wavePlans[key];
+}
+
+template <class T> boost::shared_ptr<FFTBackendT<T> > makeFFTBackend(const char *name) {
+	if (strcmp(name, "fftw") == 0) return boost::shared_ptr<FFTBackendT<T> >(new FFTWBackend<T>());
+	if (strcmp(name, "builtin") == 0) return boost::shared_ptr<FFTBackendT<T> >(new BuiltinBackend<T>());
+#ifdef HAVE_MKL
+	if (strcmp(name, "mkl") == 0) return makeMKLBackend<T>();
+#endif
+	return boost::shared_ptr<FFTBackendT<T> >();
+}
+
+// one backend per precision, made again when the name changes
+template <class T> boost::shared_ptr<FFTBackendT<T> > fftBackend() {
+	static boost::shared_ptr<FFTBackendT<T> > backend;
+
+	if ((backend == NULL) || (s_backendName != backend->Name())) 
+		backend = makeFFTBackend<T>(s_backendName.c_str());
+	return backend;
+}
+
+template class FFTBackendT<float>;
+template class FFTBackendT<double>;
+template boost::shared_ptr<FFTBackendT<float> > fftBackend<float>();
+template boost::shared_ptr<FFTBackendT<double> > fftBackend<double>();
+template boost::shared_ptr<FFTBackendT<float> > makeFFTBackend<float>(const char *name);
+template boost::shared_ptr<FFTBackendT<double> > makeFFTBackend<double>(const char *name);
+
+FFTBackendPtr fftBackend() {
+	return fftBackend<fftw_real>();
+}
+
+bool setFFTBackend(const char *name) {
+	std::vector<std::string> names = fftBackendNames();
+
+	for (int i=0; i<(int)names.size(); i++) if (names[i] == name) {
+		s_backendName = name;
+		return true;
+	}
+	return false;
+}
+
+const char *fftBackendName() {
+	return s_backendName.c_str();
+}
+
+std::vector<std::string> fftBackendNames() {
+	std::vector<std::string> names;
+	names.push_back("fftw");
+	names.push_back("builtin");
+#ifdef HAVE_MKL
+	names.push_back("mkl");
+#endif
+	return names;
+}
+
+// wall clock seconds (a threaded FFT library uses more CPU time than that)
+static double wallTime() {
+#ifdef _OPENMP
+	return omp_get_wtime();
+#else
+	return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+// the multislice loop spends its time in PrunedFFT, so that is timed, with the 2/3 bandwidth limit
+double timeFFTBackend(const char *name, int nx, int ny) {
+	FFTBackendPtr backend = makeFFTBackend<fftw_real>(name);
+	PrunedFFTPtr fft;
+	fft_complex *data;
+	double start;
+	int runs;
+
+	if (backend == NULL) return 0;
+	fft = PrunedFFTPtr(new PrunedFFT(nx, ny, 1, ny/3, ny-ny/3, backend));
+	data = (fft_complex *)FFTW<fftw_real>::Malloc((size_t)nx*ny*sizeof(fft_complex));
+	memset(data, 0, (size_t)nx*ny*sizeof(fft_complex));
+	fft->Forward(data);   // warm up
+	fft->Inverse(data);
+	start = wallTime();
+	for (runs=0; (runs < 3) || (wallTime()-start < 0.1); runs++) {
+		fft->Forward(data);
+		fft->Inverse(data);
+	}
+	FFTW<fftw_real>::Free(data);
+	return (wallTime()-start)/runs;
+}
+
+const char *fastestFFTBackend(int nx, int ny, bool verbose) {
+	static std::string best;
+	std::vector<std::string> names = fftBackendNames();
+	double t, bestTime = 0;
+
+	best = "";
+	for (int i=0; i<(int)names.size(); i++) {
+		t = timeFFTBackend(names[i].c_str(), nx, ny);
+		if (verbose) printf("FFT library %-8s %d x %d: %.3f msec\n", names[i].c_str(), nx, ny, 1e3*t);
+		if (best.empty() || (t < bestTime)) {
+			best = names[i];
+			bestTime = t;
+		}
+	}
+	return best.c_str();
+}
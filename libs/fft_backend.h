@@ -0,0 +1,111 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef FFT_BACKEND_H
+#define FFT_BACKEND_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * A thin layer between qstem and the FFT library, so that the 
+ * fastest one can be chosen at run time:
+ *   - "fftw":    fftw3 (fftwf_* or fftw_*), with the plan rigor 
+ *                and wisdom of fft_plans.h,
+ *   - "builtin": the mixed-radix FFT of fft_builtin.h, which needs 
+ *                no library,
+ *   - "mkl":     the DFTI interface of Intel MKL, if cmake has found 
+ *                it (HAVE_MKL).
+ *
+ * Every backend exists in single (float, fftwf_complex) and double
+ * (double, fftw_complex) precision; fftw_real is the one of the build.
+ * All transforms are complex to complex and in place.  A plan 
+ * does howmany transforms of size n[0] x ... x n[rank-1] (row 
+ * major, rank 1..3), element i of transform k is data[k*dist + i*stride]:
+ *
+ * setFFTBackend("builtin");                    // at start up, "fftw" by default
+ * FFTPlanPtr plan = fftBackend()->PlanMany(2, n, nSlices, 1, nx*ny, FFTW_FORWARD);
+ * plan->Execute(data);
+ * fftBackend<double>()->Plan2D(nx, ny, FFTW_BACKWARD)->Execute(pot[0]);
+ *
+ * A plan can be executed on any array of its shape from 
+ * fftw(f)_malloc, also by several threads at once.  Plans are
+ * made by one thread at a time (the fftw planner is not thread 
+ * safe), and the transforms are not normalized.
+ * 
+ * WavePlan() returns the plan for a single nx x ny wave, which 
+ * the backend makes once and shares between all WAVEFUNCs.
+ **************************************************************/
+template <class T> struct FFTComplex;
+template <> struct FFTComplex<float>  { typedef fftwf_complex type; };
+template <> struct FFTComplex<double> { typedef fftw_complex type; };
+
+template <class T> class FFTPlanT {
+public:
+	typedef typename FFTComplex<T>::type complex_type;
+	virtual ~FFTPlanT() {}
+	virtual void Execute(complex_type *data) = 0;
+};
+
+template <class T> class FFTBackendT {
+	std::map<std::pair<std::pair<int, int>, int>, boost::shared_ptr<FFTPlanT<T> > > m_wavePlans;
+public:
+	typedef typename FFTComplex<T>::type complex_type;
+	typedef boost::shared_ptr<FFTPlanT<T> > plan_ptr;
+
+	virtual ~FFTBackendT() {}
+	virtual const char *Name() = 0;
+	// data, if given, is used for planning and may be overwritten, otherwise a scratch array is used
+	virtual plan_ptr PlanMany(int rank, const int *n, int howmany, int stride, int dist, int sign, 
+		complex_type *data=NULL) = 0;
+
+	plan_ptr Plan2D(int nx, int ny, int sign);
+	plan_ptr Plan3D(int nx, int ny, int nz, int sign);
+	plan_ptr WavePlan(int nx, int ny, int sign);
+};
+
+typedef FFTPlanT<fftw_real> FFTPlan;
+typedef boost::shared_ptr<FFTPlan> FFTPlanPtr;
+typedef FFTBackendT<fftw_real> FFTBackend;
+typedef boost::shared_ptr<FFTBackend> FFTBackendPtr;
+typedef FFTComplex<fftw_real>::type fft_complex;
+
+// the backend in use, in the precision of the build or the given one
+template <class T> boost::shared_ptr<FFTBackendT<T> > fftBackend();
+FFTBackendPtr fftBackend();
+bool setFFTBackend(const char *name);              // false for an unknown name
+const char *fftBackendName();
+std::vector<std::string> fftBackendNames();        // all backends of this build
+template <class T> boost::shared_ptr<FFTBackendT<T> > makeFFTBackend(const char *name);  // NULL for an unknown name
+
+// times the FFTs of the multislice loop (a forward and inverse PrunedFFT of an nx x ny wave)
+// with every backend and returns the name of the fastest one
+const char *fastestFFTBackend(int nx, int ny, bool verbose);
+// seconds per forward and inverse PrunedFFT of nx x ny, at least 3 runs and 0.1 sec
+double timeFFTBackend(const char *name, int nx, int ny);
+
+#ifdef HAVE_MKL
+template <class T> boost::shared_ptr<FFTBackendT<T> > makeMKLBackend();   // in fft_backend_mkl.cpp
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/* The Intel MKL backend of fft_backend.h, only built if cmake has 
+ * found MKL (HAVE_MKL). */
+
+#ifdef HAVE_MKL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mkl_dfti.h"
+#include "fft_backend.h"
+
+template <class T> class MKLPlan : public FFTPlanT<T> {
+	DFTI_DESCRIPTOR_HANDLE m_handle;
+	bool m_forward;
+public:
+	MKLPlan(DFTI_DESCRIPTOR_HANDLE handle, bool forward) : m_handle(handle), m_forward(forward) {}
+	~MKLPlan() { DftiFreeDescriptor(&m_handle); }
+
+	void Execute(typename FFTComplex<T>::type *data) {
+		if (m_forward) DftiComputeForward(m_handle, data);
+		else DftiComputeBackward(m_handle, data);
+	}
+};
+
+template <class T> class MKLBackend : public FFTBackendT<T> {
+public:
+	typedef typename FFTBackendT<T>::complex_type complex_type;
+	typedef typename FFTBackendT<T>::plan_ptr plan_ptr;
+
+	const char *Name() { return "mkl"; }
+
+	plan_ptr PlanMany(int rank, const int *n, int howmany, int stride, int dist, int sign, complex_type *data) {
+		DFTI_CONFIG_VALUE precision = (sizeof(T) == sizeof(float)) ? DFTI_SINGLE : DFTI_DOUBLE;
+		DFTI_DESCRIPTOR_HANDLE handle = NULL;
+		MKL_LONG lengths[3], strides[4], status;
+		int i;
+
+		if ((rank < 1) || (rank > 3)) {
+			printf("MKL backend: transforms of rank %d are not supported\n", rank);
+			exit(0);
+		}
+		// row major: the last dimension has the given stride
+		strides[0] = 0;
+		strides[rank] = stride;
+		for (i=rank-1; i>=0; i--) {
+			lengths[i] = n[i];
+			if (i > 0) strides[i] = strides[i+1]*n[i];
+		}
+		status = (rank == 1) ? DftiCreateDescriptor(&handle, precision, DFTI_COMPLEX, 1, lengths[0]) :
+			DftiCreateDescriptor(&handle, precision, DFTI_COMPLEX, rank, lengths);
+		if (status == DFTI_NO_ERROR) status = DftiSetValue(handle, DFTI_PLACEMENT, DFTI_INPLACE);
+		if (status == DFTI_NO_ERROR) status = DftiSetValue(handle, DFTI_INPUT_STRIDES, strides);
+		if (status == DFTI_NO_ERROR) status = DftiSetValue(handle, DFTI_OUTPUT_STRIDES, strides);
+		if ((status == DFTI_NO_ERROR) && (howmany > 1)) {
+			status = DftiSetValue(handle, DFTI_NUMBER_OF_TRANSFORMS, (MKL_LONG)howmany);
+			if (status == DFTI_NO_ERROR) status = DftiSetValue(handle, DFTI_INPUT_DISTANCE, (MKL_LONG)dist);
+			if (status == DFTI_NO_ERROR) status = DftiSetValue(handle, DFTI_OUTPUT_DISTANCE, (MKL_LONG)dist);
+		}
+		// the scan threads call the plans themselves, MKL must not start more threads
+		if (status == DFTI_NO_ERROR) status = DftiSetValue(handle, DFTI_THREAD_LIMIT, 1);
+		if (status == DFTI_NO_ERROR) status = DftiCommitDescriptor(handle);
+		if (status != DFTI_NO_ERROR) {
+			printf("MKL backend: %s\n", DftiErrorMessage(status));
+			exit(0);
+		}
+		return plan_ptr(new MKLPlan<T>(handle, sign == FFTW_FORWARD));
+	}
+};
+
+template <class T> boost::shared_ptr<FFTBackendT<T> > makeMKLBackend() {
+	return boost::shared_ptr<FFTBackendT<T> >(new MKLBackend<T>());
+}
+
+template boost::shared_ptr<FFTBackendT<float> > makeMKLBackend<float>();
+template boost::shared_ptr<FFTBackendT<double> > makeMKLBackend<double>();
+
+#endif
@@ -0,0 +1,175 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef FFT_BUILTIN_H
+#define FFT_BUILTIN_H
+
+#include <math.h>
+#include <vector>
+
+/**************************************************************
+ * A small mixed-radix FFT (after the recursive decimation in 
+ * time of kissfft), which needs no library at all.  It is the 
+ * fallback backend of fft_backend.h, and much slower than fftw 
+ * or MKL for large transforms.  Radix 4 and 2 have their own 
+ * butterflies, all other factors use the generic one.
+ *
+ * BuiltinFFT<float> fft(n, FFTW_FORWARD);
+ * fft.Transform(in, out, work);   // in and out are n (re, im) pairs, 
+ *                                 // work has room for WorkSize() pairs
+ *
+ * Transform() only reads the object, so several threads can use 
+ * the same one with their own arrays.
+ **************************************************************/
+template <class T> class BuiltinFFT {
+	struct cpx { T r, i; };
+
+	int m_n;
+	bool m_inverse;                  // sign +1, i.e. FFTW_BACKWARD
+	std::vector<int> m_factors;      // pairs of (radix, length of the sub-transforms)
+	std::vector<cpx> m_twiddles;
+	int m_maxRadix;
+
+	static void Mul(cpx &c, const cpx &a, const cpx &b) {
+		T r = a.r*b.r - a.i*b.i;
+		c.i = a.r*b.i + a.i*b.r;
+		c.r = r;
+	}
+
+	void Butterfly2(cpx *f, int fstride, int m) const {
+		const cpx *tw = &m_twiddles[0];
+		cpx t;
+		for (int k=0; k<m; k++, tw+=fstride) {
+			Mul(t, f[m+k], *tw);
+			f[m+k].r = f[k].r-t.r;
+			f[m+k].i = f[k].i-t.i;
+			f[k].r += t.r;
+			f[k].i += t.i;
+		}
+	}
+
+	void Butterfly4(cpx *f, int fstride, int m) const {
+		const cpx *tw1 = &m_twiddles[0], *tw2 = tw1, *tw3 = tw1;
+		cpx s0, s1, s2, s3, s4, s5;
+		for (int k=0; k<m; k++, f++) {
+			Mul(s0, f[m], *tw1);
+			Mul(s1, f[2*m], *tw2);
+			Mul(s2, f[3*m], *tw3);
+			s5.r = f[0].r-s1.r;  s5.i = f[0].i-s1.i;
+			f[0].r += s1.r;      f[0].i += s1.i;
+			s3.r = s0.r+s2.r;    s3.i = s0.i+s2.i;
+			s4.r = s0.r-s2.r;    s4.i = s0.i-s2.i;
+			f[2*m].r = f[0].r-s3.r;
+			f[2*m].i = f[0].i-s3.i;
+			f[0].r += s3.r;
+			f[0].i += s3.i;
+			tw1 += fstride;
+			tw2 += 2*fstride;
+			tw3 += 3*fstride;
+			if (m_inverse) {
+				f[m].r = s5.r-s4.i;    f[m].i = s5.i+s4.r;
+				f[3*m].r = s5.r+s4.i;  f[3*m].i = s5.i-s4.r;
+			}
+			else {
+				f[m].r = s5.r+s4.i;    f[m].i = s5.i-s4.r;
+				f[3*m].r = s5.r-s4.i;  f[3*m].i = s5.i+s4.r;
+			}
+		}
+	}
+
+	void ButterflyGeneric(cpx *f, int fstride, int m, int p, cpx *scratch) const {
+		int u, q, q1, k, tw;
+		cpx t;
+		for (u=0; u<m; u++) {
+			for (q1=0, k=u; q1<p; q1++, k+=m) scratch[q1] = f[k];
+			for (q1=0, k=u; q1<p; q1++, k+=m) {
+				tw = 0;
+				f[k] = scratch[0];
+				for (q=1; q<p; q++) {
+					tw += fstride*k;
+					if (tw >= m_n) tw -= m_n;
+					Mul(t, scratch[q], m_twiddles[tw]);
+					f[k].r += t.r;
+					f[k].i += t.i;
+				}
+			}
+		}
+	}
+
+	void Work(cpx *out, const cpx *in, int fstride, int istride, int stage, cpx *scratch) const {
+		int p = m_factors[2*stage], m = m_factors[2*stage+1];
+		cpx *o = out, *end = out+p*m;
+
+		if (m == 1) {
+			for (; o != end; o++, in += fstride*istride) *o = *in;
+		}
+		else {
+			for (; o != end; o += m, in += fstride*istride)
+				Work(o, in, fstride*p, istride, stage+1, scratch);
+		}
+		switch (p) {
+			case 2:  Butterfly2(out, fstride, m); break;
+			case 4:  Butterfly4(out, fstride, m); break;
+			default: ButterflyGeneric(out, fstride, m, p, scratch);
+		}
+	}
+
+public:
+	BuiltinFFT(int n, int sign) : m_n(n), m_inverse(sign > 0), m_maxRadix(1) {
+		int p = 4, rest = n;
+		double phase;
+
+		m_twiddles.resize(n);
+		for (int k=0; k<n; k++) {
+			phase = (m_inverse ? 2.0 : -2.0)*3.14159265358979323846*k/n;
+			m_twiddles[k].r = (T)cos(phase);
+			m_twiddles[k].i = (T)sin(phase);
+		}
+		// factor out 4s first, then 2s, then the odd numbers
+		while (rest > 1) {
+			while (rest % p) {
+				switch (p) {
+					case 4:  p = 2; break;
+					case 2:  p = 3; break;
+					default: p += 2;
+				}
+				if (p*p > rest) p = rest;
+			}
+			rest /= p;
+			m_factors.push_back(p);
+			m_factors.push_back(rest);
+			if (p > m_maxRadix) m_maxRadix = p;
+		}
+		if (n == 1) {
+			m_factors.push_back(1);
+			m_factors.push_back(1);
+		}
+	}
+
+	int Size() const { return m_n; }
+	int WorkSize() const { return m_maxRadix; }
+
+	// in and out must not overlap
+	void Transform(const T *in, T *out, T *work) const {
+		Work((cpx *)out, (const cpx *)in, 1, 1, 0, (cpx *)work);
+	}
+};
+
+#endif
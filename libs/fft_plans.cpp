@@ -0,0 +1,139 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "fft_plans.h"
+
+static unsigned s_rigor = FFTW_ESTIMATE;
+static int s_threads = 1;
+
+void setFFTRigor(unsigned rigor) {
+	s_rigor = rigor;
+}
+
+unsigned fftRigor() {
+	return s_rigor;
+}
+
+const char *fftRigorName(unsigned rigor) {
+	switch (rigor) {
+		case FFTW_MEASURE:    return "measure";
+		case FFTW_PATIENT:    return "patient";
+		case FFTW_EXHAUSTIVE: return "exhaustive";
+	}
+	return "estimate";
+}
+
+unsigned fftRigorFromName(const char *name) {
+	switch (tolower(name[0])) {
+		case 'e': return (tolower(name[1]) == 'x') ? FFTW_EXHAUSTIVE : FFTW_ESTIMATE;
+		case 'm': return FFTW_MEASURE;
+		case 'p': return FFTW_PATIENT;
+	}
+	return 0;
+}
+
+void setFFTThreads(int nThreads) {
+#ifdef HAVE_FFTW_THREADS
+	static bool initialized = false;
+
+	if (!initialized) {
+		fftwf_init_threads();
+		fftw_init_threads();
+		initialized = true;
+	}
+	s_threads = (nThreads > 1) ? nThreads : 1;
+	// plans are made with one thread, except in an FFTPlanThreads scope
+	fftwf_plan_with_nthreads(1);
+	fftw_plan_with_nthreads(1);
+#else
+	(void)nThreads;
+#endif
+}
+
+int fftThreads() {
+	return s_threads;
+}
+
+FFTPlanThreads::FFTPlanThreads(int nThreads) {
+#ifdef HAVE_FFTW_THREADS
+	if (nThreads > s_threads) nThreads = s_threads;
+	if (nThreads < 1) nThreads = 1;
+	fftwf_plan_with_nthreads(nThreads);
+	fftw_plan_with_nthreads(nThreads);
+#else
+	(void)nThreads;
+#endif
+}
+
+FFTPlanThreads::~FFTPlanThreads() {
+#ifdef HAVE_FFTW_THREADS
+	if (s_threads > 1) {
+		fftwf_plan_with_nthreads(1);
+		fftw_plan_with_nthreads(1);
+	}
+#endif
+}
+
+void fftWisdomName(char *fileName, const char *folder, int nx, int ny, int potNx, int potNy, int nThreads) {
+	sprintf(fileName, "%s/fftw_wisdom_%dx%d_pot%dx%d_%dthreads", folder, 
+		nx, ny, potNx, potNy, nThreads);
+}
+
+static const char *s_precisionName[2] = {"float", "double"};
+
+bool loadFFTWisdom(const char *fileName) {
+	char name[1040];
+	FILE *fp;
+	int p, ok, nRead = 0;
+
+	for (p=0; p<2; p++) {
+		sprintf(name, "%s_%s.dat", fileName, s_precisionName[p]);
+		if ((fp = fopen(name, "r")) == NULL) continue;
+		ok = (p == 0) ? fftwf_import_wisdom_from_file(fp) : fftw_import_wisdom_from_file(fp);
+		fclose(fp);
+		if (ok) nRead++;
+		else printf("Cannot read the fftw wisdom in %s, ignoring it\n", name);
+	}
+	return (nRead > 0);
+}
+
+bool saveFFTWisdom(const char *fileName) {
+	char name[1040];
+	FILE *fp;
+	int p;
+	bool ok = true;
+
+	for (p=0; p<2; p++) {
+		sprintf(name, "%s_%s.dat", fileName, s_precisionName[p]);
+		if ((fp = fopen(name, "w")) == NULL) {
+			printf("Cannot write fftw wisdom to %s\n", name);
+			ok = false;
+			continue;
+		}
+		if (p == 0) fftwf_export_wisdom_to_file(fp);
+		else fftw_export_wisdom_to_file(fp);
+		ok = (fclose(fp) == 0) && ok;
+	}
+	return ok;
+}
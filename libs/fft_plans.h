@@ -0,0 +1,82 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef FFT_PLANS_H
+#define FFT_PLANS_H
+
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * How much time fftw may spend on making plans, and the wisdom
+ * which keeps the result of that between runs.
+ *
+ * setFFTRigor(FFTW_MEASURE);              // ESTIMATE, MEASURE or PATIENT
+ * fftWisdomName(fileName, folder, nx, ny, potNx, potNy, nThreads);
+ * loadFFTWisdom(fileName);                // at start up
+ * ... make plans with fftRigor() ...
+ * saveFFTWisdom(fileName);                // at exit
+ *
+ * Wisdom files are kept apart by the size of the wave and of the
+ * potential and the number of threads, because all of them change
+ * which plans are made and which is fastest.  fileName is the 
+ * common part of the names of two files, <fileName>_float.dat and
+ * <fileName>_double.dat, for the fftwf and the fftw wisdom: both 
+ * precisions are used in one run with 'propagation precision:'.
+ * The wisdom must be loaded before the first plan is made.
+ *
+ * The rigor applies to the "fftw" backend of fft_backend.h, 
+ * which makes the plans of the waves, the potential and the
+ * multislice loop (PrunedFFT).
+ *
+ * setFFTThreads(n) sets the threads of the plans of a single wave
+ * (if fftw was built with threads, HAVE_FFTW_THREADS), for the 
+ * modes which propagate only one wave at a time.  Only the plans 
+ * made while an FFTPlanThreads is in scope use them:
+ *
+ * { FFTPlanThreads threads(fftThreads()); plan = ...; }
+ *
+ * All other plans are made with 1 thread, because they may be 
+ * executed by several OpenMP threads at once (the STEM scan, 
+ * PotentialLUTCache::Prepare()), which would otherwise start
+ * n threads each.
+ *
+ * The fftw planner is not thread safe: make plans from one 
+ * thread at a time, e.g. in #pragma omp critical(fftw_planner).
+ **************************************************************/
+void setFFTRigor(unsigned rigor);
+unsigned fftRigor();
+const char *fftRigorName(unsigned rigor);
+unsigned fftRigorFromName(const char *name);  // 0 for an unknown name
+
+void setFFTThreads(int nThreads);
+int fftThreads();                              // 1 without HAVE_FFTW_THREADS
+
+// the fftw plans made during its lifetime use nThreads (at most fftThreads()) threads
+class FFTPlanThreads {
+public:
+	FFTPlanThreads(int nThreads);
+	~FFTPlanThreads();
+};
+
+void fftWisdomName(char *fileName, const char *folder, int nx, int ny, int potNx, int potNy, int nThreads);
+bool loadFFTWisdom(const char *fileName);      // true, if the wisdom of one precision has been read
+bool saveFFTWisdom(const char *fileName);
+
+#endif
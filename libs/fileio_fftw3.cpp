@@ -44,6 +44,37 @@ QSTEM - image simulation for TEM/STEM/CBED
 #endif
 #endif
 
+/* state of the random number generators.  It is kept here, and not in 
+ * static variables of the functions using it, so that a checkpoint can 
+ * save and restore it with getRandomState()/setRandomState() */
+static long phononSeed = 0;        // phonon displacements
+static long replicateSeed = -1;    // occupancy choices in replicateUnitCell()
+static long tiltSeed = -1;         // occupancy choices in tiltBoxed()
+static long ran1Iy = 0;            // shuffle table of ran1()
+static long ran1Iv[RANDOM_TABLE_SIZE];
+static int gasdevIset = 0;         // spare deviate of gasdev()
+static float gasdevGset = 0;
+
+void getRandomState(randomState *state) {
+	state->phononSeed = phononSeed;
+	state->replicateSeed = replicateSeed;
+	state->tiltSeed = tiltSeed;
+	state->ran1Iy = ran1Iy;
+	memcpy(state->ran1Iv, ran1Iv, sizeof(ran1Iv));
+	state->gasdevIset = gasdevIset;
+	state->gasdevGset = gasdevGset;
+}
+
+void setRandomState(const randomState *state) {
+	phononSeed = state->phononSeed;
+	replicateSeed = state->replicateSeed;
+	tiltSeed = state->tiltSeed;
+	ran1Iy = state->ran1Iy;
+	memcpy(ran1Iv, state->ran1Iv, sizeof(ran1Iv));
+	gasdevIset = state->gasdevIset;
+	gasdevGset = state->gasdevGset;
+}
+
 #define NCINMAX  500	/* max number of characers in stacking spec */
 #define NRMAX	50	/* number of values in look-up-table in vzatomLUT */
 #define RMIN	0.01	/* min r (in Ang) range of LUT for vzatomLUT() */
@@ -379,7 +410,7 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 	static double *u2=NULL,*u2T,ux=0,uy=0,uz=0; // u2Collect=0; // Ttotal=0;
 	// static double uxCollect=0,uyCollect=0,uzCollect=0;
 	static int *u2Count = NULL,*u2CountT,runCount = 1,u2Size = -1;
-	static long iseed=0;
+	long &iseed = phononSeed;
 	static double **Mm=NULL,**MmInv=NULL;
 	// static double **MmOrig=NULL,**MmOrigInv=NULL;
 	static double *axCell,*byCell,*czCell,*uf,*b;
@@ -493,7 +524,10 @@ int phononDisplacement(double *u,MULS *muls,int id,int icx,int icy,
 												   * introduced in order to match the wobble factor with <u^2>
 												   */
 							   scale = (float) sqrt(muls->tds_temp/300.0) ;
-							   iseed = -(long)(time(NULL));
+							   // a fixed seed gives the same configurations in every process of a tiled scan
+							   // (unless the state has been restored from a checkpoint)
+							   if (iseed == 0)
+								   iseed = (muls->randomSeed != 0) ? -labs(muls->randomSeed) : -(long)(time(NULL));
 						   }
 
 
@@ -1102,13 +1136,9 @@ MULS initMu() {
 	muls.normHolog = 0;
 	muls.gaussianProp = 0;
 
-	muls.sparam = (float *)malloc(NPARAM*sizeof(float));
+	muls.sparam = (float_tt *)malloc(NPARAM*sizeof(float_tt));
 	for (i=0;i<NPARAM;i++)
 		muls.sparam[i] = 0.0;
-	muls.kx = NULL;
-	muls.kx2= NULL;
-	muls.ky = NULL;
-	muls.ky2= NULL;
 
 	/****************************************************/
 	/* copied from slicecell.c                          */
@@ -1192,7 +1222,7 @@ void replicateUnitCell(int ncoord,int *natom,MULS *muls,atom* atoms,int handleVa
 	double choice,lastOcc;
 	double *u;
 	// seed for random number generation
-	static long idum = -1;
+	long &idum = replicateSeed;
 
 	ncx = muls->nCellX;
 	ncy = muls->nCellY;
@@ -1688,7 +1718,7 @@ atom *tiltBoxed(int ncoord,int *natom, MULS *muls,atom *atoms,int handleVacancie
 	//static int u2Count = 0;
 	// static long iseed=0;
 	static double *u;
-	static long idum = -1;
+	long &idum = tiltSeed;
 
 
 	// if (iseed == 0) iseed = -(long) time( NULL );
@@ -2575,8 +2605,8 @@ float ran(long *idum) {
 double ran1(long *idum) { 
 	int j; 
 	long k; 
-	static long iy=0; 
-	static long iv[NTAB]; 
+	long &iy = ran1Iy; 
+	long *iv = ran1Iv; 
 	double temp; 
 	if (*idum <= 0 || !iy) { // Initialize. 
 		if (-(*idum) < 1) *idum=1; // Be sure to prevent  idum = 0. 
@@ -2609,8 +2639,8 @@ double gasdev(long *idum)
 * using ran1(idum) as the source of uniform deviates. */
 { 
 	// float ran1(long *idum); 
-	static int iset=0; 
-	static float gset; 
+	int &iset = gasdevIset; 
+	float &gset = gasdevGset; 
 	double fac,rsq,v1,v2; 
 	if (*idum < 0) {
 		iset=0; // Reinitialize. 
@@ -49,6 +49,21 @@ void writeAmorphous(FILE *fp,superCellBox superCell,int nstart,int nstop);
 double gasdev(long *idum); 
 double ran1(long *idum);
 float ran(long *idum);
+
+// complete state of the random number sequences used for building 
+// the specimen (phonon displacements, occupancies), for checkpoints
+#define RANDOM_TABLE_SIZE 32
+typedef struct randomStateStruct {
+	long phononSeed;
+	long replicateSeed, tiltSeed;
+	long ran1Iy;
+	long ran1Iv[RANDOM_TABLE_SIZE];
+	int gasdevIset;
+	float gasdevGset;
+} randomState;
+
+void getRandomState(randomState *state);
+void setRandomState(const randomState *state);
 int atomCompareZYX(const void *atPtr1,const void *atPtr2);
 int atomCompareZnum(const void *atPtr1,const void *atPtr2);
 #endif /* FILEIO_H */
@@ -0,0 +1,107 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "mapped_buffer.h"
+
+CMappedBuffer::CMappedBuffer(const char *fileName, size_t bytes) :
+m_data(NULL),
+m_bytes(bytes)
+{
+	strncpy(m_fileName, fileName, sizeof(m_fileName)-1);
+	m_fileName[sizeof(m_fileName)-1] = '\0';
+#ifdef _WIN32
+	HANDLE fh = CreateFileA(m_fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if (fh == INVALID_HANDLE_VALUE) {
+		printf("CMappedBuffer: cannot create file %s (it must not exist yet)\n", m_fileName);
+		exit(0);
+	}
+	HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)m_bytes >> 32),
+		(DWORD)(m_bytes & 0xFFFFFFFF), NULL);
+	if (mh == NULL) {
+		printf("CMappedBuffer: cannot map %.1f MB file %s\n", m_bytes/1048576.0, m_fileName);
+		exit(0);
+	}
+	m_data = MapViewOfFile(mh, FILE_MAP_ALL_ACCESS, 0, 0, m_bytes);
+	if (m_data == NULL) {
+		printf("CMappedBuffer: cannot map %.1f MB file %s\n", m_bytes/1048576.0, m_fileName);
+		exit(0);
+	}
+	m_fileHandle = (void *)fh;
+	m_mapHandle = (void *)mh;
+#else
+	// never reuse a file which another process may have mapped
+	m_fd = open(m_fileName, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (m_fd < 0) {
+		printf("CMappedBuffer: cannot create file %s (it must not exist yet)\n", m_fileName);
+		exit(0);
+	}
+	// reserve the blocks now, so that we don't run out of disk space in the middle of a scan
+#ifdef __linux__
+	if ((posix_fallocate(m_fd, 0, (off_t)m_bytes) != 0) &&
+		(ftruncate(m_fd, (off_t)m_bytes) != 0)) {
+#else
+	if (ftruncate(m_fd, (off_t)m_bytes) != 0) {
+#endif
+		printf("CMappedBuffer: cannot allocate %.1f MB for file %s\n", m_bytes/1048576.0, m_fileName);
+		exit(0);
+	}
+	void *p = mmap(NULL, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (p == MAP_FAILED) {
+		printf("CMappedBuffer: cannot map %.1f MB file %s\n", m_bytes/1048576.0, m_fileName);
+		exit(0);
+	}
+	m_data = p;
+	unlink(m_fileName);
+#endif
+}
+
+CMappedBuffer::~CMappedBuffer()
+{
+#ifdef _WIN32
+	UnmapViewOfFile(m_data);
+	CloseHandle((HANDLE)m_mapHandle);
+	CloseHandle((HANDLE)m_fileHandle);
+#else
+	munmap(m_data, m_bytes);
+	close(m_fd);
+#endif
+}
+
+void CMappedBuffer::Prefetch(size_t offset, size_t bytes)
+{
+#ifndef _WIN32
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset-(offset % page);
+
+	if (offset >= m_bytes) return;
+	if (offset+bytes > m_bytes) bytes = m_bytes-offset;
+	madvise((char *)m_data+start, bytes+(offset-start), MADV_WILLNEED);
+#endif
+}
@@ -0,0 +1,54 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPED_BUFFER_H
+#define MAPPED_BUFFER_H
+
+#include <stddef.h>
+
+/**************************************************************
+ * A zero-filled scratch buffer of a fixed size, backed by a
+ * temporary memory mapped file.  The file is allocated in full
+ * when the buffer is created, and is deleted when the buffer
+ * is destroyed (or by the OS, if we crash).  It must not exist
+ * yet, so that two processes never map the same file.
+ *
+ * CMappedBuffer spill(fileName, bytes);
+ * float *p = (float *)spill.Data();
+ **************************************************************/
+class CMappedBuffer {
+	char m_fileName[1024];
+	void *m_data;
+	size_t m_bytes;
+#ifdef _WIN32
+	void *m_fileHandle, *m_mapHandle;
+#else
+	int m_fd;
+#endif
+public:
+	CMappedBuffer(const char *fileName, size_t bytes);
+	~CMappedBuffer();
+
+	void *Data() { return m_data; }
+	size_t Size() { return m_bytes; }
+	// ask the OS to read [offset, offset+bytes) ahead of its use (no-op on Windows)
+	void Prefetch(size_t offset, size_t bytes);
+};
+
+#endif
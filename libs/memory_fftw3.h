@@ -25,8 +25,16 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "floatdef.h"
 #include "fftw3.h"
 
+// same as in stemtypes_fftw3.h, which includes this file first
+#ifndef FLOAT_PRECISION
+#define FLOAT_PRECISION 1
+#endif
 #ifndef float_tt
+#if FLOAT_PRECISION == 1
 #define float_tt float
+#else
+#define float_tt double
+#endif
 #endif
 
 
@@ -0,0 +1,109 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef MULTISLICE_KERNELS_H
+#define MULTISLICE_KERNELS_H
+
+#include <math.h>
+#include <stddef.h>
+#include "simd_kernels.h"
+
+/**************************************************************
+ * The element-wise kernels of the multislice loop, templated on
+ * the scalar type T (float or double), so that they work on 
+ * fftwf_complex and fftw_complex arrays alike.  T (*)[2] is 
+ * what fftw(f)_complex * is, so T is deduced from the arrays:
+ *
+ * transmitWave(wave->wave, muls->trans[islice], nx, ny, posx, posy, nThreads);
+ * scaleWave(wave->wave, nx, ny, 1.0/(nx*ny), nThreads);
+ * copyWave(context->otherWave, wave->wave, nx, ny, nThreads);
+ * phaseGrating(muls->trans[0][0], (size_t)nSlices*nx*ny, scale);
+ *
+ * The complex multiplications go through simd_kernels.h, which
+ * chooses the instruction set at run time.  With nThreads > 1 the
+ * rows are split between that many OpenMP threads (for the modes
+ * which have only one wave, see PropagationContext).
+ * The wave and trans may differ in precision (see 'propagation 
+ * precision:'), trans is then converted on the fly.
+ **************************************************************/
+
+// wave[ix][iy] *= trans[ix+posx][iy+posy]; the rows of both are contiguous
+template <class T> void transmitWave(T (**wave)[2], T (**trans)[2], int nx, int ny, int posx, int posy, int nThreads) {
+	int ix;
+#pragma omp parallel for num_threads(nThreads) if(nThreads > 1)
+	for (ix=0; ix<nx; ix++)
+		complexMultiply((T *)wave[ix], (const T *)(trans[ix+posx]+posy), ny);
+}
+
+// the same for a wave in another precision than trans
+template <class T, class S> void transmitWave(T (**wave)[2], S (**trans)[2], int nx, int ny, int posx, int posy, int nThreads) {
+	int ix, iy;
+	T wr, wi, tr, ti;
+	const S *t;
+#pragma omp parallel for private(iy, wr, wi, tr, ti, t) num_threads(nThreads) if(nThreads > 1)
+	for (ix=0; ix<nx; ix++) {
+		t = (const S *)(trans[ix+posx]+posy);
+		for (iy=0; iy<ny; iy++) {
+			tr = (T)t[2*iy];
+			ti = (T)t[2*iy+1];
+			wr = wave[ix][iy][0];
+			wi = wave[ix][iy][1];
+			wave[ix][iy][0] = wr*tr-wi*ti;
+			wave[ix][iy][1] = wr*ti+wi*tr;
+		}
+	}
+}
+
+// dst[ix][iy] = src[ix][iy], converted to the precision of dst
+template <class T, class S> void copyWave(T (**dst)[2], S (**src)[2], int nx, int ny, int nThreads) {
+	int ix, iy;
+#pragma omp parallel for private(iy) num_threads(nThreads) if(nThreads > 1)
+	for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+		dst[ix][iy][0] = (T)src[ix][iy][0];
+		dst[ix][iy][1] = (T)src[ix][iy][1];
+	}
+}
+
+// wave[ix][iy] *= scale, e.g. the FFT normalization
+template <class T> void scaleWave(T (**wave)[2], int nx, int ny, double scale, int nThreads) {
+	int ix, iy;
+	T s = (T)scale;
+#pragma omp parallel for private(iy) num_threads(nThreads) if(nThreads > 1)
+	for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+		wave[ix][iy][0] *= s;
+		wave[ix][iy][1] *= s;
+	}
+}
+
+// the transmission function exp(i*scale*V) of n values of the 
+// projected potential V, which are in the real parts of data
+template <class T> void phaseGrating(T (*data)[2], size_t n, double scale) {
+	long i;
+	double vz;
+#pragma omp parallel for private(vz)
+	for (i=0; i<(long)n; i++) {
+		vz = data[i][0]*scale;
+		data[i][0] = (T)cos(vz);
+		data[i][1] = (T)sin(vz);
+	}
+}
+
+#endif
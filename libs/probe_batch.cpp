@@ -0,0 +1,73 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "probe_batch.h"
+
+ProbeBatch::ProbeBatch(int size, int nx, int ny) :
+m_nx(nx),
+m_ny(ny),
+m_size(size)
+{
+	size_t waveSize = (size_t)nx*ny;
+
+#if FLOAT_PRECISION == 1
+	m_buffer = (complex_type *)fftwf_malloc(size*waveSize*sizeof(complex_type));
+#else
+	m_buffer = (complex_type *)fftw_malloc(size*waveSize*sizeof(complex_type));
+#endif
+	if (m_buffer == NULL) {
+		printf("ProbeBatch cannot allocate %d waves of %d x %d\n", size, nx, ny);
+		exit(0);
+	}
+	memset(m_buffer, 0, size*waveSize*sizeof(complex_type));
+
+	m_rows = std::vector<complex_type **>(size);
+	for (int k=0; k<size; k++) {
+		m_rows[k] = (complex_type **)malloc(nx*sizeof(complex_type *));
+		for (int ix=0; ix<nx; ix++)
+			m_rows[k][ix] = m_buffer+k*waveSize+ix*ny;
+	}
+}
+
+ProbeBatch::~ProbeBatch()
+{
+#if FLOAT_PRECISION == 1
+	fftwf_free(m_buffer);
+#else
+	fftw_free(m_buffer);
+#endif
+	for (int k=0; k<m_size; k++) free(m_rows[k]);
+}
+
+// copy each wave into its slot and let wave->wave point there (or back), 
+// the array which is not in use is parked in m_rows in the mean time.
+void ProbeBatch::Exchange(std::vector<WavePtr> &waves, int count)
+{
+	complex_type **tmp;
+
+	for (int k=0; k<count; k++) {
+		memcpy(m_rows[k][0], waves[k]->wave[0], (size_t)m_nx*m_ny*sizeof(complex_type));
+		tmp = m_rows[k];
+		m_rows[k] = waves[k]->wave;
+		waves[k]->wave = tmp;
+	}
+}
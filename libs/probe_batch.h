@@ -0,0 +1,63 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBE_BATCH_H
+#define PROBE_BATCH_H
+
+#include <vector>
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+
+/**************************************************************
+ * ProbeBatch holds the wave functions of several probe positions
+ * in one contiguous buffer, so that they can be transformed with
+ * a single set of fftw plans (see PrunedFFT).
+ *
+ * ProbeBatchPtr batch = ProbeBatchPtr(new ProbeBatch(K,nx,ny));
+ * batch->Attach(waves, count);   // waves[k]->wave now lives in the batch
+ * fft->Forward(batch->Buffer());  // fft = PrunedFFT(nx, ny, K, ...)
+ * batch->Detach(waves, count);   // waves[k]->wave is its own array again
+ *
+ * Only the first count waves take part; if count < K, the
+ * remaining slots are transformed along, but not used.
+ **************************************************************/
+class ProbeBatch {
+#if FLOAT_PRECISION == 1
+	typedef fftwf_complex complex_type;
+#else
+	typedef fftw_complex complex_type;
+#endif
+	int m_nx, m_ny, m_size;
+	complex_type *m_buffer;
+	std::vector<complex_type **> m_rows;   // row pointers of each slot, or the own array of an attached wave
+
+	void Exchange(std::vector<WavePtr> &waves, int count);
+public:
+	ProbeBatch(int size, int nx, int ny);
+	~ProbeBatch();
+
+	void Attach(std::vector<WavePtr> &waves, int count) { Exchange(waves, count); }
+	void Detach(std::vector<WavePtr> &waves, int count) { Exchange(waves, count); }
+	int Size() { return m_size; }
+	complex_type *Buffer() { return m_buffer; }
+};
+
+typedef boost::shared_ptr<ProbeBatch> ProbeBatchPtr;
+
+#endif
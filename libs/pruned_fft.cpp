@@ -0,0 +1,77 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include "pruned_fft.h"
+
+template <class T> PrunedFFTT<T>::PrunedFFTT(int nx, int ny, int count, int yLow, int yHigh, backend_ptr backend) :
+m_nx(nx),
+m_ny(ny),
+m_count(count)
+{
+	complex_type *data;
+	int r, waveSize = nx*ny;
+
+	if (backend == NULL) backend = fftBackend<T>();
+	// all columns, if the two ranges overlap
+	if (yLow >= yHigh) {
+		yLow = ny;
+		yHigh = ny;
+	}
+	m_colStart[0] = 0;
+	m_colNum[0] = yLow;
+	m_colStart[1] = yHigh;
+	m_colNum[1] = ny-yHigh;
+
+	// the plans are made with a scratch array, which MEASURE and PATIENT overwrite
+	data = (complex_type *)fftw_malloc((size_t)count*waveSize*sizeof(complex_type));
+	if (data == NULL) {
+		printf("PrunedFFT cannot allocate %d waves of %d x %d\n", count, nx, ny);
+		exit(0);
+	}
+	m_rowsForw = backend->PlanMany(1, &ny, count*nx, 1, ny, FFTW_FORWARD, data);
+	m_rowsInv = backend->PlanMany(1, &ny, count*nx, 1, ny, FFTW_BACKWARD, data);
+	// 1D transforms of length nx (stride ny) of the columns of one range
+	for (r=0; r<2; r++) if (m_colNum[r] > 0) {
+		m_colsForw[r] = backend->PlanMany(1, &nx, m_colNum[r], ny, 1, FFTW_FORWARD, data+m_colStart[r]);
+		m_colsInv[r] = backend->PlanMany(1, &nx, m_colNum[r], ny, 1, FFTW_BACKWARD, data+m_colStart[r]);
+	}
+	fftw_free(data);
+}
+
+template <class T> void PrunedFFTT<T>::Columns(plan_ptr plans[2], complex_type *data)
+{
+	for (int k=0; k<m_count; k++) for (int r=0; r<2; r++) if (m_colNum[r] > 0)
+		plans[r]->Execute(data+(size_t)k*m_nx*m_ny+m_colStart[r]);
+}
+
+template <class T> void PrunedFFTT<T>::Forward(complex_type *data)
+{
+	m_rowsForw->Execute(data);
+	Columns(m_colsForw, data);
+}
+
+template <class T> void PrunedFFTT<T>::Inverse(complex_type *data)
+{
+	Columns(m_colsInv, data);
+	m_rowsInv->Execute(data);
+}
+
+template class PrunedFFTT<float>;
+template class PrunedFFTT<double>;
@@ -0,0 +1,85 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PRUNED_FFT_H
+#define PRUNED_FFT_H
+
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+#include "fft_backend.h"
+
+/**************************************************************
+ * PrunedFFT does the 2D FFTs of the multislice loop for waves
+ * whose reciprocal space is bandwidth limited to the columns 
+ * iy < yLow and iy >= yHigh (all other columns are 0).
+ * The 2D FFT is done in two 1D passes, along y (the rows) and 
+ * along x (the columns), and the column pass is only done for 
+ * the columns inside the bandwidth limit:
+ *   - Inverse() assumes, that the other columns are 0, and so 
+ *     they stay 0 after the column pass,
+ *   - Forward() only computes the columns inside the limit, the
+ *     others contain only the row transforms.  They must be 
+ *     cleared by the caller (the propagator does that anyway).
+ * For the 2/3 bandwidth limit this skips 1/3 of the column pass.
+ *
+ * The row pass is not pruned, although the rows outside the kx 
+ * limit are 0 as well: after the column pass of Inverse() every 
+ * row has values in the columns inside the limit, and the row pass 
+ * of Forward() comes first, on the dense real space wave.  Skipping
+ * rows would only work with the passes in the other order, and then
+ * the column pass would have to be complete.  So one of the two 
+ * passes can be pruned, and it is the strided (more expensive) one.
+ * Pruning within the 1D transforms (zero inputs, unused outputs) 
+ * is not possible with the plans of the backends.
+ *
+ * PrunedFFTPtr fft = PrunedFFTPtr(new PrunedFFT(nx, ny, count, yLow, yHigh));
+ * fft->Forward(wave->wave[0]);     // count waves of nx x ny, one after the other
+ * fft->Inverse(wave->wave[0]);
+ *
+ * PrunedFFT works in the precision of the build, PrunedFFTT<T> in
+ * float or double.
+ *
+ * The 1D passes are plans of the FFT backend in use (see 
+ * fft_backend.h), or of the given one, so that "fft library:" 
+ * applies to the multislice loop, too.  They are made for arrays 
+ * from fftw(f)_malloc, which all have the same alignment, and 
+ * can be used for any of them.
+ **************************************************************/
+template <class T> class PrunedFFTT {
+	typedef typename FFTComplex<T>::type complex_type;
+	typedef typename FFTBackendT<T>::plan_ptr plan_ptr;
+	typedef boost::shared_ptr<FFTBackendT<T> > backend_ptr;
+	int m_nx, m_ny, m_count;
+	int m_colStart[2], m_colNum[2];          // the ranges of columns inside the bandwidth limit
+	plan_ptr m_rowsForw, m_rowsInv;
+	plan_ptr m_colsForw[2], m_colsInv[2];     // the columns of one range in one wave
+
+	void Columns(plan_ptr plans[2], complex_type *data);
+public:
+	PrunedFFTT(int nx, int ny, int count, int yLow, int yHigh, backend_ptr backend=backend_ptr());
+
+	void Forward(complex_type *data);
+	void Inverse(complex_type *data);
+};
+
+typedef PrunedFFTT<fftw_real> PrunedFFT;
+typedef boost::shared_ptr<PrunedFFT> PrunedFFTPtr;
+
+#endif
@@ -0,0 +1,222 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simd_kernels.h"
+
+// the vector kernels are only used for single precision on x86
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_SSE2   __attribute__((target("sse2")))
+#define TARGET_AVX2   __attribute__((target("avx2")))
+// AVX-512 implies FMA; keep gcc from contracting mul+add, so that all
+// levels round exactly like the scalar code
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
+#endif
+
+static int s_level = -1;
+
+/*------------------------ scalar versions ------------------------*/
+template <class T> static void cmulScalar(T *w, const T *t, int n) {
+	int i;
+	T wr, wi;
+
+	for (i=0; i<2*n; i+=2) {
+		wr = w[i];
+		wi = w[i+1];
+		w[i]   = wr*t[i]   - wi*t[i+1];
+		w[i+1] = wi*t[i]   + wr*t[i+1];
+	}
+}
+
+template <class T> static void cmul2Scalar(T *w, const T *a, T br, T bi, int n) {
+	int i;
+	T wr, wi, tr, ti;
+
+	for (i=0; i<2*n; i+=2) {
+		wr = w[i];
+		wi = w[i+1];
+		tr = wr*a[i]   - wi*a[i+1];
+		ti = wi*a[i]   + wr*a[i+1];
+		w[i]   = tr*br - ti*bi;
+		w[i+1] = ti*br + tr*bi;
+	}
+}
+
+#ifdef SIMD_X86
+/*------------------------ SSE2: 2 complex numbers at a time ------------------------*/
+// (ar,ai)*(br,bi) = (ar*br - ai*bi, ai*br + ar*bi), the sign flips the product 
+// in the real lanes, which gives exactly the same result as a subtraction
+TARGET_SSE2 static inline __m128 cmulSSE2(__m128 a, __m128 b) {
+	const __m128 sign = _mm_castsi128_ps(_mm_set_epi32(0, (int)0x80000000, 0, (int)0x80000000));
+	__m128 bre = _mm_shuffle_ps(b, b, _MM_SHUFFLE(2,2,0,0));
+	__m128 bim = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3,3,1,1));
+	__m128 asw = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2,3,0,1));
+	return _mm_add_ps(_mm_mul_ps(a, bre), _mm_xor_ps(_mm_mul_ps(asw, bim), sign));
+}
+
+TARGET_SSE2 static void cmulRowSSE2(float *w, const float *t, int n) {
+	int i;
+	for (i=0; i+2<=n; i+=2)
+		_mm_storeu_ps(w+2*i, cmulSSE2(_mm_loadu_ps(w+2*i), _mm_loadu_ps(t+2*i)));
+	cmulScalar(w+2*i, t+2*i, n-i);
+}
+
+TARGET_SSE2 static void cmul2RowSSE2(float *w, const float *a, float br, float bi, int n) {
+	int i;
+	__m128 b = _mm_setr_ps(br, bi, br, bi);
+	for (i=0; i+2<=n; i+=2)
+		_mm_storeu_ps(w+2*i, cmulSSE2(cmulSSE2(_mm_loadu_ps(w+2*i), _mm_loadu_ps(a+2*i)), b));
+	cmul2Scalar(w+2*i, a+2*i, br, bi, n-i);
+}
+
+/*------------------------ AVX2: 4 complex numbers at a time ------------------------*/
+TARGET_AVX2 static inline __m256 cmulAVX2(__m256 a, __m256 b) {
+	__m256 bre = _mm256_moveldup_ps(b);
+	__m256 bim = _mm256_movehdup_ps(b);
+	__m256 asw = _mm256_permute_ps(a, 0xB1);
+	return _mm256_addsub_ps(_mm256_mul_ps(a, bre), _mm256_mul_ps(asw, bim));
+}
+
+TARGET_AVX2 static void cmulRowAVX2(float *w, const float *t, int n) {
+	int i;
+	for (i=0; i+4<=n; i+=4)
+		_mm256_storeu_ps(w+2*i, cmulAVX2(_mm256_loadu_ps(w+2*i), _mm256_loadu_ps(t+2*i)));
+	cmulScalar(w+2*i, t+2*i, n-i);
+}
+
+TARGET_AVX2 static void cmul2RowAVX2(float *w, const float *a, float br, float bi, int n) {
+	int i;
+	__m256 b = _mm256_setr_ps(br, bi, br, bi, br, bi, br, bi);
+	for (i=0; i+4<=n; i+=4)
+		_mm256_storeu_ps(w+2*i, cmulAVX2(cmulAVX2(_mm256_loadu_ps(w+2*i), _mm256_loadu_ps(a+2*i)), b));
+	cmul2Scalar(w+2*i, a+2*i, br, bi, n-i);
+}
+
+/*------------------------ AVX-512: 8 complex numbers at a time ------------------------*/
+// no fused multiply-add, so that the rounding is the same as above
+TARGET_AVX512 static inline __m512 cmulAVX512(__m512 a, __m512 b) {
+	const __m512i sign = _mm512_set1_epi64(0x80000000);
+	__m512 bre = _mm512_moveldup_ps(b);
+	__m512 bim = _mm512_movehdup_ps(b);
+	__m512 asw = _mm512_permute_ps(a, 0xB1);
+	__m512 p = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_mm512_mul_ps(asw, bim)), sign));
+	return _mm512_add_ps(_mm512_mul_ps(a, bre), p);
+}
+
+TARGET_AVX512 static void cmulRowAVX512(float *w, const float *t, int n) {
+	int i;
+	for (i=0; i+8<=n; i+=8)
+		_mm512_storeu_ps(w+2*i, cmulAVX512(_mm512_loadu_ps(w+2*i), _mm512_loadu_ps(t+2*i)));
+	cmulScalar(w+2*i, t+2*i, n-i);
+}
+
+TARGET_AVX512 static void cmul2RowAVX512(float *w, const float *a, float br, float bi, int n) {
+	int i;
+	__m512 b = _mm512_setr_ps(br, bi, br, bi, br, bi, br, bi, br, bi, br, bi, br, bi, br, bi);
+	for (i=0; i+8<=n; i+=8)
+		_mm512_storeu_ps(w+2*i, cmulAVX512(cmulAVX512(_mm512_loadu_ps(w+2*i), _mm512_loadu_ps(a+2*i)), b));
+	cmul2Scalar(w+2*i, a+2*i, br, bi, n-i);
+}
+#endif
+
+/*------------------------ run time dispatch ------------------------*/
+int simdDetectLevel() {
+#ifdef SIMD_X86
+#if defined(_MSC_VER)
+	int info[4];
+	unsigned long long xcr0 = 0;
+
+	__cpuid(info, 1);
+	if (!(info[3] & (1 << 26))) return SIMD_SCALAR;
+	// the OS must save the AVX (and AVX-512) registers
+	if (!(info[2] & (1 << 27))) return SIMD_SSE2;
+	xcr0 = _xgetbv(0);
+	if ((xcr0 & 6) != 6) return SIMD_SSE2;
+	__cpuidex(info, 7, 0);
+	if ((info[1] & (1 << 16)) && ((xcr0 & 0xE6) == 0xE6)) return SIMD_AVX512;
+	if (info[1] & (1 << 5)) return SIMD_AVX2;
+	return SIMD_SSE2;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+#endif
+	return SIMD_SCALAR;
+}
+
+int simdLevel() {
+	if (s_level < 0) s_level = simdDetectLevel();
+	return s_level;
+}
+
+int setSimdLevel(int level) {
+	int best = simdDetectLevel();
+	s_level = (level < best) ? ((level < SIMD_SCALAR) ? SIMD_SCALAR : level) : best;
+	return s_level;
+}
+
+const char *simdLevelName(int level) {
+	switch (level) {
+		case SIMD_SSE2:   return "SSE2";
+		case SIMD_AVX2:   return "AVX2";
+		case SIMD_AVX512: return "AVX-512";
+	}
+	return "scalar";
+}
+
+void complexMultiply(float *w, const float *t, int n) {
+	switch (simdLevel()) {
+#ifdef SIMD_X86
+		case SIMD_AVX512: cmulRowAVX512(w, t, n); return;
+		case SIMD_AVX2:   cmulRowAVX2(w, t, n);   return;
+		case SIMD_SSE2:   cmulRowSSE2(w, t, n);   return;
+#endif
+	}
+	cmulScalar(w, t, n);
+}
+
+void complexMultiply2(float *w, const float *a, float br, float bi, int n) {
+	switch (simdLevel()) {
+#ifdef SIMD_X86
+		case SIMD_AVX512: cmul2RowAVX512(w, a, br, bi, n); return;
+		case SIMD_AVX2:   cmul2RowAVX2(w, a, br, bi, n);   return;
+		case SIMD_SSE2:   cmul2RowSSE2(w, a, br, bi, n);   return;
+#endif
+	}
+	cmul2Scalar(w, a, br, bi, n);
+}
+
+// double precision has no vector kernels (yet)
+void complexMultiply(double *w, const double *t, int n) {
+	cmulScalar(w, t, n);
+}
+
+void complexMultiply2(double *w, const double *a, double br, double bi, int n) {
+	cmul2Scalar(w, a, br, bi, n);
+}
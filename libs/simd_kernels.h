@@ -0,0 +1,54 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SIMD_KERNELS_H
+#define SIMD_KERNELS_H
+
+#include "stemtypes_fftw3.h"
+
+/**************************************************************
+ * Complex multiplication kernels for the inner loops of the
+ * multislice algorithm (transmission and propagation).  They 
+ * work on contiguous rows of n complex numbers, stored as 
+ * interleaved (re, im) pairs like fftw(f)_complex.
+ *
+ * On x86 the instruction set is chosen at run time from CPUID:
+ * AVX-512, AVX2 or SSE2, with a scalar fallback for everything 
+ * else.  All versions round the same way, so their results are 
+ * identical.  The double precision overloads are always scalar.
+ *
+ * complexMultiply(w, t, n);             // w[i] = w[i]*t[i]
+ * complexMultiply2(w, a, br, bi, n);    // w[i] = (w[i]*a[i])*(br + i bi)
+ **************************************************************/
+#define SIMD_SCALAR  0
+#define SIMD_SSE2    1
+#define SIMD_AVX2    2
+#define SIMD_AVX512  3
+
+int simdLevel();                        // the level which is in use
+int simdDetectLevel();                  // the best level this CPU supports
+int setSimdLevel(int level);            // use at most level (for tests and benchmarks), returns the new level
+const char *simdLevelName(int level);
+
+void complexMultiply(float *w, const float *t, int n);
+void complexMultiply2(float *w, const float *a, float br, float bi, int n);
+void complexMultiply(double *w, const double *t, int n);
+void complexMultiply2(double *w, const double *a, double br, double bi, int n);
+
+#endif
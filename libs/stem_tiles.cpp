@@ -0,0 +1,218 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stem_tiles.h"
+
+#define TILE_MAGIC "QSTEMTIL"
+#define TILE_VERSION 2   // 2: images in double precision
+
+void scanTileWindow(int scanXN, int scanYN, int tile, int nTiles,
+					int *ixStart, int *ixStop, int *iyStart, int *iyStop)
+{
+	int nTx, nTy, tx, ty, best=1;
+	double diff, bestDiff=-1;
+
+	if ((nTiles < 1) || (tile < 0) || (tile >= nTiles)) {
+		printf("scanTileWindow: tile %d of %d does not exist\n", tile, nTiles);
+		exit(0);
+	}
+	// use the factorization nTx*nTy = nTiles which gives the squarest blocks
+	for (nTx=1; nTx<=nTiles; nTx++) {
+		if (nTiles % nTx) continue;
+		nTy = nTiles/nTx;
+		if ((nTx > scanXN) || (nTy > scanYN)) continue;
+		diff = (double)scanXN/nTx-(double)scanYN/nTy;
+		if (diff < 0) diff = -diff;
+		if ((bestDiff < 0) || (diff < bestDiff)) {
+			bestDiff = diff;
+			best = nTx;
+		}
+	}
+	if (bestDiff < 0) {
+		printf("scanTileWindow: cannot cut a %d x %d scan into %d tiles\n", scanXN, scanYN, nTiles);
+		exit(0);
+	}
+	nTx = best;
+	nTy = nTiles/nTx;
+	tx = tile / nTy;
+	ty = tile % nTy;
+	*ixStart = (int)(((long)tx*scanXN)/nTx);
+	*ixStop  = (int)(((long)(tx+1)*scanXN)/nTx);
+	*iyStart = (int)(((long)ty*scanYN)/nTy);
+	*iyStop  = (int)(((long)(ty+1)*scanYN)/nTy);
+}
+
+void stemTileName(char *fileName, const char *folder, int tile, int nTiles)
+{
+	sprintf(fileName, "%s/stem_tile_%d_of_%d.dat", folder, tile, nTiles);
+}
+
+void writeSTEMTile(const char *fileName, STEMTileHeader &header, std::vector<float> &thickness,
+				   std::vector<std::vector<DetectorPtr> > &detectors)
+{
+	char tmpName[1024];
+	int islice, i, ix, ny;
+	FILE *fp;
+	bool ok;
+
+	sprintf(tmpName, "%s.tmp", fileName);
+	if ((fp = fopen(tmpName, "wb")) == NULL) {
+		printf("writeSTEMTile: cannot open %s for writing\n", tmpName);
+		exit(0);
+	}
+	header.version = TILE_VERSION;
+	ny = header.iyStop-header.iyStart;
+	ok = (fwrite(TILE_MAGIC, 1, 8, fp) == 8) &&
+		(fwrite(&header, sizeof(STEMTileHeader), 1, fp) == 1) &&
+		(fwrite(&thickness[0], sizeof(float), header.nPlanes, fp) == (size_t)header.nPlanes);
+	for (islice=0; ok && (islice<header.nPlanes); islice++) for (i=0; ok && (i<header.detectorNum); i++) {
+		DetectorPtr det = detectors[islice][i];
+		ok = (fwrite(det->name, 1, sizeof(det->name), fp) == sizeof(det->name)) &&
+			(fwrite(&det->Navg, sizeof(int), 1, fp) == 1);
+		for (ix=header.ixStart; ok && (ix<header.ixStop); ix++)
+			ok = (fwrite(&det->image[ix][header.iyStart], sizeof(accum_tt), ny, fp) == (size_t)ny) &&
+				(fwrite(&det->image2[ix][header.iyStart], sizeof(accum_tt), ny, fp) == (size_t)ny);
+	}
+	if ((fclose(fp) != 0) || !ok) {
+		printf("writeSTEMTile: error while writing %s\n", tmpName);
+		exit(0);
+	}
+#ifdef _WIN32
+	remove(fileName);
+#endif
+	if (rename(tmpName, fileName) != 0) {
+		printf("writeSTEMTile: cannot rename %s to %s\n", tmpName, fileName);
+		exit(0);
+	}
+}
+
+void readSTEMTile(const char *fileName, STEMTileHeader &header, const STEMTileHeader *scan,
+				  std::vector<float> &thickness, std::vector<std::vector<DetectorPtr> > &detectors)
+{
+	STEMTileHeader &h = header;
+	std::vector<float> t;
+	char magic[8], name[32];
+	int islice, i, ix, ny, Navg;
+	FILE *fp;
+	bool ok, create = (scan == NULL);
+
+	if ((fp = fopen(fileName, "rb")) == NULL) {
+		printf("readSTEMTile: cannot open %s\n", fileName);
+		exit(0);
+	}
+	ok = (fread(magic, 1, 8, fp) == 8) && (memcmp(magic, TILE_MAGIC, 8) == 0) &&
+		(fread(&h, sizeof(STEMTileHeader), 1, fp) == 1) && (h.version == TILE_VERSION) &&
+		(h.nPlanes > 0) && (h.detectorNum >= 0);
+	if (ok) {
+		t = std::vector<float>(h.nPlanes);
+		ok = (fread(&t[0], sizeof(float), h.nPlanes, fp) == (size_t)h.nPlanes);
+	}
+	if (!ok) {
+		printf("readSTEMTile: %s is not a STEM tile file\n", fileName);
+		exit(0);
+	}
+	if (create) {
+		thickness = t;
+		detectors = std::vector<std::vector<DetectorPtr> >(h.nPlanes);
+		for (islice=0; islice<h.nPlanes; islice++) for (i=0; i<h.detectorNum; i++)
+			detectors[islice].push_back(DetectorPtr(new Detector(h.scanXN, h.scanYN, h.resX, h.resY)));
+	}
+	else if ((h.nTiles != scan->nTiles) || (h.scanXN != scan->scanXN) || (h.scanYN != scan->scanYN) ||
+		(h.nPlanes != scan->nPlanes) || (h.detectorNum != scan->detectorNum) ||
+		(h.avgCount != scan->avgCount) || (t != thickness)) {
+		printf("readSTEMTile: %s does not belong to the same scan (or the same TDS run) as tile %d\n",
+			fileName, scan->tile);
+		exit(0);
+	}
+	if ((h.ixStart < 0) || (h.ixStop > h.scanXN) || (h.iyStart < 0) || (h.iyStop > h.scanYN)) {
+		printf("readSTEMTile: window of %s is outside the scan\n", fileName);
+		exit(0);
+	}
+
+	ny = h.iyStop-h.iyStart;
+	for (islice=0; ok && (islice<h.nPlanes); islice++) for (i=0; ok && (i<h.detectorNum); i++) {
+		DetectorPtr det = detectors[islice][i];
+		ok = (fread(name, 1, sizeof(name), fp) == sizeof(name)) &&
+			(fread(&Navg, sizeof(int), 1, fp) == 1);
+		if (!ok) break;
+		name[sizeof(name)-1] = '\0';
+		if (create) {
+			strcpy(det->name, name);
+			det->Navg = Navg;
+		}
+		else if ((strcmp(det->name, name) != 0) || (det->Navg != Navg)) {
+			printf("readSTEMTile: detector %s in %s does not match %s\n", name, fileName, det->name);
+			exit(0);
+		}
+		for (ix=h.ixStart; ok && (ix<h.ixStop); ix++)
+			ok = (fread(&det->image[ix][h.iyStart], sizeof(accum_tt), ny, fp) == (size_t)ny) &&
+				(fread(&det->image2[ix][h.iyStart], sizeof(accum_tt), ny, fp) == (size_t)ny);
+	}
+	fclose(fp);
+	if (!ok) {
+		printf("readSTEMTile: %s is truncated\n", fileName);
+		exit(0);
+	}
+}
+
+void writeSTEMImages(std::vector<std::vector<DetectorPtr> > &detectors, int detectorNum, int nPixels,
+					 const char *folder, std::vector<float> &thickness, int nAvg)
+{
+	int i, ix, islice;
+	int tCount = (int)thickness.size()-1;
+	double intensity;
+	char fileName[512];
+
+	// Loop over slices (intermediates)
+	for (islice=0; islice <= tCount; islice++)
+	{
+		for (i=0; i<detectorNum; i++)
+		{
+			DetectorPtr det = detectors[islice][i];
+			// calculate the standard error for this image:
+			det->error = 0;
+			intensity  = 0;
+			for (ix=0; ix<nPixels; ix++)
+			{
+				det->error += (det->image2[0][ix]-det->image[0][ix] * det->image[0][ix]);
+				intensity += det->image[0][ix] * det->image[0][ix];
+			}
+			det->error /= intensity;
+			if (islice <tCount)
+				sprintf(fileName,"%s/%s_%d.img", folder, det->name, islice);
+			else
+				sprintf(fileName,"%s/%s.img", folder, det->name);
+			// NOTE: the comment for STEM images must be this, or else the MATLAB GUI doesn't recognize it as a STEM image!
+			//     That means the quantification and source size dialogs will be disabled.
+			det->SetComment("STEM image");
+			det->SetThickness(thickness[islice]);
+			det->SetParameter(0, (double)nAvg);
+			det->SetParameter(1, (double)det->error);
+
+			for (ix=0; ix<nPixels; ix++)
+			{
+				det->SetParameter(2+ix, (double)det->image2[0][ix]);
+			}
+			det->WriteImage(fileName);
+		}
+	}
+}
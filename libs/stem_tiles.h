@@ -0,0 +1,77 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STEM_TILES_H
+#define STEM_TILES_H
+
+#include <vector>
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+
+/**************************************************************
+ * Support for splitting a STEM scan over several processes
+ * ("stem3 --tile i/N file.dat"), which only share a file system.
+ *
+ * Every process computes the rectangular block of scan positions
+ * returned by scanTileWindow() and writes the detector images of
+ * this block (image, image2 and Navg of every detector and every
+ * thickness) with writeSTEMTile() to
+ *   <folder>/stem_tile_<i>_of_<N>.dat
+ * stem3-merge reads all N tiles back with readSTEMTile() and
+ * writes the final images with writeSTEMImages(), which is also
+ * what saveSTEMImages() uses for an undivided scan.
+ **************************************************************/
+
+typedef struct STEMTileHeaderStruct {
+	int version;
+	int tile, nTiles;
+	int scanXN, scanYN;
+	int ixStart, ixStop;        // this tile covers [ixStart,ixStop) x [iyStart,iyStop)
+	int iyStart, iyStop;
+	int nPlanes;                // number of thickness planes (tCount+1)
+	int detectorNum;
+	int avgCount;
+	float_tt resX, resY;        // pixel size of the STEM images
+} STEMTileHeader;
+
+// Cut a scanXN x scanYN scan into nTiles blocks (as square as possible)
+// and return the window [ixStart,ixStop) x [iyStart,iyStop) of block tile.
+void scanTileWindow(int scanXN, int scanYN, int tile, int nTiles,
+					int *ixStart, int *ixStop, int *iyStart, int *iyStop);
+
+void stemTileName(char *fileName, const char *folder, int tile, int nTiles);
+
+// write the part of the detector images inside the window given in header.
+// The file is written under a temporary name first and then renamed, so
+// that readers never see a partially written tile.
+void writeSTEMTile(const char *fileName, STEMTileHeader &header, std::vector<float> &thickness,
+				   std::vector<std::vector<DetectorPtr> > &detectors);
+
+// Read a tile into (full size) detectors and return its header.  If scan is
+// NULL, thickness is filled in and the detectors are created from the file.
+// Otherwise the tile must belong to the same scan (and TDS run) as scan.
+void readSTEMTile(const char *fileName, STEMTileHeader &header, const STEMTileHeader *scan,
+				  std::vector<float> &thickness, std::vector<std::vector<DetectorPtr> > &detectors);
+
+// write <folder>/<detector name>[_<plane>].img for every detector and
+// thickness plane.  nAvg is the number of frozen phonon configurations.
+void writeSTEMImages(std::vector<std::vector<DetectorPtr> > &detectors, int detectorNum, int nPixels,
+					 const char *folder, std::vector<float> &thickness, int nAvg);
+
+#endif
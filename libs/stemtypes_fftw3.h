@@ -24,9 +24,12 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "boost/shared_ptr.hpp"
 
 ////////////////////////////////////////////////////////////////////////
-// define whether to use single or double precision
+// define whether to use single or double precision 
+// (cmake -DDOUBLE_PRECISION=ON defines FLOAT_PRECISION=0)
 ///////////////////////////////////////////////////////////////////////
+#ifndef FLOAT_PRECISION
 #define FLOAT_PRECISION 1
+#endif
 
 
 #define BW (2.0F/3.0F)	/* bandwidth limit */
@@ -58,13 +61,20 @@ QSTEM - image simulation for TEM/STEM/CBED
 #define float_tt  float
 #endif
 #define real      float
+#define other_real double
 #else  // FLOAT_PRECISION
 #define fftw_real double
 #ifndef float_tt
-#define float_tt  float
+#define float_tt  double
 #endif
-#define real      float
+#define real      double
+#define other_real float
 #endif  // FLOAT_PRECISION
+// the precision which the multislice may run in instead of float_tt, 
+// see 'propagation precision:' and PropagationContext
+// detector signals and frozen phonon averages are summed over many 
+// positions and configurations, so they are kept in double precision
+#define accum_tt  double
 ////////////////////////////////////////////////////////////////
 
 typedef struct atomStruct {
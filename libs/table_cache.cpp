@@ -0,0 +1,149 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "table_cache.h"
+
+#define TABLE_MAGIC "QSTEMLUT"
+
+typedef struct tableHeaderStruct {
+	char magic[8];
+	int version;
+	int headerBytes;
+	unsigned long long key;
+	unsigned long long bytes;
+	unsigned long long dataHash;
+	char reserved[24];
+} tableHeader;
+
+TableKey::TableKey() :
+m_hash(14695981039346656037ULL)
+{
+}
+
+void TableKey::AddBytes(const void *data, size_t bytes)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i=0; i<bytes; i++) {
+		m_hash ^= p[i];
+		m_hash *= 1099511628211ULL;
+	}
+}
+
+void TableKey::Add(const char *text)
+{
+	AddBytes(text, strlen(text)+1);
+}
+
+static unsigned long long dataHash(const void *data, size_t bytes)
+{
+	TableKey key;
+	key.AddBytes(data, bytes);
+	return key.Value();
+}
+
+TableCache::TableCache(const char *folder) :
+m_folder(folder)
+{
+}
+
+std::string TableCache::FileName(unsigned long long key) const
+{
+	char name[64];
+	sprintf(name, "/lut_%016llx.dat", key);
+	return m_folder+name;
+}
+
+bool TableCache::Load(unsigned long long key, void *data, size_t bytes) const
+{
+	std::string fileName = FileName(key);
+	tableHeader header;
+	bool ok;
+
+#ifdef _WIN32
+	FILE *fp = fopen(fileName.c_str(), "rb");
+	if (fp == NULL) return false;
+	ok = (fread(&header, sizeof(header), 1, fp) == 1) && (memcmp(header.magic, TABLE_MAGIC, 8) == 0) &&
+		(header.version == version) && (header.key == key) && (header.bytes == bytes) &&
+		(fread(data, 1, bytes, fp) == bytes) && (dataHash(data, bytes) == header.dataHash);
+	fclose(fp);
+#else
+	struct stat st;
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	if ((fstat(fd, &st) != 0) || ((size_t)st.st_size != sizeof(header)+bytes)) {
+		close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return false;
+	memcpy(&header, p, sizeof(header));
+	ok = (memcmp(header.magic, TABLE_MAGIC, 8) == 0) && (header.version == version) &&
+		(header.key == key) && (header.bytes == bytes) && 
+		(dataHash((char *)p+sizeof(header), bytes) == header.dataHash);
+	if (ok) memcpy(data, (char *)p+sizeof(header), bytes);
+	munmap(p, st.st_size);
+#endif
+	return ok;
+}
+
+bool TableCache::Store(unsigned long long key, const void *data, size_t bytes) const
+{
+	std::string fileName = FileName(key);
+	char suffix[32];
+	tableHeader header;
+	FILE *fp;
+	bool ok;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TABLE_MAGIC, 8);
+	header.version = version;
+	header.headerBytes = sizeof(header);
+	header.key = key;
+	header.bytes = bytes;
+	header.dataHash = dataHash(data, bytes);
+
+	sprintf(suffix, ".%d.tmp", (int)getpid());
+	std::string tmpName = fileName+suffix;
+	if ((fp = fopen(tmpName.c_str(), "wb")) == NULL) return false;
+	ok = (fwrite(&header, sizeof(header), 1, fp) == 1) && (fwrite(data, 1, bytes, fp) == bytes);
+	ok = (fclose(fp) == 0) && ok;
+#ifdef _WIN32
+	// rename() does not replace an existing file here; that one is just as good
+	if (ok && (rename(tmpName.c_str(), fileName.c_str()) == 0)) return true;
+	remove(tmpName.c_str());
+	return ok;
+#else
+	if (ok && (rename(tmpName.c_str(), fileName.c_str()) == 0)) return true;
+	remove(tmpName.c_str());
+	return false;
+#endif
+}
@@ -0,0 +1,76 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TABLE_CACHE_H
+#define TABLE_CACHE_H
+
+#include <stddef.h>
+#include <string>
+#include "boost/shared_ptr.hpp"
+
+/**************************************************************
+ * TableKey hashes (64 bit FNV-1a) everything that a lookup table
+ * depends on, TableCache keeps such tables in files named after
+ * the hash, so that later runs can read them instead of
+ * recomputing them:
+ *
+ * TableKey key;
+ * key.Add(Znum); key.Add(B); key.Add(scatPar[Znum], N_SF);
+ * TableCache cache(folder);
+ * if (!cache.Load(key.Value(), table, bytes)) {
+ *     ... compute table ...
+ *     cache.Store(key.Value(), table, bytes);
+ * }
+ *
+ * The files (<folder>/lut_<hash>.dat) have a 64 byte header with
+ * a magic, the format version, the key, the size and a hash of
+ * the data, which Load() checks; any mismatch is a miss.  Store()
+ * writes to a file of its own (with the process id) and renames
+ * it, so that several processes may share the folder: a reader
+ * sees either no file or a complete one.  Load() and Store() may 
+ * be called by several threads at once, for different keys.
+ **************************************************************/
+
+class TableKey {
+	unsigned long long m_hash;
+public:
+	TableKey();
+	void AddBytes(const void *data, size_t bytes);
+	void Add(int value) { AddBytes(&value, sizeof(value)); }
+	void Add(double value) { AddBytes(&value, sizeof(value)); }
+	void Add(const double *values, int n) { AddBytes(values, n*sizeof(double)); }
+	void Add(const char *text);
+	unsigned long long Value() const { return m_hash; }
+};
+
+class TableCache {
+	std::string m_folder;
+	std::string FileName(unsigned long long key) const;
+public:
+	static const int version = 1;
+
+	TableCache(const char *folder);
+	bool Load(unsigned long long key, void *data, size_t bytes) const;
+	bool Store(unsigned long long key, const void *data, size_t bytes) const;
+};
+
+typedef boost::shared_ptr<TableCache> TableCachePtr;
+
+#endif
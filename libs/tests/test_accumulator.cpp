@@ -0,0 +1,59 @@
+#include <boost/test/unit_test.hpp>
+
+#include "accumulator.h"
+
+BOOST_AUTO_TEST_SUITE (TestAccumulator)
+
+// the average of 1,2,3,4 is 2.5 with a variance of 1.25, in RAM as well as in the spill file
+void checkAverage(int budgetMB)
+{
+  int n = 100;
+  Accumulator acc(2, n, budgetMB, "test_accumulator.tmp");
+  std::vector<float_tt> data(n), mean(n), var(n);
+  double chisq = 0;
+
+  for (int run=1; run<=4; run++) {
+    for (int i=0; i<n; i++) data[i] = (float_tt)run;
+    chisq = acc.Add(1, &data[0]);
+  }
+  BOOST_CHECK_EQUAL(acc.Count(0), 0);
+  BOOST_CHECK_EQUAL(acc.Count(1), 4);
+  // the mean moved from 2 to 2.5 in the last run:
+  BOOST_CHECK_CLOSE(chisq, n*0.25, 1e-3);
+
+  acc.GetMean(1, &mean[0]);
+  acc.GetVariance(1, &var[0]);
+  BOOST_CHECK_CLOSE(mean[0], 2.5f, 1e-4);
+  BOOST_CHECK_CLOSE(mean[n-1], 2.5f, 1e-4);
+  BOOST_CHECK_CLOSE(var[n-1], 1.25f, 1e-4);
+}
+
+BOOST_AUTO_TEST_CASE (testRamAverage)
+{
+  checkAverage(1);
+}
+
+BOOST_AUTO_TEST_CASE (testSpilledAverage)
+{
+  checkAverage(0);
+}
+
+// a small variance on top of a large mean over many runs, which 
+// drifts off when the sums are kept in single precision
+BOOST_AUTO_TEST_CASE (testManyRuns)
+{
+  int n = 10, runs = 2000;
+  Accumulator acc(1, n, 1, "test_accumulator.tmp");
+  std::vector<float_tt> data(n), mean(n), var(n);
+
+  for (int run=0; run<runs; run++) {
+    for (int i=0; i<n; i++) data[i] = (float_tt)(1000+(run % 2));
+    acc.Add(0, &data[0]);
+  }
+  acc.GetMean(0, &mean[0]);
+  acc.GetVariance(0, &var[0]);
+  BOOST_CHECK_CLOSE(mean[0], 1000.5f, 1e-5);
+  BOOST_CHECK_CLOSE(var[n-1], 0.25f, 1e-3);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
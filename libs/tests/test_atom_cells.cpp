@@ -0,0 +1,88 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include "atom_cells.h"
+
+struct AtomCellsFixture {
+  // 500 random atoms in a 20x15x10 A box, every 7th a vacancy
+  AtomCellsFixture():
+    natom(500),
+    atoms(500)
+  {
+    srand(17);
+    for (int i=0; i<natom; i++) {
+      atoms[i].x = 20.0f*rand()/RAND_MAX;
+      atoms[i].y = 15.0f*rand()/RAND_MAX-5.0f;
+      atoms[i].z = 10.0f*rand()/RAND_MAX;
+      atoms[i].Znum = (i % 7 == 3) ? 0 : 14;
+    }
+  }
+
+  bool inside(int i, double xmin, double xmax, double ymin, double ymax, double zmin, double zmax)
+  {
+    return (atoms[i].x >= xmin) && (atoms[i].x <= xmax) && (atoms[i].y >= ymin) && 
+      (atoms[i].y <= ymax) && (atoms[i].z >= zmin) && (atoms[i].z <= zmax);
+  }
+
+  int natom;
+  std::vector<atom> atoms;
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestAtomCells, AtomCellsFixture)
+
+BOOST_AUTO_TEST_CASE (testAll)
+{
+  AtomCells cells(&atoms[0], natom, 2.0f);
+  std::vector<int> list;
+
+  BOOST_CHECK_EQUAL(cells.Atoms(), natom-71);
+  cells.Collect(0, cells.CellsX()-1, 0, cells.CellsY()-1, 0, cells.CellsZ()-1, list);
+  BOOST_CHECK_EQUAL((int)list.size(), natom-71);
+  std::sort(list.begin(), list.end());
+  for (int i=0, n=0; i<natom; i++) {
+    if (atoms[i].Znum == 0) continue;
+    BOOST_CHECK_EQUAL(list[n++], i);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testBox)
+{
+  AtomCells cells(&atoms[0], natom, 2.0f);
+  std::vector<int> list;
+  int i, n, found;
+
+  cells.Collect(3.5, 8.0, -1.0, 2.5, 4.0, 6.2, list);
+  // ascending within each cell, and no atom twice
+  for (n=1; n<(int)list.size(); n++) {
+    if (cells.CellX(atoms[list[n]].x) == cells.CellX(atoms[list[n-1]].x) &&
+        cells.CellZ(atoms[list[n]].z) == cells.CellZ(atoms[list[n-1]].z) &&
+        cells.CellY(atoms[list[n]].y) == cells.CellY(atoms[list[n-1]].y))
+      BOOST_CHECK(list[n] > list[n-1]);
+  }
+  std::sort(list.begin(), list.end());
+  BOOST_CHECK(std::unique(list.begin(), list.end()) == list.end());
+  // every atom in the box is found
+  for (i=0, found=0; i<natom; i++) {
+    if ((atoms[i].Znum == 0) || !inside(i, 3.5, 8.0, -1.0, 2.5, 4.0, 6.2)) continue;
+    BOOST_CHECK(std::binary_search(list.begin(), list.end(), i));
+    found++;
+  }
+  BOOST_CHECK(found > 0);
+  BOOST_CHECK((int)list.size() < natom/2);
+  // boxes outside of all atoms are empty
+  list.clear();
+  cells.Collect(30.0, 40.0, -1.0, 2.5, 4.0, 6.2, list);
+  BOOST_CHECK_EQUAL((int)list.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE (testCellCount)
+{
+  // a tiny cell size must not produce more cells than ~4 per atom
+  AtomCells cells(&atoms[0], natom, 0.01f);
+  BOOST_CHECK((double)cells.CellsX()*cells.CellsY()*cells.CellsZ() <= 4.0*(natom-71)+64);
+  BOOST_CHECK(cells.CellSize() > 0.01);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
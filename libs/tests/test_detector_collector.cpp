@@ -0,0 +1,158 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdlib.h>
+#include <new>
+#include "detector_collector.h"
+#include "memory_fftw3.h"
+
+// operator new counts its calls while an AllocationCounter exists, so
+// that we can check that collecting the detector signal does not
+// allocate any memory.  For all other tests it is plain malloc().
+static volatile int countAllocations = 0;
+static long allocationCount = 0;
+
+void *operator new(size_t size)
+{
+  void *p;
+  if (countAllocations) {
+#pragma omp atomic
+    allocationCount++;
+  }
+  if ((p = malloc(size ? size : 1)) == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p)
+{
+  free(p);
+}
+
+// counts the allocations during its lifetime
+class AllocationCounter {
+public:
+  AllocationCounter() { allocationCount = 0; countAllocations = 1; }
+  ~AllocationCounter() { countAllocations = 0; }
+  long Count() { return allocationCount; }
+};
+
+struct DetectorCollectorFixture {
+  // a 32x24 wave of 16x12A, i.e. dk = 1/16 and 1/12 1/A
+  DetectorCollectorFixture():
+    nx(32), ny(24), ax(16), by(12),
+    wave(WavePtr(new WAVEFUNC(32, 24, 0.5, 0.5)))
+  {
+    for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++) {
+      wave->wave[ix][iy][0] = (float_tt)(1+(ix*7+iy*3) % 11);
+      wave->wave[ix][iy][1] = (float_tt)((ix*5+iy) % 4);
+    }
+    addDetector(0, 0.1f, 0, 0);
+    addDetector(0.05f, 0.5f, 0, 0);
+    addDetector(0.02f, 0.2f, 3, -2);
+  }
+
+  void addDetector(float_tt kInside, float_tt kOutside, float_tt shiftX, float_tt shiftY)
+  {
+    DetectorPtr det = DetectorPtr(new Detector(4, 4, 1, 1));
+    det->k2Inside = kInside*kInside;
+    det->k2Outside = kOutside*kOutside;
+    det->shiftX = shiftX;
+    det->shiftY = shiftY;
+    detectors.push_back(det);
+  }
+
+  // the signal of detector i, testing every k-point
+  double bruteForce(int i)
+  {
+    double sum = 0;
+    for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++) {
+      float_tt kx = (ix>nx/2) ? (float_tt)(ix-nx)/ax : (float_tt)ix/ax;
+      float_tt ky = (iy>ny/2) ? (float_tt)(iy-ny)/by : (float_tt)iy/by;
+      float_tt k2 = kx*kx+ky*ky;
+      if ((k2 < detectors[i]->k2Inside) || (k2 > detectors[i]->k2Outside)) continue;
+      int ixs = (ix+(int)detectors[i]->shiftX+nx) % nx;
+      int iys = (iy+(int)detectors[i]->shiftY+ny) % ny;
+      sum += (double)wave->wave[ixs][iys][0]*wave->wave[ixs][iys][0]+
+        (double)wave->wave[ixs][iys][1]*wave->wave[ixs][iys][1];
+    }
+    return sum;
+  }
+
+  int nx, ny;
+  float_tt ax, by;
+  WavePtr wave;
+  std::vector<DetectorPtr> detectors;
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestDetectorCollector, DetectorCollectorFixture)
+
+BOOST_AUTO_TEST_CASE (testRingSums)
+{
+  DetectorCollector collector(nx, ny, ax, by);
+  collector.Collect(wave->wave, wave->diffpat, detectors, 1, 2, 1.0, 1.0);
+  for (int i=0; i<(int)detectors.size(); i++) {
+    BOOST_CHECK(bruteForce(i) > 0);
+    BOOST_CHECK_CLOSE((double)detectors[i]->image[1][2], bruteForce(i), 1e-4);
+    BOOST_CHECK_CLOSE((double)detectors[i]->image2[1][2], bruteForce(i)*bruteForce(i), 1e-4);
+  }
+  // the zero frequency is in the center of the diffraction pattern
+  BOOST_CHECK_CLOSE((double)wave->diffpat[nx/2][ny/2], 1.0, 1e-4);
+}
+
+BOOST_AUTO_TEST_CASE (testAverage)
+{
+  DetectorCollector collector(nx, ny, ax, by);
+  detectors[0]->image[0][0] = 2.0f*(float_tt)bruteForce(0);
+  detectors[0]->Navg = 1;
+  collector.Collect(wave->wave, wave->diffpat, detectors, 0, 0, 1.0, 1.0);
+  BOOST_CHECK_CLOSE((double)detectors[0]->image[0][0], 1.5*bruteForce(0), 1e-4);
+}
+
+// the single wave modes split the loops between threads
+BOOST_AUTO_TEST_CASE (testThreads)
+{
+  DetectorCollector collector(nx, ny, ax, by, 4);
+  collector.Collect(wave->wave, wave->diffpat, detectors, 2, 1, 1.0, 1.0);
+  for (int i=0; i<(int)detectors.size(); i++)
+    BOOST_CHECK_CLOSE((double)detectors[i]->image[2][1], bruteForce(i), 1e-4);
+  BOOST_CHECK_CLOSE((double)wave->diffpat[nx/2][ny/2], 1.0, 1e-4);
+}
+
+// 'propagation precision:' collects waves in the other precision
+BOOST_AUTO_TEST_CASE (testOtherPrecision)
+{
+  DetectorCollector collector(nx, ny, ax, by);
+#if FLOAT_PRECISION == 1
+  fftw_complex **other = complex2D(nx, ny, "other");
+#else
+  fftwf_complex **other = complex2Df(nx, ny, "other");
+#endif
+  for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++) {
+    other[ix][iy][0] = (other_real)wave->wave[ix][iy][0];
+    other[ix][iy][1] = (other_real)wave->wave[ix][iy][1];
+  }
+  collector.Collect(other, wave->diffpat, detectors, 3, 0, 1.0, 1.0);
+  for (int i=0; i<(int)detectors.size(); i++)
+    BOOST_CHECK_CLOSE((double)detectors[i]->image[3][0], bruteForce(i), 1e-4);
+  BOOST_CHECK_CLOSE((double)wave->diffpat[nx/2][ny/2], 1.0, 1e-4);
+  fftw_free(other[0]);
+  fftw_free(other);
+}
+
+BOOST_AUTO_TEST_CASE (testNoAllocations)
+{
+  long made, collected;
+  {
+    // no BOOST_CHECK in here, it may allocate
+    AllocationCounter counter;
+    DetectorCollector collector(nx, ny, ax, by);
+    made = counter.Count();
+    for (int slice=0; slice<10; slice++)
+      collector.Collect(wave->wave, wave->diffpat, detectors, slice % 4, 3, 1.0, 1.0);
+    collected = counter.Count()-made;
+  }
+  // the counter works: the constructor allocates its tables
+  BOOST_CHECK(made > 0);
+  BOOST_CHECK_EQUAL(collected, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,79 @@
+#include <boost/test/unit_test.hpp>
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "fft_backend.h"
+
+// fills howmany arrays of size values, transforms them with fftw and with 
+// the given backend, and compares the results
+template <class T> static void compareWithFFTW(const char *name, int rank, const int *n, int howmany, int sign, double tol)
+{
+  boost::shared_ptr<FFTBackendT<T> > fftw = makeFFTBackend<T>("fftw"), backend = makeFFTBackend<T>(name);
+  typedef typename FFTComplex<T>::type complex_type;
+  int size = 1, i;
+  for (i=0; i<rank; i++) size *= n[i];
+  std::vector<complex_type> a(size*howmany), b(size*howmany);
+  for (i=0; i<size*howmany; i++) {
+    a[i][0] = b[i][0] = (T)((i*7) % 13)-6;
+    a[i][1] = b[i][1] = (T)((i*5) % 11)-5;
+  }
+  fftw->PlanMany(rank, n, howmany, 1, size, sign)->Execute(&a[0]);
+  backend->PlanMany(rank, n, howmany, 1, size, sign)->Execute(&b[0]);
+  for (i=0; i<size*howmany; i++) {
+    BOOST_CHECK_SMALL(a[i][0]-b[i][0], (T)tol);
+    BOOST_CHECK_SMALL(a[i][1]-b[i][1], (T)tol);
+  }
+}
+
+BOOST_AUTO_TEST_SUITE(TestFFTBackend)
+
+BOOST_AUTO_TEST_CASE(testNames)
+{
+  std::vector<std::string> names = fftBackendNames();
+  BOOST_CHECK_EQUAL(names[0], "fftw");
+  for (int i=0; i<(int)names.size(); i++) {
+    BOOST_CHECK_EQUAL(makeFFTBackend<float>(names[i].c_str())->Name(), names[i]);
+    BOOST_CHECK_EQUAL(makeFFTBackend<double>(names[i].c_str())->Name(), names[i]);
+  }
+  BOOST_CHECK(makeFFTBackend<float>("fastest") == NULL);
+  BOOST_CHECK(!setFFTBackend("fastest"));
+  BOOST_CHECK_EQUAL(fftBackendName(), "fftw");
+}
+
+BOOST_AUTO_TEST_CASE(testSetBackend)
+{
+  BOOST_CHECK(setFFTBackend("builtin"));
+  BOOST_CHECK_EQUAL(fftBackend()->Name(), "builtin");
+  BOOST_CHECK_EQUAL(fftBackend<double>()->Name(), "builtin");
+  BOOST_CHECK(fftBackend()->WavePlan(16, 12, FFTW_FORWARD) == fftBackend()->WavePlan(16, 12, FFTW_FORWARD));
+  BOOST_CHECK(setFFTBackend("fftw"));
+  BOOST_CHECK_EQUAL(fftBackend()->Name(), "fftw");
+}
+
+// 2D waves with radix 4, 2, 3, 5 and prime factors, batches and 3D boxes
+BOOST_AUTO_TEST_CASE(testAgainstFFTW)
+{
+  std::vector<std::string> names = fftBackendNames();
+  int n2[4][2] = {{16, 12}, {10, 7}, {1, 9}, {25, 6}}, n3[3] = {6, 5, 8}, i, k, sign;
+  for (i=1; i<(int)names.size(); i++) for (sign=-1; sign<=1; sign+=2) {
+    for (k=0; k<4; k++) {
+      compareWithFFTW<float>(names[i].c_str(), 2, n2[k], 1, sign, 1e-3);
+      compareWithFFTW<double>(names[i].c_str(), 2, n2[k], 1, sign, 1e-9);
+    }
+    compareWithFFTW<float>(names[i].c_str(), 2, n2[0], 3, sign, 1e-3);
+    compareWithFFTW<float>(names[i].c_str(), 3, n3, 1, sign, 1e-3);
+    compareWithFFTW<double>(names[i].c_str(), 3, n3, 2, sign, 1e-9);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(testFastest)
+{
+  std::vector<std::string> names = fftBackendNames();
+  const char *name = fastestFFTBackend(32, 32, false);
+  BOOST_CHECK(std::find(names.begin(), names.end(), std::string(name)) != names.end());
+  BOOST_CHECK(timeFFTBackend("fftw", 32, 32) > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
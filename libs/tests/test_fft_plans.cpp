@@ -0,0 +1,62 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <string.h>
+#include "fft_plans.h"
+#include "data_containers.h"
+
+BOOST_AUTO_TEST_SUITE(TestFFTPlans)
+
+BOOST_AUTO_TEST_CASE(testRigorNames)
+{
+  unsigned rigors[4] = {FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, FFTW_EXHAUSTIVE};
+  for (int i=0; i<4; i++)
+    BOOST_CHECK_EQUAL(fftRigorFromName(fftRigorName(rigors[i])), rigors[i]);
+  BOOST_CHECK_EQUAL(fftRigorFromName("Measure"), (unsigned)FFTW_MEASURE);
+  BOOST_CHECK_EQUAL(fftRigorFromName("fast"), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(testThreads)
+{
+  setFFTThreads(4);
+#ifdef HAVE_FFTW_THREADS
+  BOOST_CHECK_EQUAL(fftThreads(), 4);
+#else
+  BOOST_CHECK_EQUAL(fftThreads(), 1);
+#endif
+  setFFTThreads(1);
+  BOOST_CHECK_EQUAL(fftThreads(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(testSharedPlans)
+{
+  WAVEFUNC a(16, 12, 0.5, 0.5), b(16, 12, 0.5, 0.5), c(12, 16, 0.5, 0.5);
+  BOOST_CHECK(a.fftPlanWaveForw == b.fftPlanWaveForw);
+  BOOST_CHECK(a.fftPlanWaveInv == b.fftPlanWaveInv);
+  BOOST_CHECK(a.fftPlanWaveForw != a.fftPlanWaveInv);
+  BOOST_CHECK(a.fftPlanWaveForw != c.fftPlanWaveForw);
+}
+
+BOOST_AUTO_TEST_CASE(testWisdom)
+{
+  char fileName[1024], floatName[1040], doubleName[1040];
+  FILE *fp;
+  fftWisdomName(fileName, ".", 16, 12, 48, 40, 4);
+  BOOST_CHECK(strstr(fileName, "16x12") != NULL);
+  BOOST_CHECK(strstr(fileName, "48x40") != NULL);
+  BOOST_CHECK(saveFFTWisdom(fileName));
+  // the wisdom of both precisions, whatever the precision of the build
+  sprintf(floatName, "%s_float.dat", fileName);
+  sprintf(doubleName, "%s_double.dat", fileName);
+  BOOST_CHECK((fp = fopen(floatName, "r")) != NULL);
+  if (fp != NULL) fclose(fp);
+  BOOST_CHECK((fp = fopen(doubleName, "r")) != NULL);
+  if (fp != NULL) fclose(fp);
+  BOOST_CHECK(loadFFTWisdom(fileName));
+  remove(floatName);
+  BOOST_CHECK(loadFFTWisdom(fileName));
+  remove(doubleName);
+  BOOST_CHECK(!loadFFTWisdom(fileName));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
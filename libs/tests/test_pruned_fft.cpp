@@ -0,0 +1,115 @@
+#include <boost/test/unit_test.hpp>
+
+#include <math.h>
+#include <string.h>
+#include "pruned_fft.h"
+
+// the fftw functions of the precision, which PrunedFFT was built with
+#if FLOAT_PRECISION == 1
+#define FFTW(name) fftwf_##name
+#else
+#define FFTW(name) fftw_##name
+#endif
+
+struct PrunedFFTFixture {
+  // two waves of 12x10, the columns 4..6 are outside the bandwidth limit
+  PrunedFFTFixture():
+    nx(12), ny(10), count(2), yLow(4), yHigh(7)
+  {
+    data = (FFTW(complex) *)FFTW(malloc)(count*nx*ny*sizeof(FFTW(complex)));
+    full = (FFTW(complex) *)FFTW(malloc)(count*nx*ny*sizeof(FFTW(complex)));
+    for (int i=0; i<count*nx*ny; i++) {
+      data[i][0] = (float_tt)((i*7) % 13)-6;
+      data[i][1] = (float_tt)((i*5) % 11)-5;
+    }
+    planForw = FFTW(plan_dft_2d)(nx, ny, full, full, FFTW_FORWARD, FFTW_ESTIMATE);
+    planInv = FFTW(plan_dft_2d)(nx, ny, full, full, FFTW_BACKWARD, FFTW_ESTIMATE);
+  }
+
+  ~PrunedFFTFixture()
+  {
+    FFTW(destroy_plan)(planForw);
+    FFTW(destroy_plan)(planInv);
+    FFTW(free)(data);
+    FFTW(free)(full);
+  }
+
+  // compare the columns inside the limit with the full 2D FFT of every wave
+  void compare(bool forward)
+  {
+    for (int k=0; k<count; k++) 
+      FFTW(execute_dft)(forward ? planForw : planInv, full+k*nx*ny, full+k*nx*ny);
+    for (int k=0; k<count; k++) for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++) {
+      int i = (k*nx+ix)*ny+iy;
+      if (forward && (iy >= yLow) && (iy < yHigh)) continue;
+      BOOST_CHECK_SMALL(data[i][0]-full[i][0], (float_tt)1e-3);
+      BOOST_CHECK_SMALL(data[i][1]-full[i][1], (float_tt)1e-3);
+    }
+  }
+
+  int nx, ny, count, yLow, yHigh;
+  FFTW(complex) *data, *full;
+  FFTW(plan) planForw, planInv;
+};
+
+BOOST_FIXTURE_TEST_SUITE(TestPrunedFFT, PrunedFFTFixture)
+
+BOOST_AUTO_TEST_CASE(testForward)
+{
+  PrunedFFT fft(nx, ny, count, yLow, yHigh);
+  memcpy(full, data, count*nx*ny*sizeof(FFTW(complex)));
+  fft.Forward(data);
+  compare(true);
+}
+
+BOOST_AUTO_TEST_CASE(testInverse)
+{
+  PrunedFFT fft(nx, ny, count, yLow, yHigh);
+  // the input of the inverse FFT is 0 outside the bandwidth limit
+  for (int i=0; i<count*nx*ny; i++) if ((i % ny >= yLow) && (i % ny < yHigh))
+    data[i][0] = data[i][1] = 0;
+  memcpy(full, data, count*nx*ny*sizeof(FFTW(complex)));
+  fft.Inverse(data);
+  compare(false);
+}
+
+BOOST_AUTO_TEST_CASE(testAllColumns)
+{
+  // overlapping ranges mean, that there is no limit at all
+  PrunedFFT fft(nx, ny, count, 6, 3);
+  yLow = yHigh = ny;
+  memcpy(full, data, count*nx*ny*sizeof(FFTW(complex)));
+  fft.Forward(data);
+  compare(true);
+}
+
+// the passes may use any FFT library
+BOOST_AUTO_TEST_CASE(testBuiltinBackend)
+{
+  PrunedFFT fft(nx, ny, count, yLow, yHigh, makeFFTBackend<fftw_real>("builtin"));
+  memcpy(full, data, count*nx*ny*sizeof(FFTW(complex)));
+  fft.Forward(data);
+  compare(true);
+}
+
+// 'propagation precision:' transforms waves in the other precision
+BOOST_AUTO_TEST_CASE(testOtherPrecision)
+{
+  PrunedFFTT<other_real> fft(nx, ny, count, yLow, yHigh);
+  typedef FFTComplex<other_real>::type other_complex;
+  other_complex *other = (other_complex *)fftw_malloc(count*nx*ny*sizeof(other_complex));
+  for (int i=0; i<count*nx*ny; i++) {
+    other[i][0] = data[i][0];
+    other[i][1] = data[i][1];
+  }
+  memcpy(full, data, count*nx*ny*sizeof(FFTW(complex)));
+  fft.Forward(other);
+  for (int i=0; i<count*nx*ny; i++) {
+    data[i][0] = (float_tt)other[i][0];
+    data[i][1] = (float_tt)other[i][1];
+  }
+  fftw_free(other);
+  compare(true);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
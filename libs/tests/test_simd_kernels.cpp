@@ -0,0 +1,59 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+#include "simd_kernels.h"
+
+struct SimdKernelsFixture {
+  // odd length, so that every version has to handle a remainder
+  SimdKernelsFixture():
+    n(37), w(2*37), a(2*37), br(0.6f), bi(-0.8f)
+  {
+    for (int i=0; i<2*n; i++) {
+      w[i] = (float_tt)((i*7) % 13)/13.0f-0.5f;
+      a[i] = (float_tt)((i*5) % 11)/11.0f-0.5f;
+    }
+    // the result of the scalar code, to which the others are compared
+    setSimdLevel(SIMD_SCALAR);
+    multiplied = w;
+    complexMultiply(&multiplied[0], &a[0], n);
+    multiplied2 = w;
+    complexMultiply2(&multiplied2[0], &a[0], br, bi, n);
+    setSimdLevel(simdDetectLevel());
+  }
+
+  int n;
+  std::vector<float_tt> w, a, multiplied, multiplied2;
+  float_tt br, bi;
+};
+
+BOOST_FIXTURE_TEST_SUITE(TestSimdKernels, SimdKernelsFixture)
+
+BOOST_AUTO_TEST_CASE(testScalar)
+{
+  for (int i=0; i<n; i++) {
+    float_tt wr=w[2*i], wi=w[2*i+1], ar=a[2*i], ai=a[2*i+1];
+    BOOST_CHECK_EQUAL(multiplied[2*i],   wr*ar-wi*ai);
+    BOOST_CHECK_EQUAL(multiplied[2*i+1], wr*ai+wi*ar);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(testAllLevels)
+{
+  for (int level=SIMD_SCALAR; level<=simdDetectLevel(); level++) {
+    BOOST_CHECK_EQUAL(setSimdLevel(level), level);
+    // every length up to n, including the ones without any full vector
+    for (int m=0; m<=n; m++) {
+      std::vector<float_tt> v = w, v2 = w;
+      complexMultiply(&v[0], &a[0], m);
+      complexMultiply2(&v2[0], &a[0], br, bi, m);
+      for (int i=0; i<2*n; i++) {
+        BOOST_CHECK_EQUAL(v[i],  (i < 2*m) ? multiplied[i] : w[i]);
+        BOOST_CHECK_EQUAL(v2[i], (i < 2*m) ? multiplied2[i] : w[i]);
+      }
+    }
+  }
+  setSimdLevel(simdDetectLevel());
+  BOOST_CHECK_EQUAL(simdLevel(), simdDetectLevel());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,79 @@
+#include <boost/test/unit_test.hpp>
+
+#include "stem_tiles.h"
+
+BOOST_AUTO_TEST_SUITE (TestSTEMTiles)
+
+// every scan position belongs to exactly one tile
+BOOST_AUTO_TEST_CASE (testTileWindows)
+{
+  int scanXN = 13, scanYN = 7, nTiles = 6;
+  int ixStart, ixStop, iyStart, iyStop;
+  std::vector<int> covered(scanXN*scanYN, 0);
+
+  for (int tile=0; tile<nTiles; tile++) {
+    scanTileWindow(scanXN, scanYN, tile, nTiles, &ixStart, &ixStop, &iyStart, &iyStop);
+    BOOST_CHECK(ixStop > ixStart);
+    BOOST_CHECK(iyStop > iyStart);
+    for (int ix=ixStart; ix<ixStop; ix++) for (int iy=iyStart; iy<iyStop; iy++)
+      covered[ix*scanYN+iy]++;
+  }
+  for (int i=0; i<scanXN*scanYN; i++) BOOST_CHECK_EQUAL(covered[i], 1);
+}
+
+// writing two tiles and reading them back gives the original images
+BOOST_AUTO_TEST_CASE (testTileRoundTrip)
+{
+  int scanXN = 4, scanYN = 6, nTiles = 2, nPlanes = 2;
+  std::vector<float> thickness(nPlanes), readThickness;
+  std::vector<std::vector<DetectorPtr> > detectors(nPlanes), merged;
+  STEMTileHeader header, scan, tile;
+  char fileName[64];
+
+  for (int p=0; p<nPlanes; p++) {
+    thickness[p] = 10.0f*(p+1);
+    DetectorPtr det = DetectorPtr(new Detector(scanXN, scanYN, 0.5f, 0.5f));
+    sprintf(det->name, "ADF%d", p);
+    det->Navg = 3;
+    for (int i=0; i<scanXN*scanYN; i++) {
+      det->image[0][i] = (float_tt)(i+100*p);
+      det->image2[0][i] = (float_tt)(i*i+p);
+    }
+    detectors[p].push_back(det);
+  }
+
+  header.nTiles = nTiles;
+  header.scanXN = scanXN;
+  header.scanYN = scanYN;
+  header.nPlanes = nPlanes;
+  header.detectorNum = 1;
+  header.avgCount = 2;
+  header.resX = header.resY = 0.5f;
+  for (int t=0; t<nTiles; t++) {
+    header.tile = t;
+    scanTileWindow(scanXN, scanYN, t, nTiles, &header.ixStart, &header.ixStop, &header.iyStart, &header.iyStop);
+    stemTileName(fileName, ".", t, nTiles);
+    writeSTEMTile(fileName, header, thickness, detectors);
+  }
+
+  for (int t=0; t<nTiles; t++) {
+    stemTileName(fileName, ".", t, nTiles);
+    readSTEMTile(fileName, tile, (t == 0) ? NULL : &scan, readThickness, merged);
+    if (t == 0) scan = tile;
+    BOOST_CHECK_EQUAL(tile.tile, t);
+    remove(fileName);
+  }
+
+  BOOST_CHECK(readThickness == thickness);
+  BOOST_REQUIRE_EQUAL(merged.size(), (size_t)nPlanes);
+  for (int p=0; p<nPlanes; p++) {
+    BOOST_CHECK_EQUAL(merged[p][0]->name, detectors[p][0]->name);
+    BOOST_CHECK_EQUAL(merged[p][0]->Navg, 3);
+    for (int i=0; i<scanXN*scanYN; i++) {
+      BOOST_CHECK_EQUAL(merged[p][0]->image[0][i], detectors[p][0]->image[0][i]);
+      BOOST_CHECK_EQUAL(merged[p][0]->image2[0][i], detectors[p][0]->image2[0][i]);
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
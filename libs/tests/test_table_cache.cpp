@@ -0,0 +1,78 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdio.h>
+#include <vector>
+#include "table_cache.h"
+
+struct TableCacheFixture {
+  // a table of 1000 floats, cached in the current folder
+  TableCacheFixture():
+    cache("."),
+    table(1000)
+  {
+    for (int i=0; i<(int)table.size(); i++) table[i] = 0.5f*i-3.0f;
+    TableKey k;
+    k.Add("test_table_cache");
+    k.Add(14);
+    k.Add(0.5);
+    key = k.Value();
+    sprintf(fileName, "./lut_%016llx.dat", key);
+    remove(fileName);
+  }
+  ~TableCacheFixture()
+  {
+    remove(fileName);
+  }
+
+  TableCache cache;
+  std::vector<float> table;
+  unsigned long long key;
+  char fileName[64];
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestTableCache, TableCacheFixture)
+
+BOOST_AUTO_TEST_CASE (testKey)
+{
+  TableKey a, b, c;
+  double sf[3] = {1.0, 2.0, 3.0};
+  a.Add(14); a.Add(sf, 3);
+  b.Add(14); b.Add(sf, 3);
+  sf[2] = 3.0000001;
+  c.Add(14); c.Add(sf, 3);
+  BOOST_CHECK_EQUAL(a.Value(), b.Value());
+  BOOST_CHECK(a.Value() != c.Value());
+}
+
+BOOST_AUTO_TEST_CASE (testStoreLoad)
+{
+  std::vector<float> loaded(table.size(), 0.0f);
+
+  BOOST_CHECK(!cache.Load(key, &loaded[0], loaded.size()*sizeof(float)));
+  BOOST_CHECK(cache.Store(key, &table[0], table.size()*sizeof(float)));
+  BOOST_CHECK(cache.Load(key, &loaded[0], loaded.size()*sizeof(float)));
+  for (int i=0; i<(int)table.size(); i++) BOOST_CHECK_EQUAL(loaded[i], table[i]);
+  // a second writer of the same table
+  BOOST_CHECK(cache.Store(key, &table[0], table.size()*sizeof(float)));
+  BOOST_CHECK(cache.Load(key, &loaded[0], loaded.size()*sizeof(float)));
+  // a table of another size, or with another key, is a miss
+  BOOST_CHECK(!cache.Load(key, &loaded[0], 10*sizeof(float)));
+  BOOST_CHECK(!cache.Load(key+1, &loaded[0], loaded.size()*sizeof(float)));
+}
+
+BOOST_AUTO_TEST_CASE (testCorrupt)
+{
+  std::vector<float> loaded(table.size(), 0.0f);
+  FILE *fp;
+
+  BOOST_CHECK(cache.Store(key, &table[0], table.size()*sizeof(float)));
+  // change one value of the data
+  fp = fopen(fileName, "r+b");
+  BOOST_REQUIRE(fp != NULL);
+  fseek(fp, 64+40, SEEK_SET);
+  fputc(0x55, fp);
+  fclose(fp);
+  BOOST_CHECK(!cache.Load(key, &loaded[0], loaded.size()*sizeof(float)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,117 @@
+#include <boost/test/unit_test.hpp>
+
+#include <math.h>
+#include "trans_store.h"
+#include "data_containers.h"
+
+struct TransStoreFixture {
+  // a 2 slice 24x20 potential and an 8x6 wave at (5,7) in it
+  TransStoreFixture():
+    slices(2), nx(24), ny(20),
+    wave(WavePtr( new WAVEFUNC(8, 6, 1.0, 1.0)))
+  { 
+    for (int ix=0; ix<wave->nx; ix++) for (int iy=0; iy<wave->ny; iy++) {
+      wave->wave[ix][iy][0] = 1.0f+0.1f*ix;
+      wave->wave[ix][iy][1] = 0.5f-0.1f*iy;
+    }
+  }
+
+  float_tt phase(int iz, int ix, int iy)
+  {
+    return (float_tt)(0.3*iz+0.05*ix*iy-0.7*iy);
+  }
+
+  // wave*exp(i*phase) of the window at (posx, posy)
+  void check(int iz, int posx, int posy, float_tt tolerance)
+  {
+    for (int ix=0; ix<wave->nx; ix++) for (int iy=0; iy<wave->ny; iy++) {
+      double p = phase(iz, ix+posx, iy+posy);
+      double wr = 1.0+0.1*ix, wi = 0.5-0.1*iy;
+      BOOST_CHECK_SMALL(wave->wave[ix][iy][0]-(float_tt)(wr*cos(p)-wi*sin(p)), tolerance);
+      BOOST_CHECK_SMALL(wave->wave[ix][iy][1]-(float_tt)(wr*sin(p)+wi*cos(p)), tolerance);
+    }
+  }
+
+  int slices, nx, ny;
+  WavePtr wave;
+  std::vector<float_tt> scratch;   // expanded rows of Transmit()
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestTransStore, TransStoreFixture)
+
+BOOST_AUTO_TEST_CASE (testHalf)
+{
+  BOOST_CHECK_EQUAL(halfToFloat(floatToHalf(1.0f)), 1.0f);
+  BOOST_CHECK_EQUAL(halfToFloat(floatToHalf(-0.5f)), -0.5f);
+  BOOST_CHECK_EQUAL(halfToFloat(floatToHalf(65504.0f)), 65504.0f);
+  BOOST_CHECK_EQUAL(halfToFloat(floatToHalf(0.0f)), 0.0f);
+  // 11 significant bits, and subnormals down to 2^-24:
+  BOOST_CHECK_CLOSE(halfToFloat(floatToHalf(0.7071068f)), 0.7071068f, 0.05);
+  BOOST_CHECK_EQUAL(halfToFloat(floatToHalf(5.9604645e-8f)), 5.9604645e-8f);
+  BOOST_CHECK(halfToFloat(floatToHalf(1e6f)) > 65504.0f);
+}
+
+BOOST_AUTO_TEST_CASE (testPotential)
+{
+  TransStore store(slices, nx, ny, TRANS_POTENTIAL);
+  BOOST_CHECK_EQUAL(store.Bytes(), slices*nx*ny*sizeof(float_tt));
+  for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++)
+    store.Potential()[1][ix][iy] = phase(1, ix, iy);
+  store.Transmit(wave->wave, 1, wave->nx, wave->ny, 5, 7, scratch);
+  check(1, 5, 7, (float_tt)1e-5);
+}
+
+BOOST_AUTO_TEST_CASE (testHalfPacked)
+{
+  TransStore store(slices, nx, ny, TRANS_HALF);
+#if FLOAT_PRECISION == 1
+  fftwf_complex **trans = complex2Df(nx, ny, "trans");
+#else
+  fftw_complex **trans = complex2D(nx, ny, "trans");
+#endif
+  for (int iz=0; iz<slices; iz++) {
+    for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++) {
+      trans[ix][iy][0] = (float_tt)cos(phase(iz, ix, iy));
+      trans[ix][iy][1] = (float_tt)sin(phase(iz, ix, iy));
+    }
+    store.Pack(iz, trans);
+  }
+  // two threads, each with its own expanded rows
+  store.Transmit(wave->wave, 0, wave->nx, wave->ny, 5, 7, scratch, 2);
+  check(0, 5, 7, (float_tt)2e-3);
+  BOOST_CHECK_EQUAL(scratch.size(), (size_t)2*2*wave->ny);
+}
+
+BOOST_AUTO_TEST_CASE (testHalfPotential)
+{
+  // 2 half floats per pixel in either precision, the potential is only
+  // kept in the store if a float_tt fits into a pixel
+  TransStore store(slices, nx, ny, TRANS_HALF);
+  BOOST_CHECK_EQUAL(store.Bytes(), slices*nx*ny*2*sizeof(unsigned short));
+  BOOST_CHECK_EQUAL(store.PotentialBytes(), slices*nx*ny*sizeof(float_tt));
+  store.ClearPotential();
+  store.Potential()[1][13][2] = 1;
+  BOOST_CHECK_EQUAL(store.Potential()[0][13]+store.SliceStep(), store.Potential()[1][13]);
+  BOOST_CHECK_EQUAL(store.PotentialData()[store.SliceStep()+13*ny+2], 1);
+  store.ReleasePotential();
+  BOOST_CHECK_EQUAL(store.PotentialData() == NULL, sizeof(float_tt) != 2*sizeof(unsigned short));
+}
+
+BOOST_AUTO_TEST_CASE (testMappedStrips)
+{
+  // strips of 8 rows: rows 5..12 of the window are in strips 0 and 1
+  TransStore store(slices, nx, ny, TRANS_POTENTIAL, 8, "test_trans_store.tmp");
+  BOOST_CHECK(store.Mapped());
+  BOOST_CHECK_EQUAL(store.SliceStep(), (size_t)8*ny);
+  BOOST_CHECK_EQUAL(store.Bytes(), 3*8*slices*ny*sizeof(float_tt));
+  for (int iz=0; iz<slices; iz++) for (int ix=0; ix<nx; ix++) for (int iy=0; iy<ny; iy++)
+    store.Potential()[iz][ix][iy] = phase(iz, ix, iy);
+  // rows are contiguous and the next slice is SliceStep() further
+  BOOST_CHECK_EQUAL(store.Potential()[0][13]+1, &store.Potential()[0][13][1]);
+  BOOST_CHECK_EQUAL(store.Potential()[0][13]+store.SliceStep(), store.Potential()[1][13]);
+  store.Prefetch(5, wave->nx);
+  store.Transmit(wave->wave, 1, wave->nx, wave->ny, 5, 7, scratch);
+  check(1, 5, 7, (float_tt)1e-5);
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
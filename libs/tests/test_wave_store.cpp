@@ -0,0 +1,64 @@
+#include <boost/test/unit_test.hpp>
+
+#include "wave_store.h"
+
+struct WaveStoreFixture {
+  // 64x64 complex floats are 32kB, so a budget of 0 MB forces
+  // everything into the spill file and 1 MB keeps everything in RAM.
+  WaveStoreFixture():
+    wave(WavePtr( new WAVEFUNC(64, 64, 1.0, 1.0)))
+  { }
+
+  void fill(float value)
+  {
+    for (int ix=0; ix<wave->nx; ix++) for (int iy=0; iy<wave->ny; iy++) {
+      wave->wave[ix][iy][0] = value+ix;
+      wave->wave[ix][iy][1] = value-iy;
+    }
+  }
+
+  bool check(float value)
+  {
+    for (int ix=0; ix<wave->nx; ix++) for (int iy=0; iy<wave->ny; iy++) {
+      if ((wave->wave[ix][iy][0] != value+ix) || (wave->wave[ix][iy][1] != value-iy))
+        return false;
+    }
+    return true;
+  }
+
+  WavePtr wave;
+};
+
+BOOST_FIXTURE_TEST_SUITE (TestWaveStore, WaveStoreFixture)
+
+BOOST_AUTO_TEST_CASE (testRamRoundTrip)
+{
+  WaveStore store(64, 64, 3, 1, "test_wave_store.tmp");
+  BOOST_CHECK_EQUAL(store.RamPositions(), 3);
+  for (int pos=0; pos<3; pos++) {
+    fill(10.0f*pos);
+    wave->thickness = (float_tt)pos;
+    store.Save(pos, wave);
+  }
+  for (int pos=2; pos>=0; pos--) {
+    store.Load(pos, wave);
+    BOOST_CHECK(check(10.0f*pos));
+    BOOST_CHECK_EQUAL(wave->thickness, (float_tt)pos);
+  }
+}
+
+BOOST_AUTO_TEST_CASE (testSpillRoundTrip)
+{
+  WaveStore store(64, 64, 3, 0, "test_wave_store.tmp");
+  BOOST_CHECK_EQUAL(store.RamPositions(), 0);
+  for (int pos=0; pos<3; pos++) {
+    fill(10.0f*pos);
+    store.Save(pos, wave);
+  }
+  for (int pos=0; pos<3; pos++) {
+    store.Load(pos, wave);
+    BOOST_CHECK(check(10.0f*pos));
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END( )
@@ -0,0 +1,250 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "trans_store.h"
+#include "simd_kernels.h"
+
+/* IEEE 754 half precision: 1 sign, 5 exponent and 10 mantissa bits.
+ * Rounds to nearest even, values beyond 65504 become infinite. */
+unsigned short floatToHalf(float f) {
+	unsigned int x, sign, mant;
+	int exp;
+
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	exp  = (int)((x >> 23) & 0xff)-127+15;
+	mant = x & 0x7fffff;
+
+	if (((x >> 23) & 0xff) == 0xff)   // inf and nan
+		return (unsigned short)(sign | 0x7c00 | (mant ? 0x200 : 0));
+	if (exp >= 31) return (unsigned short)(sign | 0x7c00);
+	if (exp <= 0) {
+		// subnormal half, or 0
+		if (exp < -10) return (unsigned short)sign;
+		mant |= 0x800000;
+		unsigned int shift = (unsigned int)(14-exp);
+		unsigned int h = mant >> shift;
+		unsigned int rest = mant & ((1u << shift)-1), halfway = 1u << (shift-1);
+		if ((rest > halfway) || ((rest == halfway) && (h & 1))) h++;
+		return (unsigned short)(sign | h);
+	}
+	unsigned int h = ((unsigned int)exp << 10) | (mant >> 13);
+	unsigned int rest = mant & 0x1fff;
+	// a carry out of the mantissa correctly increments the exponent
+	if ((rest > 0x1000) || ((rest == 0x1000) && (h & 1))) h++;
+	return (unsigned short)(sign | h);
+}
+
+float halfToFloat(unsigned short h) {
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+	unsigned int exp  = (h >> 10) & 0x1f;
+	unsigned int mant = h & 0x3ff;
+	unsigned int x;
+	float f;
+
+	if (exp == 0) {
+		// 0 or subnormal: mant * 2^-24
+		f = (float)mant*(1.0f/16777216.0f);
+		return sign ? -f : f;
+	}
+	if (exp == 31) x = sign | 0x7f800000 | (mant << 13);
+	else x = sign | ((exp-15+127) << 23) | (mant << 13);
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static std::vector<float> makeHalfTable() {
+	std::vector<float> table(65536);
+	for (int i=0; i<65536; i++) table[i] = halfToFloat((unsigned short)i);
+	return table;
+}
+
+// all 65536 half floats, so that expanding a row is one lookup per number
+static const float *halfTable() {
+	static std::vector<float> table = makeHalfTable();
+	return &table[0];
+}
+
+TransStore::TransStore(int slices, int nx, int ny, int mode, int stripRows, const char *fileName) :
+m_slices(slices),
+m_nx(nx),
+m_ny(ny),
+m_mode(mode),
+m_stripRows(nx),
+m_data(NULL),
+m_potData(NULL)
+{
+	int iz;
+
+	if ((mode != TRANS_POTENTIAL) && (mode != TRANS_HALF)) {
+		printf("TransStore: unknown storage mode %d\n",mode);
+		exit(0);
+	}
+	if ((fileName != NULL) && (stripRows > 0) && (stripRows < nx)) m_stripRows = stripRows;
+	m_strips = (nx+m_stripRows-1)/m_stripRows;
+
+	m_fileName[0] = '\0';
+	if (fileName != NULL) {
+		strncpy(m_fileName, fileName, sizeof(m_fileName)-5);
+		m_fileName[sizeof(m_fileName)-5] = '\0';
+		m_file = boost::shared_ptr<CMappedBuffer>(new CMappedBuffer(fileName, Bytes()));
+		m_data = (char *)m_file->Data();
+	}
+	else {
+		m_data = (char *)fftw_malloc(Bytes());
+		if (m_data == NULL) {
+			printf("TransStore: cannot allocate %d MB\n",(int)(Bytes() >> 20));
+			exit(0);
+		}
+		memset(m_data, 0, Bytes());
+	}
+	m_pot = (float_tt ***)malloc(slices*sizeof(float_tt **));
+	for (iz=0; iz<slices; iz++) m_pot[iz] = (float_tt **)malloc(nx*sizeof(float_tt *));
+	// a separate potential is only allocated when it is needed
+	SetPotential(SeparatePotential() ? NULL : (float_tt *)m_data);
+	if (mode == TRANS_HALF) halfTable();
+}
+
+TransStore::~TransStore()
+{
+	ReleasePotential();
+	for (int iz=0; iz<m_slices; iz++) free(m_pot[iz]);
+	free(m_pot);
+	if (m_file == NULL) fftw_free(m_data);
+}
+
+void TransStore::SetPotential(float_tt *data) {
+	m_potData = data;
+	for (int iz=0; iz<m_slices; iz++) for (int ix=0; ix<m_nx; ix++)
+		m_pot[iz][ix] = (data != NULL) ? data+RowOffset(iz, ix) : NULL;
+}
+
+void TransStore::ClearPotential() {
+	char potName[1024];
+
+	if (m_potData == NULL) {
+		if (m_file != NULL) {
+			sprintf(potName, "%s.pot", m_fileName);
+			m_potFile = boost::shared_ptr<CMappedBuffer>(new CMappedBuffer(potName, PotentialBytes()));
+			SetPotential((float_tt *)m_potFile->Data());
+		}
+		else {
+			SetPotential((float_tt *)fftw_malloc(PotentialBytes()));
+			if (m_potData == NULL) {
+				printf("TransStore: cannot allocate %d MB for the potential\n",(int)(PotentialBytes() >> 20));
+				exit(0);
+			}
+		}
+	}
+	memset(m_potData, 0, PotentialBytes());
+}
+
+void TransStore::ReleasePotential() {
+	if (!SeparatePotential() || (m_potData == NULL)) return;
+	if (m_potFile != NULL) m_potFile.reset();
+	else fftw_free(m_potData);
+	SetPotential(NULL);
+}
+
+void TransStore::Prefetch(int ix, int n) {
+	int s0, s1;
+	size_t stripBytes = (size_t)m_slices*m_stripRows*m_ny*PixelBytes();
+
+	if ((m_file == NULL) || (n <= 0)) return;
+	if (ix < 0) ix = 0;
+	if (ix+n > m_nx) n = m_nx-ix;
+	s0 = ix/m_stripRows;
+	s1 = (ix+n-1)/m_stripRows;
+	m_file->Prefetch(s0*stripBytes, (s1-s0+1)*stripBytes);
+}
+
+void TransStore::Pack(int slice, complex_type **trans) {
+	int ix, iy;
+	unsigned short *h;
+
+	for (ix=0; ix<m_nx; ix++) {
+		h = (unsigned short *)m_data+2*RowOffset(slice, ix);
+		for (iy=0; iy<m_ny; iy++) {
+			h[2*iy]   = floatToHalf((float)trans[ix][iy][0]);
+			h[2*iy+1] = floatToHalf((float)trans[ix][iy][1]);
+		}
+	}
+}
+
+template <class T> void TransStore::Expand(T (*out)[2], int slice, int ix, int iy, int n) {
+	int i;
+
+	if (m_mode == TRANS_POTENTIAL) {
+		const float_tt *phase = m_pot[slice][ix]+iy;
+		// no dependencies between the iterations, so this loop may be vectorized
+		for (i=0; i<n; i++) {
+			out[i][0] = (T)cos(phase[i]);
+			out[i][1] = (T)sin(phase[i]);
+		}
+	}
+	else {
+		const float *table = halfTable();
+		const unsigned short *h = (const unsigned short *)m_data+2*(RowOffset(slice, ix)+iy);
+		for (i=0; i<n; i++) {
+			out[i][0] = (T)table[h[2*i]];
+			out[i][1] = (T)table[h[2*i+1]];
+		}
+	}
+}
+
+// the number of the calling thread in its OpenMP team, 0 without OpenMP
+static int threadNum() {
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+template <class T> void TransStore::Transmit(T (**wave)[2], int slice, int nx, int ny, int posx, int posy, 
+											 std::vector<T> &scratch, int nThreads) {
+	if (scratch.size() < 2*(size_t)ny*nThreads) scratch.resize(2*(size_t)ny*nThreads);
+#pragma omp parallel num_threads(nThreads) if(nThreads > 1)
+	{
+		// one expanded row of the transmission function per thread
+		T *row = &scratch[2*(size_t)ny*threadNum()];
+		int ix;
+#pragma omp for
+		for (ix=0; ix<nx; ix++) {
+			Expand((T (*)[2])row, slice, ix+posx, posy, ny);
+			complexMultiply((T *)wave[ix], row, ny);
+		}
+	}
+}
+
+template void TransStore::Expand<float>(float (*out)[2], int slice, int ix, int iy, int n);
+template void TransStore::Expand<double>(double (*out)[2], int slice, int ix, int iy, int n);
+template void TransStore::Transmit<float>(float (**wave)[2], int slice, int nx, int ny, int posx, int posy, 
+										  std::vector<float> &scratch, int nThreads);
+template void TransStore::Transmit<double>(double (**wave)[2], int slice, int nx, int ny, int posx, int posy, 
+										   std::vector<double> &scratch, int nThreads);
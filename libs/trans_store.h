@@ -0,0 +1,125 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TRANS_STORE_H
+#define TRANS_STORE_H
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "stemtypes_fftw3.h"
+#include "mapped_buffer.h"
+
+#define TRANS_COMPLEX    0  // muls->trans: complex, 8 bytes per pixel (16 in double)
+#define TRANS_POTENTIAL  1  // the phase sigma*V_proj, one float_tt (4 bytes, 8 in double) per pixel
+#define TRANS_HALF       2  // exp(i sigma*V_proj) as 2 half precision floats, 4 bytes per pixel in either precision
+
+/**************************************************************
+ * TransStore keeps the transmission functions in a compact form
+ * instead of the complex muls->trans array, and expands them row
+ * by row while they are applied to a wave.
+ *
+ * TRANS_POTENTIAL keeps only the real phase sigma*V, which is all
+ * there is to a transmission function that is not bandwidth 
+ * limited.  TRANS_HALF keeps the complex transmission function
+ * (bandwidth limited or not) in half precision, 2 unsigned shorts
+ * per pixel.  make3DSlices writes the projected potential (one 
+ * float_tt per pixel) directly into Potential(), see 
+ * initSTEMSlices() for the conversion.  For TRANS_POTENTIAL, and 
+ * for TRANS_HALF in the float build, the potential is kept in the
+ * store itself, and Pack() overwrites it.  For TRANS_HALF in the 
+ * double build the 8 byte potential does not fit into the 4 bytes
+ * of a pixel, and is kept in a buffer of its own (mapped as well,
+ * if the store is), from ClearPotential() to ReleasePotential().
+ *
+ * For potentials larger than RAM the store can live in a memory
+ * mapped file, cut into strips of stripRows rows of all slices:
+ * strip s holds rows s*stripRows..(s+1)*stripRows-1 of slice 0, 
+ * then the same rows of slice 1, etc.  A probe window of nx <= 
+ * stripRows rows thus lies in at most 2 contiguous strips, which
+ * the OS pages in and out as the scan moves on.  Prefetch() asks 
+ * for the strips of the next probe positions ahead of time.  Rows
+ * stay contiguous, and pixel (ix,iy) of the next slice is always 
+ * SliceStep() float_tt further.
+ *
+ * TransStorePtr store = TransStorePtr(new TransStore(slices,potNx,potNy,TRANS_HALF));
+ * TransStorePtr store = TransStorePtr(new TransStore(slices,potNx,potNy,TRANS_HALF,nx,"trans.tmp"));
+ * store->ClearPotential();       // before make3DSlices writes to Potential()
+ * store->Pack(islice, trans);   // TRANS_HALF: trans is a complex nx x ny slice
+ * store->ReleasePotential();     // once all slices are packed
+ * store->Transmit(wave, islice, nx, ny, posx, posy, context->transRow, nThreads);
+ **************************************************************/
+class TransStore {
+#if FLOAT_PRECISION == 1
+	typedef fftwf_complex complex_type;
+#else
+	typedef fftw_complex complex_type;
+#endif
+	int m_slices, m_nx, m_ny;
+	int m_mode;
+	int m_stripRows, m_strips;
+	char *m_data;        // Bytes() of the store
+	float_tt *m_potData; // the potential: m_data, or a buffer of its own (see above)
+	float_tt ***m_pot;   // [slice][ix][iy]: the potential or its phase
+	char m_fileName[1024];
+	boost::shared_ptr<CMappedBuffer> m_file, m_potFile;
+
+	size_t Pixels() { return (size_t)m_strips*m_stripRows*m_slices*m_ny; }
+	// offset (in pixels) of row ix of slice iz
+	size_t RowOffset(int iz, int ix) { return (((size_t)(ix/m_stripRows)*m_slices+iz)*m_stripRows+(ix % m_stripRows))*m_ny; }
+	bool SeparatePotential() { return PixelBytes() != sizeof(float_tt); }
+	void SetPotential(float_tt *data);
+public:
+	// stripRows <= 0 or fileName == NULL: everything in RAM, in one strip
+	TransStore(int slices, int nx, int ny, int mode, int stripRows=0, const char *fileName=NULL);
+	~TransStore();
+
+	int Mode() { return m_mode; }
+	bool Mapped() { return m_file != NULL; }
+	size_t PixelBytes() { return (m_mode == TRANS_HALF) ? 2*sizeof(unsigned short) : sizeof(float_tt); }
+	size_t Bytes() { return Pixels()*PixelBytes(); }
+	size_t PotentialBytes() { return Pixels()*sizeof(float_tt); }
+	size_t SliceStep() { return (size_t)m_stripRows*m_ny; }
+	// the potential of all slices, the strips are padded to stripRows rows
+	float_tt *PotentialData() { return m_potData; }
+	float_tt ***Potential() { return m_pot; }
+	// sets the potential to 0 (and allocates it, if it has been released)
+	void ClearPotential();
+	// frees a potential that is not kept in the store
+	void ReleasePotential();
+	// rows ix..ix+n-1 of all slices will be needed soon
+	void Prefetch(int ix, int n);
+
+	// TRANS_HALF: convert the complex slice (nx x ny, contiguous rows) to half precision
+	// (this overwrites the potential of the slice, if it is kept in the store)
+	void Pack(int slice, complex_type **trans);
+	// out[i] = trans[slice][ix][iy+i] for i=0..n-1, in float or double (T)
+	template <class T> void Expand(T (*out)[2], int slice, int ix, int iy, int n);
+	// wave[ix][iy] *= trans[slice][ix+posx][iy+posy], like transmit(); the rows are 
+	// expanded into scratch, which is resized to nThreads rows the first time
+	template <class T> void Transmit(T (**wave)[2], int slice, int nx, int ny, int posx, int posy, 
+		std::vector<T> &scratch, int nThreads=1);
+};
+
+typedef boost::shared_ptr<TransStore> TransStorePtr;
+
+unsigned short floatToHalf(float f);
+float halfToFloat(unsigned short h);
+
+#endif
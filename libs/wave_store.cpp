@@ -0,0 +1,108 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wave_store.h"
+
+WaveStore::WaveStore(int nx, int ny, int nPos, int budgetMB, const char *spillName) :
+m_nx(nx),
+m_ny(ny),
+m_nPos(nPos),
+m_spill(NULL)
+{
+	size_t waveBytes = (size_t)nx*ny*sizeof(complex_type);
+	size_t budget = (size_t)(budgetMB > 0 ? budgetMB : 0)*1024*1024;
+
+	m_nRam = (int)(budget/waveBytes);
+	if (m_nRam > nPos) m_nRam = nPos;
+	m_ram = std::vector<complex_type **>(m_nRam, (complex_type **)NULL);
+	m_thickness = std::vector<float_tt>(nPos, 0.0f);
+
+	if (m_nRam < nPos) {
+		m_spillFile = boost::shared_ptr<CMappedBuffer>(new CMappedBuffer(spillName, (size_t)(nPos-m_nRam)*waveBytes));
+		m_spill = (complex_type *)m_spillFile->Data();
+	}
+}
+
+WaveStore::~WaveStore()
+{
+	for (int i=0; i<m_nRam; i++) {
+		if (m_ram[i] != NULL) {
+#if FLOAT_PRECISION == 1
+			fftwf_free(m_ram[i][0]);
+			fftwf_free(m_ram[i]);
+#else
+			fftw_free(m_ram[i][0]);
+			fftw_free(m_ram[i]);
+#endif
+		}
+	}
+}
+
+void WaveStore::Save(int pos, WavePtr wave)
+{
+	complex_type **tmp;
+
+	if ((pos < 0) || (pos >= m_nPos)) {
+		printf("WaveStore: position %d out of range (0..%d)\n", pos, m_nPos-1);
+		exit(0);
+	}
+	m_thickness[pos] = wave->thickness;
+	if (pos < m_nRam) {
+		if (m_ram[pos] == NULL) {
+#if FLOAT_PRECISION == 1
+			m_ram[pos] = complex2Df(m_nx, m_ny, "WaveStore");
+#else
+			m_ram[pos] = complex2D(m_nx, m_ny, "WaveStore");
+#endif
+		}
+		// hand the exit wave to the store, and take its old array in exchange
+		tmp = m_ram[pos];
+		m_ram[pos] = wave->wave;
+		wave->wave = tmp;
+	}
+	else {
+		memcpy(m_spill+(size_t)(pos-m_nRam)*m_nx*m_ny, wave->wave[0], (size_t)m_nx*m_ny*sizeof(complex_type));
+	}
+}
+
+void WaveStore::Load(int pos, WavePtr wave)
+{
+	complex_type **tmp;
+
+	if ((pos < 0) || (pos >= m_nPos)) {
+		printf("WaveStore: position %d out of range (0..%d)\n", pos, m_nPos-1);
+		exit(0);
+	}
+	if (pos < m_nRam) {
+		if (m_ram[pos] == NULL) {
+			printf("WaveStore: no wave has been saved for position %d\n", pos);
+			exit(0);
+		}
+		tmp = m_ram[pos];
+		m_ram[pos] = wave->wave;
+		wave->wave = tmp;
+	}
+	else {
+		memcpy(wave->wave[0], m_spill+(size_t)(pos-m_nRam)*m_nx*m_ny, (size_t)m_nx*m_ny*sizeof(complex_type));
+	}
+	wave->thickness = m_thickness[pos];
+}
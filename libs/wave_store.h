@@ -0,0 +1,71 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WAVE_STORE_H
+#define WAVE_STORE_H
+
+#include <vector>
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+#include "mapped_buffer.h"
+
+/**************************************************************
+ * WaveStore keeps the exit wave of every scan position between
+ * slabs of a multi-slab STEM run, so that the next slab can start
+ * from it without writing/reading mulswav_ix_iy.img files.
+ *
+ * WaveStorePtr store = WaveStorePtr(new WaveStore(nx,ny,nPos,budgetMB,spillName));
+ * store->Save(pos, wave);   // after runMulsSTEM
+ * store->Load(pos, wave);   // before the next slab
+ *
+ * Up to budgetMB worth of positions are held in RAM.  Save/Load of
+ * these simply swap the wave->wave array with the stored one, so
+ * the FFT plans must be executed with fftw(f)_execute_dft on
+ * wave->wave[0] (all arrays come from fftw_malloc and share the
+ * same alignment).  All other positions go to a single memory
+ * mapped spill file which is allocated once at construction.
+ * Different positions may be accessed by different threads
+ * concurrently, the same position may not.
+ **************************************************************/
+
+class WaveStore {
+#if FLOAT_PRECISION == 1
+	typedef fftwf_complex complex_type;
+#else
+	typedef fftw_complex complex_type;
+#endif
+	int m_nx, m_ny;
+	int m_nPos;                        // number of scan positions
+	int m_nRam;                        // positions [0..m_nRam-1] are kept in RAM
+	std::vector<complex_type **> m_ram;  // swap partners for the RAM positions
+	std::vector<float_tt> m_thickness;
+	boost::shared_ptr<CMappedBuffer> m_spillFile;
+	complex_type *m_spill;             // mapped spill file for positions >= m_nRam
+public:
+	WaveStore(int nx, int ny, int nPos, int budgetMB, const char *spillName);
+	~WaveStore();
+
+	void Save(int pos, WavePtr wave);
+	void Load(int pos, WavePtr wave);
+	int RamPositions() { return m_nRam; }
+};
+
+typedef boost::shared_ptr<WaveStore> WaveStorePtr;
+
+#endif
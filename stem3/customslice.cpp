@@ -29,6 +29,7 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include "stemutil.h"
 #include "customslice.h"
 #include "fileio_fftw3.h"
+#include "fft_backend.h"
 
 #define _CRTDBG_MAP_ALLOC
 #include <stdio.h>	/* ANSI C libraries */
@@ -89,8 +90,6 @@ void make3DSlicesFT(MULS *muls) {
   /******************************************
    * only needed during initialization: 
    */
-  fftw_plan plan;                   // fftw array
-  int fftMeasureFlag = FFTW_ESTIMATE; // fftw plan needed for FFT
   fftw_complex **pot = NULL;          // single atom potential box
   float ax,cz;                        // real space size of FT box
   double dsX,dsZ;                     // rec. space size of FT box
@@ -189,9 +188,7 @@ void make3DSlicesFT(MULS *muls) {
       }
 
       // new fftw3 code:
-      plan = fftw_plan_dft_2d(Nz,Nx,pot[0],pot[0],FFTW_BACKWARD,fftMeasureFlag);
-      fftw_execute(plan);
-      fftw_destroy_plan(plan);
+      fftBackend<double>()->Plan2D(Nz,Nx,FFTW_BACKWARD)->Execute(pot[0]);
     
       /* see L.M. Peng, Micron 30, p. 625 (1999) for details on the scale factor
        * so that pot is the true electrostatic potential. 
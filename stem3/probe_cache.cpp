@@ -0,0 +1,69 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "probe_cache.h"
+#include "stemlib.h"
+
+ProbeCache::ProbeCache(MULS *muls) :
+m_x0(muls->nx/2*muls->resolutionX),
+m_y0(muls->ny/2*muls->resolutionY)
+{
+	m_probe = WavePtr(new WAVEFUNC(muls->nx, muls->ny, muls->resolutionX, muls->resolutionY));
+}
+
+// everything probe() reads from muls
+void ProbeCache::MakeKey(MULS *muls, std::vector<double> &key)
+{
+	double values[] = {
+		(double)muls->nx, (double)muls->ny, muls->resolutionX, muls->resolutionY,
+		muls->v0, muls->alpha, muls->df0, muls->Cc*muls->dE_E,
+		muls->astigMag, muls->astigAngle, muls->Cs, muls->C5,
+		muls->a33, muls->phi33, muls->a31, muls->phi31, 
+		muls->a44, muls->phi44, muls->a42, muls->phi42,
+		muls->a55, muls->phi55, muls->a53, muls->phi53, muls->a51, muls->phi51,
+		muls->a66, muls->phi66, muls->a64, muls->phi64, muls->a62, muls->phi62,
+		(double)muls->ismoth, (double)muls->gaussFlag, muls->gaussScale, muls->aAIS
+	};
+	key.assign(values, values+sizeof(values)/sizeof(double));
+}
+
+void ProbeCache::Update(MULS *muls)
+{
+	std::vector<double> key;
+
+	MakeKey(muls, key);
+	if (key == m_key) return;
+	probe(muls, m_probe, m_x0, m_y0);
+	m_key = key;
+}
+
+void ProbeCache::Get(MULS *muls, WavePtr wave, double x, double y, std::vector<double> &ramp)
+{
+	if ((wave->nx != m_probe->nx) || (wave->ny != m_probe->ny)) {
+		printf("ProbeCache: wave has %d x %d pixels, probe has %d x %d\n",
+			wave->nx, wave->ny, m_probe->nx, m_probe->ny);
+		exit(0);
+	}
+	memcpy(wave->wave[0], m_probe->wave[0], (size_t)wave->nx*wave->ny*sizeof(wave->wave[0][0]));
+	if ((x != m_x0) || (y != m_y0))
+		probeShiftAndCrop(muls, wave, x, y, wave->nx, wave->ny, ramp);
+}
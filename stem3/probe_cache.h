@@ -0,0 +1,57 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBE_CACHE_H
+#define PROBE_CACHE_H
+
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+
+/**************************************************************
+ * ProbeCache keeps the incident probe wave function, so that it
+ * is not recomputed for every scan position.  probe() is only
+ * called when one of the parameters it depends on (aberrations,
+ * aperture, energy, defocus spread dE_E, sampling) has changed.
+ *
+ * ProbeCachePtr cache = ProbeCachePtr(new ProbeCache(&muls));
+ * cache->Update(&muls);              // before the scan loop, e.g. after muls.dE_E changed
+ * cache->Get(&muls, wave, x, y, context->shiftRamp);   // in the scan loop, from any thread
+ *
+ * Get() copies the probe, which is computed in the center of the 
+ * array, and moves it to (x, y) with probeShiftAndCrop(), if needed.
+ * Update() is not thread safe and must not run while Get() is used.
+ **************************************************************/
+class ProbeCache {
+	WavePtr m_probe;
+	std::vector<double> m_key;     // parameters m_probe was computed with
+	double m_x0, m_y0;             // position of m_probe
+
+	void MakeKey(MULS *muls, std::vector<double> &key);
+public:
+	ProbeCache(MULS *muls);
+
+	void Update(MULS *muls);
+	void Get(MULS *muls, WavePtr wave, double x, double y, std::vector<double> &ramp);
+};
+
+typedef boost::shared_ptr<ProbeCache> ProbeCachePtr;
+
+#endif
@@ -0,0 +1,236 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <string.h>
+#include "propagation_context.h"
+#include "simd_kernels.h"
+#include "stemutil.h"
+#include "matrixlib.h"
+#include "memory_fftw3.h"
+#include "fft_plans.h"
+
+PropagationContext::PropagationContext(MULS *muls, int batchSize, int nThreads, int sizeX, int sizeY) :
+m_dz(0),
+m_v0(0),
+m_resX(0),
+m_resY(0),
+nx((sizeX > 0) ? sizeX : muls->nx),
+ny((sizeY > 0) ? sizeY : muls->ny),
+k2max(0),
+rmin(0), rmax(0), aimin(0), aimax(0),
+waveScale(muls->propagator2D ? 1.0/((double)nx*ny) : 1.0),
+otherWave(NULL),
+intensity(0),
+chisq(0),
+nThreads(nThreads)
+{
+	m_propxr = m_propxi = kx = kx2 = std::vector<float_tt>(nx);
+	ky = ky2 = std::vector<float_tt>(ny);
+	m_propy = std::vector<float_tt>(2*ny);
+	m_yStop = m_yStart = std::vector<int>(nx);
+	if (muls->propagator2D)
+		m_prop2D = std::vector<float_tt>(2*(size_t)nx*ny);
+	if (batchSize > 1)
+		batch = ProbeBatchPtr(new ProbeBatch(batchSize, nx, ny));
+	transRow = std::vector<float_tt>(2*(size_t)ny*nThreads);
+	shiftRamp = std::vector<double>(2*(nx+ny));
+	if (muls->propagateOther) {
+		otherTransRow = std::vector<other_real>(2*(size_t)ny*nThreads);
+		m_otherPropxr = m_otherPropxi = std::vector<other_real>(nx);
+		m_otherPropy = std::vector<other_real>(2*ny);
+		if (muls->propagator2D)
+			m_otherProp2D = std::vector<other_real>(2*(size_t)nx*ny);
+#if FLOAT_PRECISION == 1
+		otherWave = complex2D(nx, ny, "otherWave");
+#else
+		otherWave = complex2Df(nx, ny, "otherWave");
+#endif
+	}
+}
+
+PropagationContext::~PropagationContext()
+{
+	if (otherWave != NULL) {
+		fftw_free(otherWave[0]);
+		fftw_free(otherWave);
+	}
+}
+
+/******************************************************************
+* the nx x ny propagator: the product of the separable factors, 
+* times the FFT normalization fftScale, and 0 outside the bandwidth 
+* limit
+*****************************************************************/
+template <class T> static void makePropagator2D(std::vector<T> &prop2D, const std::vector<T> &propxr, 
+	const std::vector<T> &propxi, const std::vector<T> &propy, const std::vector<int> &yStop, 
+	const std::vector<int> &yStart, int nx, int ny, T fftScale)
+{
+	int ixa, iya;
+	T pxr, pxi, *p;
+
+	memset(&prop2D[0], 0, prop2D.size()*sizeof(T));
+	for( ixa=0; ixa<nx; ixa++) {
+		pxr = fftScale*propxr[ixa];
+		pxi = fftScale*propxi[ixa];
+		p = &prop2D[2*(size_t)ixa*ny];
+		for (iya=0; iya<ny; iya++) if ((iya < yStop[ixa]) || (iya >= yStart[ixa])) {
+			p[2*iya]   = pxr*propy[2*iya] - pxi*propy[2*iya+1];
+			p[2*iya+1] = pxr*propy[2*iya+1] + pxi*propy[2*iya];
+		}
+	}
+}
+
+/******************************************************************
+* replicates the original way, mulslice did it: the propagator
+* for the slice thickness muls->cz[0] is separable in kx and ky.
+* The 2D propagator is the product of both factors, times the FFT
+* normalization, and 0 outside the bandwidth limit.
+*****************************************************************/
+void PropagationContext::Update(MULS *muls)
+{
+	int ixa, iya;
+	float_tt ax, by, scale, t, wavlen;
+	bool resChanged;
+
+	if ((muls->cz[0] == m_dz) && (muls->v0 == m_v0) &&
+		(muls->resolutionX == m_resX) && (muls->resolutionY == m_resY)) return;
+	ax = muls->resolutionX*nx;
+	by = muls->resolutionY*ny;
+	resChanged = (collector == NULL) || (muls->resolutionX != m_resX) || (muls->resolutionY != m_resY);
+	if (resChanged)
+		collector = DetectorCollectorPtr(new DetectorCollector(nx, ny, ax, by, nThreads));
+	m_dz = muls->cz[0];
+	m_v0 = muls->v0;
+	m_resX = muls->resolutionX;
+	m_resY = muls->resolutionY;
+
+	scale = m_dz*PI;
+	wavlen = (float_tt)wavelength(m_v0);
+
+	for( ixa=0; ixa<nx; ixa++) {
+		kx[ixa] = (ixa>nx/2) ? (float_tt)(ixa-nx)/ax : 
+			(float_tt)ixa/ax;
+		kx2[ixa] = kx[ixa]*kx[ixa];
+		t = scale * (kx2[ixa]*wavlen);
+		m_propxr[ixa] = (float_tt)  cos(t);
+		m_propxi[ixa] = (float_tt) -sin(t);
+	}
+	for( iya=0; iya<ny; iya++) {
+		ky[iya] = (iya>ny/2) ? 
+			(float_tt)(iya-ny)/by : 
+		(float_tt)iya/by;
+		ky2[iya] = ky[iya]*ky[iya];
+		t = scale * (ky2[iya]*wavlen);
+		m_propy[2*iya]   = (float_tt)  cos(t);
+		m_propy[2*iya+1] = (float_tt) -sin(t);
+	}
+	k2max = nx/(2.0F*ax);
+	if (ny/(2.0F*by) < k2max ) k2max = ny/(2.0F*by);
+	k2max = 2.0/3.0 * k2max;
+	k2max = k2max*k2max;
+
+	/* ky2 grows from iy=0 to ny/2 and falls from there on, so the part of
+	 * every row inside the bandwidth limit is [0,m_yStop) and [m_yStart,ny) */
+	for( ixa=0; ixa<nx; ixa++) {
+		for (iya=0; (iya<=ny/2) && (kx2[ixa] + ky2[iya] < k2max); iya++);
+		m_yStop[ixa] = iya;
+		for (iya=ny; (iya-1>ny/2) && (kx2[ixa] + ky2[iya-1] < k2max); iya--);
+		m_yStart[ixa] = iya;
+	}
+	// the columns inside the bandwidth limit are those of the row kx=0
+	// (the fftw planner must not be used by several threads at once)
+	if (resChanged) {
+#pragma omp critical(fftw_planner)
+		{
+			FFTPlanThreads threads(nThreads);
+			fft = PrunedFFTPtr(new PrunedFFT(nx, ny, 1, m_yStop[0], m_yStart[0]));
+			if (batch != NULL)
+				batchFFT = PrunedFFTPtr(new PrunedFFT(nx, ny, batch->Size(), m_yStop[0], m_yStart[0]));
+			if (otherWave != NULL)
+				otherFFT = boost::shared_ptr<PrunedFFTT<other_real> >(
+					new PrunedFFTT<other_real>(nx, ny, 1, m_yStop[0], m_yStart[0]));
+		}
+	}
+
+	if (!m_prop2D.empty())
+		makePropagator2D(m_prop2D, m_propxr, m_propxi, m_propy, m_yStop, m_yStart, nx, ny, (float_tt)waveScale);
+
+	if (otherWave != NULL) {
+		// the phases in double, whatever float_tt is
+		double dscale = (double)m_dz*PI*wavelength(m_v0), kd;
+		for( ixa=0; ixa<nx; ixa++) {
+			kd = (ixa>nx/2) ? (double)(ixa-nx)/ax : (double)ixa/ax;
+			m_otherPropxr[ixa] = (other_real)  cos(dscale*kd*kd);
+			m_otherPropxi[ixa] = (other_real) -sin(dscale*kd*kd);
+		}
+		for( iya=0; iya<ny; iya++) {
+			kd = (iya>ny/2) ? (double)(iya-ny)/by : (double)iya/by;
+			m_otherPropy[2*iya]   = (other_real)  cos(dscale*kd*kd);
+			m_otherPropy[2*iya+1] = (other_real) -sin(dscale*kd*kd);
+		}
+		if (!m_otherProp2D.empty())
+			makePropagator2D(m_otherProp2D, m_otherPropxr, m_otherPropxi, m_otherPropy, m_yStop, m_yStart, 
+				nx, ny, (other_real)waveScale);
+	}
+}
+
+/******************************************************************
+* propagate the wave (in reciprocal space) through one slice and
+* limit its bandwidth
+*****************************************************************/
+void PropagationContext::Propagate(void **w)
+{
+#if FLOAT_PRECISION == 1
+	fftwf_complex **wave = (fftwf_complex **)w;
+#else
+	fftw_complex **wave = (fftw_complex **)w;
+#endif
+	PropagateRows(wave, m_prop2D.empty() ? NULL : &m_prop2D[0], &m_propy[0], &m_propxr[0], &m_propxi[0]);
+}
+
+void PropagationContext::PropagateOther()
+{
+	PropagateRows(otherWave, m_otherProp2D.empty() ? NULL : &m_otherProp2D[0], &m_otherPropy[0], 
+		&m_otherPropxr[0], &m_otherPropxi[0]);
+}
+
+// prop2D: the 2D propagator, or NULL for the separable one (propy, propxr, propxi)
+template <class T> void PropagationContext::PropagateRows(T (**wave)[2], const T *prop2D, const T *propy, 
+														  const T *propxr, const T *propxi)
+{
+	int ixa;
+	T *row;
+
+#pragma omp parallel for private(row) num_threads(nThreads) if(nThreads > 1)
+	for( ixa=0; ixa<nx; ixa++) {
+		row = (T *)wave[ixa];
+		if (prop2D != NULL) {
+			if (kx2[ixa] < k2max) complexMultiply(row, prop2D+2*(size_t)ixa*ny, ny);
+			else memset(row, 0, 2*ny*sizeof(T));
+		}
+		else if( kx2[ixa] < k2max ) {
+			complexMultiply2(row, propy, propxr[ixa], propxi[ixa], m_yStop[ixa]);
+			memset(row+2*m_yStop[ixa], 0, 2*(m_yStart[ixa]-m_yStop[ixa])*sizeof(T));
+			complexMultiply2(row+2*m_yStart[ixa], propy+2*m_yStart[ixa], propxr[ixa], propxi[ixa], 
+				ny-m_yStart[ixa]);
+		} 
+		else memset(row, 0, 2*ny*sizeof(T));
+	} /* end for(ix..) */
+}
@@ -0,0 +1,113 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROPAGATION_CONTEXT_H
+#define PROPAGATION_CONTEXT_H
+
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+#include "probe_batch.h"
+#include "detector_collector.h"
+#include "pruned_fft.h"
+
+/**************************************************************
+ * PropagationContext holds everything a thread of the scan loop
+ * writes to while it runs the multislice algorithm: the Fresnel
+ * propagator and the k-vectors (formerly static in propagate_slow() 
+ * and copied to muls->kx2 ...), the value range of the last exit 
+ * wave (formerly muls->rmin ...), the detector collector with its 
+ * scratch space, the totals of the positions done by this thread, 
+ * the FFT plans, which skip the columns outside the bandwidth limit,
+ * and, for runMulsSTEMBatch(), the batch buffer with its own plans.
+ * Every thread has its own context, so that muls is only read during 
+ * the scan, and nothing is allocated once the first position is done:
+ * the scratch rows of the transmission and the phase ramp of the probe
+ * shift are kept here, too.
+ *
+ * PropagationContextPtr context = PropagationContextPtr(new PropagationContext(&muls, batchSize));
+ * runMulsSTEM(&muls, context, wave);
+ *
+ * The propagator (and the collector and FFTs) is (re)computed by Update(), 
+ * which runMulsSTEM() calls before each slab, whenever the slice 
+ * thickness, the high tension or the sampling has changed.
+ * Because Update() uses the fftw planner, which is not thread safe,
+ * the scan loops call it for every context before the threads start.
+ *
+ * With muls->propagator2D the propagator is stored as one nx x ny 
+ * array, which already contains the bandwidth limit and the 
+ * normalization 1/(nx*ny) of the FFT, so that Propagate() is a single
+ * multiplication and fft_normalize() is not needed.  Otherwise only 
+ * the separable factors are stored (nx+ny instead of nx*ny values), 
+ * and the wave must be normalized after the inverse FFT.  waveScale 
+ * tells the callers which one it is.
+ *
+ * nThreads is the number of OpenMP threads which Propagate() and the
+ * collector use for one wave: 1 in the STEM scan, where every thread 
+ * has its own wave, all of them in the single wave modes.
+ * The waves have muls->nx x muls->ny pixels, unless sizeX and sizeY
+ * are given (the S-matrix of PRISM propagates waves of the size of 
+ * the potential).
+ *
+ * With muls->propagateOther the multislice runs in other_real instead
+ * of float_tt ('propagation precision:'): runMulsSTEM() copies the 
+ * wave to otherWave, which has its own FFTs (otherFFT) and propagator
+ * (PropagateOther()), computed in double.
+ **************************************************************/
+class PropagationContext {
+	float_tt m_dz, m_v0, m_resX, m_resY;     // parameters of the current propagator
+	std::vector<float_tt> m_propxr, m_propxi;
+	std::vector<float_tt> m_propy;           // interleaved (re, im), for complexMultiply2()
+	std::vector<int> m_yStop, m_yStart;       // row ix is inside the bandwidth limit for iy < m_yStop[ix] and iy >= m_yStart[ix]
+	std::vector<float_tt> m_prop2D;          // interleaved nx x ny propagator, only with muls->propagator2D
+	std::vector<other_real> m_otherPropxr, m_otherPropxi, m_otherPropy, m_otherProp2D;  // the same for otherWave
+
+	template <class T> void PropagateRows(T (**wave)[2], const T *prop2D, const T *propy, const T *propxr, const T *propxi);
+public:
+	int nx, ny;
+	std::vector<float_tt> kx, ky, kx2, ky2;   // k-vectors in 1/A, 
+	float_tt k2max;                           // bandwidth limit (2/3 of Nyquist)^2
+	float_tt rmin, rmax, aimin, aimax;        // value range of the last exit wave
+	double waveScale;                         // Propagate() multiplies the wave by this, besides the propagator: 
+	                                          // 1/(nx*ny) for the 2D propagator, 1 for the separable one
+	DetectorCollectorPtr collector;
+	PrunedFFTPtr fft;                         // for one wave
+	ProbeBatchPtr batch;                      // only if batchSize > 1
+	PrunedFFTPtr batchFFT;                    // for all waves of batch
+	other_real (**otherWave)[2];              // the wave in other_real, only with muls->propagateOther
+	boost::shared_ptr<PrunedFFTT<other_real> > otherFFT;  // for otherWave
+	std::vector<float_tt> transRow;           // scratch rows of TransStore::Transmit()
+	std::vector<other_real> otherTransRow;    // the same for otherWave
+	std::vector<float_tt> batchRow;           // expanded row of transmitBatch()
+	std::vector<double> shiftRamp;            // phase ramp of probeShiftAndCrop()
+	double intensity, chisq;                  // summed over the positions of this thread, reset by the caller
+	int nThreads;                             // threads working on one wave
+
+	PropagationContext(MULS *muls, int batchSize=1, int nThreads=1, int sizeX=0, int sizeY=0);
+	~PropagationContext();
+
+	void Update(MULS *muls);
+	void Propagate(void **wave);
+	void PropagateOther();                    // Propagate() for otherWave
+};
+
+typedef boost::shared_ptr<PropagationContext> PropagationContextPtr;
+
+#endif
@@ -0,0 +1,203 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "s_matrix.h"
+#include "memory_fftw3.h"
+#include "matrixlib.h"
+#include "stemlib.h"
+#include "stemutil.h"
+
+SMatrix::SMatrix(MULS *muls, int fx, int fy) :
+m_nx(muls->potNx),
+m_ny(muls->potNy),
+m_fx((fx > 0) ? fx : muls->potNx/muls->nx),
+m_fy((fy > 0) ? fy : muls->potNy/muls->ny)
+{
+	int mx, my, mxMax, myMax, b, th;
+	double kx, ky, k2, k2max, pixel, wavlen;
+
+	if ((m_fx < 1) || (m_fy < 1) || (m_nx < m_fx*muls->nx) || (m_ny < m_fy*muls->ny)) {
+		printf("SMatrix: with the interpolation %d x %d, the probe (%d x %d) does not fit into the potential (%d x %d)\n",
+			m_fx, m_fy, muls->nx, muls->ny, m_nx, m_ny);
+		exit(0);
+	}
+	// the beams are on a grid of fx/potSizeX x fy/potSizeY in reciprocal space
+	m_dkx = m_fx/(m_nx*(double)muls->resolutionX);
+	m_dky = m_fy/(m_ny*(double)muls->resolutionY);
+
+	/* the aperture of probe(), with the same smooth edge */
+	wavlen = wavelength(muls->v0);
+	k2max = sin(0.001*muls->alpha)/wavlen;
+	k2max = k2max*k2max;
+	pixel = m_dkx*m_dkx+m_dky*m_dky;
+	mxMax = (int)(sqrt(k2max)/m_dkx)+1;
+	myMax = (int)(sqrt(k2max)/m_dky)+1;
+	for (mx=-mxMax; mx<=mxMax; mx++) for (my=-myMax; my<=myMax; my++) {
+		kx = mx*m_dkx;
+		ky = my*m_dky;
+		k2 = kx*kx+ky*ky;
+		if ((muls->ismoth != 0) && (fabs(k2-k2max) <= pixel)) m_weight.push_back(0.5);
+		else if (k2 <= k2max) m_weight.push_back(1.0);
+		else continue;
+		m_mx.push_back(mx);
+		m_my.push_back(my);
+	}
+	m_coef = std::vector<double>(2*m_weight.size(), 0.0);
+	for (b=0; b<(int)m_weight.size(); b++) {
+#if FLOAT_PRECISION == 1
+		m_beams.push_back(complex2Df(m_nx, m_ny, "SMatrix"));
+#else
+		m_beams.push_back(complex2D(m_nx, m_ny, "SMatrix"));
+#endif
+	}
+	for (th=0; th<omp_get_max_threads(); th++)
+		m_contexts.push_back(PropagationContextPtr(new PropagationContext(muls, 1, 1, m_nx, m_ny)));
+}
+
+SMatrix::~SMatrix()
+{
+	for (int b=0; b<(int)m_beams.size(); b++) {
+#if FLOAT_PRECISION == 1
+		fftwf_free(m_beams[b][0]);
+		fftwf_free(m_beams[b]);
+#else
+		fftw_free(m_beams[b][0]);
+		fftw_free(m_beams[b]);
+#endif
+	}
+}
+
+// beam b = exp(2 pi i k.r), r on the pixels of the potential
+void SMatrix::Reset()
+{
+	int b, ix, iy;
+	double phaseX, phase;
+
+#pragma omp parallel for private(ix, iy, phaseX, phase)
+	for (b=0; b<(int)m_beams.size(); b++) {
+		for (ix=0; ix<m_nx; ix++) {
+			phaseX = 2.0*PI*(((long)m_mx[b]*m_fx*ix) % m_nx)/m_nx;
+			for (iy=0; iy<m_ny; iy++) {
+				phase = phaseX+2.0*PI*(((long)m_my[b]*m_fy*iy) % m_ny)/m_ny;
+				m_beams[b][ix][iy][0] = (float_tt)cos(phase);
+				m_beams[b][ix][iy][1] = (float_tt)sin(phase);
+			}
+		}
+	}
+}
+
+/******************************************************************
+* the multislice loop of runMulsSTEM() for every beam, through the 
+* whole potential, i.e. the beams are transmitted at (0, 0)
+*****************************************************************/
+void SMatrix::Propagate(MULS *muls)
+{
+	int b, islice, mRepeat;
+	complex_type **beam;
+	PropagationContextPtr context;
+
+	// plan the FFTs outside of the parallel loop, the fftw planner is not thread safe
+	for (b=0; b<(int)m_contexts.size(); b++)
+		m_contexts[b]->Update(muls);
+
+#pragma omp parallel for private(islice, mRepeat, beam, context) schedule(dynamic)
+	for (b=0; b<(int)m_beams.size(); b++) {
+		beam = m_beams[b];
+		context = m_contexts[omp_get_thread_num()];
+		for (mRepeat = 0; mRepeat < muls->mulsRepeat1; mRepeat++) {
+			for (islice=0; islice < muls->slices; islice++) {
+				if (muls->transStore)
+					muls->transStore->Transmit(beam, islice, m_nx, m_ny, 0, 0, context->transRow);
+				else
+					transmit((void **)beam, (void **)(muls->trans[islice]), m_nx, m_ny, 0, 0);
+				context->fft->Forward(beam[0]);
+				context->Propagate((void **)beam);
+				context->fft->Inverse(beam[0]);
+				if (context->waveScale == 1.0)
+					fft_normalize((void **)beam, m_nx, m_ny);
+			}
+		}
+	}
+}
+
+// the coefficients of probe(): aperture times exp(-i chi(k)), with sum |c|^2 = 1
+void SMatrix::Update(MULS *muls)
+{
+	int b;
+	double chi, wavlen, norm = 0;
+
+	wavlen = wavelength(muls->v0);
+	for (b=0; b<(int)m_weight.size(); b++) {
+		chi = aberrationPhase(muls, m_mx[b]*m_dkx, m_my[b]*m_dky, wavlen);
+		m_coef[2*b]   =  m_weight[b]*cos(chi);
+		m_coef[2*b+1] = -m_weight[b]*sin(chi);
+		norm += m_weight[b]*m_weight[b];
+	}
+	norm = (norm > 0) ? 1.0/sqrt(norm) : 0;
+	for (b=0; b<(int)m_coef.size(); b++) m_coef[b] *= norm;
+}
+
+/******************************************************************
+* the exit wave of the probe at (x, y) of its window, which starts at
+* pixel (wave->iPosX, wave->iPosY) of the potential:
+* wave(r) = sum_b c_b exp(-2 pi i k_b.r0) beam_b(r)
+*****************************************************************/
+void SMatrix::Synthesize(MULS *muls, WavePtr wave, double x, double y)
+{
+	int b, ix, iy, nb = (int)m_beams.size();
+	double x0, y0, phase, cr, ci;
+	std::vector<double> coef(2*nb), row(2*wave->ny);
+	complex_type *s;
+
+	if ((wave->iPosX < 0) || (wave->iPosY < 0) || 
+		(wave->iPosX+wave->nx > m_nx) || (wave->iPosY+wave->ny > m_ny)) {
+		printf("SMatrix: window at (%d, %d) is outside of the potential\n", wave->iPosX, wave->iPosY);
+		exit(0);
+	}
+	// the position of the probe in the potential
+	x0 = wave->iPosX*muls->resolutionX+x;
+	y0 = wave->iPosY*muls->resolutionY+y;
+	for (b=0; b<nb; b++) {
+		phase = -2.0*PI*(m_mx[b]*m_dkx*x0+m_my[b]*m_dky*y0);
+		coef[2*b]   = m_coef[2*b]*cos(phase)-m_coef[2*b+1]*sin(phase);
+		coef[2*b+1] = m_coef[2*b]*sin(phase)+m_coef[2*b+1]*cos(phase);
+	}
+	for (ix=0; ix<wave->nx; ix++) {
+		memset(&row[0], 0, row.size()*sizeof(double));
+		for (b=0; b<nb; b++) {
+			cr = coef[2*b];
+			ci = coef[2*b+1];
+			s = m_beams[b][wave->iPosX+ix]+wave->iPosY;
+			for (iy=0; iy<wave->ny; iy++) {
+				row[2*iy]   += cr*s[iy][0]-ci*s[iy][1];
+				row[2*iy+1] += cr*s[iy][1]+ci*s[iy][0];
+			}
+		}
+		for (iy=0; iy<wave->ny; iy++) {
+			wave->wave[ix][iy][0] = (float_tt)row[2*iy];
+			wave->wave[ix][iy][1] = (float_tt)row[2*iy+1];
+		}
+	}
+}
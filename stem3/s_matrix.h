@@ -0,0 +1,86 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef S_MATRIX_H
+#define S_MATRIX_H
+
+#include <vector>
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+#include "propagation_context.h"
+
+/**************************************************************
+ * SMatrix is the scattering matrix of the PRISM algorithm: instead
+ * of running the multislice algorithm for every scan position, the
+ * plane waves inside the probe aperture are propagated once through 
+ * the whole potential (muls->potNx x muls->potNy), and the exit wave 
+ * of a probe is a weighted sum of them, cropped to the nx x ny 
+ * window of the probe.
+ * Only every fx-th (fy-th) plane wave is used, so that the probe 
+ * repeats itself after potNx/fx (potNy/fy) pixels, which must not 
+ * be less than the window.  fx = 0 takes the largest factor which 
+ * fits, potNx/nx.
+ *
+ * SMatrixPtr sMatrix = SMatrixPtr(new SMatrix(&muls, fx, fy));
+ * sMatrix->Reset();                 // plane waves, before the first slab
+ * sMatrix->Propagate(&muls);        // through the slices of this slab
+ * sMatrix->Update(&muls);           // aberrations, e.g. after muls.dE_E changed
+ * sMatrix->Synthesize(&muls, wave, x, y);  // exit wave of the probe at (x, y) in its 
+ *                                          // window at (wave->iPosX, wave->iPosY)
+ *
+ * The coefficients of the plane waves are those of probe() (aperture,
+ * aberrations, and the phase ramp of the position), normalized like 
+ * its probe.  Propagate() runs the beams in parallel, with one context
+ * for each thread.  Synthesize() may be called from several threads, 
+ * but not while Reset(), Propagate() or Update() are running.
+ **************************************************************/
+class SMatrix {
+#if FLOAT_PRECISION == 1
+	typedef fftwf_complex complex_type;
+#else
+	typedef fftw_complex complex_type;
+#endif
+	int m_nx, m_ny;                        // size of the potential and of the beams
+	int m_fx, m_fy;                        // interpolation factors
+	double m_dkx, m_dky;                   // spacing of the beams in reciprocal space
+	std::vector<int> m_mx, m_my;           // beam b has k = (m_mx[b]*m_dkx, m_my[b]*m_dky)
+	std::vector<double> m_weight;          // aperture, 0.5 on the edge with muls->ismoth
+	std::vector<double> m_coef;            // interleaved (re, im) of every beam, from Update()
+	std::vector<complex_type **> m_beams;
+	std::vector<PropagationContextPtr> m_contexts;   // one for each thread
+public:
+	SMatrix(MULS *muls, int fx=0, int fy=0);
+	~SMatrix();
+
+	int Beams() const {return (int)m_beams.size();}
+	int FactorX() const {return m_fx;}
+	int FactorY() const {return m_fy;}
+	size_t Bytes() const {return m_beams.size()*m_nx*m_ny*sizeof(complex_type);}
+
+	void Reset();
+	void Propagate(MULS *muls);
+	void Update(MULS *muls);
+	void Synthesize(MULS *muls, WavePtr wave, double x, double y);
+};
+
+typedef boost::shared_ptr<SMatrix> SMatrixPtr;
+
+#endif
@@ -0,0 +1,164 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "scan_scheduler.h"
+
+/* index of (x,y) along a Hilbert curve through an n x n grid, n = 2^k */
+static long hilbertIndex(long n, long x, long y) {
+	long rx, ry, s, t, d=0;
+
+	for (s=n/2; s>0; s/=2) {
+		rx = (x & s) > 0;
+		ry = (y & s) > 0;
+		d += s*s*((3*rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = n-1-x;
+				y = n-1-y;
+			}
+			t = x; x = y; y = t;
+		}
+	}
+	return d;
+}
+
+/* index of (x,y) along a Z-order (Morton) curve, i.e. interleaved bits */
+static long zOrderIndex(long x, long y) {
+	long d=0;
+
+	for (int b=0; b<(int)(4*sizeof(long)); b++) {
+		d |= ((x >> b) & 1L) << (2*b+1);
+		d |= ((y >> b) & 1L) << (2*b);
+	}
+	return d;
+}
+
+ScanScheduler::ScanScheduler(int scanXN, int scanYN, int order, int tileSize, int nThreads) :
+m_tileSize(tileSize > 0 ? tileSize : 1),
+m_nThreads(nThreads > 0 ? nThreads : 1)
+{
+	std::vector<std::pair<long,int> > keys(scanXN*scanYN);
+	long n = 1;
+	int ix, iy, i;
+
+	while ((n < scanXN) || (n < scanYN)) n *= 2;
+	for (ix=0; ix<scanXN; ix++) for (iy=0; iy<scanYN; iy++) {
+		i = ix*scanYN+iy;
+		switch (order) {
+			case SCAN_HILBERT:
+				keys[i].first = hilbertIndex(n, ix, iy);
+				break;
+			case SCAN_ZORDER:
+				keys[i].first = zOrderIndex(ix, iy);
+				break;
+			default:
+				keys[i].first = i;
+		}
+		keys[i].second = i;
+	}
+	std::sort(keys.begin(), keys.end());
+	m_order = std::vector<int>(keys.size());
+	for (i=0; i<(int)keys.size(); i++) m_order[i] = keys[i].second;
+
+	m_tiles = std::vector<std::deque<std::pair<int,int> > >(m_nThreads);
+	m_locks = std::vector<omp_lock_t>(m_nThreads);
+	for (i=0; i<m_nThreads; i++) omp_init_lock(&m_locks[i]);
+	Reset();
+}
+
+ScanScheduler::~ScanScheduler() {
+	for (int i=0; i<m_nThreads; i++) omp_destroy_lock(&m_locks[i]);
+}
+
+// deal the tiles out round robin, so that tile j goes to thread j % nThreads
+void ScanScheduler::Reset() {
+	int start, tile;
+
+	for (int i=0; i<m_nThreads; i++) m_tiles[i].clear();
+	for (start=0, tile=0; start<(int)m_order.size(); start+=m_tileSize, tile++) {
+		m_tiles[tile % m_nThreads].push_back(std::make_pair(start, 
+			std::min(start+m_tileSize, (int)m_order.size())));
+	}
+}
+
+// move a tile from the back of the first non-empty deque of another thread 
+// to our own.  Returns false, if there is no work left.
+bool ScanScheduler::Steal(int thread) {
+	std::pair<int,int> tile;
+	int victim;
+
+	for (int i=1; i<m_nThreads; i++) {
+		victim = (thread+i) % m_nThreads;
+		omp_set_lock(&m_locks[victim]);
+		if (m_tiles[victim].empty()) {
+			omp_unset_lock(&m_locks[victim]);
+			continue;
+		}
+		tile = m_tiles[victim].back();
+		m_tiles[victim].pop_back();
+		omp_unset_lock(&m_locks[victim]);
+
+		omp_set_lock(&m_locks[thread]);
+		m_tiles[thread].push_back(tile);
+		omp_unset_lock(&m_locks[thread]);
+		return true;
+	}
+	return false;
+}
+
+// fill positions with up to count positions from the front of our tile deque
+bool ScanScheduler::Next(int thread, std::vector<int> &positions, int count) {
+	std::pair<int,int> *tile;
+	int i;
+
+	positions.clear();
+	if ((thread < 0) || (thread >= m_nThreads)) {
+		printf("ScanScheduler: thread %d out of range (0..%d)\n", thread, m_nThreads-1);
+		exit(0);
+	}
+	do {
+		omp_set_lock(&m_locks[thread]);
+		if (!m_tiles[thread].empty()) {
+			tile = &m_tiles[thread].front();
+			for (i=0; (i<count) && (tile->first < tile->second); i++)
+				positions.push_back(m_order[tile->first++]);
+			if (tile->first >= tile->second) m_tiles[thread].pop_front();
+			omp_unset_lock(&m_locks[thread]);
+			return true;
+		}
+		omp_unset_lock(&m_locks[thread]);
+	} while (Steal(thread));
+	return false;
+}
+
+bool ScanScheduler::Peek(int thread, std::vector<int> &positions, int count) {
+	int i, k;
+
+	positions.clear();
+	if ((thread < 0) || (thread >= m_nThreads)) return false;
+	omp_set_lock(&m_locks[thread]);
+	for (k=0; (k<(int)m_tiles[thread].size()) && ((int)positions.size()<count); k++)
+		for (i=m_tiles[thread][k].first; (i<m_tiles[thread][k].second) && ((int)positions.size()<count); i++)
+			positions.push_back(m_order[i]);
+	omp_unset_lock(&m_locks[thread]);
+	return !positions.empty();
+}
@@ -0,0 +1,69 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCAN_SCHEDULER_H
+#define SCAN_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <utility>
+#include <omp.h>
+#include "boost/shared_ptr.hpp"
+
+// orders in which the STEM scan positions are visited ("scan order:")
+#define SCAN_ROWS     0
+#define SCAN_ZORDER   1
+#define SCAN_HILBERT  2
+
+/**************************************************************
+ * ScanScheduler hands out the probe positions of a STEM scan to
+ * the threads of the scan loop.  Positions are sorted along a 
+ * space filling curve (or simply row by row), cut into tiles of 
+ * tileSize consecutive positions and dealt out round robin to one
+ * deque per thread.  Threads therefore work on neighbouring parts 
+ * of the specimen at the same time.  A thread whose deque is 
+ * empty steals a tile from the back of somebody else's.
+ *
+ * // outside the parallel region, before every pass over the scan:
+ * scheduler->Reset();
+ * // inside:
+ * while (scheduler->Next(omp_get_thread_num(), positions, count)) ...
+ *
+ * Positions are numbered ix*scanYN+iy, as in doSTEM().
+ **************************************************************/
+class ScanScheduler {
+	std::vector<int> m_order;    // scan positions in the order they should be done
+	int m_tileSize, m_nThreads;
+	std::vector<std::deque<std::pair<int,int> > > m_tiles;  // [start,end) ranges of m_order
+	std::vector<omp_lock_t> m_locks;
+
+	bool Steal(int thread);
+public:
+	ScanScheduler(int scanXN, int scanYN, int order, int tileSize, int nThreads);
+	~ScanScheduler();
+
+	void Reset();
+	bool Next(int thread, std::vector<int> &positions, int count);
+	// the positions Next() would hand to thread (without stealing), e.g. to prefetch their data
+	bool Peek(int thread, std::vector<int> &positions, int count);
+};
+
+typedef boost::shared_ptr<ScanScheduler> ScanSchedulerPtr;
+
+#endif
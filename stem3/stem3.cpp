@@ -48,6 +48,12 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <ctype.h>
 #include <sys/stat.h>
 // #include <stat.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 #include <omp.h>
 
@@ -61,6 +67,14 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "weblib.h"
 #include "customslice.h"
 #include "data_containers.h"
+#include "wave_store.h"
+#include "scan_scheduler.h"
+#include "stem_tiles.h"
+#include "stem_checkpoint.h"
+#include "fft_plans.h"
+#include "fft_backend.h"
+#include "probe_cache.h"
+#include "s_matrix.h"
 
 #define NCINMAX 1024
 #define NPARAM	64    /* number of parameters */
@@ -77,8 +91,6 @@ QSTEM - image simulation for TEM/STEM/CBED
 const char *resultPage = "result.html";
 /* global variable: */
 MULS muls;
-// int fftMeasureFlag = FFTW_MEASURE;
-int fftMeasureFlag = FFTW_ESTIMATE;
 extern char *elTable;
 
 void makeAnotation(real **pict,int nx,int ny,char *text);
@@ -97,7 +109,9 @@ void readFile();
 void displayParams();
 
 void usage() {
-	printf("usage: stem [input file='stem.dat']\n\n");
+	printf("usage: stem [--tile i/N] [input file='stem.dat']\n\n");
+	printf("  --tile i/N  compute only tile i (0..N-1) of the STEM scan,\n"
+		   "              stem3-merge <output folder> N combines the tiles\n\n");
 }
 
 
@@ -109,9 +123,9 @@ void usage() {
 
 
 int main(int argc, char *argv[]) {
-	int i; 
+	int i, tile=-1, nTiles=0; 
 	double timerTot;
-	char fileName[512]; 
+	char fileName[512], wisdomFile[1024]; 
 	char cinTemp[BUF_LEN];
 
 	timerTot = cputim();
@@ -126,10 +140,17 @@ int main(int argc, char *argv[]) {
 	/*************************************************************
 	* read in the parameters
 	************************************************************/  
-	if (argc < 2)
-		sprintf(fileName,"stem.dat");
-	else
-		strcpy(fileName,argv[1]);
+	sprintf(fileName,"stem.dat");
+	for (i=1;i<argc;i++) {
+		if (strcmp(argv[i],"--tile") == 0) {
+			if ((i+1 >= argc) || (sscanf(argv[++i],"%d/%d",&tile,&nTiles) != 2)) {
+				usage();
+				exit(0);
+			}
+		}
+		else
+			strcpy(fileName,argv[i]);
+	}
 	if (parOpen(fileName) == 0) 
 	{
 		printf("could not open input file %s!\n",fileName);
@@ -137,11 +158,26 @@ int main(int argc, char *argv[]) {
 		exit(0);
 	}
 	readFile();
+	if (nTiles > 0) {
+		muls.tile = tile;
+		muls.nTiles = nTiles;
+	}
+	if (muls.mode == STEM) {
+		scanTileWindow(muls.scanXN, muls.scanYN, muls.tile, muls.nTiles,
+			&muls.tileXStart, &muls.tileXStop, &muls.tileYStart, &muls.tileYStop);
+		// all tiles must see the same phonon configurations
+		if ((muls.nTiles > 1) && muls.tds && (muls.randomSeed == 0)) {
+			printf("A tiled TDS scan needs a fixed 'random seed:' in %s\n",fileName);
+			exit(0);
+		}
+	}
 
 	displayParams();
 #ifdef _OPENMP
 	omp_set_dynamic(1);
 #endif
+	/* readFile() has loaded the wisdom from this file before making the first plan */
+	fftWisdomName(wisdomFile, muls.wisdomFolder, muls.nx, muls.ny, muls.potNx, muls.potNy, omp_get_max_threads());
 	if (muls.mode == STEM) {
 		// sprintf(systStr,"mkdir %s",muls.folder);
 		// system(systStr);
@@ -167,6 +203,9 @@ int main(int argc, char *argv[]) {
 	  default:
 		  printf("Mode not supported\n");
 	}
+	// ESTIMATE plans are not worth keeping
+	if ((muls.wisdomFolder[0] != '\0') && (fftRigor() != FFTW_ESTIMATE))
+		saveFFTWisdom(wisdomFile);
 
 	parClose();
 #if _DEBUG
@@ -229,13 +268,15 @@ void initMuls() {
 	muls.gaussianProp = 0;
 
 
-	muls.sparam = (float *)malloc(NPARAM*sizeof(float));
+	muls.sparam = (float_tt *)malloc(NPARAM*sizeof(float_tt));
 	for (i=0;i<NPARAM;i++)
 		muls.sparam[i] = 0.0;
-	muls.kx = NULL;
-	muls.kx2= NULL;
-	muls.ky = NULL;
-	muls.ky2= NULL;
+	muls.diffpatSeries = NULL;
+	muls.probeBatch = 1;
+	muls.prism = 0;
+	muls.prismFx = muls.prismFy = 0;
+	muls.tile = 0;
+	muls.nTiles = 1;
 
 	/****************************************************/
 	/* copied from slicecell.c                          */
@@ -338,7 +379,7 @@ void displayParams() {
 
 	printf("\n*****************************************************\n");
 	printf("* Running program STEM3 (version %.2f) in %s mode\n",VERSION,
-		(muls.mode == STEM) ? "STEM" : (muls.mode==TEM) ? "TEM" : 
+		(muls.mode == STEM) ? (muls.prism ? "PRISM" : "STEM") : (muls.mode==TEM) ? "TEM" : 
 		(muls.mode == CBED) ? "CBED" : (muls.mode==TOMO)? "TOMO" : 
 		(muls.mode == NBED) ? "NBED" :
 		"???"); 
@@ -446,7 +487,14 @@ void displayParams() {
 	*/
 	printf("* Temperature:          %gK\n",muls.tds_temp);
 	if (muls.tds)
+	{
 		printf("* TDS:                  yes (%d runs)\n",muls.avgRuns);
+		printf("* Average store memory: %d MB\n",muls.avgStoreMB);
+		if (muls.randomSeed != 0)
+			printf("* Random seed:          %ld\n",muls.randomSeed);
+		else
+			printf("* Random seed:          from clock\n");
+	}
 	else
 		printf("* TDS:                  no\n"); 
 	if (muls.imageGamma == 0)
@@ -457,17 +505,42 @@ void displayParams() {
 	/**********************************************************
 	* FFTW specific data structures (stores in row major order)
 	*/
-	if (fftMeasureFlag == FFTW_MEASURE)
+	if (fftRigor() != FFTW_ESTIMATE)
 		printf("* Probe array:          %d x %d pixels (optimized)\n",muls.nx,muls.ny);
 	else
 		printf("* Probe array:          %d x %d pixels (estimated)\n",muls.nx,muls.ny);
 	printf("*                       %g x %gA\n",
 		muls.nx*muls.resolutionX,muls.ny*muls.resolutionY);
+	if (muls.propagator2D)
+		printf("* Propagator:           2D (%d kB per thread)\n",
+			(int)(((size_t)muls.nx*muls.ny*2*sizeof(float_tt)) >> 10));
+	else
+		printf("* Propagator:           separable\n");
+	printf("* Propagation:          %s\n", (sizeof(float_tt) == sizeof(float)) ? 
+		(muls.propagateOther ? "double" : "float") : (muls.propagateOther ? "float" : "double"));
 
-	if (fftMeasureFlag == FFTW_MEASURE)
+	if (fftRigor() != FFTW_ESTIMATE)
 		printf("* Potential array:      %d x %d (optimized)\n",muls.potNx,muls.potNy);
 	else
 		printf("* Potential array:      %d x %d (estimated)\n",muls.potNx,muls.potNy);
+	if (muls.transStorage == TRANS_COMPLEX)
+		printf("* Transmission storage: complex (%d MB)\n",
+			(int)(((size_t)muls.slices*muls.potNx*muls.potNy*2*sizeof(float_tt)) >> 20));
+	else
+		printf("* Transmission storage: %s (%d MB%s%s)\n",
+			(muls.transStorage == TRANS_POTENTIAL) ? "potential" : "half",(int)(muls.transStore->Bytes() >> 20),
+			muls.transStore->Mapped() ? " in " : "",muls.transStore->Mapped() ? muls.transFile : "");
+	printf("* FFT library:          %s\n",muls.fftLibrary);
+	printf("* Threads per wave:     %d (FFTs: %d)\n",muls.waveThreads,fftThreads());
+	printf("* FFT plans:            %s, ",fftRigorName(fftRigor()));
+	if (muls.wisdomFolder[0] != '\0')
+		printf("wisdom in %s\n",muls.wisdomFolder);
+	else
+		printf("no wisdom\n");
+	if (muls.potentialCacheFolder[0] != '\0')
+		printf("* Potential cache:      %s\n",muls.potentialCacheFolder);
+	else
+		printf("* Potential cache:      none\n");
 	printf("*                       %g x %gA\n",muls.potSizeX,muls.potSizeY);
 	printf("* Scattering factors:   %d\n",muls.scatFactor);
 	/***************************************************/
@@ -504,6 +577,28 @@ void displayParams() {
 		printf("* Scan window:          (%g,%g) to (%g,%g)A, %d x %d = %d pixels\n",
 			muls.scanXStart,muls.scanYStart,muls.scanXStop,muls.scanYStop,
 			muls.scanXN,muls.scanYN,muls.scanXN*muls.scanYN);
+		printf("* Scan step:            %g x %g pixels of the potential\n",
+			(muls.scanXStop-muls.scanXStart)/(muls.scanXN*muls.resolutionX),
+			(muls.scanYStop-muls.scanYStart)/(muls.scanYN*muls.resolutionY));
+		printf("* Wave store memory:    %d MB\n",muls.waveStoreMB);
+		if (muls.prism) {
+			if (muls.prismFx > 0)
+				printf("* PRISM interpolation:  %d x %d\n",muls.prismFx,muls.prismFy);
+			else
+				printf("* PRISM interpolation:  %d x %d (auto)\n",muls.potNx/muls.nx,muls.potNy/muls.ny);
+		}
+		else
+			printf("* Probe batch size:     %d\n",muls.probeBatch);
+		if (muls.checkpointInterval > 0)
+			printf("* Checkpoint interval:  %d sec\n",muls.checkpointInterval);
+		else
+			printf("* Checkpoints:          no\n");
+		if (muls.nTiles > 1)
+			printf("* Tile:                 %d of %d (x: %d..%d, y: %d..%d)\n",muls.tile,muls.nTiles,
+				muls.tileXStart,muls.tileXStop-1,muls.tileYStart,muls.tileYStop-1);
+		printf("* Scan order:           %s, tiles of %d positions\n",
+			(muls.scanOrder == SCAN_ROWS) ? "rows" : (muls.scanOrder == SCAN_ZORDER) ? "Z-order" : "Hilbert",
+			muls.scanTileSize);
 	} /* end of if mode == STEM */
 
 	/***********************************************************************
@@ -616,6 +711,7 @@ void readFile() {
 	char buf[BUF_LEN],*strPtr;
 	int i,ix;
 	int potDimensions[2];
+	char wisdomFile[1024];
 	long ltime;
 	unsigned long iseed;
 	double dE_E0,x,y,dx,dy;
@@ -630,7 +726,9 @@ void readFile() {
 
 	muls.mode = STEM;
 	if (readparam("mode:",buf,1)) {
-		if (strstr(buf,"STEM")) muls.mode = STEM;
+		// PRISM is STEM with a different way of getting the exit waves
+		if (strstr(buf,"PRISM")) {muls.mode = STEM; muls.prism = 1;}
+		else if (strstr(buf,"STEM")) muls.mode = STEM;
 		else if (strstr(buf,"TEM")) muls.mode = TEM;
 		else if (strstr(buf,"CBED")) muls.mode = CBED;
 		else if (strstr(buf, "NBED")) muls.mode = NBED;
@@ -980,6 +1078,107 @@ void readFile() {
 		sscanf(buf,"%s",answer);
 		muls.bandlimittrans = (tolower(answer[0]) == (int)'y');
 	}    
+	/* transmission storage: complex (default), potential (only without bandlimit 
+	 * f_trans) or half.  The last two need half the memory, see trans_store.h */
+	muls.transStorage = TRANS_COMPLEX;
+	if (readparam("transmission storage:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		switch (tolower(answer[0])) {
+			case 'c': muls.transStorage = TRANS_COMPLEX; break;
+			case 'p': muls.transStorage = TRANS_POTENTIAL; break;
+			case 'h': muls.transStorage = TRANS_HALF; break;
+			default:
+				printf("Unknown transmission storage %s, must be complex, potential or half\n",answer);
+				exit(0);
+		}
+	}
+	/* keep the compact transmission functions in a memory mapped file, 
+	 * for potentials larger than RAM (see trans_store.h) */
+	muls.transFile[0] = '\0';
+	if (readparam("transmission file:",buf,1)) {
+		sscanf(buf,"%s",muls.transFile);
+		// tile processes (--tile i/N) read the same parameter file, each needs a file of its own
+		sprintf(muls.transFile+strlen(muls.transFile),".%d",(int)getpid());
+		if (muls.transStorage == TRANS_COMPLEX) {
+			printf("A transmission file needs transmission storage potential or half, will use half\n");
+			muls.transStorage = TRANS_HALF;
+		}
+	}
+	if ((muls.transStorage == TRANS_POTENTIAL) && muls.bandlimittrans) {
+		printf("Transmission storage potential needs bandlimit f_trans: no, will use half precision\n");
+		muls.transStorage = TRANS_HALF;
+	}
+	/* time fftw may spend on making plans: estimate, measure or patient.  The plans are
+	 * kept as wisdom in the given folder ("no": don't keep them) for the next run */
+	if (readparam("fft plans:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		if (fftRigorFromName(answer) == 0) {
+			printf("Unknown fft plans %s, must be estimate, measure or patient\n",answer);
+			exit(0);
+		}
+		setFFTRigor(fftRigorFromName(answer));
+	}
+	strcpy(muls.wisdomFolder,".");
+	if (readparam("fft wisdom folder:",buf,1)) {
+		sscanf(buf,"%s",muls.wisdomFolder);
+		if (strcmp(muls.wisdomFolder,"no") == 0) muls.wisdomFolder[0] = '\0';
+	}
+	/* if a folder is given, the lookup tables of the atom potentials are kept there 
+	 * for the next run with the same sampling (see table_cache.h).  Off by default 
+	 * ("no"), so that runs don't leave files behind unless asked to */
+	muls.potentialCacheFolder[0] = '\0';
+	if (readparam("potential cache folder:",buf,1)) {
+		sscanf(buf,"%s",muls.potentialCacheFolder);
+		if (strcmp(muls.potentialCacheFolder,"no") == 0) muls.potentialCacheFolder[0] = '\0';
+	}
+	/* FFT library: fftw, builtin, mkl (if built with it), or fastest */
+	strcpy(muls.fftLibrary,"fftw");
+	if (readparam("fft library:",buf,1)) {
+		sscanf(buf,"%31s",muls.fftLibrary);
+		if ((strcmp(muls.fftLibrary,"fastest") != 0) && !setFFTBackend(muls.fftLibrary)) {
+			printf("Unknown fft library %s, must be fastest",muls.fftLibrary);
+			std::vector<std::string> names = fftBackendNames();
+			for (int i=0; i<(int)names.size(); i++) printf(", %s",names[i].c_str());
+			printf("\n");
+			exit(0);
+		}
+	}
+	/* the modes with a single wave use all threads for it, the STEM scan runs 
+	 * one position per thread and needs single threaded FFTs */
+	muls.waveThreads = (muls.mode == STEM) ? 1 : omp_get_max_threads();
+	setFFTThreads(muls.waveThreads);
+
+	/* separable (default): kx and ky factors only, 2D: one precomputed nx x ny 
+	 * propagator per thread, which saves the normalization pass but needs 
+	 * nx*ny values per thread */
+	muls.propagator2D = 0;
+	if (readparam("propagator:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		switch (tolower(answer[0])) {
+			case '2': muls.propagator2D = 1; break;
+			case 's': muls.propagator2D = 0; break;
+			default:
+				printf("Unknown propagator %s, must be 2D or separable\n",answer);
+				exit(0);
+		}
+	}
+	/* float or double for the waves, FFTs and propagators of the multislice, 
+	 * the transmission functions stay in float_tt, the detector sums in double */
+	muls.propagateOther = 0;
+	if (readparam("propagation precision:",buf,1)) {
+		sscanf(buf,"%s",answer);
+		switch (tolower(answer[0])) {
+			case 'f': muls.propagateOther = (sizeof(float_tt) != sizeof(float)); break;
+			case 'd': muls.propagateOther = (sizeof(float_tt) != sizeof(double)); break;
+			default:
+				printf("Unknown propagation precision %s, must be float or double\n",answer);
+				exit(0);
+		}
+	}
+	if (muls.prism && muls.propagateOther) {
+		printf("PRISM propagates the S-matrix in the precision of the build\n");
+		muls.propagateOther = 0;
+	}
 	muls.readPotential = 0;
 	if (readparam("read potential:",buf,1)) {
 		sscanf(buf," %s",answer);
@@ -1021,6 +1220,12 @@ void readFile() {
 	}  
 
 	if (!muls.tds) muls.avgRuns = 1;
+	muls.randomSeed = 0;
+	if (readparam("random seed:",buf,1))
+		sscanf(buf,"%ld",&(muls.randomSeed));
+	muls.avgStoreMB = 1024;
+	if (readparam("average store memory:",buf,1))
+		sscanf(buf,"%d",&(muls.avgStoreMB));
 
 	muls.scanXStart = muls.ax/2.0;
 	muls.scanYStart = muls.by/2.0;
@@ -1073,6 +1278,69 @@ void readFile() {
 		muls.displayProgInterval = muls.scanYN*muls.scanYN;
 		if (readparam("propagation progress interval:",buf,1)) 
 			sscanf(buf,"%d",&(muls.displayProgInterval));
+
+		muls.waveStoreMB = 1024;
+		if (readparam("wave store memory:",buf,1)) 
+			sscanf(buf,"%d",&(muls.waveStoreMB));
+
+		/* order in which the scan positions are visited, and how many
+		 * neighbouring positions a thread takes at a time */
+		muls.scanOrder = SCAN_HILBERT;
+		if (readparam("scan order:",buf,1)) {
+			sscanf(buf,"%s",answer);
+			switch (tolower(answer[0])) {
+				case 'r': muls.scanOrder = SCAN_ROWS; break;
+				case 'z': muls.scanOrder = SCAN_ZORDER; break;
+				case 'h': muls.scanOrder = SCAN_HILBERT; break;
+				default:
+					printf("Unknown scan order %s, must be rows, zorder or hilbert\n",answer);
+					exit(0);
+			}
+		}
+		muls.scanTileSize = 16;
+		if (readparam("scan tile size:",buf,1)) 
+			sscanf(buf,"%d",&(muls.scanTileSize));
+		if (muls.scanTileSize < 1) muls.scanTileSize = 1;
+
+		/* compute only one rectangular block of the scan, stem3-merge puts the tiles together.
+		 * "--tile i/N" on the command line overrides this. */
+		if (readparam("process tile:",buf,1)) {
+			if (sscanf(buf,"%d/%d",&(muls.tile),&(muls.nTiles)) != 2) {
+				printf("process tile: expected i/N, e.g. 0/4\n");
+				exit(0);
+			}
+		}
+
+		/* number of probe positions which are propagated together */
+		if (readparam("probe batch size:",buf,1)) 
+			sscanf(buf,"%d",&(muls.probeBatch));
+		if (muls.probeBatch < 1) muls.probeBatch = 1;
+
+		/* PRISM: only every f-th plane wave is propagated, "fx fy" or "f".
+		 * There are no multislice runs of single probes to batch. */
+		if (readparam("prism interpolation:",buf,1)) {
+			if (sscanf(buf,"%d %d",&(muls.prismFx),&(muls.prismFy)) < 2)
+				muls.prismFy = muls.prismFx;
+		}
+		if (muls.prismFx < 0) muls.prismFx = 0;
+		if (muls.prismFy < 0) muls.prismFy = 0;
+		if (muls.prism) muls.probeBatch = 1;
+		/* the batch buffer and its plans are in float_tt */
+		if (muls.propagateOther && (muls.probeBatch > 1)) {
+			printf("The probe batch is not available in the other propagation precision, using 1\n");
+			muls.probeBatch = 1;
+		}
+
+		/* seconds between checkpoints of the scan, 0 (default) switches them off */
+		muls.checkpointInterval = 0;
+		if (readparam("checkpoint interval:",buf,1)) 
+			sscanf(buf,"%d",&(muls.checkpointInterval));
+		/* the diffraction pattern averages (save level > 0) are not part of the
+		 * checkpoint, so a resumed run would lose the configurations before it */
+		if ((muls.checkpointInterval > 0) && (muls.saveLevel > 0)) {
+			printf("Checkpoints are not available with save level > 0, switching them off\n");
+			muls.checkpointInterval = 0;
+		}
 	}
 	muls.displayPotCalcInterval = 100000; // RAM: default, but normally read-in by .CFG file in next code fragment
 	if ( readparam( "potential progress interval:", buf, 1 ) )
@@ -1524,29 +1792,49 @@ void readFile() {
 		printf( "DEBUG: tilt/tds default filename made = %s \n", muls.cfgFile );
 	}
 
+	/* reuse the plans of earlier runs with the same sizes and number of threads.
+	 * This must come before the first plan, which is that of the potential */
+	if (muls.wisdomFolder[0] != '\0') {
+		fftWisdomName(wisdomFile, muls.wisdomFolder, muls.nx, muls.ny, muls.potNx, muls.potNy, omp_get_max_threads());
+		if (loadFFTWisdom(wisdomFile)) printf("Read fftw wisdom from %s\n", wisdomFile);
+	}
+	/* time every FFT library on the multislice FFTs of a wave of this run, the 
+	 * plans of the potential and of all waves are then made with the fastest one */
+	if (strcmp(muls.fftLibrary,"fastest") == 0) {
+		setFFTBackend(fastestFFTBackend(muls.nx, muls.ny, muls.printLevel >= 2));
+		printf("Using FFT library %s\n", fftBackendName());
+	}
+
 	/* allocate memory for wave function */
 
 	potDimensions[0] = muls.potNx;
 	potDimensions[1] = muls.potNy;
+	/* the custom potential (make3DSlicesFT) is made in the complex array */
+	if ((muls.transStorage != TRANS_COMPLEX) && (muls.scatFactor == CUSTOM)) {
+		printf("Custom scattering factors need transmission storage: complex\n");
+		muls.transStorage = TRANS_COMPLEX;
+	}
+	if (muls.transStorage != TRANS_COMPLEX) {
+		/* a strip of nx rows holds all of a probe window (or 2 strips do) */
+		muls.transStore = TransStorePtr(new TransStore(muls.slices,muls.potNx,muls.potNy,muls.transStorage,
+			muls.nx,(muls.transFile[0] != '\0') ? muls.transFile : NULL));
+	}
+	else {
 #if FLOAT_PRECISION == 1
 	muls.trans = complex3Df(muls.slices,muls.potNx,muls.potNy,"trans");
 	// printf("allocated trans %d %d %d\n",muls.slices,muls.potNx,muls.potNy);
-	muls.fftPlanPotForw = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_FORWARD, fftMeasureFlag);
-	muls.fftPlanPotInv = fftwf_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_BACKWARD, fftMeasureFlag);
 #else
 
 	muls.trans = complex3D(muls.slices,muls.potNx,muls.potNy,"trans");
-	muls.fftPlanPotForw = fftw_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_FORWARD, fftMeasureFlag);
-	muls.fftPlanPotInv = fftw_plan_many_dft(2,potDimensions, muls.slices,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy,muls.trans[0][0], NULL,
-		1, muls.potNx*muls.potNy, FFTW_BACKWARD, fftMeasureFlag);
 #endif
+	{
+		FFTPlanThreads threads(fftThreads());
+		muls.fftPlanPotForw = fftBackend()->PlanMany(2,potDimensions,muls.slices,
+			1,muls.potNx*muls.potNy,FFTW_FORWARD,muls.trans[0][0]);
+		muls.fftPlanPotInv = fftBackend()->PlanMany(2,potDimensions,muls.slices,
+			1,muls.potNx*muls.potNy,FFTW_BACKWARD,muls.trans[0][0]);
+	}
+	}
 
 	////////////////////////////////////
 	if (muls.printLevel >= 4) 
@@ -1718,22 +2006,24 @@ void doNBED()
 	// RAM: image reading is found in imagelib_fftw3
 	// Basic idea is to use the writeIMG function in Matlab and use it to pass in a complex-value probe to stem3.exe which can be rastered like a CBED probe
 	// RAM: All we really need to do is initialize the WavePtr wave with a filename found by readFile() above ^^
-	// FIXME: With phonon calcs the original WavePtr is not being reloaded for each series, which produces some funky results.
 
 
 	int ix, iy, i, pCount, result;
-	FILE *avgFp, *fpWave, *fpPos, *fpNBED, *fpTest = 0;
-	double timer, timerTot;
+	FILE *avgFp, *fpWave, *fpPos, *fpNBED;
+	double timer, timerTot, chisq;
 	double probeCenterX, probeCenterY, probeOffsetX, probeOffsetY;
-	char buf[BUF_LEN], avgName[32], systStr[64];
+	char buf[BUF_LEN], avgName[512], systStr[512];
 	real t = 0;
 	real **avgPendelloesung = NULL;
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
 	long iseed = 0;
 	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+	WavePtr incident = WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY));
+	PropagationContextPtr context = PropagationContextPtr(new PropagationContext(&muls, 1, muls.waveThreads));
 	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls.nx, muls.ny, t, muls.resolutionX, muls.resolutionY));
 	std::vector<double> params(2);
+	std::vector<double> ramp;   // phase ramp of probeShiftAndCrop()
 
 	//printf("Debug doNBED: wavefile: %s\n",muls.fileWaveIn);
 
@@ -1743,12 +2033,17 @@ void doNBED()
 	//if( fpWave != NULL ) fclose(fpWave);
 	//printf("Debug doNBED2 \n");
 	// RAM: read-in the entry wave .IMG
-	wave->ReadWave(muls.fileWaveIn);
+	// it is kept in incident and copied to wave at the beginning of every run
+	incident->ReadWave(muls.fileWaveIn);
 
 	//printf("Debug doNBED3 \n");
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
 
+	/* the exit face diffraction pattern is averaged over all runs in memory */
+	sprintf(avgName, "%s/diffAvg.tmp", muls.folder);
+	muls.diffAverage = AccumulatorPtr(new Accumulator(1, muls.nx*muls.ny, muls.avgStoreMB, avgName));
+
 	if (iseed == 0) iseed = -(long)time(NULL);
 
 	if (muls.lbeams) {
@@ -1789,8 +2084,8 @@ void doNBED()
 		// RAM: This is where I need to remove the existing STEM probe and in the future add some circular shift and crop?
 		// RAM: made a new function in stemlib, probeShiftAndCrop(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY)
 		// probe(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY);
-		probeShiftAndCrop(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY, muls.nx, muls.ny);
-		// RAM: function is empty for now (returns wave)
+		memcpy(wave->wave[0], incident->wave[0], (size_t)muls.nx*muls.ny*sizeof(wave->wave[0][0]));
+		probeShiftAndCrop(&muls, wave, muls.scanXStart - muls.potOffsetX, muls.scanYStart - muls.potOffsetY, muls.nx, muls.ny, ramp);
 
 		if (muls.saveLevel > 2) 
 		{
@@ -1892,7 +2187,7 @@ void doNBED()
 
 				timer = cputim();
 				// what probe should runMulsSTEM use here?
-				runMulsSTEM(&muls, wave);
+				runMulsSTEM(&muls, context, wave);
 
 				printf("Thickness: %gA, int.=%g, time: %gsec\n",
 					wave->thickness, wave->intIntensity, cputim() - timer);
@@ -1912,35 +2207,25 @@ void doNBED()
 		}
 		/*    printf("Total CPU time = %f sec.\n", cputim()-timerTot ); */
 
-		sprintf(avgName, "%s/diff.img", muls.folder);
-		// TODO: Why are we reading in a DP at this point?  Do we have one yet?  
-		//     What happens if it isn't there?
-		// RAM: Assume these are Michael's comments above, this crashes because the diffraction pattern isn't there yet.  Provide if/else fix
-		fpTest = fopen( avgName, "rb" );
-		if ( fpTest != NULL )
-		{
-			printf( "DEBUG doNBED: Found filename %s \n", avgName );
-			fclose( fpTest ); // close file handle before opening it again in data_container.cpp
-			wave->ReadDiffPat( avgName );
-		}
-		else
-		{
-			printf( "DEBUG doNBED: Did not find filename %s \n", avgName );
-			wave->WriteDiffPat( avgName, "DEBUG Wave intensity" );
-		}
-			//fpWave = fopen(muls.fileWaveIn, "r+");
-			//printf("Debug doNBED1 \n");
-			//if( fpWave != NULL ) fclose(fpWave);
+		/* add this run's diffraction pattern to its frozen phonon average */
+		chisq = muls.diffAverage->Add(0, wave->diffpat[0]);
+		if (muls.avgCount > 0)
+			muls.chisq[muls.avgCount - 1] = chisq / (double)(muls.nx*muls.ny);
 
-		
+		muls.storeSeries = 1;
+		if (muls.saveLevel == 0)	muls.storeSeries = 0;
+		else if (muls.avgCount % muls.saveLevel != 0) muls.storeSeries = 0;
 
-		if (muls.avgCount == 0) {
-			memcpy((void *)wave->avgArray[0], (void *)wave->diffpat[0],
-				(size_t)(muls.nx*muls.ny*sizeof(float_tt)));
-			/* move the averaged (raw data) file to the target directory as well */
+		/* only write the intermediate averages which are part of the series, and the final one */
+		if ((muls.storeSeries) || (muls.avgCount == muls.avgRuns - 1)) {
+			muls.diffAverage->GetMean(0, wave->avgArray[0]);
 			sprintf(avgName, "%s/diffAvg_%d.img", muls.folder, muls.avgCount + 1);
-			sprintf(systStr, "mv %s/diff.img %s", muls.folder, avgName);
-			system(systStr);
+			params[0] = muls.tomoTilt;
+			params[1] = 1.0 / wavelength(muls.v0);
+			wave->WriteAvgArray(avgName, "Averaged Diffraction pattern, unit: 1/A", params);
+		}
+
+		if (muls.avgCount == 0) {
 			if (muls.lbeams) {
 				for (iy = 0; iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv; iy++) {
 					for (ix = 0; ix<muls.nbout; ix++) {
@@ -1950,31 +2235,6 @@ void doNBED()
 			}
 		} // of if muls.avgCount == 0 ...
 		else {
-			muls.chisq[muls.avgCount - 1] = 0.0;
-			for (ix = 0; ix<muls.nx; ix++) for (iy = 0; iy<muls.ny; iy++) {
-				t = ((real)muls.avgCount*wave->avgArray[ix][iy] +
-					wave->diffpat[ix][iy]) / ((real)(muls.avgCount + 1));
-				muls.chisq[muls.avgCount - 1] += (wave->avgArray[ix][iy] - t)*(wave->avgArray[ix][iy] - t);
-				wave->avgArray[ix][iy] = t;
-
-			}
-			muls.chisq[muls.avgCount - 1] = muls.chisq[muls.avgCount - 1] / (double)(muls.nx*muls.ny);
-			sprintf(avgName, "%s/diffAvg_%d.img", muls.folder, muls.avgCount + 1);
-			params[0] = muls.tomoTilt;
-			params[1] = 1.0 / wavelength(muls.v0);
-			wave->WriteAvgArray(avgName, "Averaged Diffraction pattern, unit: 1/A", params);
-
-			muls.storeSeries = 1;
-			if (muls.saveLevel == 0)	muls.storeSeries = 0;
-			else if (muls.avgCount % muls.saveLevel != 0) muls.storeSeries = 0;
-
-			if (muls.storeSeries == 0) {
-				// printf("Removing old file \n");
-				sprintf(avgName, "%s/diffAvg_%d.img", muls.folder, muls.avgCount);
-				sprintf(systStr, "rm %s", avgName);
-				system(systStr);
-			}
-
 			/* write the data to a file */
 			if (muls.saveFlag >-1) {
 				sprintf(systStr, "%s/avgresults.dat", muls.folder);
@@ -2046,22 +2306,29 @@ void doNBED()
 ***********************************************************************/
 
 void doCBED() {
-	int ix,iy,i,pCount,result;
-	FILE *avgFp, *fpCBED, *fpPos = 0, *fpTest = 0;
-	double timer,timerTot;
+	int ix,iy,i,it,pCount,result,tCount;
+	FILE *avgFp, *fpCBED, *fpPos = 0;
+	double timer,timerTot,chisq=0;
 	double probeCenterX,probeCenterY,probeOffsetX,probeOffsetY;
-	char buf[BUF_LEN],avgName[32],systStr[64];
+	char buf[BUF_LEN],avgName[512],systStr[512];
 	real t=0;
 	real **avgPendelloesung = NULL;
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
 	long iseed=0;
 	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx,muls.ny, muls.resolutionX, muls.resolutionY));
+	PropagationContextPtr context = PropagationContextPtr(new PropagationContext(&muls, 1, muls.waveThreads));
 	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls.nx, muls.ny, t, muls.resolutionX, muls.resolutionY));
 	std::vector<double> params(2);
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
 
+	/* one diffraction pattern per output thickness, averaged over all runs in memory */
+	tCount = (int)(ceil((double)((muls.slices * muls.cellDiv) / muls.outputInterval)));
+	muls.diffpatSeries = float3D(tCount+1,muls.nx,muls.ny,"diffpatSeries");
+	sprintf(avgName,"%s/diffAvg.tmp",muls.folder);
+	muls.diffAverage = AccumulatorPtr(new Accumulator(tCount+1,muls.nx*muls.ny,muls.avgStoreMB,avgName));
+
 	if (iseed == 0) iseed = -(long) time( NULL );
 
 	if (muls.lbeams) {
@@ -2201,7 +2468,7 @@ void doCBED() {
 
 				timer = cputim();
 				// what probe should runMulsSTEM use here?
-				runMulsSTEM(&muls,wave); 
+				runMulsSTEM(&muls,context,wave); 
 
 				printf("Thickness: %gA, int.=%g, time: %gsec\n",
 					wave->thickness,wave->intIntensity,cputim()-timer);
@@ -2221,32 +2488,37 @@ void doCBED() {
 		}
 		/*    printf("Total CPU time = %f sec.\n", cputim()-timerTot ); */
 
-		sprintf(avgName,"%s/diff.img",muls.folder);
-		// TODO: Why are we reading in a DP at this point?  Do we have one yet?  
-		//     What happens if it isn't there?
-		// RAM: fix to CBED code as well.  In the future doCBED and doNBED should be merged (pending C++ refactor)
-		fpTest = fopen(avgName, "rb");
-		if (fpTest != NULL)
-		{
-			printf("DEBUG doCBED: Found filename %s \n", avgName);
-			fclose(fpTest); // close file handle before opening it again in data_container.cpp
-			wave->ReadDiffPat(avgName);
+		/* add this run's diffraction patterns to their frozen phonon averages.
+		 * collectIntensity() has left the pattern of every output thickness
+		 * in muls.diffpatSeries, the last one belongs to the exit face.
+		 */
+		for (it=0;it<=tCount;it++)
+			chisq = muls.diffAverage->Add(it,muls.diffpatSeries[it][0]);
+		if (muls.avgCount > 0)
+			muls.chisq[muls.avgCount-1] = chisq/(double)(muls.nx*muls.ny);
+
+		muls.storeSeries = 1;
+		if (muls.saveLevel == 0)	muls.storeSeries = 0;
+		else if (muls.avgCount % muls.saveLevel != 0) muls.storeSeries = 0;
+
+		/* only write the intermediate averages which are part of the series, and the final one */
+		if ((muls.storeSeries) || (muls.avgCount == muls.avgRuns-1)) {
+			muls.diffAverage->GetMean(tCount,wave->avgArray[0]);
+			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
+			params[0] = muls.tomoTilt;
+			params[1] = 1.0/wavelength(muls.v0);
+			wave->WriteAvgArray(avgName,"Averaged Diffraction pattern, unit: 1/A",params);
 		}
-		else
-		{
-			printf("DEBUG doCBED: Did not find filename %s \n", avgName);
-			wave->WriteDiffPat(avgName, "DEBUG Wave intensity");
+		/* the averages for the intermediate thicknesses are written once, at the end */
+		if ((muls.saveLevel > 0) && (muls.avgCount == muls.avgRuns-1)) {
+			for (it=0;it<=tCount;it++) {
+				muls.diffAverage->GetMean(it,wave->avgArray[0]);
+				sprintf(avgName,"%s/diff_%d.img",muls.folder,it);
+				wave->WriteAvgArray(avgName);
+			}
 		}
-		// RAM: old code
-		//wave->ReadDiffPat(avgName);
 
 		if (muls.avgCount == 0) {
-			memcpy((void *)wave->avgArray[0],(void *)wave->diffpat[0],
-				(size_t)(muls.nx*muls.ny*sizeof(float_tt)));
-			/* move the averaged (raw data) file to the target directory as well */
-			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
-			sprintf(systStr,"mv %s/diff.img %s",muls.folder,avgName);
-			system(systStr);
 			if (muls.lbeams) {
 				for (iy=0;iy<muls.slices*muls.mulsRepeat1*muls.mulsRepeat2*muls.cellDiv;iy++) {
 					for (ix=0;ix<muls.nbout;ix++) {
@@ -2256,31 +2528,6 @@ void doCBED() {
 			}
 		} // of if muls.avgCount == 0 ...
 		else {
-			muls.chisq[muls.avgCount-1] = 0.0;
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				t = ((real)muls.avgCount*wave->avgArray[ix][iy]+
-					wave->diffpat[ix][iy])/((real)(muls.avgCount+1));
-				muls.chisq[muls.avgCount-1] += (wave->avgArray[ix][iy]-t)*(wave->avgArray[ix][iy]-t);
-				wave->avgArray[ix][iy] = t;
-
-			}
-			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
-			params[0] = muls.tomoTilt;
-			params[1] = 1.0/wavelength(muls.v0);
-			wave->WriteAvgArray(avgName,"Averaged Diffraction pattern, unit: 1/A",params);
-
-			muls.storeSeries = 1;
-			if (muls.saveLevel == 0)	muls.storeSeries = 0;
-			else if (muls.avgCount % muls.saveLevel != 0) muls.storeSeries = 0;
-
-			if (muls.storeSeries == 0) {
-				// printf("Removing old file \n");
-				sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount);
-				sprintf(systStr,"rm %s",avgName);
-				system(systStr);
-			}
-
 			/* write the data to a file */
 			if (muls.saveFlag >-1) {
 				sprintf(systStr,"%s/avgresults.dat",muls.folder);
@@ -2355,23 +2602,31 @@ void doTEM() {
 	const double pi=3.1415926535897;
 	int ix,iy,i,pCount,result;
 	FILE *avgFp,*fpTEM; // *fpPos=0;
-	double timer,timerTot;
+	double timer,timerTot,chisq;
 	double x,y,ktx,kty;
 	char buf[BUF_LEN],avgName[256],systStr[512];
 	char *comment;
-	real t;
 	real **avgPendelloesung = NULL;
 	int oldMulsRepeat1 = 1;
 	int oldMulsRepeat2 = 1;
 	long iseed=0;
 	std::vector<double> params;
 	WavePtr wave = WavePtr(new WAVEFUNC(muls.nx,muls.ny,muls.resolutionX,muls.resolutionY));
+	PropagationContextPtr context = PropagationContextPtr(new PropagationContext(&muls, 1, muls.waveThreads));
+#if FLOAT_PRECISION == 1
 	fftwf_complex **imageWave = NULL;
+#else
+	fftw_complex **imageWave = NULL;
+#endif
 
 	if (iseed == 0) iseed = -(long) time( NULL );
 
 	muls.chisq=std::vector<double>(muls.avgRuns);
 
+	/* diffraction pattern (0) and image intensity (1), averaged over all runs in memory */
+	sprintf(avgName,"%s/diffAvg.tmp",muls.folder);
+	muls.diffAverage = AccumulatorPtr(new Accumulator(2,muls.nx*muls.ny,muls.avgStoreMB,avgName));
+
 	if (muls.lbeams) {
 		muls.pendelloesung = NULL;
 		if (avgPendelloesung == NULL) {
@@ -2482,7 +2737,7 @@ void doTEM() {
 				}
 
 				timer = cputim();
-				runMulsSTEM(&muls,wave); 
+				runMulsSTEM(&muls,context,wave); 
 				muls.totalSliceCount += muls.slices;
 
 				if (muls.printLevel > 0) {
@@ -2542,25 +2797,11 @@ void doTEM() {
 		// and diffraction patterns.
 		//////////////////////////////////////////////////////////////////////////////
 
-		sprintf(avgName,"%s/diff.img",muls.folder);
-
-		wave->ReadDiffPat(avgName);
+		/* collectIntensity() has left the exit face diffraction pattern in 
+		 * wave->diffpat, add it to its frozen phonon average */
+		chisq = muls.diffAverage->Add(0,wave->diffpat[0]);
 
 		if (muls.avgCount == 0) {
-			/***********************************************************
-			* Save the diffraction pattern
-			**********************************************************/	
-			memcpy((void *)wave->avgArray[0],(void *)wave->diffpat[0],(size_t)(muls.nx*muls.ny*sizeof(real)));
-			/* move the averaged (raw data) file to the target directory as well */
-#ifndef WIN32
-			sprintf(avgName,"diffAvg_%d.img",muls.avgCount+1);
-			sprintf(systStr,"mv %s/diff.img %s/%s",muls.folder,muls.folder,avgName);
-			system(systStr);
-#else
-			sprintf(avgName,"diffAvg_%d.img",muls.avgCount+1);
-			sprintf(systStr,"move %s\\diff.img %s/%s",muls.folder,muls.folder,avgName);
-			// system(systStr);
-#endif
 			/***********************************************************
 			* Save the Pendelloesung Plot
 			**********************************************************/	
@@ -2571,44 +2812,9 @@ void doTEM() {
 					}
 				}
 			}
-			/***********************************************************
-			* Save the defocused image, we can do with the wave what 
-			* we want, since it is not used after this anymore. 
-			* We will therefore multiply with the transfer function for
-			* all the different defoci, inverse FFT and save each image.
-			* diffArray will be overwritten with the image.
-			**********************************************************/ 
-			if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
-			// multiply wave (in rec. space) with transfer function and write result to imagewave
-			fftwf_execute(wave->fftPlanWaveForw);
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				// here, we apply the CTF:
-				imageWave[ix][iy][0] = wave->wave[ix][iy][0];
-				imageWave[ix][iy][1] = wave->wave[ix][iy][1];
-			}
-			fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-			// get the amplitude squared:
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				wave->diffpat[ix][iy] = imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1];
-			}
-			sprintf(avgName,"%s/waveIntensity.img",muls.folder);
-			wave->WriteDiffPat(avgName, "Wave intensity");
-			// End of Image writing (if avgCount = 0)
-			//////////////////////////////////////////////////////////////////////
-
 		} // of if muls.avgCount == 0 ...
 		else {
-			/* 	 readRealImage_old(avgArray,muls.nx,muls.ny,&t,"diffAvg.img"); */
-			muls.chisq[muls.avgCount-1] = 0.0;
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				t = ((real)muls.avgCount*wave->avgArray[ix][iy]+
-					wave->diffpat[ix][iy])/((real)(muls.avgCount+1));
-				muls.chisq[muls.avgCount-1] += (wave->avgArray[ix][iy]-t)*(wave->avgArray[ix][iy]-t);
-				wave->avgArray[ix][iy] = t;
-			}
-			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
-			wave->WriteAvgArray(avgName, "Diffraction pattern");
+			muls.chisq[muls.avgCount-1] = chisq/(double)(muls.nx*muls.ny);
 
 			/* write the data to a file */
 			if ((avgFp = fopen("avgresults.dat","w")) == NULL )
@@ -2633,44 +2839,49 @@ void doTEM() {
 					}
 				}
 			}
-			/***********************************************************
-			* Save the defocused image, we can do with the wave what 
-			* we want, since it is not used after this anymore. 
-			* We will therefore multiply with the transfer function for
-			* all the different defoci, inverse FFT and save each image.
-			* diffArray will be overwritten with the image.
-			**********************************************************/ 
-			if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
-			// multiply wave (in rec. space) with transfer function and write result to imagewave
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveForw);
-#elif FLOAT_PRECISION == 2
-			fftw_execute(wave->fftPlanWaveForw);
-#endif
+		} /* else ... if avgCount was greater than 0 */
 
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				imageWave[ix][iy][0] = wave->wave[ix][iy][0];
-				imageWave[ix][iy][1] = wave->wave[ix][iy][1];
-			}
+		/***********************************************************
+		* Make the image, we can do with the wave what 
+		* we want, since it is not used after this anymore. 
+		* diffpat will be overwritten with the image.
+		**********************************************************/ 
 #if FLOAT_PRECISION == 1
-			fftwf_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
-#elif FLOAT_PRECISION == 2
-			fftw_execute_dft(wave->fftPlanWaveInv,imageWave[0],imageWave[0]);
+		if (imageWave == NULL) imageWave = complex2Df(muls.nx,muls.ny,"imageWave");
+#else
+		if (imageWave == NULL) imageWave = complex2D(muls.nx,muls.ny,"imageWave");
 #endif
+		// multiply wave (in rec. space) with transfer function and write result to imagewave
+		wave->fftPlanWaveForw->Execute(wave->wave[0]);
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			// here, we apply the CTF:
+			imageWave[ix][iy][0] = wave->wave[ix][iy][0];
+			imageWave[ix][iy][1] = wave->wave[ix][iy][1];
+		}
+		wave->fftPlanWaveInv->Execute(imageWave[0]);
+		// get the amplitude squared:
+		for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
+			wave->diffpat[ix][iy] = imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1];
+		}
+		muls.diffAverage->Add(1,wave->diffpat[0]);
+		if (muls.avgCount == 0) {
+			sprintf(avgName,"%s/waveIntensity.img",muls.folder);
+			wave->WriteDiffPat(avgName, "Wave intensity");
+		}
 
-			// save the amplitude squared:
-			sprintf(avgName,"%s/image.img",muls.folder); 
-			wave->ReadDiffPat(avgName);
-			for (ix=0;ix<muls.nx;ix++) for (iy=0;iy<muls.ny;iy++) {
-				t = ((real)muls.avgCount*wave->diffpat[ix][iy]+
-					imageWave[ix][iy][0]*imageWave[ix][iy][0]+imageWave[ix][iy][1]*imageWave[ix][iy][1])/(real)(muls.avgCount+1);
-				wave->diffpat[ix][iy] = t;
+		/***********************************************************
+		* The averages are written only once, after the last run
+		**********************************************************/ 
+		if (muls.avgCount == muls.avgRuns-1) {
+			muls.diffAverage->GetMean(0,wave->avgArray[0]);
+			sprintf(avgName,"%s/diffAvg_%d.img",muls.folder,muls.avgCount+1);
+			wave->WriteAvgArray(avgName, "Diffraction pattern");
+			if (muls.avgCount > 0) {
+				muls.diffAverage->GetMean(1,wave->diffpat[0]);
+				sprintf(avgName,"%s/image.img",muls.folder); 
+				wave->WriteDiffPat(avgName, "Image intensity");
 			}
-			wave->WriteDiffPat(avgName, "Image intensity");
-			// End of Image writing (if avgCount > 0)
-			//////////////////////////////////////////////////////////////////////
-
-		} /* else ... if avgCount was greater than 0 */
+		}
 
 
 		/////////////////////////////////////////////////////
@@ -2719,35 +2930,102 @@ void doTEM() {
 *
 ***********************************************************************/
 
+/* asks a memory mapped muls.transStore for the strips, which the
+ * given scan positions (numbered as in doSTEM) will need */
+static void prefetchTrans(std::vector<int> &positions, int nTileY) {
+	int k, ix, iPosX, rowMin, rowMax;
+
+	if ((muls.transStore == NULL) || !muls.transStore->Mapped() || positions.empty()) return;
+	rowMin = muls.potNx;
+	rowMax = 0;
+	for (k=0; k<(int)positions.size(); k++) {
+		ix = muls.tileXStart + positions[k] / nTileY;
+		iPosX = (int)floor(ix*(muls.scanXStop-muls.scanXStart)/((double)muls.scanXN*muls.resolutionX)+1e-4);
+		if (iPosX > muls.potNx-muls.nx) iPosX = muls.potNx-muls.nx;
+		if (iPosX < rowMin) rowMin = iPosX;
+		if (iPosX > rowMax) rowMax = iPosX;
+	}
+	muls.transStore->Prefetch(rowMin, rowMax-rowMin+muls.nx);
+}
+
 void doSTEM() {
-	int ix=0,iy=0,i,pCount,picts,ixa,iya,totalRuns;
+	int ix=0,iy=0,i,k,t,nBatch,pCount,picts,totalRuns,firstRun=0;
+	int nTileX,nTileY,completePixels;
 	double timer, total_time=0;
 	char buf[BUF_LEN];
-	real t;
-	static real **avgArray=NULL;
-	double collectedIntensity;
+	double collectedIntensity, chisq, posX, posY;
 
-	std::vector<WavePtr> waves;
+	std::vector<std::vector<WavePtr> > waves;
+	std::vector<WavePtr> *batchWaves;
+	std::vector<PropagationContextPtr> contexts;
+	PropagationContextPtr context;
+	std::vector<int> positions, upcoming;
 	WavePtr wave;
-
-	//pre-allocate several waves (enough for one row of the scan.  
+	WaveStorePtr waveStore;
+	ScanSchedulerPtr scheduler;
+	STEMCheckpointPtr checkpoint;
+	ProbeCachePtr probeCache = ProbeCachePtr(new ProbeCache(&muls));
+	SMatrixPtr sMatrix;
+
+	//pre-allocate a batch of waves and a propagation context for each thread.  
+	//    The threads only write to these (and their own pixels of the detectors), not to muls.
 	for (int th=0; th<omp_get_max_threads(); th++)
 	{
-		waves.push_back(WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY)));
-	}
+		waves.push_back(std::vector<WavePtr>());
+		for (k=0; k<muls.probeBatch; k++)
+			waves[th].push_back(WavePtr(new WAVEFUNC(muls.nx, muls.ny, muls.resolutionX, muls.resolutionY)));
+		contexts.push_back(PropagationContextPtr(new PropagationContext(&muls, muls.probeBatch)));
+	}
+	/* PRISM: the plane waves of the S-matrix are propagated instead of the probes */
+	if (muls.prism) {
+		sMatrix = SMatrixPtr(new SMatrix(&muls, muls.prismFx, muls.prismFy));
+		if (muls.printLevel > 1)
+			printf("S-matrix: %d beams, interpolation %d x %d (%d MB)\n",sMatrix->Beams(),
+				sMatrix->FactorX(),sMatrix->FactorY(),(int)(sMatrix->Bytes() >> 20));
+	}
+	/* this process computes the positions (tileXStart..tileXStop-1, tileYStart..tileYStop-1),
+	 * which is the whole scan, unless we run in tile mode.  Position i within the tile 
+	 * is ix = tileXStart+i/nTileY, iy = tileYStart+i%nTileY */
+	nTileX = muls.tileXStop-muls.tileXStart;
+	nTileY = muls.tileYStop-muls.tileYStart;
+	scheduler = ScanSchedulerPtr(new ScanScheduler(nTileX, nTileY, muls.scanOrder, 
+		muls.scanTileSize, omp_get_max_threads()));
 
 	muls.chisq = std::vector<double>(muls.avgRuns);
 	totalRuns = muls.avgRuns;
 	timer = cputim();
 
+	/* the diffraction patterns of all scan positions are averaged in memory
+	 * and only written once, after the last run */
+	if (muls.saveLevel > 0) {
+		sprintf(buf,"%s/diffAvg_%d.tmp",muls.folder,muls.tile);
+		muls.diffAverage = AccumulatorPtr(new Accumulator(nTileX*nTileY, muls.nx*muls.ny,
+			muls.avgStoreMB, buf));
+	}
+
+	/* continue from the last checkpoint, if there is one */
+	if (muls.checkpointInterval > 0) {
+		sprintf(buf,"%s/stem_checkpoint_%d.dat",muls.folder,muls.tile);
+		checkpoint = STEMCheckpointPtr(new STEMCheckpoint(buf, &muls, muls.checkpointInterval));
+		firstRun = checkpoint->Restore(&muls);
+	}
+
 	/* average over several runs of for TDS */
 	displayProgress(-1);
 
-	for (muls.avgCount = 0;muls.avgCount < totalRuns; muls.avgCount++) {
+	for (muls.avgCount = firstRun;muls.avgCount < totalRuns; muls.avgCount++) {
 		total_time = 0;
 		collectedIntensity = 0;
+		for (k=0; k<(int)contexts.size(); k++)
+			contexts[k]->intensity = contexts[k]->chisq = 0;
 		muls.totalSliceCount = 0;
 		muls.dE_E = muls.dE_EArray[muls.avgCount];
+		/* the incident probe only depends on dE_E and the aberrations,
+		 * so it is computed once per run and copied to every position */
+		if (sMatrix != NULL) sMatrix->Update(&muls);
+		else probeCache->Update(&muls);
+		// remember where this configuration starts (images, random numbers)
+		if (checkpoint != NULL) checkpoint->BeginRun(&muls);
 
 
 		/****************************************
@@ -2792,6 +3070,16 @@ void doSTEM() {
 			}
 			picts *= muls.cellDiv;
 
+			/* exit waves are kept in memory (or the spill file) between slabs */
+			if ((picts > 1) && (waveStore == NULL) && (sMatrix == NULL)) {
+				sprintf(buf,"%s/mulswav_%d.tmp",muls.folder,muls.tile);
+				waveStore = WaveStorePtr(new WaveStore(muls.nx, muls.ny, nTileX*nTileY,
+					muls.waveStoreMB, buf));
+				if (muls.printLevel > 1)
+					printf("Keeping %d of %d exit waves in memory\n",waveStore->RamPositions(),
+						nTileX*nTileY);
+			}
+
 			if (muls.equalDivs) {
 				make3DSlices(&muls, muls.slices, muls.atomPosFile, NULL);
 				initSTEMSlices(&muls, muls.slices);
@@ -2811,138 +3099,181 @@ void doSTEM() {
 					timer = cputim();
 				}
 
-				muls.complete_pixels=0;
+				/* PRISM: the S-matrix goes through every slab, but the probes 
+				 * are only put together from it at the exit surface */
+				if (sMatrix != NULL) {
+					if (pCount == 0) sMatrix->Reset();
+					sMatrix->Propagate(&muls);
+					if (pCount < picts-1) {
+						muls.totalSliceCount += muls.slices;
+						continue;
+					}
+				}
+
+				/* the fftw planner is not thread safe, so the contexts plan their 
+				 * FFTs here, and runMulsSTEM() finds them up to date */
+				for (k=0; k<(int)contexts.size(); k++)
+					contexts[k]->Update(&muls);
+
+				completePixels=0;
+				/* runMulsSTEM will only write the exit waves to files 
+				   if saveLevel > 1, but we need to define the file names */
+				muls.saveFlag = 1;
+				scheduler->Reset();
 				/**************************************************
 				* scan through the different probe positions
 				*************************************************/
 				// default(none) forces us to specify all of the variables that are used in the parallel section.  
 				//    Otherwise, they are implicitly shared (and this was cause of several bugs.)
+				// the scheduler hands out (up to) muls.probeBatch neighbouring positions at a time
 #pragma omp parallel \
-	private(ix, iy, ixa, iya, wave, t, timer) \
-	shared(pCount, picts, muls, collectedIntensity, total_time, waves) \
+	private(ix, iy, i, k, nBatch, wave, batchWaves, context, positions, upcoming, chisq, timer, posX, posY) \
+	shared(pCount, picts, muls, total_time, waves, contexts, scheduler, waveStore, totalRuns, nTileX, nTileY, checkpoint, probeCache, sMatrix, completePixels) \
 	default(none)
-#pragma omp for
-				for (i=0; i < (muls.scanXN * muls.scanYN); i++)
+				while (scheduler->Next(omp_get_thread_num(), positions, muls.probeBatch))
 				{
+					// skip the positions which had been finished before a restart
+					if (checkpoint != NULL) {
+						for (k=(int)positions.size()-1; k>=0; k--)
+							if (checkpoint->IsDone(positions[k])) positions.erase(positions.begin()+k);
+						if (positions.empty()) continue;
+					}
+					// the part of trans which this thread will need after this batch
+					if ((sMatrix == NULL) && scheduler->Peek(omp_get_thread_num(), upcoming, muls.probeBatch))
+						prefetchTrans(upcoming, nTileY);
 					timer=cputim();
-					ix = i / muls.scanYN;
-					iy = i % muls.scanYN;
-
-					wave = waves[omp_get_thread_num()];
-							
-					//printf("Scanning: %d %d %d %d\n",ix,iy,pCount,muls.nx);
+					batchWaves = &waves[omp_get_thread_num()];
+					context = contexts[omp_get_thread_num()];
+					nBatch = (int)positions.size();
 
-					/* if this is run=0, create the inc. probe wave function */
-					if (pCount == 0) 
+					for (k=0; k<nBatch; k++)
 					{
-						probe(&muls, wave, muls.nx/2*muls.resolutionX, muls.ny/2*muls.resolutionY);
+						i = positions[k];
+						ix = muls.tileXStart + i / nTileY;
+						iy = muls.tileYStart + i % nTileY;
+						wave = (*batchWaves)[k];
+							
+						//printf("Scanning: %d %d %d %d\n",ix,iy,pCount,muls.nx);
+
+						/* position of the probe in pixels of the potential.  The integer part
+						 * is the offset of the probe array in trans, the rest is applied to 
+						 * the incident probe as a phase ramp, so that the scan step does not 
+						 * have to be a multiple of the potential sampling. */
+						posX = ix*(muls.scanXStop-muls.scanXStart)/((double)muls.scanXN*muls.resolutionX);
+						posY = iy*(muls.scanYStop-muls.scanYStart)/((double)muls.scanYN*muls.resolutionY);
+						// whole pixels, apart from rounding errors, need no phase ramp
+						if (fabs(posX-floor(posX+0.5)) < 1e-4) posX = floor(posX+0.5);
+						if (fabs(posY-floor(posY+0.5)) < 1e-4) posY = floor(posY+0.5);
+						wave->iPosX = (int)floor(posX);
+						wave->iPosY = (int)floor(posY);
+						if (wave->iPosX > muls.potNx-muls.nx)
+						{
+							wave->iPosX = muls.potNx-muls.nx;  
+						}
+						if (wave->iPosY > muls.potNy-muls.ny)
+						{
+							wave->iPosY = muls.potNy-muls.ny;
+						}
+						// what is left is the offset of the probe from the center of its array
+						posX -= wave->iPosX;
+						posY -= wave->iPosY;
+
+						/* PRISM: the exit wave is a sum of the beams of the S-matrix */
+						if (sMatrix != NULL)
+							sMatrix->Synthesize(&muls, wave, (muls.nx/2+posX)*muls.resolutionX, 
+								(muls.ny/2+posY)*muls.resolutionY);
+						/* if this is run=0, create the inc. probe wave function */
+						else if (pCount == 0) 
+						{
+							probeCache->Get(&muls, wave, (muls.nx/2+posX)*muls.resolutionX, 
+								(muls.ny/2+posY)*muls.resolutionY, context->shiftRamp);
 
-						// TODO: modifying shared value from multiple threads?
-						//muls.nslic0 = 0;
-						//wave->thickness = 0.0;
-					}
+							// TODO: modifying shared value from multiple threads?
+							//muls.nslic0 = 0;
+							//wave->thickness = 0.0;
+						}
                                           
-					else 
-					{
-						/* load incident wave function and then propagate it */
-						sprintf(wave->fileStart, "%s/mulswav_%d_%d.img", muls.folder, ix, iy);
-						readStartWave(wave);  /* this also sets the thickness!!! */
-						// TODO: modifying shared value from multiple threads?
-						//muls.nslic0 = pCount;
-					}
-					/* run multislice algorithm
-					   and save exit wave function for this position 
-					   (done by runMulsSTEM), 
-					   but we need to define the file name */
-					sprintf(wave->fileout,"%s/mulswav_%d_%d.img",muls.folder,ix,iy);
-					muls.saveFlag = 1;
-
-					wave->iPosX =(int)(ix*(muls.scanXStop-muls.scanXStart)/
-									  ((float)muls.scanXN*muls.resolutionX));
-					wave->iPosY = (int)(iy*(muls.scanYStop-muls.scanYStart)/
-									   ((float)muls.scanYN*muls.resolutionY));
-					if (wave->iPosX > muls.potNx-muls.nx)
-					{
-						wave->iPosX = muls.potNx-muls.nx;  
-					}
-					if (wave->iPosY > muls.potNy-muls.ny)
-					{
-						wave->iPosY = muls.potNy-muls.ny;
-					}
-
-					// MCS - update the probe wavefunction with its position
-					wave->detPosX=ix;
-					wave->detPosY=iy;
-
-					runMulsSTEM(&muls,wave); 
-
+						else 
+						{
+							/* load incident wave function and then propagate it */
+							waveStore->Load(i, wave);  /* this also sets the thickness!!! */
+							// TODO: modifying shared value from multiple threads?
+							//muls.nslic0 = pCount;
+						}
+						sprintf(wave->fileout,"%s/mulswav_%d_%d.img",muls.folder,ix,iy);
 
-					/***************************************************************
-					* In order to save some disk space we will add the diffraction 
-					* patterns to their averages now.  The diffraction pattern 
-					* should be stored in wave->diffpat (which each thread has independently), 
-					* if collectIntensity() has been executed correctly.
-					***************************************************************/
+						// MCS - update the probe wavefunction with its position
+						wave->detPosX=ix;
+						wave->detPosY=iy;
+					}
 
-					#pragma omp atomic
-					collectedIntensity += wave->intIntensity;
+					if (sMatrix != NULL) {
+						for (k=0; k<nBatch; k++)
+							collectPRISM(&muls, context, (*batchWaves)[k]);
+					}
+					else if (muls.probeBatch > 1)
+						runMulsSTEMBatch(&muls, context, *batchWaves, nBatch);
+					else
+						runMulsSTEM(&muls, context, (*batchWaves)[0]); 
 
-					if (pCount == picts-1)  /* if this is the last slice ... */
+					for (k=0; k<nBatch; k++)
 					{
-						sprintf(wave->avgName,"%s/diffAvg_%d_%d.img",muls.folder,ix,iy);
-						// printf("Will copy to avgArray %d %d (%d, %d)\n",muls.nx, muls.ny,(int)(muls.diffpat),(int)avgArray);	
-
-						if (muls.saveLevel > 0) 
+						i = positions[k];
+						ix = muls.tileXStart + i / nTileY;
+						iy = muls.tileYStart + i % nTileY;
+						wave = (*batchWaves)[k];
+
+						/* keep the exit wave for the next slab */
+						if (pCount < picts-1)
+							waveStore->Save(i, wave);
+
+						/***************************************************************
+						* In order to save some disk space we will add the diffraction 
+						* patterns to their averages now.  The diffraction pattern 
+						* should be stored in wave->diffpat (which each thread has independently), 
+						* if collectIntensity() has been executed correctly.
+						***************************************************************/
+
+						// every thread adds up its own positions, the totals are formed after the scan
+						context->intensity += wave->intIntensity;
+
+						if (pCount == picts-1)  /* if this is the last slice ... */
 						{
-							if (muls.avgCount == 0)  
+							if (muls.saveLevel > 0) 
 							{
-								// initialize the avgArray from the diffpat
-								for (ixa=0;ixa<muls.nx;ixa++) 
+								chisq = muls.diffAverage->Add(i, wave->diffpat[0]);
+								if (muls.avgCount>1)
+									context->chisq += chisq;
+								if (muls.avgCount == totalRuns-1)
 								{
-									for (iya=0;iya<muls.ny;iya++)
-									{
-										wave->avgArray[ixa][iya]=wave->diffpat[ixa][iya];
-									}
+									sprintf(wave->avgName,"%s/diffAvg_%d_%d.img",muls.folder,ix,iy);
+									muls.diffAverage->GetMean(i, wave->avgArray[0]);
+									wave->WriteAvgArray(wave->avgName);
 								}
-							}
-							else 
-							{
-								// printf("Will read image %d %d\n",muls.nx, muls.ny);	
-								wave->ReadAvgArray(wave->avgName);
-								for (ixa=0;ixa<muls.nx;ixa++) for (iya=0;iya<muls.ny;iya++) {
-									t = ((real)muls.avgCount * wave->avgArray[ixa][iya] +
-										wave->diffpat[ixa][iya]) / ((real)(muls.avgCount + 1));
-									if (muls.avgCount>1)
-									{
-										#pragma omp atomic
-										muls.chisq[muls.avgCount-1] += (wave->avgArray[ixa][iya]-t)*
-											(wave->avgArray[ixa][iya]-t);
-									}
-									wave->avgArray[ixa][iya] = t;
-								}
-							}
-							// Write the array to a file, resize and crop it, 
-							wave->WriteAvgArray(wave->avgName);
 							}	
-							else {
-								if (muls.avgCount > 0)	muls.chisq[muls.avgCount-1] = 0.0;
-							}
-					} /* end of if pCount == picts, i.e. conditional code, if this
-						  * was the last slice
-						  */
-
-					#pragma omp atomic
-					++muls.complete_pixels;
+							/* with a single slab, this pixel is now complete for this run.  
+							 * Otherwise we can only restart at the beginning of a run, 
+							 * because the exit waves between slabs are not saved. */
+							if ((checkpoint != NULL) && (picts == 1))
+								checkpoint->Done(i, &muls, ((muls.saveLevel > 0) && (muls.avgCount > 1)) ? chisq : 0);
+						} /* end of if pCount == picts, i.e. conditional code, if this
+							  * was the last slice
+							  */
 
-					if (muls.displayProgInterval > 0) if ((muls.complete_pixels) % muls.displayProgInterval == 0) 
-					{
 						#pragma omp atomic
-						total_time += cputim()-timer;
-						printf("Pixels complete: (%d/%d), int.=%.3f, avg time per pixel: %.2fsec\n",
-							muls.complete_pixels, muls.scanXN*muls.scanYN, wave->intIntensity,
-							(total_time)/muls.complete_pixels);
-						timer=cputim();
+						++completePixels;
+
+						if (muls.displayProgInterval > 0) if ((completePixels) % muls.displayProgInterval == 0) 
+						{
+							#pragma omp atomic
+							total_time += cputim()-timer;
+							printf("Pixels complete: (%d/%d), int.=%.3f, avg time per pixel: %.2fsec\n",
+								completePixels, nTileX*nTileY, wave->intIntensity,
+								(total_time)/completePixels);
+							timer=cputim();
+						}
 					}
+					if (checkpoint != NULL) checkpoint->Update();
 				} /* end of looping through STEM image pixels */
 				/* save STEM images in img files */
 				saveSTEMImages(&muls);
@@ -2951,12 +3282,24 @@ void doSTEM() {
 		} /* end of  while (readparam("sequence: ",buf,0)) */
 		// printf("Total CPU time = %f sec.\n", cputim()-timerTot ); 
 
+		/* the STEM images now average over one more configuration */
+		for (t=0; t<(int)muls.detectors.size(); t++) for (i=0; i<muls.detectorNum; i++)
+			muls.detectors[t][i]->Navg++;
+
+		/* add up what the threads have collected */
+		for (k=0; k<(int)contexts.size(); k++) {
+			collectedIntensity += contexts[k]->intensity;
+			if (muls.avgCount>1) muls.chisq[muls.avgCount-1] += contexts[k]->chisq;
+		}
+		if ((muls.saveLevel == 0) && (muls.avgCount > 0)) muls.chisq[muls.avgCount-1] = 0.0;
+
 		/*************************************************************/
 		if (muls.avgCount>1)
 			muls.chisq[muls.avgCount-1] = muls.chisq[muls.avgCount-1]/(double)(muls.nx*muls.ny);
-		muls.intIntensity = collectedIntensity/(muls.scanXN*muls.scanYN);
+		muls.intIntensity = collectedIntensity/(nTileX*nTileY);
 		displayProgress(1);
 	} /* end of loop over muls.avgCount */
+	if (checkpoint != NULL) checkpoint->Remove();
 
 }
 
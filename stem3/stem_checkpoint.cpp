@@ -0,0 +1,249 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stem_checkpoint.h"
+
+#define CHECKPOINT_MAGIC "QSTEMCKP"
+#define CHECKPOINT_VERSION 2   // 2: images in double precision
+
+// everything in the file before the state vectors
+typedef struct checkpointHeaderStruct {
+	int version;
+	int ixStart, iyStart, nx, ny;
+	int nPlanes, detectorNum;
+	int avgRuns, avgCount;
+	randomState random;
+} checkpointHeader;
+
+template <class T> static bool writeVector(std::vector<T> &v, FILE *fp) {
+	return v.empty() || (fwrite(&v[0], sizeof(T), v.size(), fp) == v.size());
+}
+
+template <class T> static bool readVector(std::vector<T> &v, FILE *fp) {
+	return v.empty() || (fread(&v[0], sizeof(T), v.size(), fp) == v.size());
+}
+
+STEMCheckpoint::STEMCheckpoint(const char *fileName, MULS *muls, double interval) :
+m_ixStart(muls->tileXStart),
+m_iyStart(muls->tileYStart),
+m_nx(muls->tileXStop-muls->tileXStart),
+m_ny(muls->tileYStop-muls->tileYStart),
+m_nPlanes((int)muls->detectors.size()),
+m_detectorNum(muls->detectorNum),
+m_interval(interval),
+m_resumed(false),
+m_avgCount(0)
+{
+	strncpy(m_fileName, fileName, sizeof(m_fileName)-1);
+	m_fileName[sizeof(m_fileName)-1] = '\0';
+	m_chisq = std::vector<double>(muls->avgRuns, 0.0);
+	m_Navg = std::vector<int>(m_nPlanes*m_detectorNum, 0);
+	m_done = std::vector<unsigned char>((m_nx*m_ny+7)/8, 0);
+	m_images = std::vector<accum_tt>(2*(size_t)m_nx*m_ny*m_nPlanes*m_detectorNum);
+	memset(&m_random, 0, sizeof(m_random));
+	omp_init_lock(&m_lock);
+	omp_init_lock(&m_writeLock);
+	m_lastWrite = omp_get_wtime();
+}
+
+STEMCheckpoint::~STEMCheckpoint()
+{
+	omp_destroy_lock(&m_lock);
+	omp_destroy_lock(&m_writeLock);
+}
+
+// copy image and image2 of all planes and detectors of position pos
+// from muls->detectors to our copy, or back
+void STEMCheckpoint::CopyPixel(int pos, MULS *muls, bool toMuls)
+{
+	int ix = m_ixStart + pos / m_ny;
+	int iy = m_iyStart + pos % m_ny;
+	accum_tt *p = &m_images[2*(size_t)pos*m_nPlanes*m_detectorNum];
+
+	for (int t=0; t<m_nPlanes; t++) for (int i=0; i<m_detectorNum; i++, p+=2) {
+		DetectorPtr det = muls->detectors[t][i];
+		if (toMuls) {
+			det->image[ix][iy]  = p[0];
+			det->image2[ix][iy] = p[1];
+		}
+		else {
+			p[0] = det->image[ix][iy];
+			p[1] = det->image2[ix][iy];
+		}
+	}
+}
+
+// returns the configuration to start with, i.e. 0, if there is no checkpoint
+int STEMCheckpoint::Restore(MULS *muls)
+{
+	checkpointHeader header;
+	char magic[8];
+	int t, i, nDone=0;
+	FILE *fp;
+	bool ok;
+
+	if ((fp = fopen(m_fileName, "rb")) == NULL) return 0;
+	ok = (fread(magic, 1, 8, fp) == 8) && (memcmp(magic, CHECKPOINT_MAGIC, 8) == 0) &&
+		(fread(&header, sizeof(header), 1, fp) == 1) && (header.version == CHECKPOINT_VERSION);
+	if (ok && ((header.ixStart != m_ixStart) || (header.iyStart != m_iyStart) ||
+		(header.nx != m_nx) || (header.ny != m_ny) || (header.nPlanes != m_nPlanes) ||
+		(header.detectorNum != m_detectorNum) || (header.avgRuns != (int)m_chisq.size()))) {
+		printf("Checkpoint %s belongs to a different scan, please remove it\n", m_fileName);
+		exit(0);
+	}
+	ok = ok && readVector(m_chisq, fp) && readVector(m_Navg, fp) && 
+		readVector(m_done, fp) && readVector(m_images, fp);
+	fclose(fp);
+	if (!ok) {
+		printf("Checkpoint %s is damaged, please remove it\n", m_fileName);
+		exit(0);
+	}
+
+	m_avgCount = header.avgCount;
+	m_random = header.random;
+	for (i=0; i<m_nx*m_ny; i++) {
+		CopyPixel(i, muls, true);
+		if (IsDone(i)) nDone++;
+	}
+	for (t=0; t<m_nPlanes; t++) for (i=0; i<m_detectorNum; i++)
+		muls->detectors[t][i]->Navg = m_Navg[t*m_detectorNum+i];
+	muls->chisq = m_chisq;
+	setRandomState(&m_random);
+	m_resumed = true;
+	printf("Resuming from checkpoint %s: run %d, %d of %d positions done\n",
+		m_fileName, m_avgCount+1, nDone, m_nx*m_ny);
+	return m_avgCount;
+}
+
+// Start a new configuration, unless we have just resumed it from a checkpoint.
+// Must be called before the random numbers for this configuration are drawn.
+void STEMCheckpoint::BeginRun(MULS *muls)
+{
+	int t, i;
+
+	if (m_resumed) {
+		m_resumed = false;
+		return;
+	}
+	omp_set_lock(&m_lock);
+	m_avgCount = muls->avgCount;
+	getRandomState(&m_random);
+	m_chisq = muls->chisq;
+	for (t=0; t<m_nPlanes; t++) for (i=0; i<m_detectorNum; i++)
+		m_Navg[t*m_detectorNum+i] = muls->detectors[t][i]->Navg;
+	for (i=0; i<m_nx*m_ny; i++) CopyPixel(i, muls, false);
+	m_done.assign(m_done.size(), 0);
+	omp_unset_lock(&m_lock);
+	Write(true);
+}
+
+bool STEMCheckpoint::IsDone(int pos)
+{
+	bool done;
+
+	omp_set_lock(&m_lock);
+	done = ((m_done[pos >> 3] >> (pos & 7)) & 1) != 0;
+	omp_unset_lock(&m_lock);
+	return done;
+}
+
+// position pos has been finished for this configuration, chisq is its contribution
+// to muls->chisq[avgCount-1]
+void STEMCheckpoint::Done(int pos, MULS *muls, double chisq)
+{
+	omp_set_lock(&m_lock);
+	CopyPixel(pos, muls, false);
+	m_done[pos >> 3] |= (unsigned char)(1 << (pos & 7));
+	if (m_avgCount > 0) m_chisq[m_avgCount-1] += chisq;
+	omp_unset_lock(&m_lock);
+}
+
+// Write the checkpoint.  Unless wait is set, this only happens if the
+// checkpoint interval has passed and nobody else is writing one right now.
+void STEMCheckpoint::Write(bool wait)
+{
+	checkpointHeader header;
+	std::vector<double> chisq;
+	std::vector<int> Navg;
+	std::vector<unsigned char> done;
+	std::vector<accum_tt> images;
+	char tmpName[1040];
+	FILE *fp;
+	bool ok;
+
+	if (wait) omp_set_lock(&m_writeLock);
+	else {
+		if (!omp_test_lock(&m_writeLock)) return;
+		if (omp_get_wtime()-m_lastWrite < m_interval) {
+			omp_unset_lock(&m_writeLock);
+			return;
+		}
+	}
+
+	// take a consistent snapshot, then write it without blocking the scan
+	omp_set_lock(&m_lock);
+	memset(&header, 0, sizeof(header));
+	header.version = CHECKPOINT_VERSION;
+	header.ixStart = m_ixStart;
+	header.iyStart = m_iyStart;
+	header.nx = m_nx;
+	header.ny = m_ny;
+	header.nPlanes = m_nPlanes;
+	header.detectorNum = m_detectorNum;
+	header.avgRuns = (int)m_chisq.size();
+	header.avgCount = m_avgCount;
+	header.random = m_random;
+	chisq = m_chisq;
+	Navg = m_Navg;
+	done = m_done;
+	images = m_images;
+	omp_unset_lock(&m_lock);
+
+	sprintf(tmpName, "%s.tmp", m_fileName);
+	if ((fp = fopen(tmpName, "wb")) == NULL) {
+		printf("Cannot write checkpoint %s\n", tmpName);
+		omp_unset_lock(&m_writeLock);
+		return;
+	}
+	ok = (fwrite(CHECKPOINT_MAGIC, 1, 8, fp) == 8) &&
+		(fwrite(&header, sizeof(header), 1, fp) == 1) &&
+		writeVector(chisq, fp) && writeVector(Navg, fp) && 
+		writeVector(done, fp) && writeVector(images, fp);
+	ok = (fclose(fp) == 0) && ok;
+	if (ok) {
+#ifdef _WIN32
+		remove(m_fileName);
+#endif
+		ok = (rename(tmpName, m_fileName) == 0);
+	}
+	if (!ok) printf("Error while writing checkpoint %s\n", m_fileName);
+	m_lastWrite = omp_get_wtime();
+	omp_unset_lock(&m_writeLock);
+}
+
+// the scan is complete, we don't need the checkpoint any more
+void STEMCheckpoint::Remove()
+{
+	omp_set_lock(&m_writeLock);
+	remove(m_fileName);
+	omp_unset_lock(&m_writeLock);
+}
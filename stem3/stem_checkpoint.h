@@ -0,0 +1,89 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STEM_CHECKPOINT_H
+#define STEM_CHECKPOINT_H
+
+#include <vector>
+#include <omp.h>
+#include "boost/shared_ptr.hpp"
+#include "stemtypes_fftw3.h"
+#include "data_containers.h"
+#include "fileio_fftw3.h"
+
+/**************************************************************
+ * STEMCheckpoint periodically saves the state of a STEM scan, so
+ * that a crashed run can be restarted where it stopped:
+ *   - the frozen phonon configuration (avgCount) being computed,
+ *     the random number state at its beginning, and chisq,
+ *   - Navg, image and image2 of every detector and thickness,
+ *   - a bitmap of the scan positions finished in this configuration.
+ * The frozen phonon averages of the diffraction patterns (save 
+ * level > 0) are not saved, so there are no checkpoints for them.
+ *
+ * checkpoint->Restore(&muls);           // returns the first configuration to do
+ * checkpoint->BeginRun(&muls);          // at the beginning of every configuration
+ * if (checkpoint->IsDone(i)) skip ...   // position i of this tile
+ * checkpoint->Done(i, &muls, chisq);    // after collectIntensity() of the last slab
+ * checkpoint->Update();                 // write, if the checkpoint interval has passed
+ *
+ * Done() copies the finished pixel into a private copy of the
+ * images, which is therefore always consistent with the bitmap.
+ * The scan thread whose Update() finds the interval passed takes
+ * a snapshot of it and writes the file itself, i.e. it stops 
+ * scanning for that long; the other threads only wait for the 
+ * snapshot.  The file is written under a temporary name and 
+ * renamed afterwards.
+ **************************************************************/
+class STEMCheckpoint {
+	char m_fileName[1024];
+	int m_ixStart, m_iyStart, m_nx, m_ny;   // window of this tile
+	int m_nPlanes, m_detectorNum;
+	double m_interval, m_lastWrite;          // in seconds
+	bool m_resumed;
+
+	// state which is saved:
+	int m_avgCount;
+	randomState m_random;
+	std::vector<double> m_chisq;
+	std::vector<int> m_Navg;
+	std::vector<unsigned char> m_done;      // one bit per position
+	std::vector<accum_tt> m_images;         // image and image2 of every position, plane and detector
+
+	omp_lock_t m_lock;                      // protects the state above
+	omp_lock_t m_writeLock;                 // held by the thread writing the file
+
+	void CopyPixel(int pos, MULS *muls, bool toMuls);
+	void Write(bool wait);
+public:
+	STEMCheckpoint(const char *fileName, MULS *muls, double interval);
+	~STEMCheckpoint();
+
+	int Restore(MULS *muls);
+	void BeginRun(MULS *muls);
+	bool Resumed() { return m_resumed; }
+	bool IsDone(int pos);
+	void Done(int pos, MULS *muls, double chisq);
+	void Update() { if (m_interval > 0) Write(false); }
+	void Remove();
+};
+
+typedef boost::shared_ptr<STEMCheckpoint> STEMCheckpointPtr;
+
+#endif
@@ -22,6 +22,9 @@ QSTEM - image simulation for TEM/STEM/CBED
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <omp.h>
+#include <vector>
+#include <algorithm>
 
 #include "stemlib.h"
 #include "memory_fftw3.h"	/* memory allocation routines */
@@ -29,6 +32,10 @@ QSTEM - image simulation for TEM/STEM/CBED
 // #include "tiffsubs.h"
 #include "imagelib_fftw3.h"
 #include "fileio_fftw3.h"
+#include "stem_tiles.h"
+#include "simd_kernels.h"
+#include "multislice_kernels.h"
+#include "fft_plans.h"
 // #include "floatdef.h"
 // #include "imagelib.h"
 
@@ -141,546 +148,419 @@ double scatPar[N_ELEM][N_SF] = {{0.0000,0.0500,0.1000,0.1500,0.2000,0.2500,0.300
 0.0957,0.0727,0.0569,0.0369,0.0258,0,0,0}};
 #endif  // USE_REZ_SFACTS
 /****************************************************************************
-* function: atomBoxLookUp
+* function: createAtomBox
 *
-* Znum = element
-* x,y,z = real space position (in A)
-* B = Debye-Waller factor, B=8 pi^2 <u^2>
+* fills aBox->rpotential with the first quadrant of the potential of
+* element Znum (without Debye-Waller factor) on the grid 
+* aBox->nx,ny,nz / dx,dy,dz (set by the caller).  The radial potential 
+* comes from v3Datom() (without its own DW factor).  For 3D boxes
+* (nz > 1) every value is the integral of V over one slice 
+* (muls->sliceThickness) centered at z, for 2D boxes over all z, so
+* that both are in V*A like the projected potential.
 ***************************************************************************/
-void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,double z,double B) {
-	static int boxNx,boxNy,boxNz;
-	static double dx,dy,dz,ddx,ddy,ddz;
-	static atomBox *aBox = NULL;
-	static int ix,iy,iz; // idz, intSteps;
-	// static double x2,y2,z2,r2;
-	// static int avgSteps,maxSteps,stepCount,maxStepCount;
-	static double maxRadius2;
-	static char fileName[256],systStr[256];
-	static fftw_complex sum;
-	static int tZ, tnx, tny, tnz, tzOversample;  
-	static double tdx, tdy, tdz, tv0, tB;
-	FILE *fpBox;
-	int numRead = 0,dummy;
-
-
-	(*vlu)[0] = 0.0;
-	(*vlu)[1] = 0.0;
+void createAtomBox(MULS *muls, int Znum, atomBox *aBox) {
+	int i,j,ix,iy,iz,nr,nSub,nProj;
+	double dr,rmax,r,sum,x2,y2,z,zz;
+	std::vector<double> vr;
+
+	// radial table of V(r), up to the largest distance that we will look up
+	dr = aBox->dx;
+	if (aBox->dy < dr) dr = aBox->dy;
+	if ((aBox->nz > 1) && (aBox->dz < dr)) dr = aBox->dz;
+	dr *= 0.5;
+	rmax = 2.0*muls->atomRadius+2.0*muls->sliceThickness;
+	nr = (int)(rmax/dr)+2;
+	vr = std::vector<double>(nr);
+	// avoid the singularity at r=0 (Weickenmeier & Kohl)
+	for (i=0;i<nr;i++) vr[i] = v3Datom(Znum,i > 0 ? i*dr : 0.5*dr,1,muls->scatFactor);
+
+	aBox->rpotential = float3D(aBox->nz,aBox->nx,aBox->ny,"atomBox");
+	aBox->potential  = NULL;
+	// z-integration with nSub (even, so that z=0 is not sampled) points per slice
+	nSub  = 2*OVERSAMPLINGZ;
+	nProj = (int)(rmax/dr);
+	for (iz=0;iz<aBox->nz;iz++) for (ix=0;ix<aBox->nx;ix++) for (iy=0;iy<aBox->ny;iy++) {
+		x2 = ix*aBox->dx; x2 *= x2;
+		y2 = iy*aBox->dy; y2 *= y2;
+		z  = iz*aBox->dz;
+		for (sum=0,i=0;i<(aBox->nz > 1 ? nSub : nProj);i++) {
+			if (aBox->nz > 1) zz = z+muls->sliceThickness*((i+0.5)/nSub-0.5);
+			else zz = (i+0.5)*dr;
+			r = sqrt(x2+y2+zz*zz)/dr;
+			j = (int)r;
+			if (j >= nr-1) continue;
+			sum += (1.0-(r-j))*vr[j]+(r-j)*vr[j+1];
+		}
+		aBox->rpotential[iz][ix][iy] = (float_tt)(aBox->nz > 1 ? sum*muls->sliceThickness/nSub : 2.0*sum*dr);
+	}
+}
 
-	/* initialize all the atoms to non-used */
-	if (aBox == NULL) {
-		aBox = (atomBox *)malloc(sizeof(atomBox)*(NZMAX+1));
-		for (ix=0;ix<=NZMAX;ix++) {
-			aBox[ix].potential = NULL;
-			aBox[ix].rpotential = NULL;
-			aBox[ix].B = -1.0;
+/****************************************************************************
+* function: readAtomBox
+*
+* fills aBox->potential with the complex atom box of element Znum 
+* and Debye-Waller factor aBox->B > 0, whose imaginary part is the
+* absorptive potential.  It is read from potential_<Z>_B<100 B>.prj, 
+* which the external scatpot makes if it does not exist yet, or if
+* it has been made for other parameters.
+***************************************************************************/
+static void readAtomBox(MULS *muls, int Znum, atomBox *aBox) {
+	char fileName[256],systStr[256],line[256];
+	FILE *fpBox;
+	int tZ,tnx,tny,tnz,tzOversample,numRead,n;
+	double tB,tdx,tdy,tdz,tv0;
+
+	n = aBox->nx*aBox->ny*aBox->nz;
+	sprintf(fileName,"potential_%d_B%d.prj",Znum,(int)(100.0*aBox->B));
+	sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
+		fileName,Znum,aBox->B,aBox->nx,aBox->ny,aBox->nz,aBox->dx,aBox->dy,aBox->dz,OVERSAMPLINGZ,muls->v0);
+	if ((fpBox = fopen(fileName,"r")) != NULL) {
+		fgets(line,250,fpBox);
+		sscanf(line,"%d %le %d %d %d %le %le %le %d %le\n",
+			&tZ,&tB,&tnx,&tny,&tnz,&tdx,&tdy,&tdz,&tzOversample,&tv0);
+		if ((tZ != Znum) || (fabs(tB-aBox->B)>1e-6) || (tnx != aBox->nx) || (tny != aBox->ny) || (tnz != aBox->nz) ||
+			(fabs(tdx-aBox->dx) > 1e-5) || (fabs(tdy-aBox->dy) > 1e-5) || (fabs(tdz-aBox->dz) > 1e-5) || 
+			(tzOversample != OVERSAMPLINGZ) || (tv0 != muls->v0)) {
+			if (muls->printLevel > 2)
+				printf("Potential input file %s has the wrong parameters, will create a new one\n",fileName);
+			fclose(fpBox);
+			fpBox = NULL;
 		}
-		dx = (*muls).resolutionX;    ddx = dx/(double)OVERSAMPLING;
-		dy = (*muls).resolutionY;    ddy = dy/(double)OVERSAMPLING;
-		dz = (*muls).sliceThickness; ddz = dz/(double)OVERSAMPLINGZ;
-		maxRadius2 = (*muls).atomRadius*(*muls).atomRadius;
-		/* For now we don't care, if the box has only small 
-		* prime factors, because we will not fourier transform it
-		* especially not very often.
-		*/
-		boxNx = (int)((*muls).atomRadius/ddx+2.0);  
-		boxNy = (int)((*muls).atomRadius/ddy+2.0);  
-		boxNz = (int)((*muls).atomRadius/ddz+2.0);     
-		if ((*muls).potential3D == 0)
-			boxNz = 1;
+	}
+	else if (muls->printLevel > 2)
+		printf("Could not find precalculated potential for Z=%d, will calculate now.\n",Znum);
+	if (fpBox == NULL) {
+		if (muls->printLevel > 2) printf("Calling: %s\n",systStr);
+		system(systStr);
+		if ((fpBox = fopen(fileName,"r")) == NULL) {
+			if (muls->printLevel > 0)
+				printf("cannot calculate projected potential using scatpot - exit!\n");
+			exit(0);
+		}
+		fgets(line,250,fpBox);
+	}
 
-		if (muls->printLevel > 2)
-			printf("Atombox has real space resolution of %g x %g x %gA (%d x %d x %d pixels)\n",
-			ddx,ddy,ddz,boxNx,boxNy,boxNz);
+	aBox->rpotential = NULL;
+#if FLOAT_PRECISION == 1
+	aBox->potential = complex3Df(aBox->nz,aBox->nx,aBox->ny,"atomBox");
+	numRead = (int)fread(aBox->potential[0][0],sizeof(fftwf_complex),(size_t)n,fpBox);
+#else
+	aBox->potential = complex3D(aBox->nz,aBox->nx,aBox->ny,"atomBox");
+	numRead = (int)fread(aBox->potential[0][0],sizeof(fftw_complex),(size_t)n,fpBox);
+#endif
+	fclose(fpBox);
+	if (numRead != n) {
+		if (muls->printLevel > 0)
+			printf("error while reading potential file %s: read %d of %d values\n",fileName,numRead,n);
+		exit(0);
 	}
-	// printf("Debugging: %d %g %g: %g\n",Znum,aBox[Znum].B,B,fabs(aBox[Znum].B - B));
+	if (muls->printLevel > 1)
+		printf("Sucessfully read in the projected potential\n");
+}
 
-	/* Creating/Reading a atombox for every new kind of atom, but only as needed */
-	if (fabs(aBox[Znum].B - B) > 1e-6) {
-		//  printf("Debugging 1 (%d: %.7g-%.7g= %.7g), %d\n",
-		//	   Znum,aBox[Znum].B,B,fabs(aBox[Znum].B - B),fabs(aBox[Znum].B - B) > 1e-6);
-		aBox[Znum].B = B;
-		/* Open the file with the projected potential for this particular element
-		*/
-		sprintf(fileName,"potential_%d_B%d.prj",Znum,(int)(100.0*B));
-		if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-			sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
-				fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-			if (muls->printLevel > 2) {
-				printf("Could not find precalculated potential for Z=%d,"
-					" will calculate now.\n",Znum);
-				printf("Calling: %s\n",systStr);
-			}
-			system(systStr);
-			for (dummy=0;dummy < 10000;dummy++);
-			if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-				if (muls->printLevel >0)
-					printf("cannot calculate projected potential using scatpot - exit!\n");
-				exit(0);
-			}  
+AtomBoxCache::AtomBoxCache(MULS *muls) {
+	m_dx = muls->resolutionX/(double)OVERSAMPLING;
+	m_dy = muls->resolutionY/(double)OVERSAMPLING;
+	m_dz = muls->sliceThickness/(double)OVERSAMPLINGZ;
+	/* For now we don't care, if the box has only small 
+	* prime factors, because we will not fourier transform it
+	* especially not very often.
+	*/
+	m_nx = (int)(muls->atomRadius/m_dx+2.0);  
+	m_ny = (int)(muls->atomRadius/m_dy+2.0);  
+	m_nz = muls->potential3D ? (int)(muls->atomRadius/m_dz+2.0) : 1;
+	omp_init_lock(&m_lock);
+	if (muls->printLevel > 2)
+		printf("Atombox has real space resolution of %g x %g x %gA (%d x %d x %d pixels)\n",
+		m_dx,m_dy,m_dz,m_nx,m_ny,m_nz);
+}
 
-		}
-		fgets( systStr, 250, fpBox );
-		sscanf(systStr,"%d %le %d %d %d %le %le %le %d %le\n",
-			&tZ, &tB, &tnx, &tny, &tnz, &tdx, &tdy, &tdz, &tzOversample, &tv0);
-		/* If the parameters in the file don't match the current ones,
-		* we need to create a new potential file
-		*/
-		if ((tZ != Znum) || (fabs(tB-B)>1e-6) || (tnx != boxNx) || (tny != boxNy) || (tnz != boxNz) ||
-			(fabs(tdx-ddx) > 1e-5) || (fabs(tdy-ddy) > 1e-5) || (fabs(tdz-ddz) > 1e-5) || 
-			(tzOversample != OVERSAMPLINGZ) || (tv0 != muls->v0)) {
-				if (muls->printLevel > 2) {
-					printf("Potential input file %s has the wrong parameters\n",fileName);
-					printf("Parameters:\n"
-						"file:    Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
-						"program: Z=%d, B=%.3f A^2 (%d, %d, %d) (%.7f, %.7f %.7f) nsz=%d V=%g\n"
-						"will create new potential file, please wait ...\n",
-						tZ,tB,tnx,tny,tnz,tdx,tdy,tdz,tzOversample,tv0,
-						Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-					/* printf("%d %d %d %d %d %d %d %d %d %d\n",
-					(tZ != Znum),(tB != B),(tnx != boxNx),(tny != boxNy),(tnz != boxNz),
-					(fabs(tdx-ddx) > 1e-5),(fabs(tdy-ddy) > 1e-5),(fabs(tdz-ddz) > 1e-5), 
-					(tzOversample != OVERSAMPLINGZ),(tv0 != muls->v0));
-					*/
-				}
-				/* Close the old file, Create a new potential file now 
-				*/
-				fclose( fpBox );
-				sprintf(systStr,"scatpot %s %d %g %d %d %d %g %g %g %d %g",
-					fileName,Znum,B,boxNx,boxNy,boxNz,ddx,ddy,ddz,OVERSAMPLINGZ,(*muls).v0);
-				system(systStr);
-				if ( (fpBox = fopen( fileName, "r" )) == NULL ) {
-					if (muls->printLevel >0)
-						printf("cannot calculate projected potential using scatpot - exit!\n");
-					exit(0);
-				}  
-				fgets( systStr, 250, fpBox );
-		}
+AtomBoxCache::~AtomBoxCache() {
+	box_map::iterator it;
+	atomBox *aBox;
 
-		/* Finally we can read in the projected potential
-		*/
-		if (B == 0) {
-			aBox[Znum].rpotential = float3D(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].rpotential[0][0],sizeof(real),
-				(size_t)(boxNx*boxNy*boxNz), fpBox );
+	for (it=m_boxes.begin();it!=m_boxes.end();it++) {
+		aBox = it->second;
+		if (aBox->rpotential != NULL) {
+			fftw_free(aBox->rpotential[0][0]);
+			for (int i=0;i<aBox->nz;i++) fftw_free(aBox->rpotential[i]);
+			fftw_free(aBox->rpotential);
 		}
-		else {
+		if (aBox->potential != NULL) {
 #if FLOAT_PRECISION == 1
-			aBox[Znum].potential = complex3Df(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].potential[0][0],sizeof(fftwf_complex),
-				(size_t)(boxNx*boxNy*boxNz), fpBox );
+			fftwf_free(aBox->potential[0][0]);
+			for (int i=0;i<aBox->nz;i++) fftwf_free(aBox->potential[i]);
+			fftwf_free(aBox->potential);
 #else
-			aBox[Znum].potential = complex3D(boxNz,boxNx,boxNy,"atomBox");
-			numRead = fread(aBox[Znum].potential[0][0],sizeof(fftw_complex),
-				(size_t)(boxNx*boxNy*boxNz),fpBox);	
+			fftw_free(aBox->potential[0][0]);
+			for (int i=0;i<aBox->nz;i++) fftw_free(aBox->potential[i]);
+			fftw_free(aBox->potential);
 #endif
 		}
+		delete aBox;
+	}
+	omp_destroy_lock(&m_lock);
+}
 
-		/* writeImage_old(aBox[Znum].potential[0],boxNx,boxNy, 0.0,"potential.img");
-		system("showimage potential.img");
-		*/
-		fclose( fpBox );
+atomBox *AtomBoxCache::Get(MULS *muls, int Znum, double B) {
+	box_map::iterator it;
+	atomBox *aBox;
 
-		if (numRead == boxNx*boxNy*boxNz) {
-			if (muls->printLevel > 1)
-				printf("Sucessfully read in the projected potential\n");
-		}
-		else {
-			if (muls->printLevel > 0)
-				printf("error while reading potential file %s: read %d of %d values\n",
-				fileName,numRead,boxNx*boxNy*boxNz);
-			exit(0);
-		}
+	omp_set_lock(&m_lock);
+	it = m_boxes.find(std::make_pair(Znum,B));
+	if (it != m_boxes.end()) aBox = it->second;
+	else {
+		aBox = new atomBox;
+		aBox->used = 1;
+		aBox->nx = m_nx;  aBox->dx = m_dx;
+		aBox->ny = m_ny;  aBox->dy = m_dy;
+		aBox->nz = m_nz;  aBox->dz = m_dz;
+		aBox->B = B;
+		if (B > 0) readAtomBox(muls,Znum,aBox);
+		else createAtomBox(muls,Znum,aBox);
+		m_boxes[std::make_pair(Znum,B)] = aBox;
+		if (muls->printLevel > 2)
+			printf("Created %d x %d x %d atom box for Z=%d, B=%g\n",m_nx,m_ny,m_nz,Znum,B);
 	}
+	omp_unset_lock(&m_lock);
+	return aBox;
+}
+
+AtomBoxCachePtr atomBoxCache(MULS *muls) {
+	static AtomBoxCachePtr cache;
+	if (!cache) cache = AtomBoxCachePtr(new AtomBoxCache(muls));
+	return cache;
+}
+
+// value part (0: real, 1: imaginary) of pixel (iz,ix,iy) of aBox
+static double atomBoxPixel(atomBox *aBox, int iz, int ix, int iy, int part) {
+	if (aBox->potential != NULL) return aBox->potential[iz][ix][iy][part];
+	return part == 0 ? aBox->rpotential[iz][ix][iy] : 0.0;
+}
+
+/****************************************************************************
+* function: atomBoxLookUp
+*
+* aBox = atom box of the element and Debye-Waller factor, from 
+*        atomBoxCache(muls)->Get()
+* x,y,z = real space position (in A) relative to the atom
+***************************************************************************/
+void atomBoxLookUp(fftw_complex *vlu,MULS *muls,atomBox *aBox,double x,double y,double z) {
+	int ix,iy,iz,part;
+	double fx,fy,fz,v;
+
+	(*vlu)[0] = 0.0;
+	(*vlu)[1] = 0.0;
 
 	/***************************************************************
 	* Do the trilinear interpolation
 	*/
-	sum[0] = 0.0;
-	sum[1] = 0.0;
-	if (x*x+y*y+z*z > maxRadius2) {
+	if (x*x+y*y+z*z > muls->atomRadius*muls->atomRadius) {
 		return;
 	}
 	x = fabs(x);
 	y = fabs(y);
 	z = fabs(z);
-	ix = (int)(x/ddx);
-	iy = (int)(y/ddy);
-	iz = (int)(z/ddz);
-	dx = x-(double)ix*ddx;
-	dy = y-(double)iy*ddy;
-	dz = z-(double)iz*ddz;
-	if ((dx < 0) || (dy<0) || (dz<0)) {
-		/* printf("Warning, dx(%g), dy(%g), dz(%g) < 0, (x=%g, y=%g, z=%g)\n",dx,dy,dz,x,y,z);
-		*/
-		if (dx < 0) dx = 0.0;
-		if (dy < 0) dy = 0.0;
-		if (dz < 0) dz = 0.0;
-	}
-
-
-	if ((*muls).potential3D) {
-		if (aBox[Znum].B > 0) {
-			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz][ix][iy][0]+
-				dx*aBox[Znum].potential[iz][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz][ix][iy+1][0]+
-				dx*aBox[Znum].potential[iz][ix+1][iy+1][0]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy][0]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy+1][0]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy+1][0]));
-			sum[1] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz][ix][iy][1]+
-				dx*aBox[Znum].potential[iz][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz][ix][iy+1][1]+
-				dx*aBox[Znum].potential[iz][ix+1][iy+1][1]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy][1]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[iz+1][ix][iy+1][1]+
-				dx*aBox[Znum].potential[iz+1][ix+1][iy+1][1]));
-		}
-		else {
-			sum[0] = (1.0-dz)*((1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[iz][ix][iy]+
-				dx*aBox[Znum].rpotential[iz][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[iz][ix][iy+1]+
-				dx*aBox[Znum].rpotential[iz][ix+1][iy+1]))+
-				dz*((1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[iz+1][ix][iy]+
-				dx*aBox[Znum].rpotential[iz+1][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[iz+1][ix][iy+1]+
-				dx*aBox[Znum].rpotential[iz+1][ix+1][iy+1]));
-		}
-	}
-	else {
-		if (aBox[Znum].B > 0) {
-			sum[0] = (1.0-dy)*((1.0-dx)*aBox[Znum].potential[0][ix][iy][0]+
-				dx*aBox[Znum].potential[0][ix+1][iy][0])+
-				dy*((1.0-dx)*aBox[Znum].potential[0][ix][iy+1][0]+
-				dx*aBox[Znum].potential[0][ix+1][iy+1][0]);
-			sum[1] = (1.0-dy)*((1.0-dx)*aBox[Znum].potential[0][ix][iy][1]+
-				dx*aBox[Znum].potential[0][ix+1][iy][1])+
-				dy*((1.0-dx)*aBox[Znum].potential[0][ix][iy+1][1]+
-				dx*aBox[Znum].potential[0][ix+1][iy+1][1]);
-		}
-		else {
-			sum[0] = (1.0-dy)*((1.0-dx)*aBox[Znum].rpotential[0][ix][iy]+
-				dx*aBox[Znum].rpotential[0][ix+1][iy])+
-				dy*((1.0-dx)*aBox[Znum].rpotential[0][ix][iy+1]+
-				dx*aBox[Znum].rpotential[0][ix+1][iy+1]);
-		}
+	ix = (int)(x/aBox->dx);
+	iy = (int)(y/aBox->dy);
+	iz = (int)(z/aBox->dz);
+	// fractional position within the box pixel:
+	fx = x/aBox->dx-(double)ix;
+	fy = y/aBox->dy-(double)iy;
+	fz = z/aBox->dz-(double)iz;
+	if (fx < 0) fx = 0.0;
+	if (fy < 0) fy = 0.0;
+	if (fz < 0) fz = 0.0;
+	if (!muls->potential3D) iz = 0;
+
+	for (part=0;part<(aBox->potential != NULL ? 2 : 1);part++) {
+		v = (1.0-fy)*((1.0-fx)*atomBoxPixel(aBox,iz,ix,iy,part)+
+			fx*atomBoxPixel(aBox,iz,ix+1,iy,part))+
+			fy*((1.0-fx)*atomBoxPixel(aBox,iz,ix,iy+1,part)+
+			fx*atomBoxPixel(aBox,iz,ix+1,iy+1,part));
+		if (muls->potential3D) 
+			v = (1.0-fz)*v+
+			fz*((1.0-fy)*((1.0-fx)*atomBoxPixel(aBox,iz+1,ix,iy,part)+
+			fx*atomBoxPixel(aBox,iz+1,ix+1,iy,part))+
+			fy*((1.0-fx)*atomBoxPixel(aBox,iz+1,ix,iy+1,part)+
+			fx*atomBoxPixel(aBox,iz+1,ix+1,iy+1,part)));
+		(*vlu)[part] = v;
 	}
-	(*vlu)[0] = sum[0];
-	(*vlu)[1] = sum[1];
 }
 
 
 
 /*****************************************************
-* void make3DSlices()
-*
-* This function will create a 3D potential from whole
-* unit cell, slice it, and make transr/i and propr/i
-* Call this function with center = NULL, if you don't
-* want the array to be shifted.
+* The projected potential of pixel (iz,ix,iy): the real part
+* of muls->trans, or one float_tt of muls->transStore.  In both
+* cases the neighbouring pixel in y is potStep(muls) further,
+* and the same pixel of the next slice potSliceStep(muls).
 ****************************************************/
-void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
-	// FILE *fpu2;
-	char fileOut[512]; // RAM: this is terrible, why is fileName a function argument and here we have filename?  FIXED: rename function argument to fileIn and this to fileOut
-	int natom,iatom,iz;  /* number of atoms */
-	atom *atoms;
-	real dx,dy,dz;
-	real c,atomX,atomY,atomZ;
-	int i=0,j,nx,ny,ix,iy,iax,iay,iaz,sliceStep;
-	int iAtomX,iAtomY,iAtomZ,iRadX,iRadY,iRadZ,iRad2;
-	int iax0,iax1,iay0,iay1,iaz0,iaz1,nyAtBox,nyAtBox2,nxyAtBox,nxyAtBox2,iOffsX,iOffsY,iOffsZ;
-	int nzSub,Nr,ir,Nz_lut;
-	int iOffsLimHi,iOffsLimLo,iOffsStep;
+static float_tt *potentialPixel(MULS *muls, int iz, int ix, int iy) {
+	if (muls->transStore) return &(muls->transStore->Potential()[iz][ix][iy]);
+	return &(muls->trans[iz][ix][iy][0]);
+}
 
-	real *slicePos;
-	double z,x,y,r,ddx,ddy,ddr,dr,r2sqr,x2,y2,potVal,dOffsZ;
-	// char *sliceFile = "slices.dat";
-	char buf[BUF_LEN];
-	FILE *sliceFp;
-	real minX,maxX,minY,maxY,minZ,maxZ;
-	double atomRadius2;
-	time_t time0,time1;
-	float s11,s12,s21,s22;
-	fftwf_complex	*atPotPtr;
-	float *potPtr=NULL, *ptr;
-	static int divCount = 0;
-	static real **tempPot = NULL;
-#if FLOAT_PRECISION == 1
-	static fftwf_complex ***oldTrans = NULL;
-	static fftwf_complex ***oldTrans0 = NULL;
-#else
-	static fftw_complex ***oldTrans = NULL;
-	static fftw_complex ***oldTrans0 = NULL;
-#endif
-	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls->potNx,muls->potNy,
-				muls->sliceThickness,muls->resolutionX,muls->resolutionY));
-	fftw_complex dPot;
-#if Z_INTERPOLATION
-	double ddz;
-#endif
-#if USE_Q_POT_OFFSETS
-	fftwf_complex	*atPotOffsPtr;
-#endif
+static int potStep(MULS *muls) {
+	return muls->transStore ? 1 : 2;
+}
 
-	if (muls->trans == NULL) {
-		printf("Severe error: trans-array not allocated - exit!\n");
-		exit(0);
+static int potSliceStep(MULS *muls) {
+	if (muls->transStore) return (int)muls->transStore->SliceStep();
+	return 2*muls->potNx*muls->potNy;
+}
+
+// adds (re, im) to pixel (iz,ix,iy); there is no room for im in transStore
+static void addPotential(MULS *muls, int iz, int ix, int iy, double re, double im) {
+	if (muls->transStore) {
+		muls->transStore->Potential()[iz][ix][iy] += re;
+		return;
 	}
+	muls->trans[iz][ix][iy][0] += re;
+	muls->trans[iz][ix][iy][1] += im;
+}
 
-	if (oldTrans0 == NULL) {
+// sets the potential of all slices to 0
+static void clearPotential(MULS *muls) {
+	if (muls->transStore) {
+		muls->transStore->ClearPotential();
+		return;
+	}
 #if FLOAT_PRECISION == 1
-		oldTrans0 = (fftwf_complex ***)fftw_malloc(nlayer * sizeof(fftwf_complex**));
+	memset((void *)&(muls->trans[0][0][0][0]),0,
+		muls->slices*muls->potNx*muls->potNy*sizeof(fftwf_complex));
 #else
-		oldTrans0 = (fftw_complex ***)fftw_malloc(nlayer * sizeof(fftw_complex**));
+	memset((void *)&(muls->trans[0][0][0][0]),0,
+		muls->slices*muls->potNx*muls->potNy*sizeof(fftw_complex));
 #endif
-		for (i=0;i<nlayer;i++) {
-			// printf("%d %d\n",i,(int)(muls->trans));
-			oldTrans0[i] = muls->trans[i]; 
-		}
-		oldTrans = muls->trans;
-	}
-	if (oldTrans != muls->trans)
-		printf("Warning: Transmission function pointer has changed!\n");
-
-	/* return, if there is nothing to do */
-	if (nlayer <1)
-		return;
-
-	nx = muls->potNx;
-	ny = muls->potNy;
-
-
-
-	/* we need to keep track of which subdivision of the unit cell we are in
-	* If the cell is not subdivided, then muls.cellDiv-1 = 0.
-	*/
-	if ((divCount == 0) || (muls->equalDivs))
-		divCount = muls->cellDiv;
-	divCount--;
-
-	/* we only want to reread and shake the atoms, if we have finished the 
-	* current unit cell.
-	*/
-	if (divCount == muls->cellDiv-1) {
-		if (muls->avgCount == 0) {
-			// if this is the first run, the atoms have already been
-			// read during initialization
-			natom = (*muls).natom;
-			atoms = (*muls).atoms;
-		}
-		else {
-			/* 
-			the following function makes an array of natom atoms from
-			the input file (with x,y,z,dw,occ);
-			*/
-			// the last parameter is handleVacancies.  If it is set to 1 vacancies 
-
-			// and multiple occupancies will be handled. 
-			atoms = readUnitCell(&natom,fileIn,muls,1);
-			if (muls->printLevel>=3)
-				printf("Read %d atoms from %s, tds: %d\n",natom,fileIn,muls->tds);
-			muls->natom = natom;
-			muls->atoms = atoms;
-		}
-		minX = maxX = atoms[0].x;
-		minY = maxY = atoms[0].y;
-		minZ = maxZ = atoms[0].z;
-
-		for (i=0;i<natom;i++) {
-			if (atoms[i].x < minX) minX = atoms[i].x;
-			if (atoms[i].x > maxX) maxX = atoms[i].x;
-			if (atoms[i].y < minY) minY = atoms[i].y;
-			if (atoms[i].y > maxY) maxY = atoms[i].y;
-			if (atoms[i].z < minZ) minZ = atoms[i].z;
-			if (atoms[i].z > maxZ) maxZ = atoms[i].z;
-		}
-		/*
-		printf("Root of mean square TDS displacement: %f A (wobble=%g at %gK) %g %g %g\n",
-		sqrt(u2/natom),wobble,(*muls).tds_temp,ux,uy,uz);
-		*/
-		if (muls->printLevel >= 2) {
-			printf("range of thermally displaced atoms (%d atoms): \n",natom);
-			printf("X: %g .. %g\n",minX,maxX);
-			printf("Y: %g .. %g\n",minY,maxY);
-			printf("Z: %g .. %g\n",minZ,maxZ);
-		}
-		/* 
-		define the center of our unit cell by moving the atom specified
-		by "center" at position (0.5,0.5,0.0) 
-		*/
-
-		if (center != NULL) {
-			dx = (*muls).ax/2.0f - (*center).x;	
-			dy = (*muls).by/2.0f - (*center).y;	
-			dz = -(*center).z;
-			for (i=0;i<natom;i++) {
-				atoms[i].x += dx;
-				if (atoms[i].x < 0.0f) atoms[i].x += (*muls).ax;
-				else if (atoms[i].x > (*muls).ax) atoms[i].x -= (*muls).ax;
-				atoms[i].y += dy;
-				if (atoms[i].y < 0.0f) atoms[i].y += (*muls).by;
-				else if (atoms[i].y > (*muls).by) atoms[i].y -= (*muls).by;
-				atoms[i].z += dz;
-				if (atoms[i].z < 0.0f) atoms[i].z += (*muls).c;
-				else if (atoms[i].z > (*muls).c) atoms[i].z -= (*muls).c;
-			}
-		}
-
-		/**********************************************************
-		* Sort the atoms in z.
-		*********************************************************/
-		// RAM I think this is not working correctly to output the file
-		// Muls passed in as *muls, so by pointer rather than by-value.
-		// Ok, and cfgFile is not set before here...  Look at Muls and see if there's been some variable confusion
-
-
-		printf( "DEBUG: stemlib::make3Dslices : muls.cfgFile = %s \n", muls->cfgFile );
+}
 
-		qsort(atoms,natom,sizeof(atom),atomCompare);
+/*****************************************************
+* true, if one of the rows ix0..ix1 (periodic in nx) is 
+* inside xStart..xStop-1
+****************************************************/
+static int rowsInBand(int ix0, int ix1, int nx, int xStart, int xStop) {
+	int n = ix1-ix0;
 
+	if (n+1 >= nx) return 1;
+	ix0 = ((ix0 % nx)+nx) % nx;
+	ix1 = ix0+n;          // < 2*nx
+	return ((ix0 < xStop) && (ix1 >= xStart)) || ((ix0 < xStop+nx) && (ix1 >= xStart+nx));
+}
 
-		if ((*muls).cfgFile != NULL) 
-		{
-			sprintf(buf,"%s/%s",muls->folder,muls->cfgFile);
-			// append the TDS run number
-			if (strcmp(buf+strlen(buf)-4,".cfg") == 0) *(buf+strlen(buf)-4) = '\0';
-			if (muls->tds) sprintf(buf+strlen(buf),"_%d.cfg",muls->avgCount);
-			else sprintf(buf+strlen(buf),".cfg");
-		
-			// printf("Will write CFG file <%s> (%d)\n",buf,muls->tds)
-			writeCFG(atoms,natom,buf,muls);
+/*****************************************************
+* builds the lookup tables of getAtomPotential3D() (and of the
+* charge offsets) or getAtomPotential2D() for every element and
+* B of atoms, in parallel, so that the threads of make3DSlices()
+* only read them.
+****************************************************/
+static void prepareAtomPotentials(MULS *muls, atom *atoms, int natom) {
+	potentialLUTCache(muls)->Prepare(muls,atoms,natom);
+}
 
-			if (muls->readPotential) 
-			{
-				sprintf(buf,"nanopot %s/%s %d %d %d %s",muls->folder,muls->cfgFile,
-					ny,nx,muls->slices*muls->cellDiv,muls->folder);
-				system(buf);
-			}
-		}
-	} /* end of if divCount==cellDiv-1 ... */
-	else {
-		natom = muls->natom;
-		atoms = muls->atoms;
-	}
+/*****************************************************
+* collectAtoms() - appends the atoms of muls->atomCells which may
+* reach into the rows xStart..xStop-1 of the potential and into
+* the slab divCount to list, in ascending order.  The cells are
+* atomRadius (or more) wide, so one cell more is taken on each
+* side of the potential window.
+****************************************************/
+static void collectAtoms(MULS *muls, int divCount, int xStart, int xStop, std::vector<int> &list) {
+	int ix,iRadX,r0,r1,nx,iy0,iy1,iz0,iz1;
+	double dx,c,zOffs;
+	AtomCellsPtr cells = muls->atomCells;
 
-	/************************************************************** 
-	*	setup the slices with their start and end positions
-	*	then loop through all the atoms and add their potential to
-	*	the slice that their potential reaches into (up to RMAX)
-	*************************************************************/
-	// c = (*muls).c/(real)((*muls).cellDiv);
+	nx = muls->potNx;
+	dx = muls->resolutionX;
+	iRadX = (int)ceil(muls->atomRadius/dx);
 	c = muls->sliceThickness * muls->slices;
-	dx = (*muls).resolutionX;
-	dy = (*muls).resolutionY;
-	dr   = muls->resolutionX/OVERSAMP_X;  // define step width in which radial V(r,z) is defined 
-	iRadX = (int)ceil((*muls).atomRadius/dx);
-	iRadY = (int)ceil((*muls).atomRadius/dy);
-	iRadZ = (int)ceil((*muls).atomRadius/muls->sliceThickness);
-	iRad2 = iRadX*iRadX+iRadY*iRadY;
-	atomRadius2 = (*muls).atomRadius * (*muls).atomRadius;
-
-	if (muls->printLevel >= 3) {
-		printf("Slab thickness: %gA z-offset: %gA (cellDiv=%d)\n",
-			c,c*(real)(muls->cellDiv-divCount-1),divCount);
-	}	 
-	/*******************************************************
-	* initializing slicPos, cz, and transr
-	*************************************************************/
-	if (oldTrans0[0] != muls->trans[0]) {
-		printf("Warning: transmision array pointers have changed!\n");
-		for (i=0;i<nlayer;i++)
-			muls->trans[i] = oldTrans0[i];
-	}
-	/*
-	if (oldTrans0[0][0] != muls->trans[0][0]) {
-	printf("Warning: transmision array pointers have changed!\n");
-	for (i=0;i<nlayer;i++)
-	muls->trans[i] = oldTrans0[i];
-	}
-	*/
-	if ((*muls).cz == NULL) {
-		(*muls).cz = float1D(nlayer,"cz");
-	}
-	// sliceFp = fopen(sliceFile,"r");
-	sliceFp = NULL;
-	slicePos = float1D(nlayer,"slicePos");
-
 
-	if (muls->sliceThickness == 0)
-		(*muls).cz[0] = c/(real)nlayer;
-	else
-		(*muls).cz[0] = muls->sliceThickness;
-	slicePos[0] = (*muls).czOffset;  
-	/*
-	************************************************************/
-
-
-	for (i=1;i<nlayer;i++) {
-		if (sliceFp == NULL) (*muls).cz[i] = (*muls).cz[0];  
-		/* don't need to all be the same, yes they do for fast 3D-FFT method! */
-		else {
-			fgets(buf,BUF_LEN,sliceFp);
-			(*muls).cz[i] = atof(buf);
-		}
-		slicePos[i] = slicePos[i-1]+(*muls).cz[i-1]/2.0+(*muls).cz[i]/2.0;
+	// y-range of the potential window (all atoms, if periodic)
+	iy0 = 0;
+	iy1 = cells->CellsY()-1;
+	if (muls->nonPeriod) {
+		iy0 = cells->CellY(muls->potOffsetY-muls->atomRadius);
+		iy1 = cells->CellY(muls->potOffsetY+muls->potNy*muls->resolutionY+muls->atomRadius);
 	}
-
-	memset(muls->trans[0][0],0,nlayer*nx*ny*sizeof(fftwf_complex));
-	/* check whether we have constant slice thickness */
-
-	if (muls->fftpotential) {
-		for (i = 0;i<nlayer;i++)  if ((*muls).cz[0] != (*muls).cz[i]) break;
-		if (i<nlayer) printf("Warning: slice thickness not constant, will give wrong results (iz=%d)!\n",i);
-
+	// z-range of this slab, see atomZ in addAtomPotentials()
+	iz0 = 0;
+	iz1 = cells->CellsZ()-1;
+	if (muls->nonPeriodZ) {
+		zOffs = -c*(real)(muls->cellDiv-divCount-1) + muls->czOffset 
+			-(0.5*muls->sliceThickness*(1-muls->centerSlices));
+		iz0 = cells->CellZ(-zOffs-muls->atomRadius-2.0*muls->sliceThickness);
+		iz1 = cells->CellZ(-zOffs+c+muls->atomRadius+muls->sliceThickness);
+		if ((-zOffs+c+muls->atomRadius+muls->sliceThickness < cells->CellZ0(0)) ||
+			(-zOffs-muls->atomRadius-2.0*muls->sliceThickness >= cells->CellZ0(cells->CellsZ()))) return;
 	}
 
-	/*************************************************************************
-	* read the potential that has been created externally!
-	*/
-	if (muls->readPotential) {
-		for (i=(divCount+1)*muls->slices-1,j=0;i>=(divCount)*muls->slices;i--,j++) {
-			sprintf(buf,"%s/potential_%d.img",muls->folder,i);
-			imageIO->ReadImage((void **)tempPot,nx,ny,buf);
-			for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
-				(*muls).trans[j][ix][iy][0] = tempPot[ix][iy];
-				(*muls).trans[j][ix][iy][1] = 0.0;
-			}
-		}
-		return;
+	for (ix=0;ix<cells->CellsX();ix++) {
+		// the rows which the atoms of this x-tile can reach:
+		r0 = (int)floor((cells->CellX0(ix)-muls->potOffsetX)/dx)-iRadX-1;
+		r1 = (int)floor((cells->CellX0(ix+1)-muls->potOffsetX)/dx)+iRadX+1;
+		if ((muls->nonPeriod) && ((r1 < 0) || (r0 >= nx))) continue;
+		if (!rowsInBand(r0,r1,nx,xStart,xStop)) continue;
+		cells->Collect(ix,ix,iy0,iy1,iz0,iz1,list);
 	}
+	std::sort(list.begin(),list.end());
+}
 
-	// reset the potential to zero:  
-#if FLOAT_PRECISION == 1
-	memset((void *)&(muls->trans[0][0][0][0]),0,
-		muls->slices*muls->potNx*muls->potNy*sizeof(fftwf_complex));
-#else
-	memset((void *)&(muls->trans[0][0][0][0]),0,
-		muls->slices*muls->potNx*muls->potNy*sizeof(fftw_complex));
+/*****************************************************
+* addAtomPotentials() - the atom loop of make3DSlices(): adds
+* the potential of the atoms in list (ascending, i.e. sorted 
+* in z) to the rows xStart..xStop-1 of the slices.  divCount 
+* is the subdivision of the unit cell that the slices belong to.
+* The potentials come from luts (prepared, with fftpotential) or
+* from boxes (without).
+****************************************************/
+static void addAtomPotentials(MULS *muls, PotentialLUTCache *luts, AtomBoxCache *boxes, atom *atoms, const std::vector<int> &list, int nlayer, int divCount, int xStart, int xStop) {
+	int iatom,iList,iz,nx,ny,ix,iy,iax,iay,iaz,sliceStep;
+	int iAtomX,iAtomY,iAtomZ,iRadX,iRadY,iRadZ;
+	int iax0,iax1,iay0,iay1,iaz0,iaz1,nxAtBox,nyAtBox,nyAtBox2,iOffsX,iOffsY,iOffsZ;
+	int nzSub,Nr,ir,Nz_lut;
+	int iOffsLimHi,iOffsLimLo,iOffsStep;
+	real c,dx,dy,atomX,atomY,atomZ;
+	double z,x,y,r,ddx,ddy,ddr,dr,r2sqr,x2,y2,potVal,dOffsZ;
+	double atomRadius2;
+	float s11,s12,s21,s22;
+	fftwf_complex	*atPotPtr;
+	float_tt *potPtr=NULL, *ptr;
+	float *atPtr;                  // into the (single precision) atom potential tables
+	fftw_complex dPot;
+	atomBox *aBox;
+#if Z_INTERPOLATION
+	double ddz;
+#endif
+#if USE_Q_POT_OFFSETS
+	fftwf_complex	*atPotOffsPtr;
 #endif
-	nyAtBox   = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
-	nxyAtBox  = nyAtBox*(2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX));
-	nyAtBox2  = 2*nyAtBox;
-	nxyAtBox2 = 2*nxyAtBox;
-	sliceStep = 2*muls->potNx*muls->potNy;
-
-	/*
-	for (i=0;i<nlayer;i++)
-	printf("slice center: %g width: %g\n",slicePos[i],(*muls).cz[i]);
-	*/ 
 
-	/****************************************************************
-	* Loop through all the atoms and add their potential 
-	* to the slices:									 
-	***************************************************************/
+	nx = muls->potNx;
+	ny = muls->potNy;
+	c = muls->sliceThickness * muls->slices;
+	dx = (*muls).resolutionX;
+	dy = (*muls).resolutionY;
+	dr   = muls->resolutionX/OVERSAMP_X;  // define step width in which radial V(r,z) is defined 
+	iRadX = (int)ceil((*muls).atomRadius/dx);
+	iRadY = (int)ceil((*muls).atomRadius/dy);
+	iRadZ = (int)ceil((*muls).atomRadius/muls->sliceThickness);
+	atomRadius2 = (*muls).atomRadius * (*muls).atomRadius;
+	nxAtBox   = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
+	nyAtBox   = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
+	nyAtBox2  = 2*nyAtBox;
+	sliceStep = potSliceStep(muls);
+	if (muls->fftpotential) {
+		nzSub  = luts->NzSub();
+		Nr     = luts->Nr();
+		Nz_lut = luts->NzLut();
+	}
 
-	time(&time0);
-	for (iatom = 0;iatom<natom;iatom++) {
+	for (iList = 0;iList<(int)list.size();iList++) {
+		iatom = list[iList];
 		// make sure we skip vacancies:
-		while (atoms[iatom].Znum == 0) iatom++;
-		if (iatom >=natom) break;
+		if (atoms[iatom].Znum == 0) continue;
 
-		if ((muls->printLevel >= 4) && (muls->displayPotCalcInterval > 0)) {
+		if ((muls->printLevel >= 4) && (muls->displayPotCalcInterval > 0) && (xStart == 0)) {
 			if (((iatom+1) % (muls->displayPotCalcInterval)) == 0) {
 				printf("Adding potential for atom %d (Z=%d, pos=[%.1f, %.1f, %.1f])\n",iatom+1,atoms[iatom].Znum,atoms[iatom].x,atoms[iatom].y,atoms[iatom].z);
 			}
@@ -712,22 +592,13 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		if (muls->potential3D==0)	atomZ += 0.5*muls->sliceThickness;
 		else atomZ -= muls->sliceThickness;
 
-		/* Now we need to find the first atom that contributes to this slice */
-		/* Make use of the fact that we sorted the atoms in z */
+		/* Skip the atoms below this slab, and stop at the first one above
+		 * it: the atoms (and list) are sorted in z */
 		if ((*muls).nonPeriodZ) {
 			if (((*muls).potential3D) && (atomZ -(*muls).atomRadius > c)) break;	 
 			if (((*muls).potential3D==0) && (atomZ > c)) break;		
-			do {
-				// printf("z: %g c: %g\n",atomZ,c);
-				if (((*muls).potential3D) && (atomZ+(*muls).atomRadius+muls->sliceThickness >=0)) break;
-				if (((*muls).potential3D==0) && (atomZ >=0)) break;			  
-				// atomZ = atoms[++iatom].z-c*(real)((*muls).cellDiv-divCount-1)+ (0.5*(*muls).cz[0]*muls->centerSlices);	
-				atomZ = atoms[++iatom].z-c*(real)(muls->cellDiv-divCount-1) + muls->czOffset 
-					-(0.5*muls->sliceThickness*(1-muls->centerSlices));
-				if (muls->potential3D==0)	atomZ += 0.5*muls->sliceThickness;
-				else atomZ -= muls->sliceThickness;
-			}
-			while (iatom < natom-1);
+			if (((*muls).potential3D) && (atomZ+(*muls).atomRadius+muls->sliceThickness < 0)) continue;
+			if (((*muls).potential3D==0) && (atomZ < 0)) continue;			  
 		}
 		/* atom coordinates in cartesian coords
 		* The x- and y-position will be offset by the starting point
@@ -735,6 +606,9 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		*/
 		atomX = atoms[iatom].x -(*muls).potOffsetX;
 		atomY = atoms[iatom].y -(*muls).potOffsetY;
+		// skip the atoms which do not reach into the rows of this thread
+		iAtomX = (int)floor(atomX/dx);
+		if (!rowsInBand(iAtomX-iRadX,iAtomX+iRadX,nx,xStart,xStop)) continue;
 
 		/* so far we need periodicity in z-direction.
 		* This requirement can later be removed, if we 
@@ -749,6 +623,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 		* real space potential lookup table summation
 		************************************************************/
 		if (!muls->fftpotential) {
+			aBox = boxes->Get(muls,atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
 			/* Warning: will assume constant slice thickness ! */
 			/* do not round here: atomX=0..dx -> iAtomX=0 */
 			/*
@@ -766,7 +641,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			// printf("atomZ(%d)=%g(%d)\t",iatom,atomZ,iAtomZ);
 
 			if (muls->displayPotCalcInterval > 0) {
-				if ((muls->printLevel>=3) && ((iatom+1) % muls->displayPotCalcInterval == 0)) {
+				if ((muls->printLevel>=3) && ((iatom+1) % muls->displayPotCalcInterval == 0) && (xStart == 0)) {
 					printf("adding atom %d [%.3f %.3f %.3f (%.3f)], Z=%d\n",
 						iatom+1,atomX+(*muls).potOffsetX,atomY+(*muls).potOffsetY,
 						atoms[iatom].z,atomZ,atoms[iatom].Znum);
@@ -784,6 +659,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 				}
 				x = (double)(iAtomX+iax)*dx-atomX;
 				ix = (iax+iAtomX+16*nx) % nx;	/* shift into the positive range */
+				if ((ix < xStart) || (ix >= xStop)) continue;
 				for (iay=-iRadY;iay<=iRadY;iay++) {
 					if ((*muls).nonPeriod) {
 						if (iay+iAtomY < 0) {
@@ -821,11 +697,9 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 								* We can look up the proj potential at that spot
 								* using trilinear extrapolation.
 								*/
-								atomBoxLookUp(&dPot,muls,atoms[iatom].Znum,x,y,z,
-									muls->tds ? 0 : atoms[iatom].dw);
+								atomBoxLookUp(&dPot,muls,aBox,x,y,z);
 								//    printf("access: %d %d %d\n",iz,ix,iy);
-								muls->trans[iz][ix][iy][0] += dPot[0];
-								muls->trans[iz][ix][iy][1] += dPot[1]; 	
+								addPotential(muls,iz,ix,iy,dPot[0],dPot[1]);
 							} /* end of for iaz=-iRadZ .. iRadZ */
 						} /* end of if potential3D */
 
@@ -837,8 +711,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 								if (iAtomZ >= nlayer)	break;	
 							}		 
 							iz = (iAtomZ+32*nlayer) % nlayer;	  /* shift into the positive range */
-							atomBoxLookUp(&dPot,muls,atoms[iatom].Znum,x,y,0,
-								muls->tds ? 0 : atoms[iatom].dw);
+							atomBoxLookUp(&dPot,muls,aBox,x,y,0);
 							z = (double)(iAtomZ+1)*(*muls).cz[0]-atomZ;
 
 							/* 
@@ -848,22 +721,17 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 							/* split the atom if it is close to the top edge of the slice */
 							//    printf("access: %d %d %d\n",iz,ix,iy);
 							if ((z<0.15*(*muls).cz[0]) && (iz >0)) {
-								muls->trans[iz][ix][iy][0] += 0.5*dPot[0];
-								muls->trans[iz][ix][iy][1] += 0.5*dPot[1]; 
-								muls->trans[iz-1][ix][iy][0] += 0.5*dPot[0];
-								muls->trans[iz-1][ix][iy][1] += 0.5*dPot[1];			
+								addPotential(muls,iz,ix,iy,0.5*dPot[0],0.5*dPot[1]);
+								addPotential(muls,iz-1,ix,iy,0.5*dPot[0],0.5*dPot[1]);
 							}
 							/* split the atom if it is close to the bottom edge of the slice */
 							else {
 								if ((z>0.85*(*muls).cz[0]) && (iz < nlayer-1)) {
-									(*muls).trans[iz][ix][iy][0] += 0.5*dPot[0];
-									(*muls).trans[iz][ix][iy][1] += 0.5*dPot[1];	
-									(*muls).trans[iz+1][ix][iy][0] += 0.5*dPot[0];
-									(*muls).trans[iz+1][ix][iy][1] += 0.5*dPot[1]; 		
+									addPotential(muls,iz,ix,iy,0.5*dPot[0],0.5*dPot[1]);
+									addPotential(muls,iz+1,ix,iy,0.5*dPot[0],0.5*dPot[1]);
 								}
 								else {
-									(*muls).trans[iz][ix][iy][0] += dPot[0];
-									(*muls).trans[iz][ix][iy][1] += dPot[1];	
+									addPotential(muls,iz,ix,iy,dPot[0],dPot[1]);
 								}
 							}
 							/*
@@ -911,11 +779,11 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 						// printf("iatomZ: %d, %d..%d cz=%g, %g (%d), dOffsZ=%g (%d)\n",iAtomZ,iaz0,iaz1,muls->sliceThickness,atomZ,(int)atomZ,(iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub,(int)(iAtomZ+iaz0-atomZ/muls->sliceThickness)*nzSub+0.5);
 						if ((iAtomZ+iaz0 <	muls->slices) && (iAtomZ+iaz1 >= 0)) {
 							// retrieve the pointer for this atom
-							atPotPtr     = getAtomPotential3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut);
+							atPotPtr     = luts->Potential3D(atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
 #if USE_Q_POT_OFFSETS
 							// retrieve the pointer to the array of charge-dependent potential offset
-							// This function will return NULL; if the charge of this atom is zero:
-							atPotOffsPtr = getAtomPotentialOffset3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut,atoms[iatom].q);
+							// NULL if the charge of this atom is zero:
+							atPotOffsPtr = atoms[iatom].q == 0 ? NULL : luts->Offset3D(atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
 #endif // USE_Q_POT_OFFSETS
 							iOffsLimHi   =  Nr*(Nz_lut-1);
 							iOffsLimLo   = -Nr*(Nz_lut-1);
@@ -924,7 +792,8 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 							// Slices around the slice that this atom is located in must be affected by this atom:
 							// iaz must be relative to the first slice of the atom potential box.
 							for (iax=iax0; iax <= iax1; iax++) {
-								potPtr = &(muls->trans[iAtomZ+iaz0][iax][iay0][0]);
+								if ((iax < xStart) || (iax >= xStop)) continue;
+								potPtr = potentialPixel(muls,iAtomZ+iaz0,iax,iay0);
 								// potPtr = &(muls->trans[iAtomZ-iaz0+iaz][iax][iay0][0]);
 								// printf("access: %d %d %d (%d)\n",iAtomZ+iaz0,iax,iay0,(int)potPtr);							
 
@@ -1019,7 +888,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 										} // end of iaz-loop
 									} // if ir < Nr
 									// advance pointer to next complex potential point:
-									potPtr+=2;
+									potPtr += potStep(muls);
 									// make imaginary part zero for now
 									// *potPtr = 0;
 									// potPtr++;
@@ -1047,30 +916,35 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 					iay1 = iAtomY+iRadY >= muls->potNy ? muls->potNy-1 : iAtomY+iRadY;
 					// if within the potential map range:
 					if ((iax0 <  muls->potNx) && (iax1 >= 0) && (iay0 <  muls->potNy) && (iay1 >= 0)) {
-						ddx = (-(double)iax0+(atomX/dx-(double)iRadX))*(double)OVERSAMP_X;
-						ddy = (-(double)iay0+(atomY/dy-(double)iRadY))*(double)OVERSAMP_X;
+						// the table starts at (iAtomX-iRadX, iAtomY-iRadY), also if that is cut away
+						ddx = (-(double)(iAtomX-iRadX)+(atomX/dx-(double)iRadX))*(double)OVERSAMP_X;
+						ddy = (-(double)(iAtomY-iRadY)+(atomY/dy-(double)iRadY))*(double)OVERSAMP_X;
 						iOffsX = (int)floor(ddx);
 						iOffsY = (int)floor(ddy);
 						ddx -= (double)iOffsX;
 						ddy -= (double)iOffsY;
+						iOffsX += OVERSAMP_X*(iax0-iAtomX+iRadX);
+						iOffsY += OVERSAMP_X*(iay0-iAtomY+iRadY);
 						s11 = (1-ddx)*(1-ddy);
 						s12 = (1-ddx)*ddy;
 						s21 = ddx*(1-ddy);
 						s22 = ddx*ddy;
-						atPotPtr = getAtomPotential2D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw);
+						atPotPtr = luts->Potential2D(atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
 
 						for (iax=iax0; iax < iax1; iax++) {
+							if ((iax < xStart) || (iax >= xStop)) continue;
 							// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
 							// potPtr and ptr are of type (float *)
-							potPtr = &(muls->trans[iAtomZ][iax][iay0][0]);
-							ptr = &(atPotPtr[(iOffsX+OVERSAMP_X*(iax-iax0))*nyAtBox+iOffsY][0]);
-							for (iay=iay0; iay < iay1; iay++) {
-								*potPtr += s11*(*ptr)+s12*(*(ptr+2))+s21*(*(ptr+nyAtBox2))+s22*(*(ptr+nyAtBox2+2));
-
-								potPtr++;
-								// *potPtr = 0;
-								potPtr++;
-								ptr += 2*OVERSAMP_X;
+							// the interpolation must not read beyond the last row or column of the table
+							if (iOffsX+OVERSAMP_X*(iax-iax0) >= nxAtBox-1) break;
+							potPtr = potentialPixel(muls,iAtomZ,iax,iay0);
+							atPtr = &(atPotPtr[(iOffsX+OVERSAMP_X*(iax-iax0))*nyAtBox+iOffsY][0]);
+							for (iay=iay0; (iay < iay1) && (iOffsY+OVERSAMP_X*(iay-iay0) < nyAtBox-1); iay++) {
+								*potPtr += s11*(*atPtr)+s12*(*(atPtr+2))+s21*(*(atPtr+nyAtBox2))+s22*(*(atPtr+nyAtBox2+2));
+
+								// *(potPtr+1) = 0;
+								potPtr += potStep(muls);
+								atPtr += 2*OVERSAMP_X;
 							}
 						}
 
@@ -1101,11 +975,11 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 					// printf("%d: iatomZ: %d, %d cz=%g, %g\n",iatom,iAtomZ,iaz0,muls->sliceThickness,atomZ);
 					if ((iAtomZ+iaz0 <  muls->slices) && (iAtomZ+iaz1 >= 0)) {
 						// retrieve the pointer for this atom
-						atPotPtr = getAtomPotential3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut);
+						atPotPtr = luts->Potential3D(atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
 #if USE_Q_POT_OFFSETS
 						// retrieve the pointer to the array of charge-dependent potential offset
-						// This function will return NULL; if the charge of this atom is zero:
-						atPotOffsPtr = getAtomPotentialOffset3D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw,&nzSub,&Nr,&Nz_lut,atoms[iatom].q);
+						// NULL if the charge of this atom is zero:
+						atPotOffsPtr = atoms[iatom].q == 0 ? NULL : luts->Offset3D(atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
 #endif // USE_Q_POT_OFFSETS
 						iOffsLimHi =	Nr*(Nz_lut-1);
 						iOffsLimLo = -Nr*(Nz_lut-1);
@@ -1114,7 +988,9 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 						// Slices around the slice that this atom is located in must be affected by this atom:
 						// iaz must be relative to the first slice of the atom potential box.
 						for (iax=iax0; iax < iax1; iax++) {
-							potPtr = &(muls->trans[iAtomZ+iaz0][(iax+2*muls->potNx) % muls->potNx][(iay0+2*muls->potNy) % muls->potNy][0]);
+							ix = (iax+2*muls->potNx) % muls->potNx;
+							if ((ix < xStart) || (ix >= xStop)) continue;
+							potPtr = potentialPixel(muls,iAtomZ+iaz0,ix,(iay0+2*muls->potNy) % muls->potNy);
 							// potPtr = &(muls->trans[iAtomZ-iaz0+iaz][iax][iay0][0]);
 							x2 = iax*dx - atomX;	x2 *= x2;
 							for (iay=iay0; iay < iay1; ) {
@@ -1200,13 +1076,13 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 									}
 								} // if ir < Nr-1
 								// advance pointer to next complex potential point:
-								potPtr+=2;
+								potPtr += potStep(muls);
 								// make imaginary part zero for now
 								// *potPtr = 0;
 								// potPtr++;
 
 								// wrap around when end of y-line is reached:
-								if (++iay % muls->potNy == 0) potPtr -= 2*muls->potNy;		
+								if (++iay % muls->potNy == 0) potPtr -= potStep(muls)*muls->potNy;		
 							}   
 						}
 					} // iaz0+iAtomZ < muls->slices
@@ -1237,39 +1113,337 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 					s12 = ddx*(1-ddy);
 					s11 = ddx*ddy;
 
-					atPotPtr = getAtomPotential2D(atoms[iatom].Znum,muls,muls->tds ? 0 : atoms[iatom].dw);
+					atPotPtr = luts->Potential2D(atoms[iatom].Znum,muls->tds ? 0 : atoms[iatom].dw);
+
+					// if (iatom < 3) printf("atom #%d: ddx=%g, ddy=%g iatomZ=%d, atomZ=%g, %g\n",iatom,ddx,ddy,iAtomZ,atomZ,atoms[iatom].z);
+					for (iax=iax0; iax < iax1; iax++) {  // TODO: should use ix += OVERSAMP_X
+						// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
+						// potPtr and ptr are of type (float *)
+						//////////////////
+						// Only the exact slice that this atom is located in is affected by this atom:
+						int atPosX = (OVERSAMP_X*(iax-iax0)-iOffsX);
+						ix = iax % muls->potNx;
+						if ((ix < xStart) || (ix >= xStop)) continue;
+						if ((atPosX >= 0) && (atPosX < nyAtBox-1)) {
+							atPtr = &(atPotPtr[atPosX*nyAtBox-iOffsY][0]);
+						for (iay=iay0; iay < iay1; iay++) {
+							// wrap around when end of y-line is reached:
+								int atPosY = (iay-iay0)*OVERSAMP_X-iOffsY; 
+								if ((atPosY < nyAtBox-1) && (atPosY >=0)) {
+							// do the real part
+									*potentialPixel(muls,iAtomZ,ix,iay % muls->potNy) +=
+									     s11*(*atPtr)+s12*(*(atPtr+2))+s21*(*(atPtr+nyAtBox2))+s22*(*(atPtr+nyAtBox2+2));
+								}
+							// make imaginary part zero for now
+								// *potPtr = 0;  potPtr++;
+							atPtr += 2*OVERSAMP_X;
+						}
+						} // if atPosX within limits
+					}   
+				}  // muls->potential3D	== 0
+			}
+			////////////////////////////////////////////////////////////////////
+		} /* end of if (fftpotential) */
+	} /* for iatom =0 ... */
+}
+
+/*****************************************************
+* void make3DSlices()
+*
+* This function will create a 3D potential from whole
+* unit cell, slice it, and make transr/i and propr/i
+* Call this function with center = NULL, if you don't
+* want the array to be shifted.
+****************************************************/
+void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
+	// FILE *fpu2;
+	char fileOut[512]; // RAM: this is terrible, why is fileName a function argument and here we have filename?  FIXED: rename function argument to fileIn and this to fileOut
+	int natom,iz;  /* number of atoms */
+	atom *atoms;
+	real dx,dy,dz;
+	real c;
+	int i=0,j,nx,ny,ix,iy;
+	int nBands;                    // threads of the atom loop
+	PotentialLUTCachePtr luts;     // with fftpotential
+	AtomBoxCachePtr boxes;         // without fftpotential
+
+	real *slicePos;
+	double ddx,ddy,potVal;
+	// char *sliceFile = "slices.dat";
+	char buf[BUF_LEN];
+	FILE *sliceFp, *fp;
+	real minX,maxX,minY,maxY,minZ,maxZ;
+	time_t time0,time1;
+	static int divCount = 0;
+	static real **tempPot = NULL;
+#if FLOAT_PRECISION == 1
+	static fftwf_complex ***oldTrans = NULL;
+	static fftwf_complex ***oldTrans0 = NULL;
+#else
+	static fftw_complex ***oldTrans = NULL;
+	static fftw_complex ***oldTrans0 = NULL;
+#endif
+	ImageIOPtr imageIO = ImageIOPtr(new CImageIO(muls->potNx,muls->potNy,
+				muls->sliceThickness,muls->resolutionX,muls->resolutionY));
+
+	if ((muls->trans == NULL) && (muls->transStore == NULL)) {
+		printf("Severe error: trans-array not allocated - exit!\n");
+		exit(0);
+	}
+
+	if ((oldTrans0 == NULL) && (muls->trans != NULL)) {
+#if FLOAT_PRECISION == 1
+		oldTrans0 = (fftwf_complex ***)fftw_malloc(nlayer * sizeof(fftwf_complex**));
+#else
+		oldTrans0 = (fftw_complex ***)fftw_malloc(nlayer * sizeof(fftw_complex**));
+#endif
+		for (i=0;i<nlayer;i++) {
+			// printf("%d %d\n",i,(int)(muls->trans));
+			oldTrans0[i] = muls->trans[i]; 
+		}
+		oldTrans = muls->trans;
+	}
+	if (oldTrans != muls->trans)
+		printf("Warning: Transmission function pointer has changed!\n");
+
+	/* return, if there is nothing to do */
+	if (nlayer <1)
+		return;
+
+	nx = muls->potNx;
+	ny = muls->potNy;
+
+
+
+	/* we need to keep track of which subdivision of the unit cell we are in
+	* If the cell is not subdivided, then muls.cellDiv-1 = 0.
+	*/
+	if ((divCount == 0) || (muls->equalDivs))
+		divCount = muls->cellDiv;
+	divCount--;
+
+	/* we only want to reread and shake the atoms, if we have finished the 
+	* current unit cell.
+	*/
+	if (divCount == muls->cellDiv-1) {
+		if (muls->avgCount == 0) {
+			// if this is the first run, the atoms have already been
+			// read during initialization
+			natom = (*muls).natom;
+			atoms = (*muls).atoms;
+		}
+		else {
+			/* 
+			the following function makes an array of natom atoms from
+			the input file (with x,y,z,dw,occ);
+			*/
+			// the last parameter is handleVacancies.  If it is set to 1 vacancies 
+
+			// and multiple occupancies will be handled. 
+			atoms = readUnitCell(&natom,fileIn,muls,1);
+			if (muls->printLevel>=3)
+				printf("Read %d atoms from %s, tds: %d\n",natom,fileIn,muls->tds);
+			muls->natom = natom;
+			muls->atoms = atoms;
+		}
+		minX = maxX = atoms[0].x;
+		minY = maxY = atoms[0].y;
+		minZ = maxZ = atoms[0].z;
+
+		for (i=0;i<natom;i++) {
+			if (atoms[i].x < minX) minX = atoms[i].x;
+			if (atoms[i].x > maxX) maxX = atoms[i].x;
+			if (atoms[i].y < minY) minY = atoms[i].y;
+			if (atoms[i].y > maxY) maxY = atoms[i].y;
+			if (atoms[i].z < minZ) minZ = atoms[i].z;
+			if (atoms[i].z > maxZ) maxZ = atoms[i].z;
+		}
+		/*
+		printf("Root of mean square TDS displacement: %f A (wobble=%g at %gK) %g %g %g\n",
+		sqrt(u2/natom),wobble,(*muls).tds_temp,ux,uy,uz);
+		*/
+		if (muls->printLevel >= 2) {
+			printf("range of thermally displaced atoms (%d atoms): \n",natom);
+			printf("X: %g .. %g\n",minX,maxX);
+			printf("Y: %g .. %g\n",minY,maxY);
+			printf("Z: %g .. %g\n",minZ,maxZ);
+		}
+		/* 
+		define the center of our unit cell by moving the atom specified
+		by "center" at position (0.5,0.5,0.0) 
+		*/
+
+		if (center != NULL) {
+			dx = (*muls).ax/2.0f - (*center).x;	
+			dy = (*muls).by/2.0f - (*center).y;	
+			dz = -(*center).z;
+			for (i=0;i<natom;i++) {
+				atoms[i].x += dx;
+				if (atoms[i].x < 0.0f) atoms[i].x += (*muls).ax;
+				else if (atoms[i].x > (*muls).ax) atoms[i].x -= (*muls).ax;
+				atoms[i].y += dy;
+				if (atoms[i].y < 0.0f) atoms[i].y += (*muls).by;
+				else if (atoms[i].y > (*muls).by) atoms[i].y -= (*muls).by;
+				atoms[i].z += dz;
+				if (atoms[i].z < 0.0f) atoms[i].z += (*muls).c;
+				else if (atoms[i].z > (*muls).c) atoms[i].z -= (*muls).c;
+			}
+		}
+
+		/**********************************************************
+		* Sort the atoms in z.
+		*********************************************************/
+		// RAM I think this is not working correctly to output the file
+		// Muls passed in as *muls, so by pointer rather than by-value.
+		// Ok, and cfgFile is not set before here...  Look at Muls and see if there's been some variable confusion
+
+
+		printf( "DEBUG: stemlib::make3Dslices : muls.cfgFile = %s \n", muls->cfgFile );
+
+		qsort(atoms,natom,sizeof(atom),atomCompare);
+		muls->atomCells = AtomCellsPtr(new AtomCells(atoms,natom,muls->atomRadius));
+
+
+		if ((*muls).cfgFile != NULL) 
+		{
+			sprintf(buf,"%s/%s",muls->folder,muls->cfgFile);
+			// append the TDS run number
+			if (strcmp(buf+strlen(buf)-4,".cfg") == 0) *(buf+strlen(buf)-4) = '\0';
+			if (muls->tds) sprintf(buf+strlen(buf),"_%d.cfg",muls->avgCount);
+			else sprintf(buf+strlen(buf),".cfg");
+		
+			// printf("Will write CFG file <%s> (%d)\n",buf,muls->tds)
+			writeCFG(atoms,natom,buf,muls);
+		}
+	} /* end of if divCount==cellDiv-1 ... */
+	else {
+		natom = muls->natom;
+		atoms = muls->atoms;
+	}
+
+	/************************************************************** 
+	*	setup the slices with their start and end positions
+	*	then loop through all the atoms and add their potential to
+	*	the slice that their potential reaches into (up to RMAX)
+	*************************************************************/
+	// c = (*muls).c/(real)((*muls).cellDiv);
+	c = muls->sliceThickness * muls->slices;
+
+	if (muls->printLevel >= 3) {
+		printf("Slab thickness: %gA z-offset: %gA (cellDiv=%d)\n",
+			c,c*(real)(muls->cellDiv-divCount-1),divCount);
+	}	 
+	/*******************************************************
+	* initializing slicPos, cz, and transr
+	*************************************************************/
+	if ((muls->trans != NULL) && (oldTrans0[0] != muls->trans[0])) {
+		printf("Warning: transmision array pointers have changed!\n");
+		for (i=0;i<nlayer;i++)
+			muls->trans[i] = oldTrans0[i];
+	}
+	/*
+	if (oldTrans0[0][0] != muls->trans[0][0]) {
+	printf("Warning: transmision array pointers have changed!\n");
+	for (i=0;i<nlayer;i++)
+	muls->trans[i] = oldTrans0[i];
+	}
+	*/
+	if ((*muls).cz == NULL) {
+		(*muls).cz = float1D(nlayer,"cz");
+	}
+	// sliceFp = fopen(sliceFile,"r");
+	sliceFp = NULL;
+	slicePos = float1D(nlayer,"slicePos");
+
+
+	if (muls->sliceThickness == 0)
+		(*muls).cz[0] = c/(real)nlayer;
+	else
+		(*muls).cz[0] = muls->sliceThickness;
+	slicePos[0] = (*muls).czOffset;  
+	/*
+	************************************************************/
+
+
+	for (i=1;i<nlayer;i++) {
+		if (sliceFp == NULL) (*muls).cz[i] = (*muls).cz[0];  
+		/* don't need to all be the same, yes they do for fast 3D-FFT method! */
+		else {
+			fgets(buf,BUF_LEN,sliceFp);
+			(*muls).cz[i] = atof(buf);
+		}
+		slicePos[i] = slicePos[i-1]+(*muls).cz[i-1]/2.0+(*muls).cz[i]/2.0;
+	}
+
+	clearPotential(muls);
+	/* check whether we have constant slice thickness */
 
-					// if (iatom < 3) printf("atom #%d: ddx=%g, ddy=%g iatomZ=%d, atomZ=%g, %g\n",iatom,ddx,ddy,iAtomZ,atomZ,atoms[iatom].z);
-					for (iax=iax0; iax < iax1; iax++) {  // TODO: should use ix += OVERSAMP_X
-						// printf("(%d, %d): %d,%d\n",iax,nyAtBox,(iOffsX+OVERSAMP_X*(iax-iax0)),iOffsY+iay1-iay0);
-						// potPtr and ptr are of type (float *)
-						//////////////////
-						// Only the exact slice that this atom is located in is affected by this atom:
-						int atPosX = (OVERSAMP_X*(iax-iax0)-iOffsX);
-						if ((atPosX >= 0) && (atPosX < nyAtBox-1)) {
-							ptr = &(atPotPtr[atPosX*nyAtBox-iOffsY][0]);
-						for (iay=iay0; iay < iay1; iay++) {
-							// wrap around when end of y-line is reached:
-								int atPosY = (iay-iay0)*OVERSAMP_X-iOffsY; 
-								if ((atPosY < nyAtBox-1) && (atPosY >=0)) {
-							// do the real part
-									muls->trans[iAtomZ][iax % muls->potNx][iay % muls->potNy][0] +=
-									     s11*(*ptr)+s12*(*(ptr+2))+s21*(*(ptr+nyAtBox2))+s22*(*(ptr+nyAtBox2+2));
-								}
-							// make imaginary part zero for now
-								// *potPtr = 0;  potPtr++;
-							ptr += 2*OVERSAMP_X;
-						}
-						} // if atPosX within limits
-					}   
-				}  // muls->potential3D	== 0
+	if (muls->fftpotential) {
+		for (i = 0;i<nlayer;i++)  if ((*muls).cz[0] != (*muls).cz[i]) break;
+		if (i<nlayer) printf("Warning: slice thickness not constant, will give wrong results (iz=%d)!\n",i);
+
+	}
+
+	/*************************************************************************
+	* read the potential that has been created externally!
+	* If any of the slices is missing, it is calculated here instead.
+	*/
+	if (muls->readPotential) {
+		for (i=(divCount+1)*muls->slices-1;i>=(divCount)*muls->slices;i--) {
+			sprintf(buf,"%s/potential_%d.img",muls->folder,i);
+			if ((fp = fopen(buf,"r")) == NULL) break;
+			fclose(fp);
+		}
+		if (i < divCount*muls->slices) {
+			for (i=(divCount+1)*muls->slices-1,j=0;i>=(divCount)*muls->slices;i--,j++) {
+				sprintf(buf,"%s/potential_%d.img",muls->folder,i);
+				imageIO->ReadImage((void **)tempPot,nx,ny,buf);
+				for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
+					*potentialPixel(muls,j,ix,iy) = tempPot[ix][iy];
+				}
 			}
-			////////////////////////////////////////////////////////////////////
-		} /* end of if (fftpotential) */
-	} /* for iatom =0 ... */
+			return;
+		}
+		if (muls->printLevel) printf("Cannot find %s, will calculate the potential\n",buf);
+	}
+
+	// reset the potential to zero:  
+	clearPotential(muls);
+
+	/*
+	for (i=0;i<nlayer;i++)
+	printf("slice center: %g width: %g\n",slicePos[i],(*muls).cz[i]);
+	*/ 
+
+	/****************************************************************
+	* Loop through all the atoms and add their potential 
+	* to the slices:									 
+	***************************************************************/
+
+	/* Every thread adds the atoms to its own band of rows ix, so that no
+	 * two threads write to the same pixel, and each pixel gets its 
+	 * contributions in the same order (that of the atoms) as in the 
+	 * serial loop.  The lookup tables of the atom potentials are filled
+	 * in beforehand, since the threads can only read them; the atom
+	 * boxes (without fftpotential) are made by the threads as needed. */
+	time(&time0);
+	if (muls->fftpotential) {
+		prepareAtomPotentials(muls,atoms,natom);
+		luts = potentialLUTCache(muls);
+	}
+	else boxes = atomBoxCache(muls);
+	nBands = omp_get_max_threads();
+	if (nBands > nx) nBands = nx;
+#pragma omp parallel for schedule(static,1) num_threads(nBands)
+	for (i=0;i<nBands;i++) {
+		// only the atoms of the cells which reach into this band and slab
+		std::vector<int> list;
+		collectAtoms(muls,divCount,(i*nx)/nBands,((i+1)*nx)/nBands,list);
+		addAtomPotentials(muls,luts.get(),boxes.get(),atoms,list,nlayer,divCount,(i*nx)/nBands,((i+1)*nx)/nBands);
+	}
 	time(&time1);
-	if (iatom > 0)
-	if (muls->printLevel) printf("%g sec used for real space potential calculation (%g sec per atom)\n",difftime(time1,time0),difftime(time1,time0)/iatom);
+	if (natom > 0)
+	if (muls->printLevel) printf("%g sec used for real space potential calculation (%g sec per atom, %d threads)\n",difftime(time1,time0),difftime(time1,time0)/natom,nBands);
 	else
 	if (muls->printLevel) printf("%g sec used for real space potential calculation\n",difftime(time1,time0));
 
@@ -1284,8 +1458,9 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			showCrossSection(muls,(*muls).transr[iz],nx,1,0);
 			*/	
 			// find the maximum value of each layer:
-			potVal = muls->trans[iz][0][0][0];
-			for (ddx=potVal,ddy = potVal,ix=0;ix<muls->potNy*muls->potNx;potVal = muls->trans[iz][0][++ix][0]) {
+			potVal = *potentialPixel(muls,iz,0,0);
+			for (ddx=potVal,ddy=potVal,ix=0;ix<muls->potNx;ix++) for (iy=0;iy<muls->potNy;iy++) {
+				potVal = *potentialPixel(muls,iz,ix,iy);
 				if (ddy<potVal) ddy = potVal; 
 				if (ddx>potVal) ddx = potVal; 
 			}
@@ -1301,7 +1476,14 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 			imageIO->SetThickness(muls->sliceThickness);
 			sprintf(buf,"Projected Potential (slice %d)",iz);		 
 			imageIO->SetComment(buf);
-			imageIO->WriteComplexImage( (void **)muls->trans[iz], fileOut );
+			if (muls->transStore) {
+				// the rows of a slice of transStore need not be contiguous
+				if (tempPot == NULL) tempPot = float2D(muls->potNx,muls->potNy,"total projected potential");
+				for (ix=0;ix<muls->potNx;ix++) 
+					memcpy(tempPot[ix],muls->transStore->Potential()[iz][ix],muls->potNy*sizeof(float_tt));
+				imageIO->WriteRealImage( (void **)tempPot, fileOut );
+			}
+			else imageIO->WriteComplexImage( (void **)muls->trans[iz], fileOut );
 		} // loop through all slices
 	} /* end of if savePotential ... */
 	if (muls->saveTotalPotential) {
@@ -1309,7 +1491,7 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 
 		for (ix=0;ix<muls->potNx;ix++) for (iy=0;iy<muls->potNy;iy++) {
 			tempPot[ix][iy] = 0;
-			for (iz=0;iz<nlayer;iz++) tempPot[ix][iy] += muls->trans[iz][ix][iy][0];
+			for (iz=0;iz<nlayer;iz++) tempPot[ix][iy] += *potentialPixel(muls,iz,ix,iy);
 		}
 
 		for (ddx=tempPot[0][0],ddy = potVal,ix=0;ix<muls->potNy*muls->potNx;potVal = tempPot[0][++ix]) {
@@ -1336,525 +1518,366 @@ void make3DSlices(MULS *muls,int nlayer,char *fileIn,atom *center) {
 
 
 /********************************************************************************
-* Create Lookup table for 3D potential due to neutral atoms
+* PotentialLUTCache: the lookup tables for the 3D potential due to neutral 
+* atoms, the 3D potential offset due to charged atoms (ions), and the 2D
+* potential, see stemlib.h
 ********************************************************************************/
 #define PHI_SCALE 47.87658
-fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut) {
-	int ix,iy,iz,iiz,ind3d,iKind,izOffset;
-	double zScale,kzmax,zPos,xPos;
-	fftwf_plan plan;
-	static double f,phase,s2,s3,kmax2,smax2,kx,kz,dkx,dky,dkz; // ,dx2,dy2,dz2;
-	static int nx,ny,nz,nzPerSlice;
-	static fftwf_complex **atPot = NULL;
-	static fftwf_complex *temp = NULL;
-#if SHOW_SINGLE_POTENTIAL == 1
-	ImageIOPtr imageio = ImageIOPtr();
-	static fftwf_complex *ptr = NULL;
-	static char fileName[256];
-#endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
+#define LUT_3D     0
+#define LUT_OFFS3D 1
+#define LUT_2D     2
 
+// limits the scattering factors of table (scatPar or scatParOffs) to kmax
+static void cutScatteringFactors(double table[N_ELEM][N_SF], double kmax, const char *name, int printLevel) {
+	int ix,iy;
 
-	// scattering factors in:
-	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(N_SF, "splinb" );
-		splinc = double1D(N_SF, "splinc" );
-		splind = double1D(N_SF, "splind" );
+	table[0][N_SF-1] = 1.2*kmax;
+	table[0][N_SF-2] = 1.1*kmax;
+	table[0][N_SF-3] = kmax;
+	// adjust the resolution of the lookup table if necessary
+	if (table[0][N_SF-4] > table[0][N_SF-3]) {
+		// set additional scattering parameters to zero:
+		for (ix = 0;ix < N_SF-10;ix++) {
+			if (table[0][N_SF-4-ix] < table[0][N_SF-3]-0.001*(ix+1)) break;
+			table[0][N_SF-4-ix] = table[0][N_SF-3]-0.001*(ix+1);
+			for (iy=1; iy<N_ELEM;iy++) table[iy][N_SF-4-ix] = 0; 
+		}
+		if (printLevel > 1) printf("%s: set resolution of scattering factor to %g/A!\n",name,table[0][N_SF-4-ix]);
+	}
+}
 
+PotentialLUTCache::PotentialLUTCache(MULS *muls) :
+m_sliceThickness(muls->sliceThickness),
+m_resolutionX(muls->resolutionX),
+m_resolutionY(muls->resolutionY),
+m_printLevel(muls->printLevel)
+{
+	m_nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
+	m_ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
+	// The FFT-resolution in the z-direction must be high enough to avoid 
+	// artifacts due to premature cutoff of the rec. space scattering factor 
+	// we will therefore make it roughly the same as the x-resolution
+	// However, we will make sure that a single slice contains an integer number 
+	// of sampling points.
+	m_nzPerSlice = (int)floor(OVERSAMP_X*muls->sliceThickness/muls->resolutionX);
+	// make nzPerSlice odd:
+	if (2.0*(m_nzPerSlice >> 1) == m_nzPerSlice) m_nzPerSlice += 1;
+	// Total number of z-positions should be twice that of atomRadius/sliceThickness 
+	m_nz = (2*(int)ceil(muls->atomRadius/muls->sliceThickness))*m_nzPerSlice;
+	if (m_printLevel > 1) printf("Will use %d sampling points per slice, total nz=%d (%d)\n",m_nzPerSlice,m_nz,m_nzPerSlice >> 1);
+
+	m_dkx = 0.5*OVERSAMP_X/(m_nx*muls->resolutionX);  // nx*muls->resolutionX is roughly 2*muls->atomRadius
+	m_dky = 0.5*OVERSAMP_X/(m_ny*muls->resolutionY);
+	m_dkz = m_nzPerSlice/(double)(m_nz*muls->sliceThickness);
+	m_kmax2 = 0.5*m_nx*m_dkx/(double)OVERSAMP_X;  // largest k that we'll admit
+	if (m_printLevel > 1) printf("Cutoff scattering angle: kmax=%g (1/A), dk=(%g,%g %g)\n",m_kmax2,m_dkx,m_dky,m_dkz);
+	cutScatteringFactors(scatPar,m_kmax2,"PotentialLUTCache",m_printLevel);
+#if USE_REZ_SFACTS
+	cutScatteringFactors(scatParOffs,m_kmax2,"PotentialLUTCache (offsets)",m_printLevel);
+#endif
+	m_kmax2 *= m_kmax2;
 
-		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
-		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
-		// The FFT-resolution in the z-direction must be high enough to avoid 
-		// artifacts due to premature cutoff of the rec. space scattering factor 
-		// we will therefore make it roughly the same as the x-resolution
-		// However, we will make sure that a single slice contains an integer number 
-		// of sampling points.
-		nzPerSlice = (int)floor(OVERSAMP_X*muls->sliceThickness/muls->resolutionX);
-		// make nzPerSlice odd:
-		if (2.0*(nzPerSlice >> 1) == nzPerSlice) nzPerSlice += 1;
-		// Total number of z-positions should be twice that of atomRadius/sliceThickness 
-		nz = (2*(int)ceil(muls->atomRadius/muls->sliceThickness))*nzPerSlice;
-		if (muls->printLevel > 1) printf("Will use %d sampling points per slice, total nz=%d (%d)\n",nzPerSlice,nz,nzPerSlice >> 1);
-
-		dkx = 0.5*OVERSAMP_X/(nx*muls->resolutionX);  // nx*muls->resolutionX is roughly 2*muls->atomRadius
-		dky = dkx;                                    
-		dkz = nzPerSlice/(double)(nz*muls->sliceThickness);
-		kmax2 = 0.5*nx*dkx/(double)OVERSAMP_X;  // largest k that we'll admit
-		smax2 = kmax2;
-
-		printf("dkx = %g, nx = %d, kmax2 = %g\n",dkx,nx,kmax2);
-		if (muls->printLevel > 1) printf("Cutoff scattering angle: kmax=%g (1/A), dk=(%g,%g %g)\n",kmax2,dkx,dky,dkz);
-		scatPar[0][N_SF-1] = 1.2*smax2;
-		scatPar[0][N_SF-2] = 1.1*smax2;
-		scatPar[0][N_SF-3] = smax2;
-		// adjust the resolution of the lookup table if necessary
-		if (scatPar[0][N_SF-4] > scatPar[0][N_SF-3]) {
-
-			if (1) {
-				// set additional scattering parameters to zero:
-				for (ix = 0;ix < N_SF-10;ix++) {
-					if (scatPar[0][N_SF-4-ix] < scatPar[0][N_SF-3]-0.001*(ix+1)) break;
-					scatPar[0][N_SF-4-ix] = scatPar[0][N_SF-3]-0.001*(ix+1);
-					for (iy=1; iy<N_ELEM;iy++) scatPar[iy][N_SF-4-ix] = 0; 
-				}
-			}
-			else {
-				for (ix = 0;ix < 20;ix++) {
-					if (scatPar[0][N_SF-4-ix] < scatPar[0][N_SF-3]) break;
-					scatPar[0][N_SF-4-ix] = scatPar[0][N_SF-3];
-					for (iy=1; iy<N_ELEM;iy++) scatPar[iy][N_SF-4-ix] = scatPar[iy][N_SF-3];	
-				}
-			}		
-			if (muls->printLevel > 1) printf("getAtomPotential3D: set resolution of scattering factor to %g/A!\n",
-				scatPar[0][N_SF-4-ix]);
-		}	// end of if (scatPar[0][N_SF-4] > scatPar[0][N_SF-3])
-		smax2 *= smax2;
-		kmax2 *= kmax2;
-		// allocate a list of pointers for the element-specific potential lookup table
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
-		temp  = (fftwf_complex*) fftwf_malloc(nx*nz*sizeof(fftwf_complex));
-	}
-	// initialize this atom, if it has not been done yet:
-	if (atPot[Znum] == NULL) {
-		iKind = Znum;
+	// the fftw planner is not thread safe, so the plans are made here:
+	m_plan3D = fftBackend<float>()->Plan2D(m_nz,m_nx,FFTW_BACKWARD);
+	m_plan2D = fftBackend<float>()->Plan2D(m_nx,m_ny,FFTW_BACKWARD);
+	if (muls->potentialCacheFolder[0] != '\0') 
+		m_disk = TableCachePtr(new TableCache(muls->potentialCacheFolder));
+}
 
-		// setup cubic spline interpolation:
-		splinh(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF);
-
-		// allocate a 3D array:
-		atPot[Znum] = (fftwf_complex*) fftwf_malloc(nx*nz/4*sizeof(fftwf_complex));
-		memset(temp,0,nx*nz*sizeof(fftwf_complex));
-		kzmax	  = dkz*nz/2.0; 
-		// define x-and z-position of atom center:
-		// The atom should sit in the top-left corner, 
-		// however (nzPerSlice+1)/2 above zero in z-direction
-		xPos = -2.0*PI*0.0;  // or muls->resolutionX*nx/(OVERSAMP_X), if in center
-		izOffset = (nzPerSlice-1)/2;
-		zPos = -2.0*PI*(muls->sliceThickness/nzPerSlice*(izOffset));
-
-		// What this look-up procedure will do is to supply V(r,z) computed from fe(q).
-		// Since V(r,z) is rotationally symmetric we might as well compute 
-		// V(x,y,z) at y=0, i.e. V(x,z).  
-		// In order to do the proper 3D inverse FT without having to do a complete 3D FFT
-		// we will pre-compute the qy-integral for y=0.
-
-		// kzborder = dkz*(nz/(2*OVERSAMP_Z) -1); 
-		for (iz=0;iz<nz;iz++) {
-			kz = dkz*(iz<nz/2 ? iz : iz-nz);	
-			// We also need to taper off the potential in z-direction
-			// in order to avoid cutoff artifacts.
-			// zScale = fabs(kz) <= kzborder ? 1.0 : 0.5+0.5*cos(M_PI*(fabs(kz)-kzborder)/(kzmax-kzborder));
-			// printf("iz=%d, kz=%g, zScale=%g ",iz,kz,zScale);
-			for (ix=0;ix<nx;ix++) {
-				kx = dkx*(ix<nx/2 ? ix : ix-nx);	   
-				s2 = (kx*kx+kz*kz);
-				// if this is within the allowed circle:
-				if (s2<smax2) {
-					ind3d = ix+iz*nx;
-					// f = fe3D(Znum,k2,muls->tds,1.0,muls->scatFactor);
-					// multiply scattering factor with Debye-Waller factor:
-					// printf("k2=%g,B=%g, exp(-k2B)=%g\n",k2,B,exp(-k2*B));
-					f = seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF,sqrt(s2))*exp(-s2*B*0.25);
-					// perform the qy-integration for qy <> 0:
-					for (iy=1;iy<nx;iy++) {
-						s3 = dkx*iy;
-						s3 = s3*s3+s2;
-						if (s3<smax2) {
-							f += 2*seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF,sqrt(s3))*exp(-s3*B*0.25);
-						}
-						else break;
-					}
-					f *= dkx;  
-					// note that the factor 2 is missing in the phase (2pi k*r)
-					// this places the atoms in the center of the box.
-					phase	= kx*xPos + kz*zPos;
-					temp[ind3d][0] = f*cos(phase);  // *zScale
-					temp[ind3d][1] = f*sin(phase);  // *zScale
-					// if ((kx==0) && (ky==0)) printf(" f=%g (%g, [%g, %g])\n",f,f*zScale,atPot[Znum][ind3d][0],atPot[Znum][ind3d][1]);
-				}
-			}
-		} // for iz ...
-
-
-#if SHOW_SINGLE_POTENTIAL
-		// 0 thickness
-		imageio = ImageIOPtr(new CImageIO(nz, nx, 0, dkz, dkx));
-		// This scattering factor agrees with Kirkland's scattering factor fe(q)
-		sprintf(fileName,"pot_rec_%d.img",Znum);
-		imageio->SetThickness(muls->sliceThickness);
-		imageio->WriteComplexImage((void**)temp, fileName);
-#endif	  
-		// This converts the 2D kx-kz  map of the scattering factor to a 2D real space map.
-		plan = fftwf_plan_dft_2d(nz,nx,temp,temp,FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
-		// dx2 = muls->resolutionX*muls->resolutionX/(OVERSAMP_X*OVERSAMP_X);
-		// dy2 = muls->resolutionY*muls->resolutionY/(OVERSAMP_X*OVERSAMP_X);
-		// dz2 = muls->sliceThickness*muls->sliceThickness/(OVERSAMP_Z*OVERSAMP_Z);
-		// We also make sure that the potential touches zero at least somewhere.  This will avoid 
-		// sharp edges that could produce ringing artifacts.  
-		// It is certainly debatable whether this is a good apprach, or not. 
-		// printf("Setting up %d x %d potential for Znum=%d, (atom kind %d), Omega=%g\n",nx,nz,Znum,iKind,dkx*dky*dkz);
-		// min = atPot[Znum][ny/2+nx/2*ny+nz/2*nx*ny][0];
-		for (ix=0;ix<nx/2;ix++)  for (iz=0;iz<nz/2;iz++) {
-			ind3d = ix+iz*nx/2;
-			// Integrate over nzPerSlice neighboring layers here:::::::::
-			for (zScale=0,iiz=-izOffset;iiz<=izOffset;iiz++) {
-				if (iz+izOffset+iiz < nz/2) zScale += temp[ix+(iz+izOffset+iiz)*nx][0];
-			}
-			if (zScale < 0) zScale = 0;
-			// assign the iz-th slice the sum of the 3 other slices:
-			// and divide by unit cell volume (since this is in 3D):
-			// Where does the '1/2' come from???  OVERSAMP_X*OVERSAMP_Y/8 = 1/2
-			// if nothing has changed, then OVERSAMP_X=2 OVERSAMP_Z=18.
-			// remember, that s=0.5*k; 	
-			// This potential will later again be scaled by lambda*gamma (=0.025*1.39139)
-			atPot[Znum][ind3d][0] = 47.8658*dkx*dkz/(nz)*zScale; 
-
-			// *8*14.4*0.529=4*a0*e (s. Kirkland's book, p. 207)
-			// 2*pi*14.4*0.529 = 7.6176;
-			// if (atPot[Znum][ind3d][0] < min) min = atPot[Znum][ind3d][0];	  
-			atPot[Znum][ind3d][1]= 0;
-		}
-		// make sure we don't produce negative potential:
-		// if (min < 0) for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) atPot[Znum][iy+ix*ny][0] -= min;
-#if SHOW_SINGLE_POTENTIAL
-		imageio = ImageIOPtr(new CImageIO(nz/2, nx/2, 0, muls->sliceThickness/nzPerSlice, 
-			muls->resolutionX/OVERSAMP_X));
-		// This scattering factor agrees with Kirkland's scattering factor fe(q)
-		imageio->SetThickness(nz*muls->sliceThickness/nzPerSlice);
-		sprintf(fileName,"potential_rz_%d.img",Znum);
-		ptr = atPot[Znum];
-		imageio->WriteComplexImage((void**)ptr, fileName);
-#endif	  
-		if (muls->printLevel > 1) printf("Created 3D (r-z) %d x %d potential array for Z=%d (%d, B=%g, dkx=%g, dky=%g. dkz=%g,sps=%d)\n",
-			nx/2,nz/2,Znum,iKind,B,dkx,dky,dkz,izOffset);
-	}
-	*Nz_lut = nz/2;
-	*nzSub  = nzPerSlice;
-	*Nr	  = nx/2;
-	return atPot[Znum];
+PotentialLUTCache::~PotentialLUTCache() {
+	table_map::iterator it;
+
+	for (it=m_pot3D.begin();it!=m_pot3D.end();it++) fftwf_free(it->second);
+	for (it=m_offs3D.begin();it!=m_offs3D.end();it++) fftwf_free(it->second);
+	for (it=m_pot2D.begin();it!=m_pot2D.end();it++) fftwf_free(it->second);
 }
 
+fftwf_complex *PotentialLUTCache::Find(const table_map &tables, int Znum, double B) const {
+	table_map::const_iterator it = tables.find(std::make_pair(Znum,B));
+	return it == tables.end() ? NULL : it->second;
+}
 
+fftwf_complex *PotentialLUTCache::Lookup(const table_map &tables, int Znum, double B) const {
+	fftwf_complex *table = Find(tables,Znum,B);
+	if (table == NULL) {
+		printf("No potential table for Z=%d, B=%g (not made by PotentialLUTCache::Prepare()) - exit!\n",Znum,B);
+		exit(0);
+	}
+	return table;
+}
 
 /********************************************************************************
-* Lookup function for 3D potential offset due to charged atoms (ions)
+* The 3D tables supply V(r,z) computed from fe(q).  Since V(r,z) is rotationally
+* symmetric we might as well compute V(x,y,z) at y=0, i.e. V(x,z).  In order to 
+* do the proper 3D inverse FT without having to do a complete 3D FFT we 
+* pre-compute the qy-integral for y=0.  temp is nx x nz scratch.
 ********************************************************************************/
-fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut,float q) {
+void PotentialLUTCache::Build3D(int Znum, double B, int offset, fftwf_complex *table, fftwf_complex *temp) {
 	int ix,iy,iz,iiz,ind3d,iKind,izOffset;
-	double zScale,kzmax,zPos,xPos;
-	fftwf_plan plan;
-	static double f,phase,s2,s3,kmax2,kx,kz,dkx,dky,dkz; // ,dx2,dy2,dz2;
-	static int nx,ny,nz,nzPerSlice;
-	static fftwf_complex **atPot = NULL;
-	static fftwf_complex *temp = NULL;
-#if SHOW_SINGLE_POTENTIAL == 1
-	ImageIOPtr imageio = ImageIOPtr();
-	static fftwf_complex *ptr = NULL;
-	static char fileName[256];
-#endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
-
-
-	// if there is no charge to this atom, return NULL:
-	if (q == 0) return NULL;
-
-
-	// scattering factors in:
-	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(N_SF, "splinb" );
-		splinc = double1D(N_SF, "splinc" );
-		splind = double1D(N_SF, "splind" );
-
-
-		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
-		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
-		// The FFT-resolution in the z-direction must be high enough to avoid 
-		// artifacts due to premature cutoff of the rec. space scattering factor 
-		// we will therefore make it roughly the same as the x-resolution
-		// However, we will make sure that a single slice contains an integer number 
-		// of sampling points.
-		nzPerSlice = (int)floor(OVERSAMP_X*muls->sliceThickness/muls->resolutionX);
-		// make nzPerSlice odd:
-		if (2.0*floor((double)(nzPerSlice >> 1)) == nzPerSlice) nzPerSlice += 1;
-		// Total number of z-positions should be twice that of atomRadius/sliceThickness 
-		nz = (2*(int)ceil(muls->atomRadius/muls->sliceThickness))*nzPerSlice;
-		if (muls->printLevel > 1) printf("Potential offset: will use %d sampling points per slice, total nz=%d (%d)\n",nzPerSlice,nz,nzPerSlice >> 1);
-
-		dkx = 0.5*OVERSAMP_X/(nx*muls->resolutionX);  
-		dky = 0.5*OVERSAMP_X/(ny*muls->resolutionY);
-		dkz = nzPerSlice/(double)(nz*muls->sliceThickness);
-		kmax2 = 0.5*nx*dkx/(double)OVERSAMP_X;	// largest k that we'll admit
-
-		// printf("Cutoff scattering angle:kmax=%g, smax=%g (1/A), dk=(%g,%g %g)\n",kmax2,S_SCALE*kmax2,dkx,dky,dkz);
-		scatParOffs[0][N_SF-1] = 1.2*kmax2;
-		scatParOffs[0][N_SF-2] = 1.1*kmax2;
-		scatParOffs[0][N_SF-3] = kmax2;
-		if (scatParOffs[0][N_SF-4] > scatParOffs[0][N_SF-3]) {
-
-			if (1) {
-				// set additional scattering parameters to zero:
-				for (ix = 0;ix < N_SF-10;ix++) {
-					if (scatParOffs[0][N_SF-4-ix] < scatParOffs[0][N_SF-3]-0.001*(ix+1)) break;
-					scatParOffs[0][N_SF-4-ix] = scatParOffs[0][N_SF-3]-0.001*(ix+1);
-					for (iy=1; iy<N_ELEM;iy++) scatParOffs[iy][N_SF-4-ix] = 0;	
-				}
-			}
-			else {
-				for (ix = 0;ix < 20;ix++) {
-					if (scatParOffs[0][N_SF-4-ix] < scatParOffs[0][N_SF-3]) break;
-					scatParOffs[0][N_SF-4-ix] = scatParOffs[0][N_SF-3];
-					for (iy=1; iy<N_ELEM;iy++) scatParOffs[iy][N_SF-4-ix] = scatParOffs[iy][N_SF-3];	
-				}
-			}	   
-			if (muls->printLevel > 1) printf("getAtomPotentialOffset3D: reduced angular range of scattering factor to %g/A!\n",
-				scatParOffs[0][N_SF-4-ix]);
-		}  // end of if (scatParOffs[0][N_SF-4] > scatParOffs[0][N_SF-3])
-		kmax2 *= kmax2;
+	double zScale,zPos,xPos,f,phase,s2,s3,kx,kz;
+	double splinb[N_SF],splinc[N_SF],splind[N_SF];
+	double (*sf)[N_SF] = scatPar;
 
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
-		temp  = (fftwf_complex*)fftwf_malloc(nx*nz*sizeof(fftwf_complex));
-	}
-	// initialize this atom, if it has not been done yet:
-	if (atPot[Znum] == NULL) {
+	iKind = Znum;
 #if USE_REZ_SFACTS
-		iKind = Znum;
+	if (offset) sf = scatParOffs;
 #else
-		printf("Using charged atoms only works with scattering factors by Rez et al!\n",Znum);
+	if (offset) {
+		printf("Using charged atoms only works with scattering factors by Rez et al!\n");
 		exit(0);
+	}
 #endif
-
-
-		// setup cubic spline interpolation:
-		splinh(scatParOffs[0],scatParOffs[iKind],splinb,splinc,splind,N_SF);
-
-		atPot[Znum] = (fftwf_complex*)fftwf_malloc(nx*nz/4*sizeof(fftwf_complex));
-		memset(temp,0,nx*nz*sizeof(fftwf_complex));
-		kzmax	 = dkz*nz/2.0; 
-		// define x-and z-position of atom center:
-		// The atom should sit in the top-left corner, 
-		// however (nzPerSlice+1)/2 above zero in z-direction
-		xPos = -2.0*PI*0.0;  // or muls->resolutionX*nx/(OVERSAMP_X), if in center
-		izOffset = (nzPerSlice-1)/2;
-		zPos = -2.0*PI*(muls->sliceThickness/nzPerSlice*(izOffset));
-
-		// kzborder = dkz*(nz/(2*OVERSAMP_Z) -1); 
-		for (iz=0;iz<nz;iz++) {
-			kz = dkz*(iz<nz/2 ? iz : iz-nz);   
-			// We also need to taper off the potential in z-direction
-			// in order to avoid cutoff artifacts.
-			// zScale = fabs(kz) <= kzborder ? 1.0 : 0.5+0.5*cos(M_PI*(fabs(kz)-kzborder)/(kzmax-kzborder));
-			// printf("iz=%d, kz=%g, zScale=%g ",iz,kz,zScale);
-			for (ix=0;ix<nx;ix++) {
-				kx = dkx*(ix<nx/2 ? ix : ix-nx);	  
-				s2 = (kx*kx+kz*kz);
-				// if this is within the allowed circle:
-				if (s2<kmax2) {
-					ind3d = ix+iz*nx;
-					// f = fe3D(Znum,k2,muls->tds,1.0,muls->scatFactor);
-					// multiply scattering factor with Debye-Waller factor:
-					// printf("k2=%g,B=%g, exp(-k2B)=%g\n",k2,B,exp(-k2*B));
-					f = seval(scatParOffs[0],scatParOffs[iKind],splinb,splinc,splind,N_SF,sqrt(s2))*exp(-s2*B*0.25);
-					// perform the qy-integration for qy <> 0:
-					for (iy=1;iy<nx;iy++) {
-						s3 = dky*iy;
-						s3 = s3*s3+s2;
-						if (s3<kmax2) {
-							f += 2*seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF,sqrt(s3))*exp(-s3*B*0.25);
-						}
-						else break;
+	// setup cubic spline interpolation:
+	splinh(sf[0],sf[iKind],splinb,splinc,splind,N_SF);
+
+	memset(temp,0,m_nx*m_nz*sizeof(fftwf_complex));
+	// define x-and z-position of atom center:
+	// The atom should sit in the top-left corner, 
+	// however (nzPerSlice+1)/2 above zero in z-direction
+	xPos = -2.0*PI*0.0;  // or muls->resolutionX*nx/(OVERSAMP_X), if in center
+	izOffset = (m_nzPerSlice-1)/2;
+	zPos = -2.0*PI*(m_sliceThickness/m_nzPerSlice*(izOffset));
+
+	for (iz=0;iz<m_nz;iz++) {
+		kz = m_dkz*(iz<m_nz/2 ? iz : iz-m_nz);	
+		for (ix=0;ix<m_nx;ix++) {
+			kx = m_dkx*(ix<m_nx/2 ? ix : ix-m_nx);	   
+			s2 = (kx*kx+kz*kz);
+			// if this is within the allowed circle:
+			if (s2<m_kmax2) {
+				ind3d = ix+iz*m_nx;
+				// multiply scattering factor with Debye-Waller factor:
+				f = seval(sf[0],sf[iKind],splinb,splinc,splind,N_SF,sqrt(s2))*exp(-s2*B*0.25);
+				// perform the qy-integration for qy <> 0 (the offsets have always 
+				// taken scatPar here):
+				for (iy=1;iy<m_nx;iy++) {
+					s3 = (offset ? m_dky : m_dkx)*iy;
+					s3 = s3*s3+s2;
+					if (s3<m_kmax2) {
+						f += 2*seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF,sqrt(s3))*exp(-s3*B*0.25);
 					}
-					f *= dkx;  
-					// note that the factor 2 is missing in the phase (2pi k*r)
-					// this places the atoms in the center of the box.
-					phase  = kx*xPos + kz*zPos;
-					temp[ind3d][0] = f*cos(phase);	// *zScale
-					temp[ind3d][1] = f*sin(phase);	// *zScale
-					// if ((kx==0) && (ky==0)) printf(" f=%g (%g, [%g, %g])\n",f,f*zScale,atPot[Znum][ind3d][0],atPot[Znum][ind3d][1]);
+					else break;
 				}
+				f *= m_dkx;  
+				// note that the factor 2 is missing in the phase (2pi k*r)
+				// this places the atoms in the center of the box.
+				phase	= kx*xPos + kz*zPos;
+				temp[ind3d][0] = f*cos(phase);
+				temp[ind3d][1] = f*sin(phase);
 			}
-		} // for iz ...
-
+		}
+	} // for iz ...
+
+	// This converts the 2D kx-kz  map of the scattering factor to a 2D real space map.
+	m_plan3D->Execute(temp);
+	for (ix=0;ix<m_nx/2;ix++)  for (iz=0;iz<m_nz/2;iz++) {
+		ind3d = ix+iz*m_nx/2;
+		// Integrate over nzPerSlice neighboring layers here:::::::::
+		for (zScale=0,iiz=-izOffset;iiz<=izOffset;iiz++) {
+			if (iz+izOffset+iiz < m_nz/2) zScale += temp[ix+(iz+izOffset+iiz)*m_nx][0];
+		}
+		if (zScale < 0) zScale = 0;
+		// assign the iz-th slice the sum of the 3 other slices:
+		// and divide by unit cell volume (since this is in 3D):
+		// Where does the '1/2' come from???  OVERSAMP_X*OVERSAMP_Y/8 = 1/2
+		// if nothing has changed, then OVERSAMP_X=2 OVERSAMP_Z=18.
+		// remember, that s=0.5*k; 	
+		// This potential will later again be scaled by lambda*gamma (=0.025*1.39139)
+		// *8*14.4*0.529=4*a0*e (s. Kirkland's book, p. 207)
+		table[ind3d][0] = 47.8658*m_dkx*m_dkz/(m_nz)*zScale; 
+		table[ind3d][1] = 0;
+	}
+	if (m_printLevel > 1) printf("Created 3D (r-z) %d x %d potential %sarray for Z=%d (%d, B=%g, dkx=%g, dky=%g. dkz=%g,sps=%d)\n",
+		m_nx/2,m_nz/2,offset ? "offset " : "",Znum,iKind,B,m_dkx,m_dky,m_dkz,izOffset);
+}
 
+// This function should be used yet, because it computes the projected
+// potential wrongly, since it doe not yet perform the projection!!!
+void PotentialLUTCache::Build2D(int Znum, double B, fftwf_complex *table) {
+	int ix,iy,ind,iKind;
+	double f,phase,s2,kx,ky;
+	double splinb[N_SF],splinc[N_SF],splind[N_SF];
+
+	iKind = Znum;
+	// setup cubic spline interpolation:
+	splinh(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF);
+
+	memset(table,0,m_nx*m_ny*sizeof(fftwf_complex));
+	for (ix=0;ix<m_nx;ix++) {
+		kx = m_dkx*(ix<m_nx/2 ? ix : m_nx-ix);      
+		for (iy=0;iy<m_ny;iy++) {
+			ky = m_dky*(iy<m_ny/2 ? iy : m_ny-iy);      
+			s2 = (kx*kx+ky*ky);
+			// if this is within the allowed circle:
+			if (s2<m_kmax2) {
+				ind = iy+ix*m_ny;
+				// multiply scattering factor with Debye-Waller factor:
+				f = seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF,sqrt(s2))*exp(-s2*B*0.25);
+				phase = PI*(kx*m_resolutionX*m_nx+ky*m_resolutionY*m_ny);
+				table[ind][0] = f*cos(phase);
+				table[ind][1] = f*sin(phase);
+			}
+		}
+	}
+	m_plan2D->Execute(table);
+	for (ix=0;ix<m_nx;ix++) for (iy=0;iy<m_ny;iy++) {
+		table[iy+ix*m_ny][0] *= m_dkx*m_dky*(OVERSAMP_X*OVERSAMP_X);  
+	}
+	printf("Created 2D %d x %d potential array for Z=%d (%d, B=%g A^2)\n",m_nx,m_ny,Znum,iKind,B);
+}
 
+// the hash of everything that goes into a table, for the disk cache.
+// Change the version string whenever Build2D() or Build3D() change.
+unsigned long long PotentialLUTCache::Key(int kind, int Znum, double B) const {
+	TableKey key;
+
+	key.Add("PotentialLUTCache 1");
+	key.Add(kind);
+	key.Add(Znum);
+	key.Add(B);
+	key.Add(m_nx); key.Add(m_ny); key.Add(m_nz); key.Add(m_nzPerSlice);
+	key.Add(OVERSAMP_X);
+	key.Add(m_dkx); key.Add(m_dky); key.Add(m_dkz); key.Add(m_kmax2);
+	key.Add((double)m_sliceThickness); key.Add((double)m_resolutionX); key.Add((double)m_resolutionY);
+	// the scattering factors (after cutScatteringFactors()):
+	key.Add(scatPar[0],N_SF);
+	if (Znum < N_ELEM) key.Add(scatPar[Znum],N_SF);
+#if USE_REZ_SFACTS
+	if (kind == LUT_OFFS3D) {
+		key.Add(scatParOffs[0],N_SF);
+		if (Znum < N_ELEM) key.Add(scatParOffs[Znum],N_SF);
+	}
+#endif
+	return key.Value();
+}
 
-#if SHOW_SINGLE_POTENTIAL
-		imageio = ImageIOPtr(new CImageIO(nz, nx, 0, dkx, dkz, std::vector<double>(), 
-			"rec. space potential"));
-		// This scattering factor agrees with Kirkland's scattering factor fe(q)
-		imageio->SetThickness(muls->sliceThickness);
-		imageio->WriteComplexImage((void**)temp, fileName);
-#endif	  
+// builds one table of kind LUT_3D, LUT_OFFS3D or LUT_2D (the caller stores it),
+// or reads it from the disk cache
+fftwf_complex *PotentialLUTCache::Build(int kind, int Znum, double B) {
+	fftwf_complex *table, *temp;
+	size_t bytes;
+	unsigned long long key = 0;
+
+	bytes = (kind == LUT_2D ? m_nx*m_ny : m_nx*m_nz/4)*sizeof(fftwf_complex);
+	table = (fftwf_complex*) fftwf_malloc(bytes);
+	if (m_disk) {
+		key = Key(kind,Znum,B);
+		if (m_disk->Load(key,table,bytes)) {
+			if (m_printLevel > 1) printf("Read potential table for Z=%d (B=%g) from %016llx\n",Znum,B,key);
+			return table;
+		}
+	}
+	if (kind == LUT_2D) Build2D(Znum,B,table);
+	else {
+		temp  = (fftwf_complex*) fftwf_malloc(m_nx*m_nz*sizeof(fftwf_complex));
+		Build3D(Znum,B,kind == LUT_OFFS3D,table,temp);
+		fftwf_free(temp);
+	}
+	if (m_disk && !m_disk->Store(key,table,bytes) && (m_printLevel > 0)) 
+		printf("Cannot write potential table %016llx to the cache\n",key);
+	return table;
+}
 
-		plan = fftwf_plan_dft_2d(nz,nx,temp,temp,FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
-		// dx2 = muls->resolutionX*muls->resolutionX/(OVERSAMP_X*OVERSAMP_X);
-		// dy2 = muls->resolutionY*muls->resolutionY/(OVERSAMP_X*OVERSAMP_X);
-		// dz2 = muls->sliceThickness*muls->sliceThickness/(OVERSAMP_Z*OVERSAMP_Z);
-		// We also make sure that the potential touches zero at least somewhere.  This will avoid 
-		// sharp edges that could produce ringing artifacts.  
-		// It is certainly debatable whether this is a good apprach, or not. 
-		// printf("Setting up %d x %d potential for Znum=%d, (atom kind %d), Omega=%g\n",nx,nz,Znum,iKind,dkx*dky*dkz);
-		// min = atPot[Znum][ny/2+nx/2*ny+nz/2*nx*ny][0];
-		for (ix=0;ix<nx/2;ix++)  for (iz=0;iz<nz/2;iz++) {
-			ind3d = ix+iz*nx/2;
-			// Integrate over nzPerSlice neighboring layers here:::::::::
-			for (zScale=0,iiz=-izOffset;iiz<=izOffset;iiz++) {
-				if (iz+izOffset+iiz < nz/2) zScale += temp[ix+(iz+izOffset+iiz)*nx][0];
-			}
-			if (zScale < 0) zScale = 0;
-			// assign the iz-th slice the sum of the 3 other slices:
-			// and divide by unit cell volume (since this is in 3D):
-			// Where does the '1/2' come from???  OVERSAMP_X*OVERSAMP_Y/8 = 1/2
-			// if nothing has changed, then OVERSAMP_X=2 OVERSAMP_Z=18.
-			// remember, that s=0.5*k;	   
-			// This potential will later again be scaled by lambda*gamma (=0.025*1.39139)
-			atPot[Znum][ind3d][0] = 47.8658*dkx*dkz/(nz)*zScale; 
-			atPot[Znum][ind3d][1] = 0;
+void PotentialLUTCache::Prepare(MULS *muls, atom *atoms, int natom) {
+	int i;
+	double B;
+	std::vector<int> kinds, Znums;
+	std::vector<double> Bs;
+	std::vector<fftwf_complex *> tables;
+	table_map wanted[3];
+
+	// the (kind, Znum, B) which are missing
+	for (i=0;i<natom;i++) {
+		if (atoms[i].Znum <= 0) continue;
+		B = muls->tds ? 0 : atoms[i].dw;
+		if (muls->potential3D) {
+			if (Find(m_pot3D,atoms[i].Znum,B) == NULL) wanted[LUT_3D][std::make_pair(atoms[i].Znum,B)] = NULL;
+#if USE_Q_POT_OFFSETS
+			// without a charge nothing is computed
+			if ((atoms[i].q != 0) && (Find(m_offs3D,atoms[i].Znum,B) == NULL)) 
+				wanted[LUT_OFFS3D][std::make_pair(atoms[i].Znum,B)] = NULL;
+#endif
 		}
-#if SHOW_SINGLE_POTENTIAL
-		imageio = ImageIOPtr(new CImageIO(nz/2, nx/2, 0, muls->resolutionX/OVERSAMP_X, 
-		muls->sliceThickness/nzPerSlice));
-		// This scattering factor agrees with Kirkland's scattering factor fe(q)
-		imageio->SetThickness(nz*muls->sliceThickness/nzPerSlice);
-		sprintf(fileName,"potentialOffs_rz_%d.img",Znum);
-		ptr = atPot[Znum];
-		imageio->WriteComplexImage((void**)ptr, fileName);
-#endif	  
-		if (muls->printLevel > 1) printf("Created 3D (r-z) %d x %d potential offset array for Z=%d (%d, B=%g, dkx=%g, dky=%g. dkz=%g,sps=%d)\n",
-			nx/2,nz/2,Znum,iKind,B,dkx,dky,dkz,izOffset);
-	}
-	*Nz_lut = nz/2;
-	*nzSub = nzPerSlice;
-	*Nr	 = nx/2;
-	return atPot[Znum];
+		else if (Find(m_pot2D,atoms[i].Znum,B) == NULL) wanted[LUT_2D][std::make_pair(atoms[i].Znum,B)] = NULL;
+	}
+	for (int kind=0;kind<3;kind++) {
+		for (table_map::iterator it=wanted[kind].begin();it!=wanted[kind].end();it++) {
+			kinds.push_back(kind);
+			Znums.push_back(it->first.first);
+			Bs.push_back(it->first.second);
+		}
+	}
+	tables.resize(kinds.size());
+#pragma omp parallel for schedule(dynamic,1)
+	for (i=0;i<(int)kinds.size();i++) 
+		tables[i] = Build(kinds[i],Znums[i],Bs[i]);
+
+	for (i=0;i<(int)kinds.size();i++) {
+		switch (kinds[i]) {
+			case LUT_3D:     m_pot3D[std::make_pair(Znums[i],Bs[i])] = tables[i]; break;
+			case LUT_OFFS3D: m_offs3D[std::make_pair(Znums[i],Bs[i])] = tables[i]; break;
+			default:         m_pot2D[std::make_pair(Znums[i],Bs[i])] = tables[i];
+		}
+	}
 }
-// #undef SHOW_SINGLE_POTENTIAL
-// end of fftwf_complex *getAtomPotential3D(...)
 
-#define PHI_SCALE 47.87658
-// #define SHOW_SINGLE_POTENTIAL 0
-////////////////////////////////////////////////////////////////////////////
-// This function should be used yet, because it computes the projected
-// potential wrongly, since it doe not yet perform the projection!!!
-fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
-	int ix,iy,iz,ind,iKind;
-	double min;
-	fftwf_plan plan;
-	static double f,phase,s2,s3,kmax2,kx,ky,dkx,dky;
-	static int nx,ny;
-	static fftwf_complex **atPot = NULL;
-#if SHOW_SINGLE_POTENTIAL == 1
-	ImageIOPtr imageio = ImageIOPtr();
-	static char fileName[256];
-#endif 
-	static double *splinb=NULL;
-	static double *splinc=NULL;
-	static double *splind=NULL;
+fftwf_complex *PotentialLUTCache::Get3D(int Znum, double B) {
+	fftwf_complex *table = Find(m_pot3D,Znum,B);
+	if (table == NULL) table = m_pot3D[std::make_pair(Znum,B)] = Build(LUT_3D,Znum,B);
+	return table;
+}
 
+fftwf_complex *PotentialLUTCache::GetOffset3D(int Znum, double B) {
+	fftwf_complex *table = Find(m_offs3D,Znum,B);
+	if (table == NULL) table = m_offs3D[std::make_pair(Znum,B)] = Build(LUT_OFFS3D,Znum,B);
+	return table;
+}
 
-	// scattering factors in:
-	// float scatPar[4][30]
-	if (atPot == NULL) {
-		splinb = double1D(N_SF, "splinb" );
-		splinc = double1D(N_SF, "splinc" );
-		splind = double1D(N_SF, "splind" );
-
-		nx = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionX);
-		ny = 2*OVERSAMP_X*(int)ceil(muls->atomRadius/muls->resolutionY);
-		dkx = 0.5*OVERSAMP_X/((nx)*muls->resolutionX);  
-		dky = 0.5*OVERSAMP_X/((ny)*muls->resolutionY);
-		kmax2 = 0.5*nx*dkx/(double)OVERSAMP_X;  // largest k that we'll admit
+fftwf_complex *PotentialLUTCache::Get2D(int Znum, double B) {
+	fftwf_complex *table = Find(m_pot2D,Znum,B);
+	if (table == NULL) table = m_pot2D[std::make_pair(Znum,B)] = Build(LUT_2D,Znum,B);
+	return table;
+}
 
-		printf("Cutoff scattering angle:kmax=%g (1/A)\n",kmax2);
-		scatPar[0][N_SF-1] = 1.2*kmax2;
-		scatPar[0][N_SF-2] = 1.1*kmax2;
-		scatPar[0][N_SF-3] = kmax2;
-		if (scatPar[0][N_SF-4] > scatPar[0][N_SF-3]) {
-
-			if (1) {
-				// set additional scattering parameters to zero:
-				for (ix = 0;ix < N_SF-10;ix++) {
-					if (scatPar[0][N_SF-4-ix] < scatPar[0][N_SF-3]-0.001*(ix+1)) break;
-					scatPar[0][N_SF-4-ix] = scatPar[0][N_SF-3]-0.001*(ix+1);
-					for (iy=1; iy<N_ELEM;iy++) scatPar[iy][N_SF-4-ix] = 0;	
-				}
-			}
+PotentialLUTCachePtr potentialLUTCache(MULS *muls) {
+	static PotentialLUTCachePtr cache;
+	if (!cache) cache = PotentialLUTCachePtr(new PotentialLUTCache(muls));
+	return cache;
+}
 
-			if (muls->printLevel > 1) printf("getAtomPotential2D: reduced angular range of scattering factor to %g/A!\n",
-				scatPar[0][N_SF-4-ix]);
-		}  // end of if (scatPar[0][N_SF-4] > scatPar[0][N_SF-3])
-		kmax2 *= kmax2;
+/********************************************************************************
+* Lookup table for 3D potential due to neutral atoms
+********************************************************************************/
+fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut) {
+	PotentialLUTCachePtr cache = potentialLUTCache(muls);
 
+	*Nz_lut = cache->NzLut();
+	*nzSub  = cache->NzSub();
+	*Nr	  = cache->Nr();
+	return cache->Get3D(Znum,B);
+}
 
+/********************************************************************************
+* Lookup function for 3D potential offset due to charged atoms (ions)
+********************************************************************************/
+fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int *Nz_lut,float q) {
+	PotentialLUTCachePtr cache;
 
-		atPot = (fftwf_complex **)malloc((NZMAX+1)*sizeof(fftwf_complex *));
-		for (ix=0;ix<=NZMAX;ix++) atPot[ix] = NULL;
-	}
-	// initialize this atom, if it has not been done yet:
-	if (atPot[Znum] == NULL) {
-		iKind = Znum;
-		// setup cubic spline interpolation:
-		splinh(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF);
-
-		atPot[Znum] = (fftwf_complex*) fftwf_malloc(nx*ny*sizeof(fftwf_complex));
-		// memset(temp,0,nx*nz*sizeof(fftwf_complex));
-		memset(atPot[Znum],0,nx*ny*sizeof(fftwf_complex));
-		for (ix=0;ix<nx;ix++) {
-			kx = dkx*(ix<nx/2 ? ix : nx-ix);      
-			for (iy=0;iy<ny;iy++) {
-				ky = dky*(iy<ny/2 ? iy : ny-iy);      
-				s2 = (kx*kx+ky*ky);
-				// if this is within the allowed circle:
-				if (s2<kmax2) {
-					ind = iy+ix*ny;
-					// f = fe3D(Znum,k2,muls->tds,1.0,muls->scatFactor);
-					// multiply scattering factor with Debye-Waller factor:
-					// printf("k2=%g,B=%g, exp(-k2B)=%g\n",k2,B,exp(-k2*B));
-					f = seval(scatPar[0],scatPar[iKind],splinb,splinc,splind,N_SF,sqrt(s2))*exp(-s2*B*0.25);
-					phase = PI*(kx*muls->resolutionX*nx+ky*muls->resolutionY*ny);
-					atPot[Znum][ind][0] = f*cos(phase);
-					atPot[Znum][ind][1] = f*sin(phase);
-				}
-			}
-		}
-#if SHOW_SINGLE_POTENTIAL == 1
-		imageio = ImageIOPtr(new CImageIO(ny, nx, 0, dkx, dky, std::vector<double>(), 
-		"potential"));
-		// This scattering factor agrees with Kirkland's scattering factor fe(q)
-		imageio->SetThickness(muls->sliceThickness);
-		imageio->WriteComplexImage((void**)atPot[Znum], fileName);
-#endif    
-		plan = fftwf_plan_dft_2d(nx,ny,atPot[Znum],atPot[Znum],FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
-		for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
-				atPot[Znum][iy+ix*ny][0] *= dkx*dky*(OVERSAMP_X*OVERSAMP_X);  
-		}
-		// make sure we don't produce negative potential:
-		// if (min < 0) for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) atPot[Znum][iy+ix*ny][0] -= min;
-#if SHOW_SINGLE_POTENTIAL == 1
-		imageio = ImageIOPtr(new CImageIO(nx, ny, 0, muls->resolutionX/OVERSAMP_X, 
-			muls->resolutionY/OVERSAMP_X, std::vector<double>(), "potential"));
-		// This scattering factor agrees with Kirkland's scattering factor fe(q)
-		//imageio->SetThickness(nz*muls->sliceThickness/nzPerSlice);
-		sprintf(fileName,"potential_%d.img",Znum);
-		imageio->WriteComplexImage((void**)atPot[Znum], fileName);
-#endif    
-		printf("Created 2D %d x %d potential array for Z=%d (%d, B=%g A^2)\n",nx,ny,Znum,iKind,B);
-	}
-	return atPot[Znum];
+	// if there is no charge to this atom, return NULL:
+	if (q == 0) return NULL;
+	cache = potentialLUTCache(muls);
+	*Nz_lut = cache->NzLut();
+	*nzSub  = cache->NzSub();
+	*Nr	  = cache->Nr();
+	return cache->GetOffset3D(Znum,B);
+}
+
+fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B) {
+	return potentialLUTCache(muls)->Get2D(Znum,B);
 }
+#undef LUT_3D
+#undef LUT_OFFS3D
+#undef LUT_2D
 #undef PHI_SCALE
 #undef SHOW_SINGLE_POTENTIAL
 
@@ -1938,15 +1961,109 @@ void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz) {
 
 #define SMOOTH_EDGE 5 // make a smooth edge on AIS aperture over +/-SMOOTH_EDGE pixels
 
-void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny)
+void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny, std::vector<double> &ramp)
+{
+	// Robert A. McLeod
+	// 09 April 2014
+	// This function takes an input wave and shifts it by [dx,dy] and crops it to [cnx,cny]
+	// In general the input wave should have wave.nx > nx + 2*abs(dx) and wave.ny > ny + 2*abs(dy) for a scanned system
+	//
+	// The input wave is a probe centered in the array, i.e. at (nx/2*resolutionX, ny/2*resolutionY),
+	// and [dx,dy] is the new position in the same convention as for probe().  The shift is applied 
+	// as a phase ramp in reciprocal space, so that it does not need to be a whole number of pixels.
+	// Cropping to [cnx,cny] is not supported yet, the wave keeps its size.
+	// ramp is scratch space for the phase ramp, it grows to 2*(nx+ny) values.
+	int ix, iy, nx, ny;
+	double ax, by, sx, sy, pi, scale, phase, re, im, wr;
+	double *exr, *exi, *eyr, *eyi;
+
+	nx = wave->nx;
+	ny = wave->ny;
+	if (((int)cnx != nx) || ((int)cny != ny)) 
+		printf("probeShiftAndCrop: cannot crop the wave to %d x %d, keeping %d x %d\n",(int)cnx,(int)cny,nx,ny);
+
+	ax = nx*muls->resolutionX;
+	by = ny*muls->resolutionY;
+	sx = dx-(nx/2)*muls->resolutionX;
+	sy = dy-(ny/2)*muls->resolutionY;
+	if ((sx == 0) && (sy == 0)) return;
+
+	/* the phase ramp exp(-2 pi i (kx*sx/ax + ky*sy/by)) is separable,
+	 * so we only need nx+ny sines and cosines.  The frequencies are
+	 * ordered the same way as in probe(). 
+	 */
+	pi = 4.0 * atan( 1.0 );
+	scale = 1.0/((double)nx*(double)ny);
+	if (ramp.size() < 2*(size_t)(nx+ny)) ramp.resize(2*(nx+ny));
+	exr = &ramp[0];
+	exi = exr+nx;
+	eyr = exi+nx;
+	eyi = eyr+ny;
+	for (ix=0; ix<nx; ix++) {
+		phase = -2.0*pi*((ix > nx/2) ? ix-nx : ix)*sx/ax;
+		exr[ix] = scale*cos(phase);
+		exi[ix] = scale*sin(phase);
+	}
+	for (iy=0; iy<ny; iy++) {
+		phase = -2.0*pi*((iy > ny/2) ? iy-ny : iy)*sy/by;
+		eyr[iy] = cos(phase);
+		eyi[iy] = sin(phase);
+	}
+
+	wave->fftPlanWaveForw->Execute(wave->wave[0]);
+	for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+		// e = ex*ey, then wave *= e
+		re = exr[ix]*eyr[iy]-exi[ix]*eyi[iy];
+		im = exr[ix]*eyi[iy]+exi[ix]*eyr[iy];
+		wr = wave->wave[ix][iy][0];
+		wave->wave[ix][iy][0] = (float_tt)(wr*re-wave->wave[ix][iy][1]*im);
+		wave->wave[ix][iy][1] = (float_tt)(wr*im+wave->wave[ix][iy][1]*re);
+	}
+	wave->fftPlanWaveInv->Execute(wave->wave[0]);
+}
+
+/******************************************************************
+* aberrationPhase() - the phase chi(k) of the probe forming lens at
+* k = (kx, ky) in 1/A, with the defocus muls->df0 (plus the focal 
+* spread offset Cc*dE_E), the astigmatism and the higher order 
+* aberrations of muls.  probe() and the S-matrix of PRISM use it.
+*****************************************************************/
+double aberrationPhase(MULS *muls, double kx, double ky, double wavlen)
 {
-	// Robert A. McLeod
-	// 09 April 2014
-	// This function takes an input wave and shifts it by [dx,dy] and crops it to [cnx,cny]
-	// In general the input wave should have wave.nx > nx + 2*abs(dx) and wave.ny > ny + 2*abs(dy) for a scanned system
+	double ktheta2, ktheta, phi, chi;
+
+	ktheta2 = (kx*kx+ky*ky)*(wavlen*wavlen);
+	ktheta = sqrt(ktheta2);
+	phi = atan2(ky,kx);
+	// compute the effective defocus from the actual defocus and the astigmatism: 
+	// df_eff = df + muls->astigMag*cos(muls->astigAngle+phi);
+
+	// chi = chi1*k2*(df_eff +chi2*k2)-2.0*pi*( (dx*kx/ax) + (dy*ky/by) );
+	// defocus, astigmatism, and shift:
+	chi = ktheta2*(muls->df0+muls->Cc*muls->dE_E + muls->astigMag*cos(2.0*(phi-muls->astigAngle)))/2.0;
+	ktheta2 *= ktheta;  // ktheta^3 
+	if ((muls->a33 > 0) || (muls->a31 > 0)) {
+		chi += ktheta2*(muls->a33*cos(3.0*(phi-muls->phi33))+muls->a31*cos(phi-muls->phi31))/3.0;
+	}	
+	ktheta2 *= ktheta;   // ktheta^4
+	if ((muls->a44 > 0) || (muls->a42 > 0) || (muls->Cs != 0)) {
+		// chi += ktheta2*(muls->a33*cos(3*(phi-muls->phi33))+muls->a31*cos(phi-muls->phi31))/3.0;
+		chi += ktheta2*(muls->a44*cos(4.0*(phi-muls->phi44))+muls->a42*cos(2.0*(phi-muls->phi42))+muls->Cs)/4.0;  
+		//                     1/4*(a(4,4).*cos(4*(kphi-phi(4,4)))+a(4,2).*cos(2*(kphi-phi(4,2)))+c(4)).*ktheta.^4+...
+	}
+	ktheta2 *= ktheta;    // ktheta^5
+	if ((muls->a55 > 0) || (muls->a53 > 0) || (muls->a51 > 0)) {
+		chi += ktheta2*(muls->a55*cos(5.0*(phi-muls->phi55))+muls->a53*cos(3.0*(phi-muls->phi53))+muls->a51*cos(phi-muls->phi51))/5.0;
+		//                     1/5*(a(5,5).*cos(5*(kphi-phi(5,5)))+a(5,3).*cos(3*(kphi-phi(5,3)))+a(5,1).*cos(1*(kphi-phi(5,1)))).*ktheta.^5+...
+	}
+	ktheta2 *= ktheta;    // ktheta^6
+	if ((muls->a66 > 0) || (muls->a64 > 0) || (muls->a62 > 0) || (muls->C5 != 0)) {
+		chi += ktheta2*(muls->a66*cos(6.0*(phi-muls->phi66))+muls->a64*cos(4.0*(phi-muls->phi64))+muls->a62*cos(2.0*(phi-muls->phi62))+muls->C5)/6.0;
+		//                     1/6*(a(6,6).*cos(6*(kphi-phi(6,6)))+a(6,4).*cos(4*(kphi-phi(6,4)))+a(6,2).*cos(2*(kphi-phi(6,2)))+c(6)).*ktheta.^6);
+	}
 
-	// 
-	printf("Debug: probeShiftAndCrop does nothing at present\n");
+	chi *= 2*PI/wavlen;
+	return chi;
 }
 
 void probe(MULS *muls, WavePtr wave, double dx, double dy)
@@ -1956,9 +2073,9 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	int CsDefAstOnly = 0;
 	float rmin, rmax, aimin, aimax;
 	// float **pixr, **pixi;
-	double  kx, ky, ky2,k2, ktheta2, ktheta, k2max, v0, wavlen,ax,by,x,y,
+	double  kx, ky, ky2,k2, k2max, v0, wavlen,ax,by,x,y,
 		rx2, ry2,rx,ry, pi, scale, pixel,alpha,
-		df, df_eff, chi1, chi2,chi3, sum, chi, time,r,phi;
+		df, df_eff, chi1, chi2,chi3, sum, chi, time,r;
 	double gaussScale = 0.05;
 	double envelope,delta,avgRes,edge;
 
@@ -2054,39 +2171,9 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 			kx = (double) ix;
 			if( ix > ixmid ) kx = (double) (ix-nx);
 			k2 = kx*kx*rx2 + ky2;
-			ktheta2 = k2*(wavlen*wavlen);
-			ktheta = sqrt(ktheta2);
-			phi = atan2(ry*ky,rx*kx);
-			// compute the effective defocus from the actual defocus and the astigmatism: 
-			// df_eff = df + muls->astigMag*cos(muls->astigAngle+phi);
-
-			// chi = chi1*k2*(df_eff +chi2*k2)-2.0*pi*( (dx*kx/ax) + (dy*ky/by) );
-			// defocus, astigmatism, and shift:
-			chi = ktheta2*(muls->df0+delta + muls->astigMag*cos(2.0*(phi-muls->astigAngle)))/2.0;
-			ktheta2 *= ktheta;  // ktheta^3 
-			if ((muls->a33 > 0) || (muls->a31 > 0)) {
-				chi += ktheta2*(muls->a33*cos(3.0*(phi-muls->phi33))+muls->a31*cos(phi-muls->phi31))/3.0;
-			}	
-			ktheta2 *= ktheta;   // ktheta^4
-			if ((muls->a44 > 0) || (muls->a42 > 0) || (muls->Cs != 0)) {
-				// chi += ktheta2*(muls->a33*cos(3*(phi-muls->phi33))+muls->a31*cos(phi-muls->phi31))/3.0;
-				chi += ktheta2*(muls->a44*cos(4.0*(phi-muls->phi44))+muls->a42*cos(2.0*(phi-muls->phi42))+muls->Cs)/4.0;  
-				//                     1/4*(a(4,4).*cos(4*(kphi-phi(4,4)))+a(4,2).*cos(2*(kphi-phi(4,2)))+c(4)).*ktheta.^4+...
-			}
-			ktheta2 *= ktheta;    // ktheta^5
-			if ((muls->a55 > 0) || (muls->a53 > 0) || (muls->a51 > 0)) {
-				chi += ktheta2*(muls->a55*cos(5.0*(phi-muls->phi55))+muls->a53*cos(3.0*(phi-muls->phi53))+muls->a51*cos(phi-muls->phi51))/5.0;
-				//                     1/5*(a(5,5).*cos(5*(kphi-phi(5,5)))+a(5,3).*cos(3*(kphi-phi(5,3)))+a(5,1).*cos(1*(kphi-phi(5,1)))).*ktheta.^5+...
-			}
-			ktheta2 *= ktheta;    // ktheta^6
-			if ((muls->a66 > 0) || (muls->a64 > 0) || (muls->a62 = 0) || (muls->C5 != 0)) {
-				chi += ktheta2*(muls->a66*cos(6.0*(phi-muls->phi66))+muls->a64*cos(4.0*(phi-muls->phi64))+muls->a62*cos(2.0*(phi-muls->phi62))+muls->C5)/6.0;
-				//                     1/6*(a(6,6).*cos(6*(kphi-phi(6,6)))+a(6,4).*cos(4*(kphi-phi(6,4)))+a(6,2).*cos(2*(kphi-phi(6,2)))+c(6)).*ktheta.^6);
-			}
-
-			chi *= 2*pi/wavlen;
+			// defocus, astigmatism and the higher order aberrations, and the shift:
+			chi = aberrationPhase(muls, rx*kx, ry*ky, wavlen);
 			chi -= 2.0*pi*( (dx*kx/ax) + (dy*ky/by) );
-			// include higher order aberrations
 
 
 			if ( ( (*muls).ismoth != 0) && 
@@ -2105,11 +2192,7 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 	}
 	/* Fourier transform into real space */
 	// fftwnd_one(muls->fftPlanInv, &(muls->wave[0][0]), NULL);
-#if FLOAT_PRECISION == 1
-	fftwf_execute(wave->fftPlanWaveInv);
-#else
-	fftw_execute(wave->fftPlanWaveInv);
-#endif
+	wave->fftPlanWaveInv->Execute(wave->wave[0]);
 	/**********************************************************
 	* display cross section of probe intensity
 	*/
@@ -2190,6 +2273,77 @@ void probe(MULS *muls, WavePtr wave, double dx, double dy)
 
 }  /* end probe() */
 
+/**************************************************************
+* initSTEMSlices() for muls->transStore: TRANS_POTENTIAL keeps
+* just the phase scale*V, TRANS_HALF makes the (bandwidth limited)
+* transmission function of one slice at a time in a complex 
+* scratch array and packs it into the store.  Returns the time 
+* spent in FFTs.
+**************************************************************/
+static double compactPhaseGratings(MULS *muls, int nlayer, double scale, real *kx2, real *ky2, real k2max, int *nbeams) {
+	int nx = muls->potNx, ny = muls->potNy;
+	int ilayer, ix, iy;
+	long i;
+	double fftScale = 1.0/(nx*ny), timer, time = 0;
+	float_tt ***pot = muls->transStore->Potential();
+	float_tt *data = muls->transStore->PotentialData();
+#if FLOAT_PRECISION == 1
+	static fftwf_complex **slice = NULL;
+#else
+	static fftw_complex **slice = NULL;
+#endif
+	static FFTPlanPtr planForw, planInv;
+
+	if (muls->transStore->Mode() == TRANS_POTENTIAL) {
+		// the phase is expanded to exp(i*phase) in TransStore::Transmit()
+#pragma omp parallel for
+		for (i=0; i<(long)(muls->transStore->PotentialBytes()/sizeof(float_tt)); i++) data[i] = (float_tt)(data[i]*scale);
+		return 0;
+	}
+
+	if (slice == NULL) {
+#if FLOAT_PRECISION == 1
+		slice = complex2Df(nx,ny,"slice");
+#else
+		slice = complex2D(nx,ny,"slice");
+#endif
+		FFTPlanThreads threads(fftThreads());
+		planForw = fftBackend()->Plan2D(nx,ny,FFTW_FORWARD);
+		planInv = fftBackend()->Plan2D(nx,ny,FFTW_BACKWARD);
+	}
+	for (ilayer=0; ilayer<nlayer; ilayer++) {
+		for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+			slice[ix][iy][0] = pot[ilayer][ix][iy];
+			slice[ix][iy][1] = 0;
+		}
+		phaseGrating(slice[0], (size_t)nx*ny, scale);
+		if (muls->bandlimittrans) {
+			timer = cputim();
+			planForw->Execute(slice[0]);
+			time += cputim()-timer;
+			for (ix=0; ix<nx; ix++) for (iy=0; iy<ny; iy++) {
+				if (ky2[iy]+kx2[ix] < k2max) {
+					(*nbeams)++;
+					slice[ix][iy][0] *= fftScale;
+					slice[ix][iy][1] *= fftScale;
+				}
+				else {
+					slice[ix][iy][0] = 0.0F;
+					slice[ix][iy][1] = 0.0F;
+				}
+			}
+			timer = cputim();
+			planInv->Execute(slice[0]);
+			time += cputim()-timer;
+		}
+		// may overwrite pot[ilayer], which has been copied to slice
+		muls->transStore->Pack(ilayer, slice);
+	}
+	// only the packed slices are needed from now on
+	muls->transStore->ReleasePotential();
+	return time;
+}
+
 /**************************************************************
 * The imaginary part of the trans arrays is already allocated
 * The projected potential is already located in trans[][][][0]
@@ -2200,7 +2354,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	int printFlag = 0;
 	int ilayer;
 	int nbeams;
-	double scale,vz,vzscale,mm0,wavlen;
+	double scale,vzscale,mm0,wavlen;
 	int nx,ny,ix,iy; // iz;
 	real temp,k2max,k2,kx,ky;
 	static real *kx2= NULL,*ky2 = NULL; /* *kx= NULL,*ky= NULL, */
@@ -2261,7 +2415,7 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	k2max = k2max*k2max;
 	(*muls).k2max = k2max;
 
-	if(muls->trans==NULL) {
+	if((muls->trans==NULL) && (muls->transStore==NULL)) {
 		printf("Memory for trans has not been allocated\n");
 		exit(0);
 	}
@@ -2287,53 +2441,46 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 	fftScale = 1.0/(nx*ny);
 	vzscale= 1.0;
 	timer1 = cputim();    
-	for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
-		timer2 = cputim();    
-		for( iy=0; iy<ny; iy++) for( ix=0; ix<nx; ix++) {
-			vz= muls->trans[ilayer][ix][iy][0]*scale;  // scale = lambda*gamma
+	if (muls->transStore) {
+		time2 = compactPhaseGratings(muls,nlayer,scale,kx2,ky2,k2max,&nbeams);
+	}
+	else {
+		for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
+			timer2 = cputim();    
+			// scale = lambda*gamma
 			// include absorption:
 			// vzscale= exp(-(*muls).trans[ilayer][ix][iy][1]*scale);
-			/* printf("vz(%d %d) = %g\n",ix,iy,vz); */
-			muls->trans[ilayer][ix][iy][0] =  cos(vz);
-			muls->trans[ilayer][ix][iy][1] =  sin(vz);
+			phaseGrating(muls->trans[ilayer][0], (size_t)nx*ny, scale);
 		}
-	}
 
-	/*******************************************************************
-	* FFT/IFFT the transmit functions in order to bandwidth limit them
-	*******************************************************************/ 
-	if (muls->bandlimittrans) {
-		timer2 = cputim();    
-#if FLOAT_PRECISION == 1
-		fftwf_execute(muls->fftPlanPotForw);
-#else
-		fftw_execute(muls->fftPlanPotForw);
-#endif
-		time2 = cputim()-timer2;
-		//     printf("%g sec used for 1st set of FFTs\n",time2);  
-		for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
-			for( ix=0; ix<nx; ix++) for( iy=0; iy<ny; iy++) {
-				k2= ky2[iy] + kx2[ix];
-				if (k2 < k2max) {
-					nbeams++;
-					(*muls).trans[ilayer][ix][iy][0] *= fftScale;
-					(*muls).trans[ilayer][ix][iy][1] *= fftScale;
+		/*******************************************************************
+		* FFT/IFFT the transmit functions in order to bandwidth limit them
+		*******************************************************************/ 
+		if (muls->bandlimittrans) {
+			timer2 = cputim();    
+			muls->fftPlanPotForw->Execute(muls->trans[0][0]);
+			time2 = cputim()-timer2;
+			//     printf("%g sec used for 1st set of FFTs\n",time2);  
+			for( ilayer=0;  ilayer<nlayer; ilayer++ ) {     
+				for( ix=0; ix<nx; ix++) for( iy=0; iy<ny; iy++) {
+					k2= ky2[iy] + kx2[ix];
+					if (k2 < k2max) {
+						nbeams++;
+						(*muls).trans[ilayer][ix][iy][0] *= fftScale;
+						(*muls).trans[ilayer][ix][iy][1] *= fftScale;
+					}
+					else {
+						(*muls).trans[ilayer][ix][iy][0] = 0.0F;
+						(*muls).trans[ilayer][ix][iy][1] = 0.0F;
+					}	
 				}
-				else {
-					(*muls).trans[ilayer][ix][iy][0] = 0.0F;
-					(*muls).trans[ilayer][ix][iy][1] = 0.0F;
-				}	
-			}
-		}  /* end for(ilayer=... */
-		timer2 = cputim();    
-		// old code: fftwnd_one((*muls).fftPlanPotInv, (*muls).trans[ilayer][0], NULL);
-#if FLOAT_PRECISION == 1
-		fftwf_execute(muls->fftPlanPotInv);
-#else
-		fftw_execute(muls->fftPlanPotInv);
-#endif
-		time2 += cputim()-timer2;
-	}  /* end of ... if bandlimittrans */
+			}  /* end for(ilayer=... */
+			timer2 = cputim();    
+			// old code: fftwnd_one((*muls).fftPlanPotInv, (*muls).trans[ilayer][0], NULL);
+			muls->fftPlanPotInv->Execute(muls->trans[0][0]);
+			time2 += cputim()-timer2;
+		}  /* end of ... if bandlimittrans */
+	}  /* end of ... if transStore */
 	time1 = cputim()-timer1;
 
 	if (muls->printLevel > 1) {
@@ -2361,44 +2508,73 @@ void initSTEMSlices(MULS *muls, int nlayer) {
 
 
 
+/****************************************************************
+* exitWaveStats() records the intensity (and value range) of the 
+* exit wave, and saves it, if requested.
+***************************************************************/
+static void exitWaveStats(MULS *muls, PropagationContextPtr &context, WavePtr &wave, int printFlag) {
+	int ix,iy;
+	real x,y,scale,sum;
+
+	scale = 1.0F / (((real)muls->nx) * ((real)muls->ny));
+	context->rmin  = wave->wave[0][0][0];
+	context->rmax  = context->rmin;
+	context->aimin = wave->wave[0][0][1];
+	context->aimax = context->aimin;
+
+	sum = 0.0;
+	for( ix=0; ix<muls->nx; ix++)  for( iy=0; iy<muls->ny; iy++) {
+		x =  wave->wave[ix][iy][0];
+		y =  wave->wave[ix][iy][1];
+		if( x < context->rmin ) context->rmin = x;
+		if( x > context->rmax ) context->rmax = x;
+		if( y < context->aimin ) context->aimin = y;
+		if( y > context->aimax ) context->aimax = y;
+		sum += x*x+y*y;
+	}
+	// the integrated intensity of this probe position only
+	wave->intIntensity = sum*scale;
+
+	if (printFlag) {
+		printf( "pix range %g to %g real,\n"
+			"          %g to %g imag\n",  
+			context->rmin,context->rmax,context->aimin,context->aimax);
+
+	}
+	// slabs are handed on through the WaveStore, so only write the exit wave if asked for
+	if (muls->saveFlag) {
+		if (muls->saveLevel > 1) {
+			wave->WriteWave(wave->fileout);
+			if (printFlag)
+				printf("Created complex image file %s\n",(*wave).fileout);    
+		}
+	}
+}
+
+template <class T> static void collectWave(MULS *muls, PropagationContextPtr &context, WavePtr &wave, 
+										   T (**w)[2], int slice);
+
+// wave->wave = w, if the slices run in the other precision
+template <class T> static void syncWave(MULS *muls, PropagationContextPtr &context, WavePtr &wave, T (**w)[2]) {
+	if ((void *)w != (void *)wave->wave) 
+		copyWave(wave->wave, w, muls->nx, muls->ny, context->nThreads);
+}
+
 /******************************************************************
-* runMulsSTEM() - do the multislice propagation in STEM/CBED mode
-* 
-*    Each probe position is running this function.  Each CPU is thus
-*      running a separate instance of the function.  It is nested in
-*      the main OpenMP parallel region - specifying critical, single, and
-*      barrier OpenMP pragmas should be OK.
-*
-* waver, wavei are expected to contain incident wave function 
-* they will be updated at return
+* mulsSlices() - the slice loop of runMulsSTEM() on w, which is 
+* either wave->wave, or context->otherWave (in other_real) with
+* fft = context->otherFFT and transRow = context->otherTransRow.  The beams and interim waves are written 
+* from wave->wave, so w is copied there first.
 *****************************************************************/
-int runMulsSTEM(MULS *muls, WavePtr wave) {
-	int printFlag = 0; 
+template <class T> static void mulsSlices(MULS *muls, PropagationContextPtr &context, WavePtr &wave, 
+										  T (**w)[2], PrunedFFTT<T> *fft, std::vector<T> &transRow, int printFlag) {
 	int showEverySlice=1;
 	int islice,i,ix,iy,mRepeat;
-	real cztot=0.0;
-	real wavlen,scale,sum=0.0; //,zsum=0.0
-	// static int *layer=NULL;
-	real x,y;
+	double sum=0.0, scale;
 	int absolute_slice;
-
 	char outStr[64];
-	double fftScale;
-
-	printFlag = (muls->printLevel > 3);
-	fftScale = 1.0/(muls->nx*muls->ny);
-
-	wavlen = (real)wavelength((*muls).v0);
-
-	/*  calculate the total specimen thickness and echo */
-	cztot=0.0;
-	for( islice=0; islice<(*muls).slices; islice++) {
-		cztot += (*muls).cz[islice];
-	}
-	if (printFlag)
-		printf("Specimen thickness: %g Angstroms\n", cztot);
 
-	scale = 1.0F / (((real)muls->nx) * ((real)muls->ny));
+	scale = 1.0 / (((double)muls->nx) * ((double)muls->ny));
 
 	for (mRepeat = 0; mRepeat < muls->mulsRepeat1; mRepeat++) 
 	{
@@ -2412,42 +2588,35 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 			/***********************************************************************
 			* Transmit is a simple multiplication of wave with trans in real space
 			**********************************************************************/
-			transmit((void **)wave->wave, (void **)(muls->trans[islice]), muls->nx,muls->ny, wave->iPosX, wave->iPosY);
-			//    writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavet.img");      
+			if (muls->transStore)
+				muls->transStore->Transmit(w, islice, muls->nx, muls->ny, wave->iPosX, wave->iPosY,
+					transRow, context->nThreads);
+			else
+				transmitWave(w, muls->trans[islice], muls->nx,muls->ny, wave->iPosX, wave->iPosY,
+					context->nThreads);
 			/***************************************************** 
 			* remember: prop must be here to anti-alias
 			* propagate is a simple multiplication of wave with prop
-			* but it also takes care of the bandwidth limiting
+			* but it also takes care of the bandwidth limiting.
+			* The FFTs skip the columns outside the bandwidth limit.
 			*******************************************************/
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveForw);
-#else
-			fftw_execute(wave->fftPlanWaveForw);
-#endif
-			propagate_slow((void **)wave->wave, muls->nx, muls->ny, muls);
+			fft->Forward(w[0]);
+			if ((void *)w == (void *)wave->wave) context->Propagate((void **)w);
+			else context->PropagateOther();
 
-			collectIntensity(muls, wave, muls->totalSliceCount+islice*(1+mRepeat));
+			collectWave(muls, context, wave, w, muls->totalSliceCount+islice*(1+mRepeat));
 
 			if (muls->mode != STEM) {
 				/* write pendelloesung plots, if this is not STEM */
-				writeBeams(muls,wave,islice, absolute_slice);
+				syncWave(muls, context, wave, w);
+				writeBeams(muls,wave,islice, absolute_slice, context->waveScale);
 			}
 
 			// go back to real space:
-#if FLOAT_PRECISION == 1
-			fftwf_execute(wave->fftPlanWaveInv);
-#else
-			fftw_execute(wave->fftPlanWaveInv);
-#endif
-			// old code: fftwnd_one((*muls).fftPlanInv,(fftw_complex *)wave[0][0], NULL);
-			fft_normalize((void **)wave->wave,muls->nx,muls->ny);
-
-			/*
-			sprintf(outStr,"wave%d.img",islice);
-			writeImage_old(wave,(*muls).nx,(*muls).ny,(*muls).thickness,"wavep.img");
-			*/    
-
-			// write the intermediate TEM wave function:
+			fft->Inverse(w[0]);
+			// the 2D propagator already contains the normalization
+			if (context->waveScale == 1.0)
+				scaleWave(w, muls->nx, muls->ny, scale, context->nThreads);
 
 			/********************************************************************
 			* show progress:
@@ -2456,8 +2625,7 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 			if ((printFlag)) {
 				sum = 0.0;
 				for( ix=0; ix<(*muls).nx; ix++)  for( iy=0; iy<(*muls).ny; iy++) {
-					sum +=  wave->wave[ix][iy][0]* wave->wave[ix][iy][0] +
-						wave->wave[ix][iy][1]* wave->wave[ix][iy][1];
+					sum +=  w[ix][iy][0]* w[ix][iy][0] + w[ix][iy][1]* w[ix][iy][1];
 				}
 				sum *= scale;
 
@@ -2477,13 +2645,57 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 				// TODO (MCS 2013/04): this restructure probably broke this file saving - 
 				//   need to rewrite a function to save things for TEM/CBED?
 				// This used to call interimWave(muls,wave,muls->totalSliceCount+islice*(1+mRepeat));
+				syncWave(muls, context, wave, w);
 				interimWave(muls,wave,absolute_slice*(1+mRepeat)); 
-				collectIntensity(muls,wave,absolute_slice*(1+mRepeat));
+				collectWave(muls,context,wave,w,absolute_slice*(1+mRepeat));
 			}
 		} /* end for(islice...) */
-		// collect intensity at the final slice
-		//collectIntensity(muls, wave, muls->totalSliceCount+muls->slices*(1+mRepeat));
 	} /* end of mRepeat = 0 ... */
+}
+
+/******************************************************************
+* runMulsSTEM() - do the multislice propagation in STEM/CBED mode
+* 
+*    Each probe position is running this function.  Each CPU is thus
+*      running a separate instance of the function.  It is nested in
+*      the main OpenMP parallel region - specifying critical, single, and
+*      barrier OpenMP pragmas should be OK.
+*
+* waver, wavei are expected to contain incident wave function 
+* they will be updated at return.  Everything this function writes
+* to, apart from wave and the detector pixels of its probe position,
+* is in context, which must therefore not be shared between threads.
+*****************************************************************/
+int runMulsSTEM(MULS *muls, PropagationContextPtr context, WavePtr wave) {
+	int printFlag = 0; 
+	int islice;
+	real cztot=0.0;
+	real wavlen;
+
+	printFlag = (muls->printLevel > 3);
+
+	wavlen = (real)wavelength((*muls).v0);
+
+	/*  calculate the total specimen thickness and echo */
+	cztot=0.0;
+	for( islice=0; islice<(*muls).slices; islice++) {
+		cztot += (*muls).cz[islice];
+	}
+	if (printFlag)
+		printf("Specimen thickness: %g Angstroms\n", cztot);
+
+	context->Update(muls);
+
+	/* 'propagation precision:' the slices run in the precision of 
+	 * context->otherWave, and the wave is converted on the way in and out */
+	if (context->otherWave != NULL) {
+		copyWave(context->otherWave, wave->wave, muls->nx, muls->ny, context->nThreads);
+		mulsSlices(muls, context, wave, context->otherWave, context->otherFFT.get(), 
+			context->otherTransRow, printFlag);
+		copyWave(wave->wave, context->otherWave, muls->nx, muls->ny, context->nThreads);
+	}
+	else 
+		mulsSlices(muls, context, wave, wave->wave, context->fft.get(), context->transRow, printFlag);
 	if (printFlag) printf("\n***************************************\n");
 
 	/****************************************************
@@ -2492,46 +2704,82 @@ int runMulsSTEM(MULS *muls, WavePtr wave) {
 	****************************************************
 	***************************************************/
 
-	// TODO: modifying shared value from multiple threads?
-	//#pragma omp single
-	muls->rmin  = wave->wave[0][0][0];
-	//#pragma omp single
-	muls->rmax  = (*muls).rmin;
-	//#pragma omp single
-	muls->aimin = wave->wave[0][0][1];
-	//#pragma omp single
-	muls->aimax = (*muls).aimin;
+	exitWaveStats(muls,context,wave,printFlag);
+	return 0;
+}  // end of runMulsSTEM
 
-	sum = 0.0;
-	for( ix=0; ix<muls->nx; ix++)  for( iy=0; iy<muls->ny; iy++) {
-		x =  wave->wave[ix][iy][0];
-		y =  wave->wave[ix][iy][1];
-		if( x < (*muls).rmin ) (*muls).rmin = x;
-		if( x > (*muls).rmax ) (*muls).rmax = x;
-		if( y < (*muls).aimin ) (*muls).aimin = y;
-		if( y > (*muls).aimax ) (*muls).aimax = y;
-		sum += x*x+y*y;
-	}
-	// TODO: modifying shared value from multiple threads?
-	//  Is this sum supposed to be across multiple pixels?
-	//#pragma omp critical
-	wave->intIntensity = sum*scale;
 
-	if (printFlag) {
-		printf( "pix range %g to %g real,\n"
-			"          %g to %g imag\n",  
-			(*muls).rmin,(*muls).rmax,(*muls).aimin,(*muls).aimax);
+/******************************************************************
+* runMulsSTEMBatch() - same as runMulsSTEM, but for count probe 
+* positions at once.  The waves are moved into the contiguous 
+* buffer of context->batch, so that all of them are transmitted in one pass
+* through muls->trans[islice] and transformed with one set of plans.
+* Only used in STEM mode, so there are no beams or interim waves to 
+* take care of.
+*****************************************************************/
+int runMulsSTEMBatch(MULS *muls, PropagationContextPtr context, std::vector<WavePtr> &waves, int count) {
+	int printFlag = 0; 
+	int islice,k,mRepeat;
+	ProbeBatchPtr batch = context->batch;
 
-	}
-	if (muls->saveFlag) {
-		if ((muls->saveLevel > 1) || (muls->cellDiv > 1)) {
-			wave->WriteWave(wave->fileout);
+	printFlag = (muls->printLevel > 3);
+	context->Update(muls);
+
+	batch->Attach(waves, count);
+	for (mRepeat = 0; mRepeat < muls->mulsRepeat1; mRepeat++) 
+	{
+		for( islice=0; islice < muls->slices; islice++ ) 
+		{
+			transmitBatch(waves, count, muls, islice, context->batchRow);
+			context->batchFFT->Forward(batch->Buffer());
+			for (k=0; k<count; k++) {
+				context->Propagate((void **)waves[k]->wave);
+				collectIntensity(muls, context, waves[k], muls->totalSliceCount+islice*(1+mRepeat));
+			}
+			context->batchFFT->Inverse(batch->Buffer());
+			for (k=0; k<count; k++) {
+				if (context->waveScale == 1.0)
+					fft_normalize((void **)waves[k]->wave,muls->nx,muls->ny);
+				waves[k]->thickness = (muls->totalSliceCount+islice+1)*muls->sliceThickness;
+			}
 			if (printFlag)
-				printf("Created complex image file %s\n",(*wave).fileout);    
-		}
-	}
+				printf("positions (%3d, %3d) + %d, slice %4d (%.2f)\n", 
+					waves[0]->detPosX, waves[0]->detPosY, count-1,
+					muls->totalSliceCount+islice,waves[0]->thickness);
+		} /* end for(islice...) */
+	} /* end of mRepeat = 0 ... */
+	batch->Detach(waves, count);
+
+	for (k=0; k<count; k++)
+		exitWaveStats(muls,context,waves[k],printFlag);
 	return 0;
-}  // end of runMulsSTEM
+}  // end of runMulsSTEMBatch
+
+/******************************************************************
+* collectPRISM() - PRISM mode: wave is the exit wave of the last 
+* slice, synthesized by SMatrix::Synthesize() in real space, so we
+* only need to transform it and collect it on the detectors of the 
+* final thickness.  The shared wave plans are used, because the pruned
+* FFT of context leaves the columns outside the bandwidth limit to
+* the propagator.
+*****************************************************************/
+void collectPRISM(MULS *muls, PropagationContextPtr context, WavePtr wave) {
+	int printFlag = (muls->printLevel > 3);
+
+	context->Update(muls);
+	wave->thickness = (muls->totalSliceCount+muls->slices)*muls->sliceThickness;
+	exitWaveStats(muls,context,wave,printFlag);
+	wave->fftPlanWaveForw->Execute(wave->wave[0]);
+	// collectIntensity() expects the scale of the propagated wave
+	if (context->waveScale != 1.0) {
+#if FLOAT_PRECISION == 1
+		scaleWave((fftwf_complex **)wave->wave, muls->nx, muls->ny, context->waveScale, 1);
+#else
+		scaleWave((fftw_complex **)wave->wave, muls->nx, muls->ny, context->waveScale, 1);
+#endif
+	}
+	collectIntensity(muls, context, wave, muls->slices*muls->cellDiv-1);
+}
 
 
 ////////////////////////////////////////////////////////////////
@@ -2565,124 +2813,56 @@ void interimWave(MULS *muls,WavePtr wave,int slice) {
 	wave->WriteWave(fileName, "Wave Function", params);
 }
 
+// index of the output thickness (detectors[t]) which slice belongs to
+static int outputThickness(MULS *muls, int slice)
+{
+	if (muls->outputInterval == 0) return 0;
+	if (slice < muls->slices*muls->cellDiv-1) return slice/muls->outputInterval;
+	return (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
+}
+
 /********************************************************************
-* collectIntensity(muls, wave, slice)
+* collectIntensity(muls, context, wave, slice)
 * collect the STEM signal on the annular detector(s) defined in muls
 * and write the appropriate pixel in the image for each detector and thickness
 * The number of images is determined by the following formula:
 * muls->slices*muls->cellDiv/muls->outputInterval 
 * There are muls->detectorNum different detectors
 *******************************************************************/
-void collectIntensity(MULS *muls, WavePtr wave, int slice) 
+void collectIntensity(MULS *muls, PropagationContextPtr &context, WavePtr &wave, int slice) 
 {
-	int i,ix,iy,ixs,iys,t;
-	real k2;
-	double intensity,scale,scaleCBED,scaleDiff,intensity_save;
-	char fileName[256],avgName[256]; 
-	float_tt **diffpatAvg = NULL;
-	int tCount = 0;
+	collectWave(muls, context, wave, wave->wave, slice);
+}
 
-	std::vector<std::vector<DetectorPtr> > detectors;
+// collectIntensity() for the wave w, in float or double
+template <class T> static void collectWave(MULS *muls, PropagationContextPtr &context, WavePtr &wave, 
+										   T (**w)[2], int slice)
+{
+	int t;
+	double scale,scaleDiff,norm;
 
-	scale = muls->electronScale/((double)(muls->nx*muls->ny)*(muls->nx*muls->ny));
+	// the intensities refer to the unnormalized FFT of the wave
+	norm = (double)(muls->nx*muls->ny)*context->waveScale;
+	scale = muls->electronScale/(norm*norm);
 	// scaleCBED = 1.0/(scale*sqrt((double)(muls->nx*muls->ny)));
-	scaleDiff = 1.0/sqrt((double)(muls->nx*muls->ny));
+	scaleDiff = 1.0/(sqrt((double)(muls->nx*muls->ny))*context->waveScale*context->waveScale);
 
-	tCount = (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
+	t = outputThickness(muls, slice);
+	/* The detector images average over the frozen phonon runs, so each 
+	 * thickness may be added only once per run, at its last slice. */
+	if ((slice < muls->slices*muls->cellDiv-1) && (outputThickness(muls, slice+1) == t)) return;
 
-	// we write directly to the shared muls object.  This is safe only because 
-	//    each thread is accessing different pixels in the output images.
-	detectors = muls->detectors;
-
-	if (muls->outputInterval == 0) t = 0;
-	else if (slice < ((muls->slices*muls->cellDiv)-1))
-	{
-		t = (int)((slice) / muls->outputInterval);
-		//if (t > tCount)
-		//{
-			// printf("t = %d, which is greater than tCount (%d)\n",t,tCount);
-			//t = tCount-1;
-		//}
-	}
-	else
-	{
-		t = tCount;
-	}
-
-	int position_offset = wave->detPosY * muls->scanXN + wave->detPosX;
-
-	// Multiply each image by its number of averages and divide by it later again:
-	for (i=0;i<muls->detectorNum;i++) 
-	{
-		detectors[t][i]->image[wave->detPosX][wave->detPosY]  *= detectors[t][i]->Navg;	
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] *= detectors[t][i]->Navg;	
-		detectors[t][i]->error = 0;
-	}
-	/* add the intensities in the already 
-	fourier transformed wave function */
-	for (ix = 0; ix < muls->nx; ix++) 
-	{
-		for (iy = 0; iy < muls->ny; iy++) 
-		{
-			k2 = muls->kx2[ix]+muls->ky2[iy];
-			intensity = (wave->wave[ix][iy][0]*wave->wave[ix][iy][0]+
-				wave->wave[ix][iy][1]*wave->wave[ix][iy][1]);
-			wave->diffpat[(ix+muls->nx/2)%muls->nx][(iy+muls->ny/2)%muls->ny] = intensity*scaleDiff;
-			intensity *= scale;
-			for (i=0;i<muls->detectorNum;i++) {
-				if ((k2 >= detectors[t][i]->k2Inside) && (k2 <= detectors[t][i]->k2Outside)) 
-				{
-					// detector in center of diffraction pattern:
-					if ((detectors[t][i]->shiftX == 0) && (detectors[t][i]->shiftY == 0)) 
-					{
-						detectors[t][i]->image[wave->detPosX][wave->detPosY] += intensity;
-						// misuse the error number for collecting this pixels raw intensity
-						detectors[t][i]->error += intensity;
-					}
-					/* special case for shifted detectors: */		
-					else 
-					{
-						intensity_save = intensity;
-						ixs = (ix+(int)detectors[t][i]->shiftX+muls->nx) % muls->nx;
-						iys = (iy+(int)detectors[t][i]->shiftY+muls->ny) % muls->ny;	    
-						intensity = scale * (wave->wave[ixs][iys][0]*wave->wave[ixs][iys][0]+
-							wave->wave[ixs][iys][1]*wave->wave[ixs][iys][1]);
-						detectors[t][i]->image[wave->detPosX][wave->detPosY] += intensity;
-						// repurpose the error number for collecting this pixels raw intensity
-						detectors[t][i]->error += intensity;
-						/* restore intensity, so that it will not be shifted for the other detectors */
-						intensity = intensity_save;
-					}
-				} /* end of if k2 ... */
-			} /* end of for i=0 ... detectorNum */
-		} /* end of for iy=0... */
-	} /* end of for ix = ... */
+	/* add the intensities in the already fourier transformed wave function.
+	 * We write directly to the detectors of muls.  This is safe only because 
+	 * each thread is accessing different pixels in the output images. */
+	context->collector->Collect(w, wave->diffpat, muls->detectors[t], 
+		wave->detPosX, wave->detPosY, scale, scaleDiff);
 
 	////////////////////////////////////////////////////////////////////////////
-	// write the diffraction pattern to disc in case we are working in CBED mode
-	if ((muls->mode == CBED) && (muls->saveLevel > 0)) {
-		sprintf(avgName,"%s/diff_%d.img",muls->folder,t);
-		// for (ix=0;ix<muls->nx*muls->ny;ix++) wave->diffpat[0][ix] *= scaleCBED;
-		if (muls->avgCount == 0) {
-			wave->WriteDiffPat(avgName);
-		}
-		else {
-			wave->ReadAvgArray(avgName);
-			for (ix=0;ix<muls->nx*muls->ny;ix++) {
-				wave->avgArray[0][ix] = (muls->avgCount*wave->avgArray[0][ix]+wave->diffpat[0][ix])/(muls->avgCount+1);
-			}
-			wave->WriteAvgArray(avgName);
-		}
-	}
-
-	// Divide each image by its number of averages again:
-	for (i=0;i<muls->detectorNum;i++) {
-		// add intensity squared to image2 for this detector and pixel, then rescale:
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] += detectors[t][i]->error*detectors[t][i]->error;
-		detectors[t][i]->image2[wave->detPosX][wave->detPosY] /= detectors[t][i]->Navg+1;	
-
-		// do the rescaling for the average image:
-		detectors[t][i]->image[wave->detPosX][wave->detPosY] /= detectors[t][i]->Navg+1;	
+	// keep the diffraction pattern for this thickness in case we are working in CBED mode,
+	// doCBED() adds it to the frozen phonon average at the end of the run
+	if ((muls->mode == CBED) && (muls->diffpatSeries != NULL)) {
+		memcpy(muls->diffpatSeries[t][0],wave->diffpat[0],muls->nx*muls->ny*sizeof(float_tt));
 	}
 }
 
@@ -2690,62 +2870,50 @@ void collectIntensity(MULS *muls, WavePtr wave, int slice)
 // Saves all detector images (STEM images) that are defined in muls.
 //   When saving intermediate STEM images is enabled, this also saves
 //   the intermediate STEM images for each detector.
+//   If this process computes only one tile of the scan, the tile is 
+//   written instead, and stem3-merge produces the images later on.
 void saveSTEMImages(MULS *muls)
 {
-	int i, ix, islice;
-	double intensity;
-	static char fileName[256]; 
-	//imageStruct *header = NULL;
-	std::vector<DetectorPtr> detectors;
-	float t;
+	int islice;
+	char fileName[512]; 
+	std::vector<float> thickness;
+	STEMTileHeader header;
 
 	int tCount = (int)(ceil((double)((muls->slices * muls->cellDiv) / muls->outputInterval)));
 
-	// Loop over slices (intermediates)
+	// thickness of every intermediate plane, and of the whole specimen
 	for (islice=0; islice <= tCount; islice++)
 	{
 		if (islice<tCount)
-		{
-			t = ((islice+1) * muls->outputInterval ) * muls->sliceThickness;
-		}
+			thickness.push_back(((islice+1) * muls->outputInterval ) * muls->sliceThickness);
 		else
-		{
-			t = muls->slices*muls->cellDiv*muls->sliceThickness;
-		}
-		detectors = muls->detectors[islice];
-		// write the output STEM images:
-		// This is done only after all pixels have completed, so that image is complete.
-		for (i=0; i<muls->detectorNum; i++) 
-		{
-			// calculate the standard error for this image:
-			detectors[i]->error = 0;
-			intensity             = 0;
-			for (ix=0; ix<muls->scanXN * muls->scanYN; ix++) 
-			{
-				detectors[i]->error += (detectors[i]->image2[0][ix]-
-					detectors[i]->image[0][ix] * detectors[i]->image[0][ix]);
-				intensity += detectors[i]->image[0][ix] * detectors[i]->image[0][ix];
-			}
-			detectors[i]->error /= intensity;
-			if (islice <tCount)
-				sprintf(fileName,"%s/%s_%d.img", muls->folder, detectors[i]->name, islice);
-			else
-				sprintf(fileName,"%s/%s.img", muls->folder, detectors[i]->name, islice);
-			//detectors[i]->SetComment(detectors[i]->name);
-			// NOTE: the comment for STEM images must be this, or else the MATLAB GUI doesn't recognize it as a STEM image!
-			//     That means the quantification and source size dialogs will be disabled.
-			detectors[i]->SetComment("STEM image");
-			detectors[i]->SetThickness(t);
-			detectors[i]->SetParameter(0, (double)muls->avgCount+1);
-			detectors[i]->SetParameter(1, (double)detectors[i]->error);
-
-			for (ix=0; ix<muls->scanXN * muls->scanYN; ix++) 
-			{
-				detectors[i]->SetParameter(2+ix, (double)detectors[i]->image2[0][ix]);
-			}
-			detectors[i]->WriteImage(fileName);
+			thickness.push_back(muls->slices*muls->cellDiv*muls->sliceThickness);
+	}
+
+	if (muls->nTiles > 1) {
+		header.tile = muls->tile;
+		header.nTiles = muls->nTiles;
+		header.scanXN = muls->scanXN;
+		header.scanYN = muls->scanYN;
+		header.ixStart = muls->tileXStart;
+		header.ixStop = muls->tileXStop;
+		header.iyStart = muls->tileYStart;
+		header.iyStop = muls->tileYStop;
+		header.nPlanes = tCount+1;
+		header.detectorNum = muls->detectorNum;
+		header.avgCount = muls->avgCount;
+		header.resX = header.resY = 0;
+		if (muls->detectorNum > 0) {
+			header.resX = muls->detectors[0][0]->GetResolutionX();
+			header.resY = muls->detectors[0][0]->GetResolutionY();
 		}
+		stemTileName(fileName, muls->folder, muls->tile, muls->nTiles);
+		writeSTEMTile(fileName, header, thickness, muls->detectors);
+		return;
 	}
+	// This is done only after all pixels have completed, so that image is complete.
+	writeSTEMImages(muls->detectors, muls->detectorNum, muls->scanXN * muls->scanYN, 
+		muls->folder, thickness, muls->avgCount+1);
 }
 
 void readStartWave(WavePtr wave) {
@@ -2753,103 +2921,6 @@ void readStartWave(WavePtr wave) {
 }
 
 
-/******************************************************************
-* propagate_slow() 
-* replicates the original way, mulslice did it:
-*****************************************************************/
-void propagate_slow(void **w,int nx, int ny,MULS *muls)
-{
-	int ixa, iya;
-	real wr, wi, tr, ti,ax,by;
-	real scale,t,dz; 
-	static real dzs=0;
-	static real *propxr=NULL,*propyr=NULL;
-	static real *propxi=NULL,*propyi=NULL;
-	static real *kx2,*ky2;
-	static real *kx,*ky;
-	static real k2max=0,wavlen;
-#if FLOAT_PRECISION == 1
-	fftwf_complex **wave;
-	wave = (fftwf_complex **)w;
-#else
-	fftw_complex **wave;
-	wave = (fftw_complex **)w;
-#endif
-
-	ax = (*muls).resolutionX*nx;
-	by = (*muls).resolutionY*ny;
-	dz = (*muls).cz[0];
-
-	if (dz != dzs) {
-		if (propxr == NULL) {
-			propxr = float1D(nx, "propxr" );
-			propxi = float1D(nx, "propxi" );
-			propyr = float1D(ny, "propyr" );
-			propyi = float1D(ny, "propyi" );
-			kx2    = float1D(nx, "kx2" );
-			kx     = float1D(nx, "kx" );
-			ky2    = float1D(ny, "ky2" );
-			ky     = float1D(ny, "ky" );
-		}
-		dzs = dz;
-		scale = dz*PI;
-		wavlen = wavelength((*muls).v0);
-
-		for( ixa=0; ixa<nx; ixa++) {
-			kx[ixa] = (ixa>nx/2) ? (real)(ixa-nx)/ax : 
-				(real)ixa/ax;
-			kx2[ixa] = kx[ixa]*kx[ixa];
-			t = scale * (kx2[ixa]*wavlen);
-			propxr[ixa] = (real)  cos(t);
-			propxi[ixa] = (real) -sin(t);
-		}
-		for( iya=0; iya<ny; iya++) {
-			ky[iya] = (iya>ny/2) ? 
-				(real)(iya-ny)/by : 
-			(real)iya/by;
-			ky2[iya] = ky[iya]*ky[iya];
-			t = scale * (ky2[iya]*wavlen);
-			propyr[iya] = (real)  cos(t);
-			propyi[iya] = (real) -sin(t);
-		}
-		k2max = nx/(2.0F*ax);
-		if (ny/(2.0F*by) < k2max ) k2max = ny/(2.0F*by);
-		k2max = 2.0/3.0 * k2max;
-		// TODO: modifying shared value from multiple threads?
-		k2max = k2max*k2max;
-		(*muls).kx2=kx2;
-		(*muls).ky2=ky2;
-		(*muls).kx=kx;
-		(*muls).ky=ky;
-	} 
-	/* end of: if dz != dzs */
-	/*************************************************************/
-
-	/*************************************************************
-	* Propagation
-	************************************************************/
-	for( ixa=0; ixa<nx; ixa++) {
-		if( kx2[ixa] < k2max ) {
-			for( iya=0; iya<ny; iya++) {
-				if( (kx2[ixa] + ky2[iya]) < k2max ) {
-
-					wr = wave[ixa][iya][0];
-					wi = wave[ixa][iya][1];
-					tr = wr*propyr[iya] - wi*propyi[iya];
-					ti = wr*propyi[iya] + wi*propyr[iya];
-					wave[ixa][iya][0] = tr*propxr[ixa] - ti*propxi[ixa];
-					wave[ixa][iya][1] = tr*propxi[ixa] + ti*propxr[ixa];
-
-				} else
-					wave[ixa][iya][0] = wave[ixa][iya][1] = 0.0F;
-			} /* end for(iy..) */
-
-		} else for( iya=0; iya<ny; iya++)
-			wave[ixa][iya][0] = wave[ixa][iya][1] = 0.0F;
-	} /* end for(ix..) */
-} /* end propagate_slow() */
-
-
 /*------------------------ transmit() ------------------------*/
 /*
 transmit the wavefunction thru one layer 
@@ -2864,45 +2935,66 @@ on entrance waver,i and transr,i are in real space
 
 only waver,i will be changed by this routine
 */
-void transmit(void **wave, void **trans,int nx, int ny,int posx,int posy) {
-	int ix, iy;
-	double wr, wi, tr, ti;
+void transmit(void **wave, void **trans,int nx, int ny,int posx,int posy,int nThreads) {
 #if FLOAT_PRECISION == 1
-	fftwf_complex **w, **t;
-	w = (fftwf_complex **)wave;
-	t = (fftwf_complex **)trans;
+	transmitWave((fftwf_complex **)wave, (fftwf_complex **)trans, nx, ny, posx, posy, nThreads);
 #else
-	fftw_complex **w,**t;
-	w = (fftw_complex **)wave;
-	t = (fftw_complex **)trans;
+	transmitWave((fftw_complex **)wave, (fftw_complex **)trans, nx, ny, posx, posy, nThreads);
 #endif
-	/*  trans += posx; */
-	for( ix=0; ix<nx; ix++) for( iy=0; iy<ny; iy++) {
-		wr = w[ix][iy][0];
-		wi = w[ix][iy][1];
-		tr = t[ix+posx][iy+posy][0];
-		ti = t[ix+posx][iy+posy][1];
-		w[ix][iy][0] = wr*tr - wi*ti;
-		w[ix][iy][1] = wr*ti + wi*tr;
-	} /* end for(iy.. ix .) */
 } /* end transmit() */
 
-void fft_normalize(void **array,int nx, int ny) {
-	int ix,iy;
-	double fftScale;
+/*------------------------ transmitBatch() ------------------------*/
+/*
+same as transmit() for the first count waves, which are at 
+(waves[k]->iPosX, waves[k]->iPosY) in slice islice of muls->trans.
+Neighbouring probes share most of their window of trans, so we walk 
+through the rows of trans only once and apply each row to all the 
+waves that overlap it.  With muls->transStore each row is expanded 
+once (into expanded, which grows as needed), for the columns of all waves.
+*/
+void transmitBatch(std::vector<WavePtr> &waves, int count, MULS *muls, int islice, std::vector<float_tt> &expanded) {
+	int ix, k, itx, posxMin, posxMax, posyMin, posyMax, row0;
+	int nx = muls->nx, ny = muls->ny;
+	float_tt *row;
+
+	posxMin = posxMax = waves[0]->iPosX;
+	posyMin = posyMax = waves[0]->iPosY;
+	for (k=1; k<count; k++) {
+		if (waves[k]->iPosX < posxMin) posxMin = waves[k]->iPosX;
+		if (waves[k]->iPosX > posxMax) posxMax = waves[k]->iPosX;
+		if (waves[k]->iPosY < posyMin) posyMin = waves[k]->iPosY;
+		if (waves[k]->iPosY > posyMax) posyMax = waves[k]->iPosY;
+	}
+	if (muls->transStore && (expanded.size() < 2*(size_t)(posyMax-posyMin+ny))) 
+		expanded.resize(2*(posyMax-posyMin+ny));
+	for (itx=posxMin; itx<posxMax+nx; itx++) {
+		if (muls->transStore) {
 #if FLOAT_PRECISION == 1
-	fftwf_complex **carray;
-	carray = (fftwf_complex **)array;
+			muls->transStore->Expand((fftwf_complex *)&expanded[0], islice, itx, posyMin, posyMax-posyMin+ny);
 #else
-	fftw_complex **carray;
-	carray = (fftw_complex **)array;
+			muls->transStore->Expand((fftw_complex *)&expanded[0], islice, itx, posyMin, posyMax-posyMin+ny);
 #endif
+			row = &expanded[0];
+			row0 = posyMin;   // row[2*(iy-row0)] is column iy of trans
+		}
+		else {
+			row = &(muls->trans[islice][itx][0][0]);
+			row0 = 0;
+		}
+		for (k=0; k<count; k++) {
+			ix = itx-waves[k]->iPosX;
+			if ((ix < 0) || (ix >= nx)) continue;
+			complexMultiply((float_tt *)waves[k]->wave[ix], row+2*(waves[k]->iPosY-row0), ny);
+		}
+	} /* end for(itx..) */
+} /* end transmitBatch() */
 
-	fftScale = 1.0/(double)(nx*ny);
-	for (ix=0;ix<nx;ix++) for (iy=0;iy<ny;iy++) {
-		carray[ix][iy][0] *= fftScale;
-		carray[ix][iy][1] *= fftScale;
-	}
+void fft_normalize(void **array,int nx, int ny,int nThreads) {
+#if FLOAT_PRECISION == 1
+	scaleWave((fftwf_complex **)array, nx, ny, 1.0/(double)(nx*ny), nThreads);
+#else
+	scaleWave((fftw_complex **)array, nx, ny, 1.0/(double)(nx*ny), nThreads);
+#endif
 }
 
 void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,double dz) {
@@ -2961,9 +3053,10 @@ void showPotential(fftw_complex ***pot,int nz,int nx,int ny,double dx,double dy,
 
 /*****************************************************************
 * This function will write a data file with the pendeloesungPlot 
-* for selected beams
+* for selected beams.  waveScale is the factor by which the wave 
+* differs from its unnormalized FFT (see PropagationContext).
 ****************************************************************/
-void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
+void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice, double waveScale) {
 	static char fileAmpl[32];
 	static char filePhase[32];
 	static char fileBeam[32];
@@ -3056,8 +3149,8 @@ void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
 		fprintf( fpPhase, "%g",zsum);
 		for( ib=0; ib<(*muls).nbout; ib++) {
 			fprintf(fp1, "\t%g\t%g",
-				rPart = scale*(*wave).wave[hbeam[ib]][kbeam[ib]][0],
-				iPart = scale*(*wave).wave[hbeam[ib]][kbeam[ib]][1]);
+				rPart = (real)(scale/waveScale)*(*wave).wave[hbeam[ib]][kbeam[ib]][0],
+				iPart = (real)(scale/waveScale)*(*wave).wave[hbeam[ib]][kbeam[ib]][1]);
 			ampl = (real)sqrt(rPart*rPart+iPart*iPart);
 			phase = (real)atan2(iPart,rPart);	
 			fprintf(fpAmpl,"\t%g",ampl);
@@ -3081,7 +3174,7 @@ void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
 		for( ib=0; ib<muls->nbout; ib++) {
 			rPart = (*wave).wave[muls->hbeam[ib]][muls->kbeam[ib]][0];
 			iPart = (*wave).wave[muls->hbeam[ib]][muls->kbeam[ib]][1];
-			muls->pendelloesung[ib][absolute_slice] = scale*(real)(rPart*rPart+iPart*iPart);
+			muls->pendelloesung[ib][absolute_slice] = (real)(scale/(waveScale*waveScale))*(rPart*rPart+iPart*iPart);
 			// printf("slice: %d beam: %d [%d,%d], intensity: %g\n",muls->nslic0,ib,muls->hbeam[ib],muls->kbeam[ib],muls->pendelloesung[ib][muls->nslic0]);			
 		} // end of ib=0 ... 
 	}
@@ -3108,7 +3201,6 @@ void writeBeams(MULS *muls, WavePtr wave, int ilayer, int absolute_slice) {
 fftwf_complex *getAtomPotential3D_3DFFT(int Znum, MULS *muls,double B) {
 	int ix,iy,iz,iiz,ind3d,ind3dd,iKind;
 	double zScale,kzmax,kzborder;
-	fftwf_plan plan;
 	static double f,phase,s2,kmax2,kx,ky,kz,dkx,dky,dkz,dx2,dy2,dz2;
 	static int nx,ny,nz;
 	static fftwf_complex **atPot = NULL;
@@ -3226,9 +3318,7 @@ fftwf_complex *getAtomPotential3D_3DFFT(int Znum, MULS *muls,double B) {
 			}
 		}
 
-		plan = fftwf_plan_dft_3d(nz,nx,ny,atPot[Znum],atPot[Znum],FFTW_BACKWARD,FFTW_ESTIMATE);
-		fftwf_execute(plan);
-		fftwf_destroy_plan(plan);
+		fftBackend<float>()->Plan3D(nz,nx,ny,FFTW_BACKWARD)->Execute(atPot[Znum]);
 		dx2 = muls->resolutionX*muls->resolutionX/(OVERSAMP_X*OVERSAMP_X);
 		dy2 = muls->resolutionY*muls->resolutionY/(OVERSAMP_X*OVERSAMP_X);
 		dz2 = muls->sliceThickness*muls->sliceThickness/(OVERSAMP_Z*OVERSAMP_Z);
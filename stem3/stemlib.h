@@ -22,8 +22,14 @@ QSTEM - image simulation for TEM/STEM/CBED
 
 // #define WIN
 
+#include <map>
+#include <omp.h>
 #include "stemtypes_fftw3.h"
 #include "data_containers.h"
+#include "fft_backend.h"
+#include "table_cache.h"
+#include "probe_batch.h"
+#include "propagation_context.h"
 
 
 /**********************************************
@@ -32,26 +38,118 @@ QSTEM - image simulation for TEM/STEM/CBED
  * with parameters given in muls
  *********************************************/
 // int probe(MULS *muls,double dx, double dy);
-void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny);
+void probeShiftAndCrop(MULS *muls, WavePtr wave, double dx, double dy, double cnx, double cny, std::vector<double> &ramp);
 void probe(MULS *muls, WavePtr wave, double dx, double dy);
+// the aberration phase chi(k) of probe(), k = (kx, ky) in 1/A
+double aberrationPhase(MULS *muls, double kx, double ky, double wavlen);
 void probePlot(MULS *muls, WavePtr wave);
 
 void initSTEMSlices(MULS *muls, int nlayer);
 void interimWave(MULS *muls,WavePtr wave,int slice);
-void collectIntensity(MULS *muls, WavePtr wave, int slices);
+void collectIntensity(MULS *muls, PropagationContextPtr &context, WavePtr &wave, int slices);
 //void detectorCollect(MULS *muls, WavePtr wave);
 void saveSTEMImages(MULS *muls);
 
 void make3DSlices(MULS *muls,int nlayer,char *fileName,atom *center);
 void make3DSlicesFFT(MULS *muls,int nlayer,char *fileName,atom *center);
 void createAtomBox(MULS *muls, int Znum, atomBox *aBox);
-void transmit(void **wave,void **trans,int nx, int ny,int posx,int posy);
-void propagate_slow(void** wave,int nx, int ny,MULS *muls);
+void transmit(void **wave,void **trans,int nx, int ny,int posx,int posy,int nThreads=1);
+void transmitBatch(std::vector<WavePtr> &waves, int count, MULS *muls, int islice, std::vector<float_tt> &expanded);
 fftwf_complex *getAtomPotential3D_3DFFT(int Znum, MULS *muls,double B);
 fftwf_complex *getAtomPotential3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int*Nz_lut);
 fftwf_complex *getAtomPotentialOffset3D(int Znum, MULS *muls,double B,int *nzSub,int *Nr,int*Nz_lut,float q);
 fftwf_complex *getAtomPotential2D(int Znum, MULS *muls,double B);
 
+/******************************************************************
+ * PotentialLUTCache holds the lookup tables of getAtomPotential3D(),
+ * getAtomPotentialOffset3D() and getAtomPotential2D(), one per
+ * element and Debye-Waller factor B.  The sampling is fixed by the
+ * muls of the first call, as before.
+ *
+ * potentialLUTCache(muls)->Prepare(muls, atoms, natom);
+ * table = potentialLUTCache(muls)->Potential3D(Znum, B);
+ *
+ * Prepare() builds the missing tables of all (Znum, B) in atoms at
+ * once, with one OpenMP thread per table, each with its own FFT 
+ * scratch.  Potential3D() ... only read the cache, so that after 
+ * Prepare() any number of threads may use them; a table that 
+ * Prepare() has not built is an error (exit).  The Get3D() ... and 
+ * getAtomPotential...() functions build missing tables one at a 
+ * time (not thread safe).
+ *
+ * With muls->potentialCacheFolder the tables are also kept on disk
+ * (see table_cache.h), keyed by everything that goes into them, 
+ * and later runs read them from there.
+ *****************************************************************/
+class PotentialLUTCache {
+	typedef std::map<std::pair<int, double>, fftwf_complex *> table_map;
+	int m_nx, m_ny, m_nz, m_nzPerSlice;  // nx x nz: 3D (r-z) tables, nx x ny: 2D tables
+	double m_dkx, m_dky, m_dkz, m_kmax2;
+	float_tt m_sliceThickness, m_resolutionX, m_resolutionY;  // as in muls
+	int m_printLevel;
+	boost::shared_ptr<FFTPlanT<float> > m_plan3D, m_plan2D;
+	table_map m_pot3D, m_offs3D, m_pot2D;
+	TableCachePtr m_disk;
+
+	fftwf_complex *Find(const table_map &tables, int Znum, double B) const;
+	fftwf_complex *Lookup(const table_map &tables, int Znum, double B) const;
+	void Build3D(int Znum, double B, int offset, fftwf_complex *table, fftwf_complex *temp);
+	void Build2D(int Znum, double B, fftwf_complex *table);
+	fftwf_complex *Build(int kind, int Znum, double B);
+	unsigned long long Key(int kind, int Znum, double B) const;
+public:
+	PotentialLUTCache(MULS *muls);
+	~PotentialLUTCache();
+
+	void Prepare(MULS *muls, atom *atoms, int natom);
+	fftwf_complex *Potential3D(int Znum, double B) const { return Lookup(m_pot3D, Znum, B); }
+	fftwf_complex *Offset3D(int Znum, double B) const { return Lookup(m_offs3D, Znum, B); }
+	fftwf_complex *Potential2D(int Znum, double B) const { return Lookup(m_pot2D, Znum, B); }
+	fftwf_complex *Get3D(int Znum, double B);      // builds the table if necessary
+	fftwf_complex *GetOffset3D(int Znum, double B);
+	fftwf_complex *Get2D(int Znum, double B);
+	int Nr() const { return m_nx/2; }              // size of the 3D tables
+	int NzLut() const { return m_nz/2; }
+	int NzSub() const { return m_nzPerSlice; }     // samples per slice
+};
+typedef boost::shared_ptr<PotentialLUTCache> PotentialLUTCachePtr;
+
+// the cache of the getAtomPotential...() functions, created by the first call
+PotentialLUTCachePtr potentialLUTCache(MULS *muls);
+
+/******************************************************************
+ * AtomBoxCache holds the atom boxes of atomBoxLookUp() (the real
+ * space potential without fftpotential), one per element and
+ * Debye-Waller factor B.  The box grid is fixed by the muls of the
+ * first call.
+ *
+ * aBox = atomBoxCache(muls)->Get(muls, Znum, B);
+ * atomBoxLookUp(&v, muls, aBox, x, y, z);
+ *
+ * Get() makes a missing box under a lock, so that any number of 
+ * threads may call it; boxes are not changed after that, and are
+ * freed with the cache.  Boxes with B = 0 are real and made by
+ * createAtomBox().  Boxes with B > 0 are complex, with the 
+ * absorptive potential in the imaginary part, and are read from
+ * the potential_<Z>_B<100 B>.prj files of the external scatpot.
+ *****************************************************************/
+class AtomBoxCache {
+	typedef std::map<std::pair<int, double>, atomBox *> box_map;
+	int m_nx, m_ny, m_nz;
+	double m_dx, m_dy, m_dz;
+	box_map m_boxes;
+	omp_lock_t m_lock;                // protects m_boxes
+public:
+	AtomBoxCache(MULS *muls);
+	~AtomBoxCache();
+
+	atomBox *Get(MULS *muls, int Znum, double B);
+};
+typedef boost::shared_ptr<AtomBoxCache> AtomBoxCachePtr;
+
+// the cache of atomBoxLookUp(), created by the first call
+AtomBoxCachePtr atomBoxCache(MULS *muls);
+
 WAVEFUNC initWave(int nx, int ny);
 void readStartWave(WavePtr wave);
 /******************************************************************
@@ -61,14 +159,25 @@ void readStartWave(WavePtr wave);
  * the will be updated at return
  *****************************************************************/
 int runMulsSTEM_old(MULS *muls,int lstart);
-int runMulsSTEM(MULS *muls, WavePtr wave);
+int runMulsSTEM(MULS *muls, PropagationContextPtr context, WavePtr wave);
+/******************************************************************
+ * runMulsSTEMBatch() - same for count probe positions at once, 
+ * sharing the transmission function reads and the FFT plans of 
+ * context->batch
+ *****************************************************************/
+int runMulsSTEMBatch(MULS *muls, PropagationContextPtr context, std::vector<WavePtr> &waves, int count);
+/******************************************************************
+ * collectPRISM() - collect the exit wave of a scan position, which 
+ * the S-matrix has put together in real space (see s_matrix.h)
+ *****************************************************************/
+void collectPRISM(MULS *muls, PropagationContextPtr context, WavePtr wave);
 void writePix(char *outFile,fftw_complex **pict,MULS *muls,int iz);
-void fft_normalize(void **array,int nx, int ny);
+void fft_normalize(void **array,int nx, int ny,int nThreads=1);
 void showPotential(fftw_complex ***pot,int nz,int nx,int ny,
 		   double dx,double dy,double dz);
-void atomBoxLookUp(fftw_complex *vlu,MULS *muls,int Znum,double x,double y,
-			   double z,double B);
-void writeBeams(MULS *muls, WavePtr wave,int ilayer, int absolute_slice);
+void atomBoxLookUp(fftw_complex *vlu,MULS *muls,atomBox *aBox,double x,double y,
+			   double z);
+void writeBeams(MULS *muls, WavePtr wave,int ilayer, int absolute_slice, double waveScale);
 
 /***********************************************************************************
  * old image read/write functions, may soon be outdated
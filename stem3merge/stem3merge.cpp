@@ -0,0 +1,78 @@
+/*
+QSTEM - image simulation for TEM/STEM/CBED
+    Copyright (C) 2000-2010  Christoph Koch
+	Copyright (C) 2010-2013  Christoph Koch, Michael Sarahan
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* file stem3merge.cpp: combines the tiles written by "stem3 --tile i/N"
+ * into the STEM images that a single stem3 process would have written.
+ ********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "stem_tiles.h"
+
+void usage() {
+	printf("usage: stem3-merge <folder> <N> [output folder]\n\n"
+		   "Reads <folder>/stem_tile_<i>_of_<N>.dat for i=0..N-1, as written by\n"
+		   "stem3 --tile i/N, and writes the STEM images to the output folder\n"
+		   "(default: <folder>).\n\n");
+}
+
+int main(int argc, char *argv[]) {
+	STEMTileHeader scan, tile;
+	std::vector<float> thickness;
+	std::vector<std::vector<DetectorPtr> > detectors;
+	std::vector<int> covered;
+	char fileName[1024];
+	const char *folder, *outFolder;
+	int nTiles, i, ix, iy;
+
+	if ((argc < 3) || (sscanf(argv[2], "%d", &nTiles) != 1) || (nTiles < 1)) {
+		usage();
+		exit(0);
+	}
+	folder = argv[1];
+	outFolder = (argc > 3) ? argv[3] : folder;
+
+	for (i=0; i<nTiles; i++) {
+		stemTileName(fileName, folder, i, nTiles);
+		readSTEMTile(fileName, tile, (i == 0) ? NULL : &scan, thickness, detectors);
+		if (i == 0) {
+			scan = tile;
+			covered = std::vector<int>(scan.scanXN*scan.scanYN, 0);
+		}
+		if ((tile.tile != i) || (tile.nTiles != nTiles)) {
+			printf("%s contains tile %d of %d\n", fileName, tile.tile, tile.nTiles);
+			exit(0);
+		}
+		for (ix=tile.ixStart; ix<tile.ixStop; ix++) for (iy=tile.iyStart; iy<tile.iyStop; iy++)
+			covered[ix*scan.scanYN+iy]++;
+	}
+	for (i=0; i<scan.scanXN*scan.scanYN; i++) if (covered[i] != 1) {
+		printf("Scan position (%d, %d) is covered by %d tiles\n", i / scan.scanYN, i % scan.scanYN, covered[i]);
+		exit(0);
+	}
+
+	printf("Merging %d tiles of a %d x %d scan (%d detectors, %d thickness planes, run %d)\n",
+		nTiles, scan.scanXN, scan.scanYN, scan.detectorNum, scan.nPlanes, scan.avgCount+1);
+	writeSTEMImages(detectors, scan.detectorNum, scan.scanXN*scan.scanYN, outFolder,
+		thickness, scan.avgCount+1);
+	return 0;
+}